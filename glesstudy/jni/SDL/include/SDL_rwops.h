@@ -45,6 +45,7 @@ extern "C" {
 #define SDL_RWOPS_JNIFILE   3   /* Android asset */
 #define SDL_RWOPS_MEMORY    4   /* Memory stream */
 #define SDL_RWOPS_MEMORY_RO 5   /* Read-Only memory stream */
+#define SDL_RWOPS_MAPPED    6   /* Read-Only memory mapped file */
 
 /**
  * This is the read/write operation structure -- very basic.
@@ -133,6 +134,15 @@ typedef struct SDL_RWops
             Uint8 *here;
             Uint8 *stop;
         } mem;
+        /* starts like mem, so a mapped file is read by the memory functions */
+        struct
+        {
+            Uint8 *base;
+            Uint8 *here;
+            Uint8 *stop;
+            void *mapping;      /* page aligned, base may be after it */
+            size_t mappingSize;
+        } mapped;
         struct
         {
             void *data1;
@@ -165,9 +175,28 @@ extern DECLSPEC SDL_RWops *SDLCALL SDL_RWFromMem(void *mem, int size);
 extern DECLSPEC SDL_RWops *SDLCALL SDL_RWFromConstMem(const void *mem,
                                                       int size);
 
+/**
+ *  Map a file read-only into memory and read it as a memory stream, without
+ *  copying it through a file buffer.  If the file can not be mapped (an
+ *  asset compressed inside the APK on Android, an empty file, ...) this is
+ *  SDL_RWFromFile(file, "rb"), so the stream may have no memory view.
+ */
+extern DECLSPEC SDL_RWops *SDLCALL SDL_RWFromMappedFile(const char *file);
+
 /* @} *//* RWFrom functions */
 
 
+/**
+ *  The whole data of a memory stream or a mapped file, where it is in
+ *  memory, for decoders which can work on a contiguous buffer.
+ *
+ *  \return The start of the data with its size in \c size, or NULL (and 0)
+ *          for streams which are only read piece by piece, like files.
+ */
+extern DECLSPEC const void *SDLCALL SDL_RWGetMemoryView(SDL_RWops * context,
+                                                        size_t *size);
+
+
 extern DECLSPEC SDL_RWops *SDLCALL SDL_AllocRW(void);
 extern DECLSPEC void SDLCALL SDL_FreeRW(SDL_RWops * area);
 
@@ -591,3 +591,5 @@
 #define SDL_QueueAudio SDL_QueueAudio_REAL
 #define SDL_GetQueuedAudioSize SDL_GetQueuedAudioSize_REAL
 #define SDL_ClearQueuedAudio SDL_ClearQueuedAudio_REAL
+#define SDL_RWFromMappedFile SDL_RWFromMappedFile_REAL
+#define SDL_RWGetMemoryView SDL_RWGetMemoryView_REAL
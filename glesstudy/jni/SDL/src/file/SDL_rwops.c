@@ -47,6 +47,17 @@
 #include "nacl_io/nacl_io.h"
 #endif
 
+/* Platforms where SDL_RWFromMappedFile() maps files, it reads them elsewhere */
+#if defined(__WIN32__)
+#define HAVE_MAPPED_FILE 1
+#elif defined(__LINUX__) || defined(__ANDROID__) || defined(__MACOSX__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HAVE_MAPPED_FILE 1
+#endif
+
 #ifdef __WIN32__
 
 /* Functions to read/write Win32 API file pointers */
@@ -459,6 +470,97 @@ mem_close(SDL_RWops * context)
     return 0;
 }
 
+#ifdef HAVE_MAPPED_FILE
+
+/* Functions to read mapped files, hidden.mapped starts like hidden.mem,
+   so the memory functions do the reading */
+
+static int SDLCALL
+mapped_close(SDL_RWops * context)
+{
+    if (context) {
+#ifdef __WIN32__
+        UnmapViewOfFile(context->hidden.mapped.mapping);
+#else
+        munmap(context->hidden.mapped.mapping, context->hidden.mapped.mappingSize);
+#endif
+        SDL_FreeRW(context);
+    }
+    return 0;
+}
+
+/* the data is [offset, offset + size) of the mapping, which is unmapped on failure */
+static SDL_RWops *
+mapped_create(void *mapping, size_t mappingSize, size_t offset, size_t size)
+{
+    SDL_RWops *rwops = SDL_AllocRW();
+    if (rwops == NULL) {
+#ifdef __WIN32__
+        UnmapViewOfFile(mapping);
+#else
+        munmap(mapping, mappingSize);
+#endif
+        return NULL;
+    }
+
+    rwops->size = mem_size;
+    rwops->seek = mem_seek;
+    rwops->read = mem_read;
+    rwops->write = mem_writeconst;
+    rwops->close = mapped_close;
+    rwops->hidden.mapped.mapping = mapping;
+    rwops->hidden.mapped.mappingSize = mappingSize;
+    rwops->hidden.mapped.base = (Uint8 *) mapping + offset;
+    rwops->hidden.mapped.here = rwops->hidden.mapped.base;
+    rwops->hidden.mapped.stop = rwops->hidden.mapped.base + size;
+    rwops->type = SDL_RWOPS_MAPPED;
+    return rwops;
+}
+
+#ifndef __WIN32__
+/* maps [offset, offset + size) of fd, from the page the offset is in */
+static SDL_RWops *
+mapped_from_fd(int fd, Sint64 offset, Sint64 size)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    Sint64 aligned;
+    size_t mappingSize;
+    void *mapping;
+
+    if (size <= 0 || offset < 0 || page <= 0) {
+        return NULL;            /* an empty file can not be mapped */
+    }
+
+    aligned = offset / page * page;
+    mappingSize = (size_t) (size + offset - aligned);
+    mapping = mmap(NULL, mappingSize, PROT_READ, MAP_PRIVATE, fd, (off_t) aligned);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+
+    return mapped_create(mapping, mappingSize, (size_t) (offset - aligned), (size_t) size);
+}
+
+static SDL_RWops *
+mapped_from_path(const char *path)
+{
+    SDL_RWops *rwops = NULL;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        rwops = mapped_from_fd(fd, 0, (Sint64) st.st_size);
+    }
+    close(fd);                  /* the mapping keeps the file */
+    return rwops;
+}
+#endif /* !__WIN32__ */
+
+#endif /* HAVE_MAPPED_FILE */
+
 
 /* Functions to create SDL_RWops structures from various data sources */
 
@@ -633,6 +735,96 @@ SDL_RWFromConstMem(const void *mem, int size)
     return rwops;
 }
 
+SDL_RWops *
+SDL_RWFromMappedFile(const char *file)
+{
+    SDL_RWops *rwops = NULL;
+    if (!file || !*file) {
+        SDL_SetError("SDL_RWFromMappedFile(): No file specified");
+        return NULL;
+    }
+
+#if defined(__ANDROID__)
+    /* the same places as SDL_RWFromFile(): the file system first, then the assets */
+    if (*file == '/') {
+        rwops = mapped_from_path(file);
+    } else {
+        char *path = SDL_stack_alloc(char, PATH_MAX);
+        if (path) {
+            SDL_snprintf(path, PATH_MAX, "%s/%s",
+                         SDL_AndroidGetInternalStoragePath(), file);
+            rwops = mapped_from_path(path);
+            SDL_stack_free(path);
+        }
+    }
+
+    if (!rwops) {
+        /* an asset stored uncompressed in the APK is opened by a file
+           descriptor of the APK, its part of the APK can be mapped */
+        SDL_RWops *asset = SDL_RWFromFile(file, "rb");
+        if (asset && asset->type == SDL_RWOPS_JNIFILE &&
+            asset->hidden.androidio.assetFileDescriptorRef) {
+            rwops = mapped_from_fd(asset->hidden.androidio.fd,
+                                   (Sint64) asset->hidden.androidio.offset,
+                                   (Sint64) asset->hidden.androidio.size);
+        }
+        if (!rwops) {
+            return asset;
+        }
+        SDL_RWclose(asset);
+    }
+#elif defined(__WIN32__)
+    {
+        LPTSTR tstr = WIN_UTF8ToString(file);
+        HANDLE h = CreateFile(tstr, GENERIC_READ, FILE_SHARE_READ, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        SDL_free(tstr);
+        if (h != INVALID_HANDLE_VALUE) {
+            LARGE_INTEGER size;
+            HANDLE m = NULL;
+            void *mapping = NULL;
+            if (GetFileSizeEx(h, &size) && size.QuadPart > 0) {
+                m = CreateFileMapping(h, NULL, PAGE_READONLY, 0, 0, NULL);
+            }
+            CloseHandle(h);
+            if (m) {
+                mapping = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+                CloseHandle(m);     /* the view keeps the mapping */
+            }
+            if (mapping) {
+                rwops = mapped_create(mapping, (size_t) size.QuadPart, 0,
+                                      (size_t) size.QuadPart);
+            }
+        }
+    }
+#elif defined(HAVE_MAPPED_FILE)
+    rwops = mapped_from_path(file);
+#endif
+
+    if (!rwops) {
+        rwops = SDL_RWFromFile(file, "rb");
+    }
+    return rwops;
+}
+
+const void *
+SDL_RWGetMemoryView(SDL_RWops * context, size_t *size)
+{
+    if (context && (context->type == SDL_RWOPS_MEMORY ||
+                    context->type == SDL_RWOPS_MEMORY_RO ||
+                    context->type == SDL_RWOPS_MAPPED)) {
+        if (size) {
+            *size = (size_t) (context->hidden.mem.stop - context->hidden.mem.base);
+        }
+        return context->hidden.mem.base;
+    }
+
+    if (size) {
+        *size = 0;
+    }
+    return NULL;
+}
+
 SDL_RWops *
 SDL_AllocRW(void)
 {
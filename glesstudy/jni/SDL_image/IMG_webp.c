@@ -186,6 +186,8 @@ SDL_Surface *IMG_LoadWEBP_RW(SDL_RWops *src)
     WebPBitstreamFeatures features;
     int raw_data_size;
     uint8_t *raw_data = NULL;
+    const uint8_t *data;
+    size_t view_size;
     int r;
     uint8_t *ret;
 
@@ -206,19 +208,25 @@ SDL_Surface *IMG_LoadWEBP_RW(SDL_RWops *src)
         goto error;
     }
 
-    // seek to start of file
-    SDL_RWseek(src, 0, RW_SEEK_SET );
+    // a memory stream or a mapped file is decoded where it is, without a copy
+    data = (const uint8_t*) SDL_RWGetMemoryView( src, &view_size );
+    if ( data == NULL || view_size < (size_t)raw_data_size ) {
+        // seek to start of file
+        SDL_RWseek(src, 0, RW_SEEK_SET );
 
-    raw_data = (uint8_t*) SDL_malloc( raw_data_size );
-    if ( raw_data == NULL ) {
-        error = "Failed to allocate enought buffer for WEBP";
-        goto error;
-    }
+        raw_data = (uint8_t*) SDL_malloc( raw_data_size );
+        if ( raw_data == NULL ) {
+            error = "Failed to allocate enought buffer for WEBP";
+            goto error;
+        }
 
-    r = SDL_RWread(src, raw_data, 1, raw_data_size );
-    if ( r != raw_data_size ) {
-        error = "Failed to read WEBP";
-        goto error;
+        r = SDL_RWread(src, raw_data, 1, raw_data_size );
+        if ( r != raw_data_size ) {
+            error = "Failed to read WEBP";
+            goto error;
+        }
+
+        data = raw_data;
     }
 
 #if 0
@@ -230,7 +238,7 @@ SDL_Surface *IMG_LoadWEBP_RW(SDL_RWops *src)
     }
 #endif
 
-    if ( lib.webp_get_features_internal( raw_data, raw_data_size, &features, WEBP_DECODER_ABI_VERSION ) != VP8_STATUS_OK ) {
+    if ( lib.webp_get_features_internal( data, raw_data_size, &features, WEBP_DECODER_ABI_VERSION ) != VP8_STATUS_OK ) {
         error = "WebPGetFeatures has failed";
         goto error;
     }
@@ -261,9 +269,9 @@ SDL_Surface *IMG_LoadWEBP_RW(SDL_RWops *src)
     }
 
     if ( features.has_alpha ) {
-        ret = lib.webp_decode_rgba_into( raw_data, raw_data_size, (uint8_t *)surface->pixels, surface->pitch * surface->h,  surface->pitch );
+        ret = lib.webp_decode_rgba_into( data, raw_data_size, (uint8_t *)surface->pixels, surface->pitch * surface->h,  surface->pitch );
     } else {
-        ret = lib.webp_decode_rgb_into( raw_data, raw_data_size, (uint8_t *)surface->pixels, surface->pitch * surface->h,  surface->pitch );
+        ret = lib.webp_decode_rgb_into( data, raw_data_size, (uint8_t *)surface->pixels, surface->pitch * surface->h,  surface->pitch );
     }
 
     if ( !ret ) {
@@ -304,6 +304,19 @@ typedef struct KTX_dimensions {
 	GLsizei depth;  /*!< */
 } KTX_dimensions;
 
+/**
+ * @brief Structure used to return the capabilities of the current GL context
+ *        as discovered by the loader
+ */
+typedef struct KTX_context_capabilities {
+	GLboolean isES;                 /*!< the context is OpenGL ES */
+	GLint majorVersion;             /*!< */
+	GLint minorVersion;             /*!< */
+	GLboolean supportsSwizzle;      /*!< texture swizzle is supported */
+	GLboolean supportsSRGB;         /*!< sRGB textures are supported */
+	GLboolean supportsSizedFormats; /*!< sized internal formats are supported */
+} KTX_context_capabilities;
+
 /**
  * @brief Opaque handle to a KTX_hash_table.
  */
@@ -339,6 +352,13 @@ ktxLoadTextureM(const void* bytes, GLsizei size, GLuint* pTexture, GLenum* pTarg
 				GLenum* pGlerror,
 				unsigned int* pKvdLen, unsigned char** ppKvd);
 
+/* ktxGetContextCapabilities
+ *
+ * Returns the capabilities of the current GL context, queried once.
+ */
+void
+ktxGetContextCapabilities(KTX_context_capabilities* pCaps);
+
 /* ktxWriteKTXF
  * 
  * Writes a KTX file using supplied data.
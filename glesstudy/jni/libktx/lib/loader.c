@@ -144,6 +144,13 @@ static GLint R16Formats = _KTX_ALL_R16_FORMATS;
  * @brief indicates if the current context supports sRGB textures.
  */
 static GLboolean supportsSRGB = GL_TRUE;
+/**
+ * @private
+ * @~English
+ * @brief version of the current context.
+ */
+static GLint contextMajorVersion = 1;
+static GLint contextMinorVersion = 0;
 
 
 /**
@@ -219,6 +226,9 @@ static void discoverContextCapabilities(void)
 			}
 		}
 	}
+
+	contextMajorVersion = majorVersion;
+	contextMinorVersion = minorVersion;
 }
 
 #if SUPPORT_LEGACY_FORMAT_CONVERSION
@@ -960,3 +970,27 @@ ktxLoadTextureM(const void* bytes, GLsizei size, GLuint* pTexture, GLenum* pTarg
 }
 
 
+/**
+ * @~English
+ * @brief Return the capabilities of the current GL context.
+ *
+ * The context is queried once, by the first call of this function or of a
+ * ktxLoadTexture* function, and the same results are returned afterwards.
+ * Must be called with a current GL context.
+ *
+ * @param [out] pCaps	pointer to a KTX_context_capabilities which is set to
+ *                      the capabilities of the current context.
+ */
+void
+ktxGetContextCapabilities(KTX_context_capabilities* pCaps)
+{
+	if (contextProfile == 0)
+		discoverContextCapabilities();
+
+	pCaps->isES = (contextProfile & _CONTEXT_ES_PROFILE_BIT) ? GL_TRUE : GL_FALSE;
+	pCaps->majorVersion = contextMajorVersion;
+	pCaps->minorVersion = contextMinorVersion;
+	pCaps->supportsSwizzle = supportsSwizzle;
+	pCaps->supportsSRGB = supportsSRGB;
+	pCaps->supportsSizedFormats = sizedFormats != _NO_SIZED_FORMATS ? GL_TRUE : GL_FALSE;
+}
@@ -16,7 +16,7 @@ LOCAL_SRC_FILES := \
 LOCAL_SRC_FILES += \
 	../SDL/src/main/android/SDL_android_main.c
 
-LOCAL_LDLIBS := -ldl -lGLESv2 -llog -landroid
+LOCAL_LDLIBS := -ldl -lGLESv2 -llog -landroid -lz
 # LOCAL_LDLIBS += libOpenMAXAL
 
 LOCAL_CFLAGS := -DKTX_OPENGL_ES2=1
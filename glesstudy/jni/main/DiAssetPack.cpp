@@ -0,0 +1,380 @@
+#include "DiAssetPack.h"
+#include "di_lz.h"
+
+#include <cstring>
+#include <algorithm>
+#include <zlib.h>
+
+#ifndef _WIN32
+#   include <sys/mman.h>
+#   include <unistd.h>
+#endif
+
+namespace di
+{
+    class AssetPack
+    {
+    public:
+        AssetPack() : m_rw(nullptr), m_data(nullptr), m_size(0), m_entries(nullptr), m_entryCount(0), m_compressedCount(0), m_names(nullptr) {}
+        ~AssetPack() { Close(); }
+
+        bool Open(const string& path);
+        bool Find(const string& name, AssetView* view) const;
+
+        bool IsMapped() const { return m_rw != nullptr; }
+        uint32_t GetEntryCount() const { return m_entryCount; }
+        uint32_t GetCompressedCount() const { return m_compressedCount; }
+        size_t GetSize() const { return m_size; }
+
+    private:
+        bool ReadAll(SDL_RWops* rw, const string& path);
+        void Close();
+        bool Validate(const string& path);
+
+        SDL_RWops* m_rw;            // the mapping, null if the pack is read into m_bytes
+        const uint8_t* m_data;
+        size_t m_size;
+        vector<uint8_t> m_bytes;
+        const PackEntry* m_entries;
+        uint32_t m_entryCount;
+        uint32_t m_compressedCount;
+        const char* m_names;
+
+        DI_DISABLE_COPY(AssetPack);
+    };
+
+
+    // never freed, the worker thread may still be reading a pack while static objects are destroyed at exit
+    static vector<AssetPack*>& GetPacks()
+    {
+        static vector<AssetPack*>* s_packs = new vector<AssetPack*>();
+        return *s_packs;
+    }
+
+
+    bool AssetPack::Open(const string& path)
+    {
+        DI_SAVE_CALLSTACK();
+
+        // mapped where SDL can map it, which is also a pack stored uncompressed in the APK. otherwise it is read
+        SDL_RWops* rw = SDL_RWFromMappedFile(path.c_str());
+        if (!rw)
+        {
+            return false;
+        }
+
+        // the index is read in place, which needs 8 byte alignment. zipalign only aligns a file in the APK to 4 bytes
+        size_t size = 0;
+        const void* view = SDL_RWGetMemoryView(rw, &size);
+        if (view && reinterpret_cast<uintptr_t>(view) % sizeof(uint64_t) == 0)
+        {
+            m_rw = rw;
+            m_data = static_cast<const uint8_t*>(view);
+            m_size = size;
+        }
+        else
+        {
+            bool read = ReadAll(rw, path);
+            SDL_RWclose(rw);
+            if (!read)
+            {
+                return false;
+            }
+        }
+
+        if (!Validate(path))
+        {
+            Close();
+            return false;
+        }
+
+        return true;
+    }
+
+
+    bool AssetPack::ReadAll(SDL_RWops* rw, const string& path)
+    {
+        int64_t size = SDL_RWsize(rw);
+        if (size <= 0)
+        {
+            return false;
+        }
+
+        m_bytes.resize(size_t(size));
+        if (SDL_RWread(rw, &m_bytes[0], m_bytes.size(), 1) != 1)
+        {
+            LogError("SDL_RWread('%s') failed", path.c_str());
+            vector<uint8_t>().swap(m_bytes);
+            return false;
+        }
+
+        m_data = &m_bytes[0];
+        m_size = m_bytes.size();
+        return true;
+    }
+
+
+    void AssetPack::Close()
+    {
+        if (m_rw)
+        {
+            SDL_RWclose(m_rw);
+            m_rw = nullptr;
+        }
+
+        vector<uint8_t>().swap(m_bytes);
+        m_data = nullptr;
+        m_size = 0;
+        m_entries = nullptr;
+        m_entryCount = 0;
+        m_compressedCount = 0;
+        m_names = nullptr;
+    }
+
+
+    // every offset is checked once here, so Find() trusts them
+    bool AssetPack::Validate(const string& path)
+    {
+        PackHeader header;
+        if (m_size < sizeof(header))
+        {
+            LogError("asset pack '%s' is truncated", path.c_str());
+            return false;
+        }
+
+        memcpy(&header, m_data, sizeof(header));
+        if (memcmp(header.magic, PackMagic, sizeof(PackMagic)) != 0 || header.version != PackVersion)
+        {
+            LogError("'%s' is not an asset pack of version %d", path.c_str(), int(PackVersion));
+            return false;
+        }
+
+        uint64_t indexSize = uint64_t(header.entryCount) * sizeof(PackEntry);
+        if (header.indexOffset % sizeof(uint64_t) != 0 || header.indexOffset > m_size || indexSize > m_size - header.indexOffset ||
+            header.namesOffset > m_size || header.namesSize > m_size - header.namesOffset || header.namesSize == 0 ||
+            m_data[header.namesOffset + header.namesSize - 1] != '\0')
+        {
+            LogError("asset pack '%s' has a broken index", path.c_str());
+            return false;
+        }
+
+        m_entries = reinterpret_cast<const PackEntry*>(m_data + header.indexOffset);
+        m_entryCount = header.entryCount;
+        m_names = reinterpret_cast<const char*>(m_data + header.namesOffset);
+
+        for (uint32_t i = 0; i < m_entryCount; ++i)
+        {
+            const PackEntry& entry = m_entries[i];
+            if (entry.nameOffset >= header.namesSize || entry.offset > m_size || entry.size > m_size - entry.offset ||
+                (i > 0 && entry.nameHash < m_entries[i - 1].nameHash) || entry.codec >= PackCodec_Count ||
+                (entry.codec == PackCodec_None && entry.rawSize != entry.size) || entry.rawSize > UINT32_MAX)
+            {
+                LogError("asset pack '%s' has a broken entry %u", path.c_str(), i);
+                return false;
+            }
+
+            if (entry.codec != PackCodec_None)
+            {
+                ++m_compressedCount;
+            }
+        }
+
+        return true;
+    }
+
+
+    bool AssetPack::Find(const string& name, AssetView* view) const
+    {
+        uint64_t hash = Pack_HashName(name.data(), name.size());
+        const PackEntry* end = m_entries + m_entryCount;
+        const PackEntry* entry = lower_bound(m_entries, end, hash, [](const PackEntry& e, uint64_t h) { return e.nameHash < h; });
+
+        for (; entry != end && entry->nameHash == hash; ++entry)
+        {
+            if (name == m_names + entry->nameOffset)
+            {
+                view->data = m_data + entry->offset;
+                view->size = size_t(entry->size);
+                view->rawSize = size_t(entry->rawSize);
+                view->crc = entry->crc;
+                view->format = PackFormat(entry->format);
+                view->codec = PackCodec(entry->codec);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+
+    bool AssetPack_Mount(const string& path)
+    {
+        DI_SAVE_CALLSTACK();
+
+        uint64_t startClock = HighClock_Get();
+
+        unique_ptr<AssetPack> pack(new AssetPack());
+        if (!pack->Open(path))
+        {
+            LogWarn("asset pack '%s' is not mounted", path.c_str());
+            return false;
+        }
+
+        LogInfo("asset pack '%s' mounted (%s): %u files (%u compressed), %.1f KB, cost %.3f ms", path.c_str(), pack->IsMapped() ? "mapped" : "read",
+            pack->GetEntryCount(), pack->GetCompressedCount(), pack->GetSize() / 1024.0, HighClock_ToSeconds(HighClock_Get() - startClock) * 1000.0);
+
+        GetPacks().insert(GetPacks().begin(), pack.release());
+        return true;
+    }
+
+
+    bool AssetPack_Find(const string& name, AssetView* view)
+    {
+        const vector<AssetPack*>& packs = GetPacks();
+        for (size_t i = 0; i < packs.size(); ++i)
+        {
+            if (packs[i]->Find(name, view))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+
+    // the pages of a mapped payload are asked for all at once, so the kernel reads ahead while the first chunks are
+    // decompressed. memory which is not a file mapping ignores it
+    static void WillNeed(const uint8_t* data, size_t size)
+    {
+#ifndef _WIN32
+        static const uintptr_t pageSize = uintptr_t(sysconf(_SC_PAGESIZE));
+        uintptr_t start = uintptr_t(data) / pageSize * pageSize;
+        madvise(reinterpret_cast<void*>(start), uintptr_t(data) + size - start, MADV_WILLNEED);
+#endif
+    }
+
+
+    static bool InflateZlib(const AssetView& view, uint8_t* dst)
+    {
+        // the mapping is fed to zlib a chunk at a time, so it never needs the whole payload in memory at once
+        const size_t ChunkSize = 256 * 1024;
+
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        if (inflateInit(&stream) != Z_OK)
+        {
+            return false;
+        }
+
+        stream.next_out = dst;
+        stream.avail_out = uInt(view.rawSize);
+
+        size_t consumed = 0;
+        bool done = false;
+        for (;;)
+        {
+            size_t offered = min(ChunkSize, view.size - consumed);
+            stream.next_in = const_cast<Bytef*>(view.data + consumed);
+            stream.avail_in = uInt(offered);
+
+            int result = inflate(&stream, Z_NO_FLUSH);
+            consumed += offered - stream.avail_in;
+
+            if (result == Z_STREAM_END)
+            {
+                done = consumed == view.size && stream.total_out == view.rawSize;
+                break;
+            }
+
+            // Z_BUF_ERROR: no progress, the stream is truncated or longer than the file
+            if (result != Z_OK)
+            {
+                break;
+            }
+        }
+
+        inflateEnd(&stream);
+        return done;
+    }
+
+
+    bool AssetPack_Read(const AssetView& view, uint8_t* dst)
+    {
+        DI_SAVE_CALLSTACK();
+
+        bool done = false;
+        switch (view.codec)
+        {
+        case PackCodec_None:
+            memcpy(dst, view.data, view.size);
+            return true;
+
+        case PackCodec_Zlib:
+            WillNeed(view.data, view.size);
+            done = InflateZlib(view, dst);
+            break;
+
+        case PackCodec_DiLz:
+            WillNeed(view.data, view.size);
+            done = Lz_Decode(view.data, view.size, dst, view.rawSize);
+            break;
+
+        default:
+            break;
+        }
+
+        if (!done)
+        {
+            LogError("broken compressed file in asset pack, codec %d, %u bytes", int(view.codec), unsigned(view.size));
+        }
+
+        return done;
+    }
+
+
+    bool AssetPack_Inflate(AssetView* view, PixelBufferPtr* bytes)
+    {
+        if (view->codec == PackCodec_None)
+        {
+            return true;
+        }
+
+        PixelBufferPtr inflated = PixelBufferPool::Singleton().Acquire(view->rawSize);
+        if (!AssetPack_Read(*view, inflated->GetData()))
+        {
+            return false;
+        }
+
+        *bytes = inflated;
+        view->data = inflated->GetData();
+        view->size = view->rawSize;
+        view->codec = PackCodec_None;
+        return true;
+    }
+
+
+    size_t AssetPack_WillNeed(vector<AssetView> views)
+    {
+        // the padding between payloads is small, a gap up to this is read along rather than cut into another range
+        const size_t MaxGap = 64 * 1024;
+
+        sort(views.begin(), views.end(), [](const AssetView& a, const AssetView& b) { return a.data < b.data; });
+
+        size_t ranges = 0;
+        for (size_t i = 0; i < views.size(); )
+        {
+            const uint8_t* start = views[i].data;
+            const uint8_t* end = start + views[i].size;
+            for (++i; i < views.size() && uintptr_t(views[i].data) <= uintptr_t(end) + MaxGap; ++i)
+            {
+                end = max(end, views[i].data + views[i].size);
+            }
+
+            WillNeed(start, size_t(end - start));
+            ++ranges;
+        }
+
+        return ranges;
+    }
+}
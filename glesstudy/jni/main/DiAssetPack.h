@@ -0,0 +1,48 @@
+#ifndef DI_ASSET_PACK_H_INCLUDED
+#define DI_ASSET_PACK_H_INCLUDED
+
+#include "DiImage.h"
+#include "di_pack_format.h"
+
+namespace di
+{
+    // A file in a mounted asset pack, where it is in the mapping. packs stay mounted until the process exits
+    // (the worker thread is not joined at exit), so a view is valid for the whole run.
+    // if the file is compressed, data is the compressed payload, AssetPack_Read() gets the file
+    struct AssetView
+    {
+        AssetView() : data(nullptr), size(0), rawSize(0), crc(0), format(PackFormat_Raw), codec(PackCodec_None) {}
+
+        const uint8_t* data;
+        size_t size;                // of data
+        size_t rawSize;             // of the file
+        uint32_t crc;               // of the file, PackEntry::crc
+        PackFormat format;
+        PackCodec codec;
+    };
+
+    // Asset packs (see di_pack_format.h) are mapped once by SDL_RWFromMappedFile, so reading a file is a lookup
+    // instead of an open, and the bytes are used where they are. in the APK on Android a pack is mapped if it is stored
+    // uncompressed (aapt -0 pack) and 8 byte aligned, otherwise it is read into memory once.
+    // the loaders look in the packs before the file system, packs mounted later are searched first
+
+    // ONLY in GL thread, before the files of the pack are loaded
+    bool AssetPack_Mount(const string& path);
+
+    // thread safe while no pack is being mounted
+    bool AssetPack_Find(const string& name, AssetView* view);
+
+    // the file of 'view' to dst, which has view.rawSize bytes. a compressed file is decompressed chunk by chunk
+    // straight into dst, so a loader can decompress into its upload buffer in the worker thread. false if it is broken
+    bool AssetPack_Read(const AssetView& view, uint8_t* dst);
+
+    // for decoders which need the file in one block of memory: a compressed file is read into 'bytes' from
+    // PixelBufferPool and 'view' is changed to it, other files are left where they are
+    bool AssetPack_Inflate(AssetView* view, PixelBufferPtr* bytes);
+
+    // asks the kernel to read the pages of the files ahead, files next to each other in a pack as one range.
+    // returns the ranges asked for
+    size_t AssetPack_WillNeed(vector<AssetView> views);
+}
+
+#endif
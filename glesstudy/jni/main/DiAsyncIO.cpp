@@ -0,0 +1,650 @@
+#include "DiAsyncIO.h"
+#include "DiAssetPack.h"
+
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+#if defined(__linux__) && !defined(__ANDROID__) && defined(__has_include)
+#   if __has_include(<linux/io_uring.h>)
+#       include <linux/io_uring.h>
+#       include <sys/syscall.h>
+#       include <sys/mman.h>
+#       include <sys/eventfd.h>
+#       include <sys/stat.h>
+#       include <sys/uio.h>
+#       include <fcntl.h>
+#       include <unistd.h>
+#       if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(__NR_io_uring_register)
+#           define DI_HAVE_IO_URING 1
+#       endif
+#   endif
+#endif
+
+namespace di
+{
+    struct AsyncFileReader::Read
+    {
+        enum State
+        {
+            InFlight,
+            Done,
+            Failed,
+        };
+
+        explicit Read(const string& n) : name(n), state(InFlight), byThread(false), fd(-1), done(0) {}
+
+        string name;
+        State state;
+        PixelBufferPtr bytes;
+        bool byThread;
+        int fd;                 // the rest is io_uring only
+        size_t done;
+#ifdef DI_HAVE_IO_URING
+        iovec iov;
+#endif
+    };
+
+
+#ifdef DI_HAVE_IO_URING
+
+    // the rings are used without liburing, the system calls and the shared memory are all it takes.
+    // the kernel signals 'eventFd' for each completion, so do the reading threads, and WaitForAny() waits on it for both
+    struct AsyncFileReader::Ring
+    {
+        enum { Entries = 32 };
+
+        Ring() : fd(-1), eventFd(-1), sqMap(MAP_FAILED), sqMapSize(0), cqMap(MAP_FAILED), cqMapSize(0), sqes(static_cast<io_uring_sqe*>(MAP_FAILED)), sqesSize(0),
+            sqHead(nullptr), sqTail(nullptr), sqMask(nullptr), sqEntries(nullptr), sqArray(nullptr), cqHead(nullptr), cqTail(nullptr), cqMask(nullptr), cqes(nullptr), unsubmitted(0) {}
+        ~Ring() { Close(); }
+
+        bool Open();
+        void Close();
+        bool Push(Read* read);
+        bool Enter();
+        void Signal();
+        void WaitSignal();
+
+        int fd;
+        int eventFd;
+        void* sqMap;
+        size_t sqMapSize;
+        void* cqMap;
+        size_t cqMapSize;
+        io_uring_sqe* sqes;
+        size_t sqesSize;
+        uint32_t* sqHead;
+        uint32_t* sqTail;
+        uint32_t* sqMask;
+        uint32_t* sqEntries;
+        uint32_t* sqArray;
+        uint32_t* cqHead;
+        uint32_t* cqTail;
+        uint32_t* cqMask;
+        io_uring_cqe* cqes;
+        unsigned unsubmitted;
+        vector<ReadPtr> reads;  // in flight, the kernel writes into their buffers
+    };
+
+
+    bool AsyncFileReader::Ring::Open()
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd = int(syscall(__NR_io_uring_setup, unsigned(Entries), &params));
+        if (fd < 0)
+        {
+            LogInfo("io_uring_setup failed: %s, files are read by threads", strerror(errno));
+            return false;
+        }
+
+        sqMapSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (singleMap)
+        {
+            sqMapSize = cqMapSize = max(sqMapSize, cqMapSize);
+        }
+
+        sqMap = mmap(nullptr, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sqMap == MAP_FAILED)
+        {
+            Close();
+            return false;
+        }
+
+        if (!singleMap)
+        {
+            cqMap = mmap(nullptr, cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cqMap == MAP_FAILED)
+            {
+                Close();
+                return false;
+            }
+        }
+
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED)
+        {
+            Close();
+            return false;
+        }
+
+        uint8_t* sq = static_cast<uint8_t*>(sqMap);
+        uint8_t* cq = static_cast<uint8_t*>(singleMap ? sqMap : cqMap);
+        sqHead = reinterpret_cast<uint32_t*>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+        sqMask = reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+        sqEntries = reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_entries);
+        sqArray = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+        cqHead = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+        cqMask = reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        // since Linux 5.2
+        eventFd = eventfd(0, EFD_CLOEXEC);
+        if (eventFd < 0 || syscall(__NR_io_uring_register, fd, unsigned(IORING_REGISTER_EVENTFD), &eventFd, 1u) != 0)
+        {
+            LogInfo("io_uring eventfd failed: %s, files are read by threads", strerror(errno));
+            Close();
+            return false;
+        }
+
+        return true;
+    }
+
+
+    void AsyncFileReader::Ring::Close()
+    {
+        if (sqes != MAP_FAILED)
+        {
+            munmap(sqes, sqesSize);
+            sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+        }
+        if (cqMap != MAP_FAILED)
+        {
+            munmap(cqMap, cqMapSize);
+            cqMap = MAP_FAILED;
+        }
+        if (sqMap != MAP_FAILED)
+        {
+            munmap(sqMap, sqMapSize);
+            sqMap = MAP_FAILED;
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+        if (eventFd >= 0)
+        {
+            close(eventFd);
+            eventFd = -1;
+        }
+    }
+
+
+    // a read of the rest of the file, false if the submission queue is full
+    bool AsyncFileReader::Ring::Push(Read* read)
+    {
+        uint32_t tail = *sqTail;
+        if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= *sqEntries)
+        {
+            return false;
+        }
+
+        read->iov.iov_base = read->bytes->GetData() + read->done;
+        read->iov.iov_len = read->bytes->GetSize() - read->done;
+
+        uint32_t index = tail & *sqMask;
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = read->fd;
+        sqe->off = read->done;
+        sqe->addr = uint64_t(uintptr_t(&read->iov));
+        sqe->len = 1;
+        sqe->user_data = uint64_t(uintptr_t(read));
+
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        ++unsubmitted;
+        return true;
+    }
+
+
+    // submits what is pushed
+    bool AsyncFileReader::Ring::Enter()
+    {
+        if (unsubmitted == 0)
+        {
+            return true;
+        }
+
+        for (;;)
+        {
+            int submitted = int(syscall(__NR_io_uring_enter, fd, unsubmitted, 0u, 0u, nullptr, 0));
+            if (submitted >= 0)
+            {
+                unsubmitted -= unsigned(submitted);
+                return true;
+            }
+
+            if (errno != EINTR)
+            {
+                LogWarn("io_uring_enter failed: %s", strerror(errno));
+                return false;
+            }
+        }
+    }
+
+
+    // a completion by a reading thread
+    void AsyncFileReader::Ring::Signal()
+    {
+        uint64_t one = 1;
+        while (write(eventFd, &one, sizeof(one)) < 0 && errno == EINTR)
+        {
+        }
+    }
+
+
+    // returns after a completion of either kind since the last call
+    void AsyncFileReader::Ring::WaitSignal()
+    {
+        uint64_t count;
+        while (read(eventFd, &count, sizeof(count)) < 0 && errno == EINTR)
+        {
+        }
+    }
+
+#else
+
+    struct AsyncFileReader::Ring
+    {
+    };
+
+#endif
+
+
+    AsyncFileReader::AsyncFileReader()
+        : m_threadsStarted(false), m_threadReadsInFlight(0), m_completions(0), m_seenCompletions(0), m_ringReads(0), m_threadReads(0), m_packRanges(0)
+    {
+#ifdef DI_HAVE_IO_URING
+        m_ring.reset(new Ring());
+        if (!m_ring->Open())
+        {
+            m_ring.reset();
+        }
+#endif
+
+        LogInfo("async file reader: %s", m_ring ? "io_uring" : "threads");
+    }
+
+
+    AsyncFileReader::~AsyncFileReader()
+    {
+    }
+
+
+    // never freed, the worker thread and the reading threads are not joined at exit
+    AsyncFileReader& AsyncFileReader::Singleton()
+    {
+        static AsyncFileReader* s_reader = new AsyncFileReader();
+        return *s_reader;
+    }
+
+
+    void AsyncFileReader::Submit(const vector<string>& names)
+    {
+        DI_SAVE_CALLSTACK();
+
+        vector<AssetView> packed;
+
+        for (auto iter = names.begin(); iter != names.end(); ++iter)
+        {
+            const string& name = *iter;
+
+            AssetView view;
+            if (AssetPack_Find(name, &view))
+            {
+                packed.push_back(view);
+                continue;
+            }
+
+            if (FileByteCache::Singleton().Contains(name))
+            {
+                continue;
+            }
+
+            ThreadLockGuard lock(m_lock);
+            if (m_reads.count(name) != 0)
+            {
+                continue;
+            }
+
+            ReadPtr read(new Read(name));
+            m_reads[name] = read;
+            lock.Unlock();
+
+            if (SubmitToRing(read))
+            {
+                continue;
+            }
+
+            if (!m_threadsStarted)
+            {
+                StartThreads();
+            }
+
+            ThreadLockGuard queueLock(m_lock);
+            read->byThread = true;
+            m_queue.push_back(read);
+            ++m_threadReadsInFlight;
+            ++m_threadReads;
+            m_cvQueued.Notify();
+        }
+
+#ifdef DI_HAVE_IO_URING
+        if (m_ring)
+        {
+            m_ring->Enter();
+        }
+#endif
+
+        if (!packed.empty())
+        {
+            uint32_t ranges = uint32_t(AssetPack_WillNeed(packed));
+            ThreadLockGuard lock(m_lock);
+            m_packRanges += ranges;
+        }
+    }
+
+
+    // opened and sized here, read by the kernel. false if the reading threads should read it
+    bool AsyncFileReader::SubmitToRing(const ReadPtr& read)
+    {
+#ifdef DI_HAVE_IO_URING
+        if (!m_ring || m_ring->reads.size() >= Ring::Entries)
+        {
+            return false;
+        }
+
+        int fd = open(read->name.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            close(fd);
+            return false;
+        }
+
+        read->bytes = PixelBufferPool::Singleton().Acquire(size_t(st.st_size));
+        if (st.st_size == 0)
+        {
+            close(fd);
+            Complete(read.get(), true);
+            return true;
+        }
+
+        read->fd = fd;
+
+        if (!m_ring->Push(read.get()))
+        {
+            // full of pushed reads, they go now
+            if (!m_ring->Enter() || !m_ring->Push(read.get()))
+            {
+                close(fd);
+                read->fd = -1;
+                read->bytes.reset();
+                return false;
+            }
+        }
+
+        m_ring->reads.push_back(read);
+
+        ThreadLockGuard lock(m_lock);
+        ++m_ringReads;
+        return true;
+#else
+        (void)read;
+        return false;
+#endif
+    }
+
+
+    // the completions in the queue, it does not wait. returns the reads completed
+    int AsyncFileReader::ReapRing()
+    {
+#ifdef DI_HAVE_IO_URING
+        if (!m_ring || m_ring->reads.empty())
+        {
+            return 0;
+        }
+
+        int completed = 0;
+        uint32_t head = *m_ring->cqHead;
+        uint32_t tail = __atomic_load_n(m_ring->cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+        {
+            const io_uring_cqe& cqe = m_ring->cqes[head & *m_ring->cqMask];
+            Read* read = reinterpret_cast<Read*>(uintptr_t(cqe.user_data));
+
+            if (cqe.res > 0)
+            {
+                read->done += size_t(cqe.res);
+                if (read->done < read->bytes->GetSize() && m_ring->Push(read))
+                {
+                    continue;       // a short read, the rest is read again
+                }
+            }
+
+            bool ok = read->done == read->bytes->GetSize();
+            if (!ok)
+            {
+                LogWarn("async read of '%s' failed: %s", read->name.c_str(), cqe.res < 0 ? strerror(-cqe.res) : "short read");
+            }
+
+            close(read->fd);
+            read->fd = -1;
+            Complete(read, ok);
+            ++completed;
+
+            auto found = find_if(m_ring->reads.begin(), m_ring->reads.end(), [read](const ReadPtr& r) { return r.get() == read; });
+            if (found != m_ring->reads.end())
+            {
+                m_ring->reads.erase(found);
+            }
+        }
+
+        __atomic_store_n(m_ring->cqHead, head, __ATOMIC_RELEASE);
+        m_ring->Enter();
+        return completed;
+#else
+        return 0;
+#endif
+    }
+
+
+    void AsyncFileReader::StartThreads()
+    {
+        // two reads in flight keep a flash device busy, more threads mostly wait
+        const int ThreadCount = 2;
+
+        m_threadsStarted = true;
+        for (int i = 0; i < ThreadCount; ++i)
+        {
+            ThreadEventHandlers handlers;
+            handlers.threadName = "File Reader";
+            handlers.onLoop = [this](bool* willEndThread, uint32_t* willWaitMillis)
+            {
+                *willEndThread = false;
+                *willWaitMillis = 0;
+
+                ReadPtr read;
+                m_cvQueued.WaitUntil(
+                    m_lock,
+                    [this]() { return !m_queue.empty(); },
+                    [this, &read]()
+                    {
+                        if (!m_queue.empty())
+                        {
+                            read = m_queue.front();
+                            m_queue.pop_front();
+                        }
+                    });
+
+                if (read)
+                {
+                    Complete(read.get(), ReadInThread(read.get()));
+                }
+            };
+
+            StartThread(handlers);
+        }
+    }
+
+
+    bool AsyncFileReader::ReadInThread(Read* read)
+    {
+        DI_SAVE_CALLSTACK();
+
+        // a file which is not there is not logged, the load reads it again and logs it unless it is optional
+        SDL_RWops* rw = SDL_RWFromFile(read->name.c_str(), "rb");
+        if (!rw)
+        {
+            return false;
+        }
+
+        auto rwDeleter = MakeCallAtScopeExit([rw](){ SDL_RWclose(rw); });
+
+        int64_t size = SDL_RWsize(rw);
+        if (size < 0)
+        {
+            return false;
+        }
+
+        read->bytes = PixelBufferPool::Singleton().Acquire(size_t(size));
+        return size == 0 || SDL_RWread(rw, read->bytes->GetData(), size_t(size), 1) == 1;
+    }
+
+
+    void AsyncFileReader::Complete(Read* read, bool ok)
+    {
+        ThreadLockGuard lock(m_lock);
+
+        read->state = ok ? Read::Done : Read::Failed;
+        if (!ok)
+        {
+            read->bytes.reset();
+        }
+
+        if (read->byThread)
+        {
+            --m_threadReadsInFlight;
+
+#ifdef DI_HAVE_IO_URING
+            if (m_ring)
+            {
+                m_ring->Signal();
+            }
+#endif
+        }
+
+        ++m_completions;
+        m_cvDone.Notify();
+    }
+
+
+    bool AsyncFileReader::IsDone(const string& name)
+    {
+        ThreadLockGuard lock(m_lock);
+
+        auto found = m_reads.find(name);
+        return found == m_reads.end() || found->second->state != Read::InFlight;
+    }
+
+
+    void AsyncFileReader::WaitForAny()
+    {
+        DI_SAVE_CALLSTACK();
+
+        // the ring is reaped by this thread alone, the reading threads complete by themselves
+        ReapRing();
+
+        ThreadLockGuard lock(m_lock);
+        uint32_t seen = m_seenCompletions;
+        m_seenCompletions = m_completions;
+        if (m_completions != seen)
+        {
+            return;
+        }
+
+#ifdef DI_HAVE_IO_URING
+        if (m_ring)
+        {
+            // a completion of either kind signals the eventfd, one which comes before the wait is not missed
+            lock.Unlock();
+            for (;;)
+            {
+                {
+                    ThreadLockGuard waitLock(m_lock);
+                    if (m_completions != seen || (m_threadReadsInFlight == 0 && m_ring->reads.empty()))
+                    {
+                        m_seenCompletions = m_completions;
+                        return;
+                    }
+                }
+
+                m_ring->WaitSignal();
+                ReapRing();
+            }
+        }
+#endif
+
+        lock.Unlock();
+
+        m_cvDone.WaitUntil(
+            m_lock,
+            [this, seen]() { return m_completions != seen || m_threadReadsInFlight == 0; },
+            [this]() { m_seenCompletions = m_completions; });
+    }
+
+
+    PixelBufferPtr AsyncFileReader::Take(const string& name)
+    {
+        ThreadLockGuard lock(m_lock);
+
+        auto found = m_reads.find(name);
+        if (found == m_reads.end() || found->second->state != Read::Done)
+        {
+            return PixelBufferPtr();
+        }
+
+        PixelBufferPtr bytes = found->second->bytes;
+        m_reads.erase(found);
+        return bytes;
+    }
+
+
+    void AsyncFileReader::Drop(const string& name)
+    {
+        ThreadLockGuard lock(m_lock);
+        m_reads.erase(name);
+    }
+
+
+    void AsyncFileReader::GetStats(uint32_t* ringReads, uint32_t* threadReads, uint32_t* packRanges)
+    {
+        ThreadLockGuard lock(m_lock);
+        *ringReads = m_ringReads;
+        *threadReads = m_threadReads;
+        *packRanges = m_packRanges;
+    }
+}
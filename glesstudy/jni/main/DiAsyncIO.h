@@ -0,0 +1,73 @@
+#ifndef DI_ASYNC_IO_H_INCLUDED
+#define DI_ASYNC_IO_H_INCLUDED
+
+#include "DiImage.h"
+
+namespace di
+{
+    // Reads the files of the resources at the top of the worker thread's queue ahead of their Load_InWorkThread(),
+    // so the storage reads the next files while the worker decodes, and a device with a command queue (UFS, NVMe, SSD)
+    // gets several reads to order as it likes. the worker still loads one resource at a time, the top of the queue.
+    //
+    // on desktop Linux the reads go through one io_uring, submitted by a single system call per batch. where io_uring
+    // is missing (Windows, kernels before 5.2, io_uring_disabled) and on Android (the seccomp filter of apps kills a
+    // process which calls io_uring_setup) the files are read by a few threads, as are files open() can not reach (in the APK).
+    // files in asset packs are not read, the kernel is asked for their pages, files next to each other as one range.
+    // files in the RAM tier of FileByteCache are not read either.
+    //
+    // the files read are taken by FileByteCache::Read(). ONLY used by the worker thread of ResourceManager, except Take()
+    class AsyncFileReader
+    {
+    public:
+        AsyncFileReader();
+        ~AsyncFileReader();
+
+        // starts reading the files which are not read or being read already
+        void Submit(const vector<string>& names);
+
+        // true if the file is read or failed, or was not submitted
+        bool IsDone(const string& name);
+
+        // returns when a read completes, at once if one has completed since the last call or none is in flight
+        void WaitForAny();
+
+        // the file if it is read (it leaves the reader), otherwise null. thread safe
+        PixelBufferPtr Take(const string& name);
+
+        // forget the file, for a load which did not take it. a read in flight completes into nowhere
+        void Drop(const string& name);
+
+        void GetStats(uint32_t* ringReads, uint32_t* threadReads, uint32_t* packRanges);
+
+        static AsyncFileReader& Singleton();
+
+    private:
+        struct Read;
+        struct Ring;
+        typedef shared_ptr<Read> ReadPtr;
+
+        void StartThreads();
+        void Complete(Read* read, bool ok);
+        bool SubmitToRing(const ReadPtr& read);
+        int ReapRing();
+        static bool ReadInThread(Read* read);
+
+        ThreadLock m_lock;
+        ThreadConditionVariable m_cvQueued;     // to the reading threads
+        ThreadConditionVariable m_cvDone;       // to the worker thread
+        unordered_map<string, ReadPtr> m_reads;
+        deque<ReadPtr> m_queue;                 // for the reading threads
+        unique_ptr<Ring> m_ring;                // null if io_uring is not used
+        bool m_threadsStarted;
+        int m_threadReadsInFlight;
+        uint32_t m_completions;
+        uint32_t m_seenCompletions;             // by WaitForAny()
+        uint32_t m_ringReads;
+        uint32_t m_threadReads;
+        uint32_t m_packRanges;
+
+        DI_DISABLE_COPY(AsyncFileReader);
+    };
+}
+
+#endif
@@ -4,9 +4,30 @@
 #include "SDL.h"
 
 #include <algorithm>
+#include <cstdio>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#   include <windows.h>
+#else
+#   include <dirent.h>
+#endif
 
 namespace di
 {
+    uint64_t HighClock_Get()
+    {
+        return SDL_GetPerformanceCounter();
+    }
+
+
+    double HighClock_ToSeconds(uint64_t clocks)
+    {
+        return clocks / (double)SDL_GetPerformanceFrequency();
+    }
+
+
     string String_Format(const char* fmt, ...)
     {
         va_list ap;
@@ -98,6 +119,119 @@ namespace di
     }
 
 
+    const string& PrefPath_Get()
+    {
+        static bool s_queried = false;
+        static string s_directory;
+
+        if (!s_queried)
+        {
+            s_queried = true;
+
+            char* path = SDL_GetPrefPath("eastcowboy", "glesstudy");
+            if (path)
+            {
+                s_directory = path;
+                SDL_free(path);
+            }
+            else
+            {
+                LogWarn("SDL_GetPrefPath failed: %s. nothing is written to disk", SDL_GetError());
+            }
+        }
+
+        return s_directory;
+    }
+
+
+    bool File_WriteAtomically(const string& path, const char* what, const function<bool(SDL_RWops*)>& write)
+    {
+        string tempPath = path + ".tmp";
+        SDL_RWops* rw = SDL_RWFromFile(tempPath.c_str(), "wb");
+        if (!rw)
+        {
+            LogWarn("can not create %s '%s'", what, tempPath.c_str());
+            return false;
+        }
+
+        bool written = write(rw);
+        if (SDL_RWclose(rw) != 0 || !written)
+        {
+            LogWarn("write %s '%s' failed", what, tempPath.c_str());
+            remove(tempPath.c_str());
+            return false;
+        }
+
+#ifdef _WIN32
+        remove(path.c_str());   // rename() does not replace an existing file on Windows
+#endif
+        if (rename(tempPath.c_str(), path.c_str()) != 0)
+        {
+            LogWarn("rename %s '%s' failed", what, tempPath.c_str());
+            remove(tempPath.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+
+    bool File_GetStamp(const string& path, uint64_t* size, uint64_t* modified)
+    {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 || (st.st_mode & S_IFMT) != S_IFREG)
+        {
+            return false;
+        }
+
+        *size = uint64_t(st.st_size);
+        *modified = uint64_t(st.st_mtime);
+        return true;
+    }
+
+
+    bool File_ListDirectory(const string& directory, vector<string>* names)
+    {
+        names->clear();
+
+#ifdef _WIN32
+        WIN32_FIND_DATAA data;
+        HANDLE find = FindFirstFileA((directory + "*").c_str(), &data);
+        if (find == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+
+        do
+        {
+            if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+            {
+                names->push_back(data.cFileName);
+            }
+        } while (FindNextFileA(find, &data));
+
+        FindClose(find);
+#else
+        DIR* dir = opendir(directory.c_str());
+        if (!dir)
+        {
+            return false;
+        }
+
+        while (dirent* entry = readdir(dir))
+        {
+            if (entry->d_name[0] != '.')
+            {
+                names->push_back(entry->d_name);
+            }
+        }
+
+        closedir(dir);
+#endif
+        return true;
+    }
+
+
 #ifdef _WIN32
     static __declspec(thread) FuncCallInfoStack* s_threadFuncCallInfoStack;
 #else
@@ -292,6 +426,166 @@ namespace di
     }
 
 
+    struct ParallelForData
+    {
+        const char* name;
+        int count;
+        const function<void(int)>* func;
+        SDL_atomic_t next;
+        int maxHelpers;
+        int helpers;        // pool threads which took part, under ParallelForPool::lock
+        int running;        // of them, those still running items
+    };
+
+
+    // the threads which help ParallelFor() callers, one less than the CPUs since the caller takes part. started by the
+    // first call and never ended (leaked, they may outlive exit)
+    struct ParallelForPool
+    {
+        ThreadLock lock;
+        ThreadConditionVariable cvJob;      // to the pool threads
+        ThreadConditionVariable cvDone;     // to the callers
+        vector<ParallelForData*> jobs;
+
+        ParallelForData* FindJob()
+        {
+            for (auto iter = jobs.begin(); iter != jobs.end(); ++iter)
+            {
+                ParallelForData* data = *iter;
+                if (data->helpers < data->maxHelpers && SDL_AtomicGet(&data->next) < data->count)
+                {
+                    return data;
+                }
+            }
+
+            return nullptr;
+        }
+
+        static ParallelForPool& Singleton();
+    };
+
+
+    static void ParallelForRun(ParallelForData* data)
+    {
+        for (;;)
+        {
+            int i = SDL_AtomicAdd(&data->next, 1);
+            if (i >= data->count)
+            {
+                break;
+            }
+
+            try
+            {
+                (*data->func)(i);
+            }
+            catch (const exception& ex)
+            {
+                LogError("ParallelFor '%s' item %d caught exception: %s", data->name, i, ex.what());
+            }
+            catch (...)
+            {
+                LogError("ParallelFor '%s' item %d caught unknown exception", data->name, i);
+            }
+        }
+    }
+
+
+    static ParallelForPool* ParallelForPool_Start()
+    {
+        ParallelForPool* pool = new ParallelForPool();
+
+        ThreadEventHandlers handlers;
+        handlers.threadName = "Parallel For";
+        handlers.onLoop = [pool](bool* /*willEndThread*/, uint32_t* /*willWaitMillis*/)
+        {
+            ParallelForData* data = nullptr;
+            pool->cvJob.WaitUntil(pool->lock, [pool]() { return pool->FindJob() != nullptr; }, [pool, &data]()
+            {
+                data = pool->FindJob();
+                if (data)
+                {
+                    ++data->helpers;
+                    ++data->running;
+                }
+            });
+
+            if (data)
+            {
+                ParallelForRun(data);
+
+                ThreadLockGuard lock(pool->lock);
+                --data->running;
+                pool->cvDone.Notify();
+            }
+        };
+
+        int threads = SDL_GetCPUCount() - 1;
+        for (int i = 0; i < threads; ++i)
+        {
+            StartThread(handlers);
+        }
+
+        return pool;
+    }
+
+
+    ParallelForPool& ParallelForPool::Singleton()
+    {
+        static ParallelForPool* s_pool = ParallelForPool_Start();
+        return *s_pool;
+    }
+
+
+    void ParallelFor(const char* name, int count, int maxThreads, const function<void(int)>& func)
+    {
+        DI_SAVE_CALLSTACK();
+
+        if (maxThreads <= 0)
+        {
+            maxThreads = SDL_GetCPUCount();
+        }
+
+        ParallelForData data;
+        data.name = name;
+        data.count = count;
+        data.func = &func;
+        SDL_AtomicSet(&data.next, 0);
+        data.maxHelpers = min(maxThreads, count) - 1;
+        data.helpers = 0;
+        data.running = 0;
+
+        if (data.maxHelpers <= 0)
+        {
+            ParallelForRun(&data);
+            return;
+        }
+
+        ParallelForPool& pool = ParallelForPool::Singleton();
+        {
+            ThreadLockGuard lock(pool.lock);
+            pool.jobs.push_back(&data);
+            pool.cvJob.Notify();
+        }
+
+        // if the pool is busy with other callers, everything is done here
+        ParallelForRun(&data);
+
+        bool finished = false;
+        while (!finished)
+        {
+            pool.cvDone.WaitUntil(pool.lock, [&data]() { return data.running == 0; }, [&pool, &data, &finished]()
+            {
+                if (data.running == 0)
+                {
+                    pool.jobs.erase(find(pool.jobs.begin(), pool.jobs.end(), &data));
+                    finished = true;
+                }
+            });
+        }
+    }
+
+
     ThreadLock::ThreadLock()
     {
         m_data = SDL_CreateMutex();
@@ -335,7 +629,10 @@ namespace di
         DI_SAVE_CALLSTACK();
 
         ThreadLockGuard lock(l);
-        SDL_CondWaitTimeout((SDL_cond*)m_data, (SDL_mutex*)l.m_data, 1000);
+        if (!cond())
+        {
+            SDL_CondWaitTimeout((SDL_cond*)m_data, (SDL_mutex*)l.m_data, 1000);
+        }
         func();
     }
 
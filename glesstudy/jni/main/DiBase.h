@@ -76,6 +76,20 @@ namespace di
     void LogError(_In_z_ _Printf_format_string_ const char* fmt, ...);
 #endif
 
+    // SDL_GetPrefPath() of the app, where it writes its files (encoded textures, tile pyramids, the prefetch manifest).
+    // "" if there is no writable directory. ONLY in GL thread
+    const string& PrefPath_Get();
+
+    // write a file as "<path>.tmp" by 'write' (false if it failed) and rename it to 'path' at the end, so a killed process
+    // never leaves a truncated file. failures are logged with 'what' the file is
+    bool File_WriteAtomically(const string& path, const char* what, const function<bool(SDL_RWops*)>& write);
+
+    // the size and modification time of a file, false if stat() can not see it (e.g. an asset in the APK)
+    bool File_GetStamp(const string& path, uint64_t* size, uint64_t* modified);
+
+    // the names of the files in a directory which ends with a separator (as PrefPath_Get() does), false if it can not be read
+    bool File_ListDirectory(const string& directory, vector<string>* names);
+
 
     template <typename F>
     class ExitScopeCall
@@ -182,6 +196,11 @@ namespace di
 
     void StartThread(const ThreadEventHandlers& handlers);
 
+    // call func(0) ... func(count - 1) on at most 'maxThreads' threads (including the calling thread, 0 means one per CPU),
+    // returns when all calls are done. exceptions thrown by func are logged and ignored.
+    // the other threads come from a pool started by the first call, shared by all callers
+    void ParallelFor(const char* name, int count, int maxThreads, const function<void(int)>& func);
+
 
     class ThreadLock
     {
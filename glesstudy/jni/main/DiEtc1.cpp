@@ -0,0 +1,683 @@
+#include "DiEtc1.h"
+#include "DiTextureVariant.h"
+#include <cstring>
+#include <cmath>
+#include <climits>
+#include <algorithm>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#   include <arm_neon.h>
+#   define DI_ETC1_NEON 1
+#elif defined(__SSE2__) || defined(_M_IX86) || defined(_M_X64)
+#   include <emmintrin.h>
+#   define DI_ETC1_SSE2 1
+#endif
+
+#ifndef GL_ETC1_RGB8_OES
+#   define GL_ETC1_RGB8_OES         0x8D64
+#endif
+
+#ifndef GL_COMPRESSED_RGB8_ETC2
+#   define GL_COMPRESSED_RGB8_ETC2  0x9274
+#endif
+
+// libktx/lib/etcdec.cxx
+extern void decompressBlockDiffFlipC(unsigned int block_part1, unsigned int block_part2, uint8_t* img, int width, int height, int startx, int starty, int channels);
+
+namespace di
+{
+    //
+    // An ETC1 block is 64 bits, stored big endian:
+    //   individual mode:    R1:4 R2:4 G1:4 G2:4 B1:4 B2:4 table1:3 table2:3 diff:1 (0) flip:1
+    //   differential mode:  R1:5 dR:3 G1:5 dG:3 B1:5 dB:3 table1:3 table2:3 diff:1 (1) flip:1
+    // followed by the 16 high bits and the 16 low bits of the 2 bit pixel indices, pixel (x, y) at bit x * 4 + y.
+    // flip 0 splits the block into 2x4 left / right halves, flip 1 into 4x2 top / bottom halves.
+    // each half has a base color and a table, a pixel is the base color plus one of the 4 modifiers of the table.
+    //
+    // The encoder tries both flips and both modes. the base color of a half starts from its average color,
+    // Quality_Normal and Quality_Best also try the quantized colors around it
+    //
+
+    static const int s_modifierTables[8][4] =
+    {
+        // index: 0 = +small, 1 = +large, 2 = -small, 3 = -large
+        {  2,   8,  -2,   -8 },
+        {  5,  17,  -5,  -17 },
+        {  9,  29,  -9,  -29 },
+        { 13,  42, -13,  -42 },
+        { 18,  60, -18,  -60 },
+        { 24,  80, -24,  -80 },
+        { 33, 106, -33, -106 },
+        { 47, 183, -47, -183 },
+    };
+
+
+    enum { MaxBaseCandidates = 27 };
+
+
+    struct HalfBlock
+    {
+        int16_t r[8];
+        int16_t g[8];
+        int16_t b[8];
+        int sum[3];
+    };
+
+
+    // the best table of a half for a base color
+    struct HalfFit
+    {
+        int q[3];               // quantized base color, 4 or 5 bits
+        int error;
+        int table;
+        uint8_t indices[8];
+    };
+
+
+    static inline int Clamp255(int v)
+    {
+        return v < 0 ? 0 : (v > 255 ? 255 : v);
+    }
+
+
+#if DI_ETC1_SSE2
+
+    // squared error of the 8 pixels to the nearest of 4 colors, and the index of that color
+    static int NearestColorErrors(const HalfBlock& half, const int colors[4][3], uint8_t indices[8])
+    {
+        __m128i zero = _mm_setzero_si128();
+        __m128i r = _mm_loadu_si128((const __m128i*)half.r);
+        __m128i g = _mm_loadu_si128((const __m128i*)half.g);
+        __m128i b = _mm_loadu_si128((const __m128i*)half.b);
+
+        // (r, g) pairs and (b, 0) pairs, so that _mm_madd_epi16 gives dr * dr + dg * dg and db * db in 32 bits
+        __m128i rg[2] = { _mm_unpacklo_epi16(r, g), _mm_unpackhi_epi16(r, g) };
+        __m128i b0[2] = { _mm_unpacklo_epi16(b, zero), _mm_unpackhi_epi16(b, zero) };
+
+        __m128i best[2];
+        __m128i index[2];
+
+        for (int k = 0; k < 4; ++k)
+        {
+            __m128i crg = _mm_set1_epi32((colors[k][1] << 16) | colors[k][0]);
+            __m128i cb = _mm_set1_epi32(colors[k][2]);
+            __m128i kk = _mm_set1_epi32(k);
+
+            for (int i = 0; i < 2; ++i)
+            {
+                __m128i drg = _mm_sub_epi16(rg[i], crg);
+                __m128i db = _mm_sub_epi16(b0[i], cb);
+                __m128i err = _mm_add_epi32(_mm_madd_epi16(drg, drg), _mm_madd_epi16(db, db));
+
+                if (k == 0)
+                {
+                    best[i] = err;
+                    index[i] = zero;
+                }
+                else
+                {
+                    // no _mm_min_epi32 in SSE2, select by the compare mask
+                    __m128i less = _mm_cmplt_epi32(err, best[i]);
+                    best[i] = _mm_or_si128(_mm_and_si128(less, err), _mm_andnot_si128(less, best[i]));
+                    index[i] = _mm_or_si128(_mm_and_si128(less, kk), _mm_andnot_si128(less, index[i]));
+                }
+            }
+        }
+
+        int32_t sums[4];
+        _mm_storeu_si128((__m128i*)sums, _mm_add_epi32(best[0], best[1]));
+
+        int32_t idx[8];
+        _mm_storeu_si128((__m128i*)idx, index[0]);
+        _mm_storeu_si128((__m128i*)(idx + 4), index[1]);
+        for (int i = 0; i < 8; ++i)
+        {
+            indices[i] = uint8_t(idx[i]);
+        }
+
+        return sums[0] + sums[1] + sums[2] + sums[3];
+    }
+
+#elif DI_ETC1_NEON
+
+    // squared error of the 8 pixels to the nearest of 4 colors, and the index of that color
+    static int NearestColorErrors(const HalfBlock& half, const int colors[4][3], uint8_t indices[8])
+    {
+        int16x8_t r = vld1q_s16(half.r);
+        int16x8_t g = vld1q_s16(half.g);
+        int16x8_t b = vld1q_s16(half.b);
+
+        uint32x4_t bestLo = vdupq_n_u32(0);
+        uint32x4_t bestHi = vdupq_n_u32(0);
+        uint32x4_t indexLo = vdupq_n_u32(0);
+        uint32x4_t indexHi = vdupq_n_u32(0);
+
+        for (int k = 0; k < 4; ++k)
+        {
+            int16x8_t dr = vsubq_s16(r, vdupq_n_s16(int16_t(colors[k][0])));
+            int16x8_t dg = vsubq_s16(g, vdupq_n_s16(int16_t(colors[k][1])));
+            int16x8_t db = vsubq_s16(b, vdupq_n_s16(int16_t(colors[k][2])));
+
+            int32x4_t errLo = vmull_s16(vget_low_s16(dr), vget_low_s16(dr));
+            errLo = vmlal_s16(errLo, vget_low_s16(dg), vget_low_s16(dg));
+            errLo = vmlal_s16(errLo, vget_low_s16(db), vget_low_s16(db));
+
+            int32x4_t errHi = vmull_s16(vget_high_s16(dr), vget_high_s16(dr));
+            errHi = vmlal_s16(errHi, vget_high_s16(dg), vget_high_s16(dg));
+            errHi = vmlal_s16(errHi, vget_high_s16(db), vget_high_s16(db));
+
+            uint32x4_t lo = vreinterpretq_u32_s32(errLo);
+            uint32x4_t hi = vreinterpretq_u32_s32(errHi);
+
+            if (k == 0)
+            {
+                bestLo = lo;
+                bestHi = hi;
+            }
+            else
+            {
+                uint32x4_t kk = vdupq_n_u32(uint32_t(k));
+                indexLo = vbslq_u32(vcltq_u32(lo, bestLo), kk, indexLo);
+                indexHi = vbslq_u32(vcltq_u32(hi, bestHi), kk, indexHi);
+                bestLo = vminq_u32(lo, bestLo);
+                bestHi = vminq_u32(hi, bestHi);
+            }
+        }
+
+        uint32_t sums[4];
+        vst1q_u32(sums, vaddq_u32(bestLo, bestHi));
+
+        uint32_t idx[8];
+        vst1q_u32(idx, indexLo);
+        vst1q_u32(idx + 4, indexHi);
+        for (int i = 0; i < 8; ++i)
+        {
+            indices[i] = uint8_t(idx[i]);
+        }
+
+        return int(sums[0] + sums[1] + sums[2] + sums[3]);
+    }
+
+#else
+
+    // squared error of the 8 pixels to the nearest of 4 colors, and the index of that color
+    static int NearestColorErrors(const HalfBlock& half, const int colors[4][3], uint8_t indices[8])
+    {
+        int sum = 0;
+        for (int i = 0; i < 8; ++i)
+        {
+            int best = INT_MAX;
+            for (int k = 0; k < 4; ++k)
+            {
+                int dr = half.r[i] - colors[k][0];
+                int dg = half.g[i] - colors[k][1];
+                int db = half.b[i] - colors[k][2];
+                int err = dr * dr + dg * dg + db * db;
+                if (err < best)
+                {
+                    best = err;
+                    indices[i] = uint8_t(k);
+                }
+            }
+            sum += best;
+        }
+        return sum;
+    }
+
+#endif
+
+
+    static inline int ExpandBase(int q, int bits)
+    {
+        return bits == 4 ? (q << 4) | q : (q << 3) | (q >> 2);
+    }
+
+
+    static void FitTables(const HalfBlock& half, int bits, HalfFit* fit)
+    {
+        int base[3];
+        for (int c = 0; c < 3; ++c)
+        {
+            base[c] = ExpandBase(fit->q[c], bits);
+        }
+
+        fit->error = INT_MAX;
+        for (int t = 0; t < 8; ++t)
+        {
+            int colors[4][3];
+            for (int k = 0; k < 4; ++k)
+            {
+                for (int c = 0; c < 3; ++c)
+                {
+                    colors[k][c] = Clamp255(base[c] + s_modifierTables[t][k]);
+                }
+            }
+
+            uint8_t indices[8];
+            int error = NearestColorErrors(half, colors, indices);
+            if (error < fit->error)
+            {
+                fit->error = error;
+                fit->table = t;
+                memcpy(fit->indices, indices, sizeof(indices));
+            }
+        }
+    }
+
+
+    // base colors around the average of a half, the first one is the rounded average
+    static int GetBaseCandidates(const HalfBlock& half, int bits, TextureOptions::Quality quality, int candidates[MaxBaseCandidates][3])
+    {
+        int maxValue = (1 << bits) - 1;
+
+        int q[3];
+        for (int c = 0; c < 3; ++c)
+        {
+            // round(average * maxValue / 255), the average is sum / 8
+            q[c] = (half.sum[c] * maxValue + 1020) / 2040;
+        }
+
+        int count = 0;
+        auto add = [&](int dr, int dg, int db)
+        {
+            int v[3] = { q[0] + dr, q[1] + dg, q[2] + db };
+            for (int c = 0; c < 3; ++c)
+            {
+                if (v[c] < 0 || v[c] > maxValue)
+                {
+                    return;
+                }
+            }
+            memcpy(candidates[count++], v, sizeof(v));
+        };
+
+        add(0, 0, 0);
+
+        if (quality == TextureOptions::Quality_Normal)
+        {
+            // one step along each channel
+            for (int d = -1; d <= 1; d += 2)
+            {
+                add(d, 0, 0);
+                add(0, d, 0);
+                add(0, 0, d);
+            }
+        }
+        else if (quality == TextureOptions::Quality_Best)
+        {
+            for (int dr = -1; dr <= 1; ++dr)
+            {
+                for (int dg = -1; dg <= 1; ++dg)
+                {
+                    for (int db = -1; db <= 1; ++db)
+                    {
+                        if (dr != 0 || dg != 0 || db != 0)
+                        {
+                            add(dr, dg, db);
+                        }
+                    }
+                }
+            }
+        }
+
+        return count;
+    }
+
+
+    static int FitCandidates(const HalfBlock& half, int bits, TextureOptions::Quality quality, HalfFit fits[MaxBaseCandidates])
+    {
+        int candidates[MaxBaseCandidates][3];
+        int count = GetBaseCandidates(half, bits, quality, candidates);
+        for (int i = 0; i < count; ++i)
+        {
+            memcpy(fits[i].q, candidates[i], sizeof(fits[i].q));
+            FitTables(half, bits, &fits[i]);
+        }
+        return count;
+    }
+
+
+    struct BlockChoice
+    {
+        int error;
+        bool diff;
+        bool flip;
+        HalfFit halves[2];
+    };
+
+
+    static void ChooseModes(const HalfBlock halves[2], bool flip, TextureOptions::Quality quality, BlockChoice* best)
+    {
+        HalfFit fits[2][MaxBaseCandidates];
+        int counts[2];
+
+        // individual mode, the halves are independent
+        for (int h = 0; h < 2; ++h)
+        {
+            counts[h] = FitCandidates(halves[h], 4, quality, fits[h]);
+
+            int bestIndex = 0;
+            for (int i = 1; i < counts[h]; ++i)
+            {
+                if (fits[h][i].error < fits[h][bestIndex].error)
+                {
+                    bestIndex = i;
+                }
+            }
+            fits[h][0] = fits[h][bestIndex];
+        }
+
+        if (fits[0][0].error + fits[1][0].error < best->error)
+        {
+            best->error = fits[0][0].error + fits[1][0].error;
+            best->diff = false;
+            best->flip = flip;
+            best->halves[0] = fits[0][0];
+            best->halves[1] = fits[1][0];
+        }
+
+        // differential mode, the second base color must be within [-4, 3] of the first one
+        for (int h = 0; h < 2; ++h)
+        {
+            counts[h] = FitCandidates(halves[h], 5, quality, fits[h]);
+        }
+
+        for (int i = 0; i < counts[0]; ++i)
+        {
+            for (int j = 0; j < counts[1]; ++j)
+            {
+                const HalfFit& a = fits[0][i];
+                const HalfFit& b = fits[1][j];
+
+                int error = a.error + b.error;
+                if (error >= best->error)
+                {
+                    continue;
+                }
+
+                bool fits3Bits = true;
+                for (int c = 0; c < 3; ++c)
+                {
+                    int d = b.q[c] - a.q[c];
+                    fits3Bits = fits3Bits && d >= -4 && d <= 3;
+                }
+
+                if (fits3Bits)
+                {
+                    best->error = error;
+                    best->diff = true;
+                    best->flip = flip;
+                    best->halves[0] = a;
+                    best->halves[1] = b;
+                }
+            }
+        }
+    }
+
+
+    static inline void StoreBigEndian(uint8_t* dst, uint32_t v)
+    {
+        dst[0] = uint8_t(v >> 24);
+        dst[1] = uint8_t(v >> 16);
+        dst[2] = uint8_t(v >> 8);
+        dst[3] = uint8_t(v);
+    }
+
+
+    static void SplitBlock(const uint8_t block[16][3], bool flip, HalfBlock halves[2])
+    {
+        int counts[2] = { 0, 0 };
+        memset(halves, 0, sizeof(HalfBlock) * 2);
+
+        for (int y = 0; y < 4; ++y)
+        {
+            for (int x = 0; x < 4; ++x)
+            {
+                int h = flip ? (y >> 1) : (x >> 1);
+                HalfBlock& half = halves[h];
+                int i = counts[h]++;
+
+                const uint8_t* p = block[y * 4 + x];
+                half.r[i] = p[0];
+                half.g[i] = p[1];
+                half.b[i] = p[2];
+                half.sum[0] += p[0];
+                half.sum[1] += p[1];
+                half.sum[2] += p[2];
+            }
+        }
+    }
+
+
+    // 'block' is 4x4 pixels of r, g, b, row by row
+    static void EncodeBlock(const uint8_t block[16][3], TextureOptions::Quality quality, uint8_t* dst)
+    {
+        BlockChoice best;
+        best.error = INT_MAX;
+
+        // the flip is chosen by the average colors, then only the better flip searches more base colors
+        HalfBlock halves[2][2];
+        for (int flip = 0; flip < 2; ++flip)
+        {
+            SplitBlock(block, flip != 0, halves[flip]);
+            ChooseModes(halves[flip], flip != 0, TextureOptions::Quality_Fast, &best);
+        }
+
+        if (quality != TextureOptions::Quality_Fast && best.error > 0)
+        {
+            ChooseModes(halves[best.flip ? 1 : 0], best.flip, quality, &best);
+        }
+
+        const HalfFit& a = best.halves[0];
+        const HalfFit& b = best.halves[1];
+
+        uint32_t high;
+        if (best.diff)
+        {
+            high = (a.q[0] << 27) | (((b.q[0] - a.q[0]) & 7) << 24)
+                 | (a.q[1] << 19) | (((b.q[1] - a.q[1]) & 7) << 16)
+                 | (a.q[2] << 11) | (((b.q[2] - a.q[2]) & 7) << 8);
+        }
+        else
+        {
+            high = (a.q[0] << 28) | (b.q[0] << 24) | (a.q[1] << 20) | (b.q[1] << 16) | (a.q[2] << 12) | (b.q[2] << 8);
+        }
+        high |= (a.table << 5) | (b.table << 2) | (best.diff ? 2 : 0) | (best.flip ? 1 : 0);
+
+        // the pixels of each half are visited in the same order as they were filled
+        uint32_t low = 0;
+        int counts[2] = { 0, 0 };
+        for (int y = 0; y < 4; ++y)
+        {
+            for (int x = 0; x < 4; ++x)
+            {
+                int h = best.flip ? (y >> 1) : (x >> 1);
+                int index = best.halves[h].indices[counts[h]++];
+                int bit = x * 4 + y;
+                low |= uint32_t(index >> 1) << (16 + bit);
+                low |= uint32_t(index & 1) << bit;
+            }
+        }
+
+        StoreBigEndian(dst, high);
+        StoreBigEndian(dst + 4, low);
+    }
+
+
+    // r, g, b of the pixels, or the alpha as gray
+    static void LoadBlock(const Image& src, int bpp, bool alpha, int blockX, int blockY, uint8_t block[16][3])
+    {
+        for (int y = 0; y < 4; ++y)
+        {
+            int sy = min(blockY * 4 + y, src.height - 1);
+            const uint8_t* row = src.pixels->GetData() + size_t(src.pitch) * sy;
+
+            for (int x = 0; x < 4; ++x)
+            {
+                int sx = min(blockX * 4 + x, src.width - 1);
+                if (alpha)
+                {
+                    memset(block[y * 4 + x], row[sx * bpp + 3], 3);
+                }
+                else
+                {
+                    memcpy(block[y * 4 + x], row + sx * bpp, 3);
+                }
+            }
+        }
+    }
+
+
+    GLenum Etc1_GetGlFormat()
+    {
+        const GpuTextureCaps& caps = GpuTextureCaps_Get();
+        if (caps.etc1)
+        {
+            return GL_ETC1_RGB8_OES;
+        }
+
+        if (caps.etc2)
+        {
+            return GL_COMPRESSED_RGB8_ETC2;
+        }
+
+        static bool s_warned = false;
+        if (!s_warned)
+        {
+            s_warned = true;
+            LogWarn("ETC1 is not supported, textures asking for ETC1 are not compressed");
+        }
+        return 0;
+    }
+
+
+    bool Etc1_CanEncode(const Image& image)
+    {
+        if (image.format == TextureProtocol::RGB_888)
+        {
+            return true;
+        }
+
+        if (image.format != TextureProtocol::RGBA_8888)
+        {
+            return false;
+        }
+
+        for (int y = 0; y < image.height; ++y)
+        {
+            const uint8_t* row = image.pixels->GetData() + size_t(image.pitch) * y;
+            for (int x = 0; x < image.width; ++x)
+            {
+                if (row[x * 4 + 3] != 255)
+                {
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+
+    static void EncodeImage(const Image& src, bool alpha, TextureOptions::Quality quality, GLenum glFormat, Image* dst)
+    {
+        int bpp = src.format == TextureProtocol::RGB_888 ? 3 : 4;
+        int blocksX = (src.width + 3) / 4;
+        int blocksY = (src.height + 3) / 4;
+
+        dst->format = TextureProtocol::ETC1_RGB;
+        dst->glFormat = glFormat;
+        dst->glType = 0;
+        dst->width = src.width;
+        dst->height = src.height;
+        dst->pitch = blocksX * 8;
+        dst->unpackAlignment = 4;
+        dst->pixels = PixelBufferPool::Singleton().Acquire(size_t(dst->pitch) * blocksY);
+
+        uint8_t* blocks = dst->pixels->GetData();
+        int pitch = dst->pitch;
+
+        ParallelFor("ETC1 Encoder", blocksY, 0, [&src, bpp, alpha, blocksX, blocks, pitch, quality](int blockY)
+        {
+            uint8_t block[16][3];
+            for (int blockX = 0; blockX < blocksX; ++blockX)
+            {
+                LoadBlock(src, bpp, alpha, blockX, blockY, block);
+                EncodeBlock(block, quality, blocks + size_t(pitch) * blockY + blockX * 8);
+            }
+        });
+    }
+
+
+    bool Etc1_Encode(const Image& src, TextureOptions::Quality quality, GLenum glFormat, Image* dst)
+    {
+        DI_SAVE_CALLSTACK();
+
+        if ((src.format != TextureProtocol::RGB_888 && src.format != TextureProtocol::RGBA_8888) || src.width <= 0 || src.height <= 0)
+        {
+            LogError("Etc1_Encode: format %d can not be encoded", int(src.format));
+            return false;
+        }
+
+        EncodeImage(src, false, quality, glFormat, dst);
+        return true;
+    }
+
+
+    bool Etc1_EncodeAlpha(const Image& src, TextureOptions::Quality quality, GLenum glFormat, Image* dst)
+    {
+        DI_SAVE_CALLSTACK();
+
+        if (src.format != TextureProtocol::RGBA_8888 || src.width <= 0 || src.height <= 0)
+        {
+            LogError("Etc1_EncodeAlpha: format %d has no alpha", int(src.format));
+            return false;
+        }
+
+        EncodeImage(src, true, quality, glFormat, dst);
+        return true;
+    }
+
+
+    double Etc1_ComputePSNR(const Image& src, const Image& encoded)
+    {
+        int bpp = src.format == TextureProtocol::RGB_888 ? 3 : 4;
+        int blocksX = (src.width + 3) / 4;
+        int blocksY = (src.height + 3) / 4;
+
+        double squaredError = 0;
+        for (int blockY = 0; blockY < blocksY; ++blockY)
+        {
+            for (int blockX = 0; blockX < blocksX; ++blockX)
+            {
+                const uint8_t* p = encoded.pixels->GetData() + size_t(encoded.pitch) * blockY + blockX * 8;
+                unsigned part1 = (unsigned(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+                unsigned part2 = (unsigned(p[4]) << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+
+                uint8_t decoded[16][3];
+                decompressBlockDiffFlipC(part1, part2, &decoded[0][0], 4, 4, 0, 0, 3);
+
+                for (int y = 0; y < 4 && blockY * 4 + y < src.height; ++y)
+                {
+                    const uint8_t* row = src.pixels->GetData() + size_t(src.pitch) * (blockY * 4 + y);
+                    for (int x = 0; x < 4 && blockX * 4 + x < src.width; ++x)
+                    {
+                        for (int c = 0; c < 3; ++c)
+                        {
+                            int d = int(row[(blockX * 4 + x) * bpp + c]) - decoded[y * 4 + x][c];
+                            squaredError += d * d;
+                        }
+                    }
+                }
+            }
+        }
+
+        if (squaredError == 0)
+        {
+            return HUGE_VAL;
+        }
+
+        double mse = squaredError / (double(src.width) * src.height * 3);
+        return 10.0 * log10(255.0 * 255.0 / mse);
+    }
+}
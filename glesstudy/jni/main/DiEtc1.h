@@ -0,0 +1,34 @@
+#ifndef DI_ETC1_H_INCLUDED
+#define DI_ETC1_H_INCLUDED
+
+#include "DiImage.h"
+
+namespace di
+{
+    // Runtime ETC1 encoder, for images which are only shipped as WebP / PNG / JPEG.
+    // An ETC1 image is stored as TextureProtocol::ETC1_RGB: 8 bytes per 4x4 block, rows of blocks from top to bottom,
+    // Image::glType is 0 and Image::pitch is the bytes of a row of blocks.
+    // ETC1 has no alpha, the alpha of a translucent image is encoded as a second, gray ETC1 image (ETC1_RGB_Alpha).
+
+    // GL_ETC1_RGB8_OES, or GL_COMPRESSED_RGB8_ETC2 when only ETC2 is supported (desktop GL, GLES3),
+    // ETC2 decoders read ETC1 blocks exactly. 0 if neither is supported. ONLY in GL thread
+    GLenum Etc1_GetGlFormat();
+
+    // RGB_888, or RGBA_8888 whose alpha is all 255. other RGBA_8888 images need Etc1_EncodeAlpha as well
+    bool Etc1_CanEncode(const Image& image);
+
+    // encode the r, g, b of an RGB_888 / RGBA_8888 image in worker thread, alpha is ignored.
+    // rows of blocks are spread over all CPUs by ParallelFor, the block search uses SSE2 or NEON.
+    // edge blocks of images whose size is not a multiple of 4 repeat the last row / column.
+    // 'glFormat' comes from Etc1_GetGlFormat(), 'dst' is allocated from PixelBufferPool
+    bool Etc1_Encode(const Image& src, TextureOptions::Quality quality, GLenum glFormat, Image* dst);
+
+    // encode the alpha of an RGBA_8888 image as a gray ETC1 image, the alpha plane of ETC1_RGB_Alpha
+    bool Etc1_EncodeAlpha(const Image& src, TextureOptions::Quality quality, GLenum glFormat, Image* dst);
+
+    // PSNR in dB of the encoded image against 'src', decoded by the ETC decoder of libktx (etcdec.cxx).
+    // slow, for debug builds and tools
+    double Etc1_ComputePSNR(const Image& src, const Image& encoded);
+}
+
+#endif
@@ -0,0 +1,1367 @@
+#include "DiImage.h"
+#include "DiAsyncIO.h"
+#include "SDL_image.h"
+
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#include "webp/decode.h"
+#include "png.h"
+
+#ifdef _WIN32
+// windows.h (included by ktx.h) has already typedef'ed 'boolean' as unsigned char,
+// while libjpeg is built with its own int sized 'boolean'
+#   define HAVE_BOOLEAN
+    typedef int jpeg_boolean;
+#   define boolean jpeg_boolean
+#endif
+// jconfig.h defines it again without a value, after the SDL config
+#undef HAVE_STDDEF_H
+#include "jpeglib.h"
+#ifdef _WIN32
+#   undef boolean
+#endif
+
+namespace di
+{
+    PixelBufferPool::PixelBufferPool(size_t maxIdleBytes)
+        : m_fields(new Fields)
+    {
+        m_fields->idleBytes = 0;
+        m_fields->maxIdleBytes = maxIdleBytes;
+    }
+
+
+    PixelBufferPool& PixelBufferPool::Singleton()
+    {
+        static PixelBufferPool s_pool(32 * 1024 * 1024);
+        return s_pool;
+    }
+
+
+    PixelBufferPtr PixelBufferPool::Acquire(size_t size)
+    {
+        DI_SAVE_CALLSTACK();
+
+        PixelBuffer* buffer = nullptr;
+
+        {
+            ThreadLockGuard lock(m_fields->lock);
+
+            // best fit, but don't waste a block more than twice as big as requested
+            auto& idle = m_fields->idleBuffers;
+            auto best = idle.end();
+            for (auto iter = idle.begin(); iter != idle.end(); ++iter)
+            {
+                size_t capacity = (*iter)->GetCapacity();
+                if (capacity >= size && capacity / 2 <= size && (best == idle.end() || capacity < (*best)->GetCapacity()))
+                {
+                    best = iter;
+                }
+            }
+
+            if (best != idle.end())
+            {
+                buffer = best->release();
+                idle.erase(best);
+                m_fields->idleBytes -= buffer->GetCapacity();
+            }
+        }
+
+        if (!buffer)
+        {
+            buffer = new PixelBuffer(std::max(size, size_t(1)));
+        }
+
+        buffer->m_size = size;
+
+        shared_ptr<Fields> fields = m_fields;
+        return PixelBufferPtr(buffer, [fields](PixelBuffer* b) { Recycle(fields, b); });
+    }
+
+
+    void PixelBufferPool::Recycle(const shared_ptr<Fields>& fields, PixelBuffer* buffer)
+    {
+        ThreadLockGuard lock(fields->lock);
+
+        if (fields->idleBytes + buffer->GetCapacity() > fields->maxIdleBytes)
+        {
+            lock.Unlock();
+            delete buffer;
+            return;
+        }
+
+        fields->idleBytes += buffer->GetCapacity();
+        fields->idleBuffers.push_back(unique_ptr<PixelBuffer>(buffer));
+    }
+
+
+    size_t PixelBufferPool::Trim()
+    {
+        DI_SAVE_CALLSTACK();
+
+        ThreadLockGuard lock(m_fields->lock);
+        vector<unique_ptr<PixelBuffer>> buffers;
+        buffers.swap(m_fields->idleBuffers);
+        size_t freed = m_fields->idleBytes;
+        m_fields->idleBytes = 0;
+        lock.Unlock();
+
+        return freed;
+    }
+
+
+    size_t PixelBufferPool::GetIdleBytes()
+    {
+        ThreadLockGuard lock(m_fields->lock);
+        return m_fields->idleBytes;
+    }
+
+
+    FileByteCache& FileByteCache::Singleton()
+    {
+        static FileByteCache s_cache;
+        return s_cache;
+    }
+
+
+    void FileByteCache::SetMaxBytes(size_t bytes)
+    {
+        // the buffers go back to PixelBufferPool outside of the lock
+        vector<PixelBufferPtr> evicted;
+
+        ThreadLockGuard lock(m_lock);
+        m_maxBytes = bytes;
+        Evict(GetRoom(), &evicted);
+    }
+
+
+    size_t FileByteCache::GetMaxBytes()
+    {
+        ThreadLockGuard lock(m_lock);
+        return m_maxBytes;
+    }
+
+
+    size_t FileByteCache::GetBytes()
+    {
+        ThreadLockGuard lock(m_lock);
+        return m_bytes;
+    }
+
+
+    size_t FileByteCache::GetPinnedBytes()
+    {
+        ThreadLockGuard lock(m_lock);
+        return m_pinnedBytes;
+    }
+
+
+    PixelBufferPtr FileByteCache::Read(const string& name, bool optional /* = false */)
+    {
+        DI_SAVE_CALLSTACK();
+
+        PixelBufferPtr cached = Take(name);
+        if (cached)
+        {
+            return cached;
+        }
+
+        // read ahead by the worker thread, see AsyncFileReader
+        PixelBufferPtr bytes = AsyncFileReader::Singleton().Take(name);
+        if (bytes)
+        {
+            ThreadLockGuard lock(m_lock);
+            ++m_diskReads;
+            return bytes;
+        }
+
+        SDL_RWops* rw = SDL_RWFromFile(name.c_str(), "rb");
+        if (!rw)
+        {
+            if (!optional)
+            {
+                LogError("SDL_RWFromFile('%s') failed", name.c_str());
+            }
+            return PixelBufferPtr();
+        }
+
+        auto rwDeleter = MakeCallAtScopeExit([rw](){ SDL_RWclose(rw); });
+
+        int64_t size = SDL_RWsize(rw);
+        if (size < 0)
+        {
+            LogError("SDL_RWsize('%s') failed", name.c_str());
+            return PixelBufferPtr();
+        }
+
+        bytes = PixelBufferPool::Singleton().Acquire(size_t(size));
+        if (size > 0 && SDL_RWread(rw, bytes->GetData(), size_t(size), 1) != 1)
+        {
+            LogError("SDL_RWread('%s') failed", name.c_str());
+            return PixelBufferPtr();
+        }
+
+        ThreadLockGuard lock(m_lock);
+        ++m_diskReads;
+        return bytes;
+    }
+
+
+    PixelBufferPtr FileByteCache::Take(const string& name)
+    {
+        ThreadLockGuard lock(m_lock);
+
+        auto found = m_index.find(name);
+        if (found == m_index.end())
+        {
+            return PixelBufferPtr();
+        }
+
+        PixelBufferPtr bytes = found->second->bytes;
+        m_bytes -= bytes->GetSize();
+        m_entries.erase(found->second);
+        m_index.erase(found);
+        ++m_ramHits;
+        return bytes;
+    }
+
+
+    bool FileByteCache::Contains(const string& name)
+    {
+        ThreadLockGuard lock(m_lock);
+        return m_index.count(name) != 0;
+    }
+
+
+    bool FileByteCache::Pin(const PixelBufferPtr& bytes)
+    {
+        vector<PixelBufferPtr> evicted;
+
+        ThreadLockGuard lock(m_lock);
+        if (m_pinned.count(bytes.get()) != 0)
+        {
+            return true;
+        }
+
+        if (bytes->GetSize() > GetRoom())
+        {
+            return false;
+        }
+
+        m_pinned.insert(bytes.get());
+        m_pinnedBytes += bytes->GetSize();
+        Evict(GetRoom(), &evicted);
+        return true;
+    }
+
+
+    void FileByteCache::Unpin(const PixelBufferPtr& bytes)
+    {
+        ThreadLockGuard lock(m_lock);
+        UnpinLocked(bytes);
+    }
+
+
+    void FileByteCache::UnpinLocked(const PixelBufferPtr& bytes)
+    {
+        if (m_pinned.erase(bytes.get()) != 0)
+        {
+            m_pinnedBytes -= bytes->GetSize();
+        }
+    }
+
+
+    void FileByteCache::Demote(const string& name, const PixelBufferPtr& bytes)
+    {
+        vector<PixelBufferPtr> evicted;
+
+        ThreadLockGuard lock(m_lock);
+        UnpinLocked(bytes);
+
+        auto found = m_index.find(name);
+        if (found != m_index.end())
+        {
+            m_bytes -= found->second->bytes->GetSize();
+            evicted.push_back(found->second->bytes);
+            m_entries.erase(found->second);
+            m_index.erase(found);
+        }
+
+        if (bytes->GetSize() > GetRoom())
+        {
+            return;
+        }
+
+        Evict(GetRoom() - bytes->GetSize(), &evicted);
+
+        Entry entry;
+        entry.name = name;
+        entry.bytes = bytes;
+        m_entries.push_front(entry);
+        m_index[name] = m_entries.begin();
+        m_bytes += bytes->GetSize();
+    }
+
+
+    size_t FileByteCache::Trim()
+    {
+        DI_SAVE_CALLSTACK();
+
+        vector<PixelBufferPtr> evicted;
+
+        ThreadLockGuard lock(m_lock);
+        size_t freed = m_bytes;
+        Evict(0, &evicted);
+        return freed;
+    }
+
+
+    void FileByteCache::GetStats(uint32_t* ramHits, uint32_t* diskReads)
+    {
+        ThreadLockGuard lock(m_lock);
+        *ramHits = m_ramHits;
+        *diskReads = m_diskReads;
+    }
+
+
+    void FileByteCache::Evict(size_t maxBytes, vector<PixelBufferPtr>* evicted)
+    {
+        while (m_bytes > maxBytes)
+        {
+            Entry& oldest = m_entries.back();
+            m_bytes -= oldest.bytes->GetSize();
+            evicted->push_back(oldest.bytes);
+            m_index.erase(oldest.name);
+            m_entries.pop_back();
+        }
+    }
+
+
+    bool Image_GetFormatInfo(TextureProtocol::InnerFormat format, int* bytesPerPixel, GLenum* glFormat, GLenum* glType)
+    {
+        switch (format)
+        {
+        case TextureProtocol::RGBA_8888:    *bytesPerPixel = 4; *glFormat = GL_RGBA; *glType = GL_UNSIGNED_BYTE; return true;
+        case TextureProtocol::RGB_888:      *bytesPerPixel = 3; *glFormat = GL_RGB;  *glType = GL_UNSIGNED_BYTE; return true;
+        case TextureProtocol::RGB_565:      *bytesPerPixel = 2; *glFormat = GL_RGB;  *glType = GL_UNSIGNED_SHORT_5_6_5; return true;
+        case TextureProtocol::RGBA_4444:    *bytesPerPixel = 2; *glFormat = GL_RGBA; *glType = GL_UNSIGNED_SHORT_4_4_4_4; return true;
+        case TextureProtocol::RGBA_5551:    *bytesPerPixel = 2; *glFormat = GL_RGBA; *glType = GL_UNSIGNED_SHORT_5_5_5_1; return true;
+        case TextureProtocol::Gray_8:       *bytesPerPixel = 1; *glFormat = GL_LUMINANCE; *glType = GL_UNSIGNED_BYTE; return true;
+        case TextureProtocol::Alpha_8:      *bytesPerPixel = 1; *glFormat = GL_ALPHA; *glType = GL_UNSIGNED_BYTE; return true;
+        default:                            return false;
+        }
+    }
+
+
+    int Image_GetAlignedPitch(int width, int bytesPerPixel)
+    {
+        return (width * bytesPerPixel + 3) & ~3;
+    }
+
+
+    GLint Image_GetUnpackAlignment(int rowBytes, int pitch)
+    {
+        static const GLint alignments[] = { 4, 8, 2, 1 };
+        for (int i = 0; i < int(sizeof(alignments) / sizeof(alignments[0])); ++i)
+        {
+            GLint a = alignments[i];
+            if ((rowBytes + a - 1) / a * a == pitch)
+            {
+                return a;
+            }
+        }
+
+        return 0;
+    }
+
+
+    bool Image_Allocate(Image* image, TextureProtocol::InnerFormat format, int width, int height, int minPitch /* = 0 */)
+    {
+        int bytesPerPixel;
+        if (!Image_GetFormatInfo(format, &bytesPerPixel, &image->glFormat, &image->glType))
+        {
+            LogError("Image_Allocate: format %d is not a plain pixel format", int(format));
+            return false;
+        }
+
+        int pitch = max(Image_GetAlignedPitch(width, bytesPerPixel), minPitch);
+        GLint unpackAlignment = Image_GetUnpackAlignment(width * bytesPerPixel, pitch);
+        if (unpackAlignment == 0)
+        {
+            LogError("Image_Allocate: pitch %d of width %d can not be uploaded", pitch, width);
+            return false;
+        }
+
+        image->format = format;
+        image->width = width;
+        image->height = height;
+        image->pitch = pitch;
+        image->unpackAlignment = unpackAlignment;
+        image->pixels = PixelBufferPool::Singleton().Acquire(size_t(image->pitch) * height);
+        return true;
+    }
+
+
+    ImageCodec Image_DetectCodec(const uint8_t* header, size_t size)
+    {
+        if (size >= 4 && header[0] == 0x89 && header[1] == 'P' && header[2] == 'N' && header[3] == 'G')
+        {
+            return ImageCodec_PNG;
+        }
+
+        if (size >= 3 && header[0] == 0xFF && header[1] == 0xD8 && header[2] == 0xFF)
+        {
+            return ImageCodec_JPEG;
+        }
+
+        if (size >= 12 && memcmp(header, "RIFF", 4) == 0 && memcmp(header + 8, "WEBP", 4) == 0)
+        {
+            return ImageCodec_WebP;
+        }
+
+        return ImageCodec_Unknown;
+    }
+
+
+    // how much of the source size is needed, 1 if the image is not shrunk
+    static double GetDecodeScale(const ImageDecodeHint& hint, int width, int height)
+    {
+        double scale = hint.scale > 0 && hint.scale < 1 ? hint.scale : 1.0;
+
+        int size = max(width, height);
+        if (hint.maxSize > 0 && size > hint.maxSize)
+        {
+            scale = min(scale, double(hint.maxSize) / size);
+        }
+
+        return scale;
+    }
+
+
+    static int ScaleSize(int size, double scale)
+    {
+        return max(1, int(ceil(size * scale - 1e-6)));
+    }
+
+
+    // the rest of the stream where it is in memory, for a memory stream or a mapped file. null for streams read piece by piece
+    static const uint8_t* GetMemoryView(SDL_RWops* rw, size_t* size)
+    {
+        size_t viewSize = 0;
+        const uint8_t* view = (const uint8_t*)SDL_RWGetMemoryView(rw, &viewSize);
+        Sint64 position = view ? SDL_RWtell(rw) : -1;
+        if (position < 0 || uint64_t(position) > viewSize)
+        {
+            return nullptr;
+        }
+
+        *size = viewSize - size_t(position);
+        return view + position;
+    }
+
+
+    //
+    // WebP
+    //
+    // WebP only decodes from memory: a memory stream or a mapped file is decoded where it is, other streams are read
+    // into a pooled buffer first.
+    // a shrunk image is decoded by the rescaler of libwebp, which scales each row as it comes out of the decoder
+    //
+
+    struct WebPFile
+    {
+        const uint8_t* data;
+        size_t size;
+        PixelBufferPtr bytes;       // null if data is the memory of the stream
+    };
+
+
+    static bool ReadWebPFile(SDL_RWops* rw, const string& name, WebPFile* file, WebPBitstreamFeatures* features)
+    {
+        file->data = GetMemoryView(rw, &file->size);
+        if (!file->data)
+        {
+            Sint64 fileSize = SDL_RWsize(rw) - SDL_RWtell(rw);
+            if (fileSize <= 0)
+            {
+                LogError("WebP file '%s' has no size", name.c_str());
+                return false;
+            }
+
+            file->bytes = PixelBufferPool::Singleton().Acquire(size_t(fileSize));
+            if (SDL_RWread(rw, file->bytes->GetData(), file->bytes->GetSize(), 1) != 1)
+            {
+                LogError("SDL_RWread('%s') failed", name.c_str());
+                return false;
+            }
+
+            file->data = file->bytes->GetData();
+            file->size = file->bytes->GetSize();
+        }
+
+        if (WebPGetFeatures(file->data, file->size, features) != VP8_STATUS_OK)
+        {
+            LogError("WebPGetFeatures('%s') failed", name.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+
+    // the output size, and the rescaler if the image is shrunk
+    static bool InitWebPConfig(const WebPBitstreamFeatures& features, const ImageDecodeHint& hint, const string& name, WebPDecoderConfig* config)
+    {
+        if (!WebPInitDecoderConfig(config))
+        {
+            LogError("WebPInitDecoderConfig('%s') failed", name.c_str());
+            return false;
+        }
+
+        config->output.width = features.width;
+        config->output.height = features.height;
+        config->output.is_external_memory = 1;
+
+        double scale = GetDecodeScale(hint, features.width, features.height);
+        if (scale < 1)
+        {
+            config->options.use_scaling = 1;
+            config->options.scaled_width = config->output.width = ScaleSize(features.width, scale);
+            config->options.scaled_height = config->output.height = ScaleSize(features.height, scale);
+        }
+
+        return true;
+    }
+
+
+    static bool DecodeWebPRGB(const WebPFile& file, const WebPBitstreamFeatures& features, const ImageDecodeHint& hint, const string& name, Image* image)
+    {
+        WebPDecoderConfig config;
+        if (!InitWebPConfig(features, hint, name, &config) ||
+            !Image_Allocate(image, features.has_alpha ? TextureProtocol::RGBA_8888 : TextureProtocol::RGB_888, config.output.width, config.output.height))
+        {
+            return false;
+        }
+
+        config.output.colorspace = features.has_alpha ? MODE_RGBA : MODE_RGB;
+        config.output.u.RGBA.rgba = image->pixels->GetData();
+        config.output.u.RGBA.stride = image->pitch;
+        config.output.u.RGBA.size = image->pixels->GetSize();
+
+        if (WebPDecode(file.data, file.size, &config) != VP8_STATUS_OK)
+        {
+            LogError("WebPDecode('%s') failed", name.c_str());
+            image->pixels.reset();
+            return false;
+        }
+
+        return true;
+    }
+
+
+    static bool DecodeWebP(SDL_RWops* rw, const string& name, const ImageDecodeHint& hint, Image* image)
+    {
+        DI_SAVE_CALLSTACK();
+
+        WebPFile file;
+        WebPBitstreamFeatures features;
+        return ReadWebPFile(rw, name, &file, &features) && DecodeWebPRGB(file, features, hint, name, image);
+    }
+
+
+    // lossy WebP is VP8, which is 4:2:0 YUV in video range. lossless and alpha images have no YUV to keep
+    static bool DecodeWebPYUV(SDL_RWops* rw, const string& name, const ImageDecodeHint& hint, ImagePlanes* planes)
+    {
+        DI_SAVE_CALLSTACK();
+
+        WebPFile file;
+        WebPBitstreamFeatures features;
+        if (!ReadWebPFile(rw, name, &file, &features))
+        {
+            return false;
+        }
+
+        if (features.format != 1 || features.has_alpha)
+        {
+            if (!DecodeWebPRGB(file, features, hint, name, &planes->planes[0]))
+            {
+                return false;
+            }
+
+            planes->format = planes->planes[0].format;
+            planes->width = planes->planes[0].width;
+            planes->height = planes->planes[0].height;
+            planes->count = 1;
+            return true;
+        }
+
+        WebPDecoderConfig config;
+        if (!InitWebPConfig(features, hint, name, &config))
+        {
+            return false;
+        }
+
+        int width = config.output.width;
+        int height = config.output.height;
+        int chromaWidth = (width + 1) / 2;
+        int chromaHeight = (height + 1) / 2;
+
+        Image& y = planes->planes[0];
+        Image& u = planes->planes[1];
+        Image& v = planes->planes[2];
+        if (!Image_Allocate(&y, TextureProtocol::Gray_8, width, height) ||
+            !Image_Allocate(&u, TextureProtocol::Gray_8, chromaWidth, chromaHeight) ||
+            !Image_Allocate(&v, TextureProtocol::Gray_8, chromaWidth, chromaHeight))
+        {
+            *planes = ImagePlanes();
+            return false;
+        }
+
+        WebPYUVABuffer& yuv = config.output.u.YUVA;
+        config.output.colorspace = MODE_YUV;
+        yuv.y = y.pixels->GetData();
+        yuv.y_stride = y.pitch;
+        yuv.y_size = y.pixels->GetSize();
+        yuv.u = u.pixels->GetData();
+        yuv.u_stride = u.pitch;
+        yuv.u_size = u.pixels->GetSize();
+        yuv.v = v.pixels->GetData();
+        yuv.v_stride = v.pitch;
+        yuv.v_size = v.pixels->GetSize();
+
+        if (WebPDecode(file.data, file.size, &config) != VP8_STATUS_OK)
+        {
+            LogError("WebPDecode('%s') to YUV failed", name.c_str());
+            *planes = ImagePlanes();
+            return false;
+        }
+
+        planes->format = TextureProtocol::YUV_VideoRange;
+        planes->width = width;
+        planes->height = height;
+        planes->count = 3;
+        return true;
+    }
+
+
+    //
+    // PNG
+    //
+    // libpng reports errors by longjmp, so everything between setjmp and the libpng calls must be POD.
+    // That is why the decoding is split into PngReadHeader and PngReadRows.
+    //
+
+    // libpng asks for a few bytes at a time, chunk headers and zlib buffers. they are copied out of the memory of a memory
+    // stream or a mapped file, other streams are read by big blocks
+    struct PngSource
+    {
+        enum { BufferSize = 64 * 1024 };
+
+        SDL_RWops* rw;
+        const uint8_t* data;        // the memory view of rw, or buffer
+        size_t size;
+        size_t position;
+        bool inMemory;
+        PixelBufferPtr buffer;
+    };
+
+
+    static void PngReadData(png_structp png, png_bytep area, png_size_t size)
+    {
+        PngSource* src = (PngSource*)png_get_io_ptr(png);
+        while (size > 0)
+        {
+            if (src->position == src->size)
+            {
+                if (src->inMemory)
+                {
+                    png_error(png, "unexpected end of PNG");
+                }
+
+                src->size = SDL_RWread(src->rw, src->buffer->GetData(), 1, PngSource::BufferSize);
+                src->position = 0;
+                if (src->size == 0)
+                {
+                    png_error(png, "SDL_RWread failed");
+                }
+            }
+
+            size_t n = min(size_t(size), src->size - src->position);
+            memcpy(area, src->data + src->position, n);
+            src->position += n;
+            area += n;
+            size -= n;
+        }
+    }
+
+
+    static void PngError(png_structp png, png_const_charp message)
+    {
+        LogError("libpng error: %s", message);
+        png_longjmp(png, 1);
+    }
+
+
+    static void PngWarning(png_structp /*png*/, png_const_charp message)
+    {
+        LogWarn("libpng warning: %s", message);
+    }
+
+
+    static bool PngReadHeader(png_structp png, png_infop info, PngSource* source, png_uint_32* width, png_uint_32* height, int* channels, bool* interlaced)
+    {
+        if (setjmp(png_jmpbuf(png)))
+        {
+            return false;
+        }
+
+        png_set_read_fn(png, source, PngReadData);
+        png_read_info(png, info);
+
+        int bitDepth, colorType;
+        png_get_IHDR(png, info, width, height, &bitDepth, &colorType, NULL, NULL, NULL);
+
+        png_set_strip_16(png);
+        png_set_packing(png);
+
+        if (colorType == PNG_COLOR_TYPE_PALETTE)
+        {
+            png_set_palette_to_rgb(png);
+        }
+
+        bool hasTRNS = png_get_valid(png, info, PNG_INFO_tRNS) != 0;
+
+        // plain gray stays 1 channel. gray with alpha becomes RGBA, Image_Decode makes it Alpha_8 if it is a white mask
+        if (colorType == PNG_COLOR_TYPE_GRAY || colorType == PNG_COLOR_TYPE_GRAY_ALPHA)
+        {
+            png_set_expand_gray_1_2_4_to_8(png);
+            if (colorType == PNG_COLOR_TYPE_GRAY_ALPHA || hasTRNS)
+            {
+                png_set_gray_to_rgb(png);
+            }
+        }
+
+        if (hasTRNS)
+        {
+            png_set_tRNS_to_alpha(png);
+        }
+
+        *interlaced = png_get_interlace_type(png, info) != PNG_INTERLACE_NONE;
+        if (*interlaced)
+        {
+            png_set_interlace_handling(png);
+        }
+
+        png_read_update_info(png, info);
+        *channels = png_get_channels(png, info);
+        return true;
+    }
+
+
+    static bool PngReadRows(png_structp png, png_bytepp rows)
+    {
+        if (setjmp(png_jmpbuf(png)))
+        {
+            return false;
+        }
+
+        png_read_image(png, rows);
+        return true;
+    }
+
+
+    // the next 'count' rows of a file which is not interlaced
+    static bool PngReadSomeRows(png_structp png, png_bytepp rows, png_uint_32 count)
+    {
+        if (setjmp(png_jmpbuf(png)))
+        {
+            return false;
+        }
+
+        png_read_rows(png, rows, NULL, count);
+        return true;
+    }
+
+
+    // largest power of 2 which keeps the image at least as big as the hint asks. libpng has no scaling of its own
+    static int GetPngFactor(const ImageDecodeHint& hint, int width, int height)
+    {
+        double scale = GetDecodeScale(hint, width, height);
+
+        int factor = 1;
+        while (factor < 128 && factor * 2 * scale <= 1.0)
+        {
+            factor *= 2;
+        }
+
+        return factor;
+    }
+
+
+    // blocks of 'factor' rows are read into 'block' and averaged into one row of 'image'.
+    // an interlaced file has to be read as a whole, then it is averaged the same way
+    static bool PngReadShrunkRows(png_structp png, png_uint_32 width, png_uint_32 height, int channels, bool interlaced, int factor, Image* image)
+    {
+        int rowBytes = Image_GetAlignedPitch(int(width), channels);
+        png_uint_32 blockRows = interlaced ? height : png_uint_32(factor);
+
+        PixelBufferPtr block = PixelBufferPool::Singleton().Acquire(size_t(rowBytes) * blockRows);
+        vector<png_bytep> rows(blockRows);
+        for (png_uint_32 y = 0; y < blockRows; ++y)
+        {
+            rows[y] = block->GetData() + size_t(y) * rowBytes;
+        }
+
+        if (interlaced && !PngReadRows(png, &rows[0]))
+        {
+            return false;
+        }
+
+        for (int dy = 0; dy < image->height; ++dy)
+        {
+            png_uint_32 first = png_uint_32(dy * factor);
+            png_uint_32 count = min(png_uint_32(factor), height - first);
+
+            const uint8_t* src = interlaced ? rows[first] : rows[0];
+            if (!interlaced && !PngReadSomeRows(png, &rows[0], count))
+            {
+                return false;
+            }
+
+            Image_BoxDownsampleRows(src, rowBytes, int(width), int(count), channels, factor, image->pixels->GetData() + dy * image->pitch);
+        }
+
+        return true;
+    }
+
+
+    static bool DecodePNG(SDL_RWops* rw, const string& name, const ImageDecodeHint& hint, Image* image)
+    {
+        DI_SAVE_CALLSTACK();
+
+        png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, PngError, PngWarning);
+        if (!png)
+        {
+            LogError("png_create_read_struct('%s') failed", name.c_str());
+            return false;
+        }
+
+        png_infop info = png_create_info_struct(png);
+        auto pngDeleter = MakeCallAtScopeExit([&png, &info]() { png_destroy_read_struct(&png, info ? &info : NULL, NULL); });
+        if (!info)
+        {
+            LogError("png_create_info_struct('%s') failed", name.c_str());
+            return false;
+        }
+
+        PngSource source;
+        source.rw = rw;
+        source.position = 0;
+        source.data = GetMemoryView(rw, &source.size);
+        source.inMemory = source.data != nullptr;
+        if (!source.inMemory)
+        {
+            source.buffer = PixelBufferPool::Singleton().Acquire(PngSource::BufferSize);
+            source.data = source.buffer->GetData();
+            source.size = 0;
+        }
+
+        png_uint_32 width, height;
+        int channels;
+        bool interlaced;
+        if (!PngReadHeader(png, info, &source, &width, &height, &channels, &interlaced))
+        {
+            LogError("reading PNG header of '%s' failed", name.c_str());
+            return false;
+        }
+
+        TextureProtocol::InnerFormat format;
+        switch (channels)
+        {
+        case 1:     format = TextureProtocol::Gray_8; break;
+        case 3:     format = TextureProtocol::RGB_888; break;
+        case 4:     format = TextureProtocol::RGBA_8888; break;
+        default:
+            LogError("PNG '%s' has unexpected %d channels", name.c_str(), channels);
+            return false;
+        }
+
+        int factor = GetPngFactor(hint, int(width), int(height));
+        if (factor > 1)
+        {
+            if (!Image_Allocate(image, format, (int(width) + factor - 1) / factor, (int(height) + factor - 1) / factor))
+            {
+                return false;
+            }
+
+            if (!PngReadShrunkRows(png, width, height, channels, interlaced, factor, image))
+            {
+                LogError("reading PNG rows of '%s' failed", name.c_str());
+                image->pixels.reset();
+                return false;
+            }
+
+            return true;
+        }
+
+        if (!Image_Allocate(image, format, int(width), int(height)))
+        {
+            return false;
+        }
+
+        vector<png_bytep> rows(height);
+        for (png_uint_32 y = 0; y < height; ++y)
+        {
+            rows[y] = image->pixels->GetData() + y * image->pitch;
+        }
+
+        if (!PngReadRows(png, &rows[0]))
+        {
+            LogError("reading PNG rows of '%s' failed", name.c_str());
+            image->pixels.reset();
+            return false;
+        }
+
+        return true;
+    }
+
+
+    //
+    // JPEG
+    //
+    // same setjmp rule as PNG. the source manager gives libjpeg the memory of a memory stream or a mapped file as it is,
+    // and reads other streams by big blocks
+    //
+
+    struct JpegErrorManager
+    {
+        jpeg_error_mgr pub;
+        jmp_buf escape;
+    };
+
+
+    struct JpegSourceManager
+    {
+        enum { BufferSize = 64 * 1024 };
+
+        jpeg_source_mgr pub;
+        SDL_RWops* rw;
+        bool inMemory;              // all the data is in pub from the start
+        JOCTET buffer[BufferSize];
+    };
+
+
+    static void JpegErrorExit(j_common_ptr cinfo)
+    {
+        char message[JMSG_LENGTH_MAX];
+        cinfo->err->format_message(cinfo, message);
+        LogError("libjpeg error: %s", message);
+
+        JpegErrorManager* err = (JpegErrorManager*)cinfo->err;
+        longjmp(err->escape, 1);
+    }
+
+
+    static void JpegOutputMessage(j_common_ptr /*cinfo*/)
+    {
+        // ignore warnings
+    }
+
+
+    static void JpegInitSource(j_decompress_ptr /*cinfo*/)
+    {
+    }
+
+
+    static boolean JpegFillInputBuffer(j_decompress_ptr cinfo)
+    {
+        JpegSourceManager* src = (JpegSourceManager*)cinfo->src;
+
+        size_t n = src->inMemory ? 0 : SDL_RWread(src->rw, src->buffer, 1, JpegSourceManager::BufferSize);
+        if (n == 0)
+        {
+            // insert a fake EOI marker, as libjpeg's own source managers do
+            src->buffer[0] = (JOCTET)0xFF;
+            src->buffer[1] = (JOCTET)JPEG_EOI;
+            n = 2;
+        }
+
+        src->pub.next_input_byte = src->buffer;
+        src->pub.bytes_in_buffer = n;
+        return TRUE;
+    }
+
+
+    static void JpegSkipInputData(j_decompress_ptr cinfo, long numBytes)
+    {
+        JpegSourceManager* src = (JpegSourceManager*)cinfo->src;
+
+        if (numBytes <= 0)
+        {
+            return;
+        }
+
+        if (size_t(numBytes) <= src->pub.bytes_in_buffer)
+        {
+            src->pub.next_input_byte += numBytes;
+            src->pub.bytes_in_buffer -= size_t(numBytes);
+            return;
+        }
+
+        if (!src->inMemory)
+        {
+            SDL_RWseek(src->rw, numBytes - Sint64(src->pub.bytes_in_buffer), RW_SEEK_CUR);
+        }
+        src->pub.next_input_byte = nullptr;
+        src->pub.bytes_in_buffer = 0;
+    }
+
+
+    static void JpegTermSource(j_decompress_ptr /*cinfo*/)
+    {
+    }
+
+
+    static bool JpegCreate(jpeg_decompress_struct* cinfo, JpegErrorManager* err)
+    {
+        if (setjmp(err->escape))
+        {
+            return false;
+        }
+
+        jpeg_create_decompress(cinfo);
+        return true;
+    }
+
+
+    // YUV is only kept for plain YCbCr files whose iMCU rows fit the row arrays of JpegReadRawRows
+    static bool JpegCanReadRaw(jpeg_decompress_struct* cinfo)
+    {
+        if (cinfo->num_components != 3 || cinfo->jpeg_color_space != JCS_YCbCr || cinfo->color_transform != JCT_NONE)
+        {
+            return false;
+        }
+
+        for (int c = 0; c < 3; ++c)
+        {
+            if (cinfo->comp_info[c].v_samp_factor * cinfo->comp_info[c].DCT_v_scaled_size > MAX_SAMP_FACTOR * DCTSIZE)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+
+    static bool JpegReadHeader(jpeg_decompress_struct* cinfo, JpegErrorManager* err, bool wantYUV, const ImageDecodeHint& hint, bool* rawYUV)
+    {
+        if (setjmp(err->escape))
+        {
+            return false;
+        }
+
+        jpeg_read_header(cinfo, TRUE);
+        cinfo->quantize_colors = FALSE;
+
+        // the IDCT outputs n/8 of the size directly, both for RGB and raw YUV. the smallest n which is big enough
+        double scale = GetDecodeScale(hint, int(cinfo->image_width), int(cinfo->image_height));
+        if (scale < 1)
+        {
+            cinfo->scale_num = max(1u, min(8u, unsigned(ceil(scale * 8 - 1e-6))));
+            cinfo->scale_denom = 8;
+        }
+
+        *rawYUV = false;
+        if (wantYUV)
+        {
+            // no fancy upsampling, otherwise libjpeg scales chroma up by IDCT even in raw mode
+            cinfo->out_color_space = JCS_YCbCr;
+            cinfo->raw_data_out = TRUE;
+            cinfo->do_fancy_upsampling = FALSE;
+            jpeg_calc_output_dimensions(cinfo);
+
+            *rawYUV = JpegCanReadRaw(cinfo);
+            if (*rawYUV)
+            {
+                return true;
+            }
+
+            cinfo->raw_data_out = FALSE;
+            cinfo->do_fancy_upsampling = TRUE;
+        }
+
+        cinfo->out_color_space = cinfo->jpeg_color_space == JCS_GRAYSCALE ? JCS_GRAYSCALE : JCS_RGB;
+        jpeg_calc_output_dimensions(cinfo);
+        return true;
+    }
+
+
+    static bool JpegReadRows(jpeg_decompress_struct* cinfo, JpegErrorManager* err, uint8_t* pixels, int pitch)
+    {
+        if (setjmp(err->escape))
+        {
+            return false;
+        }
+
+        jpeg_start_decompress(cinfo);
+        while (cinfo->output_scanline < cinfo->output_height)
+        {
+            JSAMPROW row = pixels + cinfo->output_scanline * pitch;
+            jpeg_read_scanlines(cinfo, &row, 1);
+        }
+        jpeg_finish_decompress(cinfo);
+        return true;
+    }
+
+
+    // one iMCU row of every component per call. rows below the plane (the padding of the last iMCU row) go to 'scratch'
+    static bool JpegReadRawRows(jpeg_decompress_struct* cinfo, JpegErrorManager* err, Image* planes, uint8_t* scratch)
+    {
+        if (setjmp(err->escape))
+        {
+            return false;
+        }
+
+        JSAMPROW rows[3][MAX_SAMP_FACTOR * DCTSIZE];
+        JSAMPARRAY components[3] = { rows[0], rows[1], rows[2] };
+
+        jpeg_start_decompress(cinfo);
+
+        JDIMENSION linesPerIMCURow = cinfo->max_v_samp_factor * cinfo->min_DCT_v_scaled_size;
+        while (cinfo->output_scanline < cinfo->output_height)
+        {
+            JDIMENSION iMCURow = cinfo->output_scanline / linesPerIMCURow;
+            for (int c = 0; c < 3; ++c)
+            {
+                int lines = cinfo->comp_info[c].v_samp_factor * cinfo->comp_info[c].DCT_v_scaled_size;
+                int first = int(iMCURow) * lines;
+                for (int i = 0; i < lines; ++i)
+                {
+                    rows[c][i] = first + i < planes[c].height ? planes[c].pixels->GetData() + (first + i) * planes[c].pitch : scratch;
+                }
+            }
+
+            jpeg_read_raw_data(cinfo, components, linesPerIMCURow);
+        }
+
+        jpeg_finish_decompress(cinfo);
+        return true;
+    }
+
+
+    static bool DecodeJPEGPlanes(SDL_RWops* rw, const string& name, bool wantYUV, const ImageDecodeHint& hint, ImagePlanes* planes)
+    {
+        DI_SAVE_CALLSTACK();
+
+        jpeg_decompress_struct cinfo;
+        JpegErrorManager err;
+        unique_ptr<JpegSourceManager> src(new JpegSourceManager);
+
+        cinfo.err = jpeg_std_error(&err.pub);
+        err.pub.error_exit = JpegErrorExit;
+        err.pub.output_message = JpegOutputMessage;
+
+        if (!JpegCreate(&cinfo, &err))
+        {
+            LogError("jpeg_create_decompress('%s') failed", name.c_str());
+            return false;
+        }
+
+        auto jpegDeleter = MakeCallAtScopeExit([&cinfo]() { jpeg_destroy_decompress(&cinfo); });
+
+        src->pub.init_source = JpegInitSource;
+        src->pub.fill_input_buffer = JpegFillInputBuffer;
+        src->pub.skip_input_data = JpegSkipInputData;
+        src->pub.resync_to_restart = jpeg_resync_to_restart;
+        src->pub.term_source = JpegTermSource;
+        src->rw = rw;
+        src->pub.next_input_byte = GetMemoryView(rw, &src->pub.bytes_in_buffer);
+        src->inMemory = src->pub.next_input_byte != nullptr;
+        if (!src->inMemory)
+        {
+            src->pub.bytes_in_buffer = 0;
+        }
+        cinfo.src = &src->pub;
+
+        bool rawYUV;
+        if (!JpegReadHeader(&cinfo, &err, wantYUV, hint, &rawYUV))
+        {
+            LogError("reading JPEG header of '%s' failed", name.c_str());
+            return false;
+        }
+
+        planes->width = int(cinfo.output_width);
+        planes->height = int(cinfo.output_height);
+
+        if (!rawYUV)
+        {
+            Image& image = planes->planes[0];
+            TextureProtocol::InnerFormat format = cinfo.out_color_space == JCS_GRAYSCALE ? TextureProtocol::Gray_8 : TextureProtocol::RGB_888;
+            if (!Image_Allocate(&image, format, int(cinfo.output_width), int(cinfo.output_height)))
+            {
+                return false;
+            }
+
+            if (!JpegReadRows(&cinfo, &err, image.pixels->GetData(), image.pitch))
+            {
+                LogError("reading JPEG rows of '%s' failed", name.c_str());
+                *planes = ImagePlanes();
+                return false;
+            }
+
+            planes->format = format;
+            planes->count = 1;
+            return true;
+        }
+
+        // libjpeg writes whole 8x8 blocks, so each row has room for the last block
+        int maxPitch = 0;
+        for (int c = 0; c < 3; ++c)
+        {
+            const jpeg_component_info& comp = cinfo.comp_info[c];
+            int blockPitch = int(comp.width_in_blocks) * comp.DCT_h_scaled_size;
+            if (!Image_Allocate(&planes->planes[c], TextureProtocol::Gray_8, int(comp.downsampled_width), int(comp.downsampled_height), blockPitch))
+            {
+                *planes = ImagePlanes();
+                return false;
+            }
+
+            maxPitch = max(maxPitch, planes->planes[c].pitch);
+        }
+
+        PixelBufferPtr scratch = PixelBufferPool::Singleton().Acquire(size_t(maxPitch));
+        if (!JpegReadRawRows(&cinfo, &err, planes->planes, scratch->GetData()))
+        {
+            LogError("reading JPEG raw data of '%s' failed", name.c_str());
+            *planes = ImagePlanes();
+            return false;
+        }
+
+        planes->format = TextureProtocol::YUV;
+        planes->count = 3;
+        return true;
+    }
+
+
+    static bool DecodeJPEG(SDL_RWops* rw, const string& name, const ImageDecodeHint& hint, Image* image)
+    {
+        ImagePlanes planes;
+        if (!DecodeJPEGPlanes(rw, name, false, hint, &planes))
+        {
+            return false;
+        }
+
+        *image = planes.planes[0];
+        return true;
+    }
+
+
+    //
+    // other formats: SDL_image, plus one conversion and one copy
+    //
+
+    static bool DecodeWithSDLImage(SDL_RWops* rw, const string& name, Image* image)
+    {
+        DI_SAVE_CALLSTACK();
+
+        SDL_Surface* decoded = IMG_Load_RW(rw, 0);
+        if (!decoded)
+        {
+            LogError("IMG_Load_RW('%s') failed: %s", name.c_str(), IMG_GetError());
+            return false;
+        }
+
+        auto decodedDeleter = MakeCallAtScopeExit([decoded]() { SDL_FreeSurface(decoded); });
+
+        bool hasAlpha = decoded->format->Amask != 0 || SDL_GetColorKey(decoded, NULL) == 0;
+        Uint32 sdlFormat = hasAlpha ? SDL_PIXELFORMAT_ABGR8888 : SDL_PIXELFORMAT_RGB24;
+
+        SDL_Surface* converted = decoded;
+        if (decoded->format->format != sdlFormat)
+        {
+            converted = SDL_ConvertSurfaceFormat(decoded, sdlFormat, 0);
+            if (!converted)
+            {
+                LogError("SDL_ConvertSurfaceFormat('%s') failed: %s", name.c_str(), SDL_GetError());
+                return false;
+            }
+        }
+
+        auto convertedDeleter = MakeCallAtScopeExit([converted, decoded]() { if (converted != decoded) SDL_FreeSurface(converted); });
+
+        if (!Image_Allocate(image, hasAlpha ? TextureProtocol::RGBA_8888 : TextureProtocol::RGB_888, converted->w, converted->h))
+        {
+            return false;
+        }
+
+        int rowBytes = converted->w * converted->format->BytesPerPixel;
+        for (int y = 0; y < converted->h; ++y)
+        {
+            memcpy(image->pixels->GetData() + y * image->pitch, (const uint8_t*)converted->pixels + y * converted->pitch, rowBytes);
+        }
+
+        return true;
+    }
+
+
+    bool Image_Decode(SDL_RWops* rw, const string& name, Image* image, const ImageDecodeHint& hint /* = ImageDecodeHint() */)
+    {
+        DI_SAVE_CALLSTACK();
+
+        uint8_t header[16];
+        Sint64 start = SDL_RWtell(rw);
+        size_t headerSize = SDL_RWread(rw, header, 1, sizeof(header));
+        SDL_RWseek(rw, start, RW_SEEK_SET);
+
+        bool decoded;
+        switch (Image_DetectCodec(header, headerSize))
+        {
+        case ImageCodec_WebP:   decoded = DecodeWebP(rw, name, hint, image); break;
+        case ImageCodec_PNG:    decoded = DecodePNG(rw, name, hint, image); break;
+        case ImageCodec_JPEG:   decoded = DecodeJPEG(rw, name, hint, image); break;
+        default:                decoded = DecodeWithSDLImage(rw, name, image); break;
+        }
+
+        if (decoded)
+        {
+            Image_ReduceChannels(image);
+        }
+
+        return decoded;
+    }
+
+
+    bool Image_DecodeYUV(SDL_RWops* rw, const string& name, ImagePlanes* planes, const ImageDecodeHint& hint /* = ImageDecodeHint() */)
+    {
+        DI_SAVE_CALLSTACK();
+
+        uint8_t header[16];
+        Sint64 start = SDL_RWtell(rw);
+        size_t headerSize = SDL_RWread(rw, header, 1, sizeof(header));
+        SDL_RWseek(rw, start, RW_SEEK_SET);
+
+        switch (Image_DetectCodec(header, headerSize))
+        {
+        case ImageCodec_WebP:   return DecodeWebPYUV(rw, name, hint, planes);
+        case ImageCodec_JPEG:   return DecodeJPEGPlanes(rw, name, true, hint, planes);
+        default:                break;
+        }
+
+        *planes = ImagePlanes();
+        if (!Image_Decode(rw, name, &planes->planes[0], hint))
+        {
+            return false;
+        }
+
+        planes->format = planes->planes[0].format;
+        planes->width = planes->planes[0].width;
+        planes->height = planes->planes[0].height;
+        planes->count = 1;
+        return true;
+    }
+}
@@ -0,0 +1,238 @@
+#ifndef DI_IMAGE_H_INCLUDED
+#define DI_IMAGE_H_INCLUDED
+
+#include "DiResource.h"
+
+#include <list>
+#include <unordered_set>
+
+namespace di
+{
+    DI_TYPEDEF_PTR(PixelBuffer);
+
+    // A block of bytes used by the loading pipeline (decoded pixels, file contents, ...).
+    // PixelBuffer is always got from PixelBufferPool, and goes back to the pool when the last PixelBufferPtr is released,
+    // so that loading textures one by one does not allocate and free a big block for every image.
+    class PixelBuffer
+    {
+    public:
+        uint8_t* GetData() const { return m_data.get(); }
+        size_t GetSize() const { return m_size; }
+        size_t GetCapacity() const { return m_capacity; }
+
+    private:
+        friend class PixelBufferPool;
+
+        PixelBuffer(size_t capacity) : m_data(new uint8_t[capacity]), m_size(0), m_capacity(capacity) {}
+
+        unique_ptr<uint8_t[]> m_data;
+        size_t m_size;
+        size_t m_capacity;
+
+        DI_DISABLE_COPY(PixelBuffer);
+    };
+
+
+    // thread safe, used by both GL thread and worker thread
+    class PixelBufferPool
+    {
+    public:
+        PixelBufferPool(size_t maxIdleBytes);
+
+        PixelBufferPtr Acquire(size_t size);
+        size_t Trim();              // free all idle buffers, returns bytes freed
+        size_t GetIdleBytes();
+
+        // unlike ResourceManager::Singleton, this one is used in more than one thread,
+        // so it is a function local static which is constructed thread safely in C++11
+        static PixelBufferPool& Singleton();
+
+    private:
+        struct Fields
+        {
+            ThreadLock lock;
+            vector<unique_ptr<PixelBuffer>> idleBuffers;
+            size_t idleBytes;
+            size_t maxIdleBytes;
+        };
+
+        static void Recycle(const shared_ptr<Fields>& fields, PixelBuffer* buffer);
+
+        shared_ptr<Fields> m_fields;
+
+        DI_DISABLE_COPY(PixelBufferPool);
+    };
+
+
+    // The RAM tier of textures, between the GPU and the disk: the files (encoded or compressed bytes, as they are on disk)
+    // of textures which have left the GPU (timed out, released, dropped under memory pressure), so that loading them again
+    // reads memory instead of the file. the least recently demoted files beyond the budget are dropped.
+    // thread safe, Read() is called by worker thread and Demote() by GL thread
+    class FileByteCache
+    {
+    public:
+        FileByteCache() : m_bytes(0), m_pinnedBytes(0), m_maxBytes(0), m_ramHits(0), m_diskReads(0) {}
+
+        // of the cached files and the pinned ones together. 0 (default) keeps nothing
+        void SetMaxBytes(size_t bytes);
+        size_t GetMaxBytes();
+        size_t GetBytes();
+        size_t GetPinnedBytes();
+
+        // the file from the cache (it leaves the cache, the texture holds it again), or from the disk.
+        // null if the file can not be read, which is logged unless it is 'optional'
+        PixelBufferPtr Read(const string& name, bool optional = false);
+
+        // the file if it is in the cache (it leaves the cache), otherwise null. the disk is not read
+        PixelBufferPtr Take(const string& name);
+        bool Contains(const string& name);
+
+        // a texture on the GPU keeps the file it was read from, to demote it later, only while Pin() says it fits the budget.
+        // cached files are evicted to make room. pinning the same bytes again is a no-op
+        bool Pin(const PixelBufferPtr& bytes);
+        void Unpin(const PixelBufferPtr& bytes);
+
+        // called by Timeout_InGlThread() of a texture which read 'bytes' by Read(), they are unpinned if they were pinned
+        void Demote(const string& name, const PixelBufferPtr& bytes);
+
+        size_t Trim();              // drop all files, returns bytes freed
+
+        void GetStats(uint32_t* ramHits, uint32_t* diskReads);
+
+        static FileByteCache& Singleton();
+
+    private:
+        struct Entry
+        {
+            string name;
+            PixelBufferPtr bytes;
+        };
+
+        void Evict(size_t maxBytes, vector<PixelBufferPtr>* evicted);
+        size_t GetRoom() const { return m_maxBytes > m_pinnedBytes ? m_maxBytes - m_pinnedBytes : 0; }
+        void UnpinLocked(const PixelBufferPtr& bytes);
+
+        ThreadLock m_lock;
+        list<Entry> m_entries;      // most recently demoted first
+        unordered_map<string, list<Entry>::iterator> m_index;
+        size_t m_bytes;
+        unordered_set<const PixelBuffer*> m_pinned;
+        size_t m_pinnedBytes;
+        size_t m_maxBytes;
+        uint32_t m_ramHits;
+        uint32_t m_diskReads;
+
+        DI_DISABLE_COPY(FileByteCache);
+    };
+
+
+    enum ImageCodec
+    {
+        ImageCodec_Unknown,         // let SDL_image try it
+        ImageCodec_WebP,
+        ImageCodec_PNG,
+        ImageCodec_JPEG,
+    };
+
+
+    // decoded pixels which can be passed to glTexImage2D as they are.
+    // compressed formats (ETC1_RGB) have glType 0 and go to glCompressedTexImage2D, their pitch is the bytes of a row of blocks
+    struct Image
+    {
+        Image() : format(TextureProtocol::RGBA_8888), glFormat(GL_RGBA), glType(GL_UNSIGNED_BYTE), width(0), height(0), pitch(0), unpackAlignment(4) {}
+
+        TextureProtocol::InnerFormat format;
+        GLenum glFormat;
+        GLenum glType;
+        int width;
+        int height;
+        int pitch;                  // bytes per row
+        GLint unpackAlignment;      // GL_UNPACK_ALIGNMENT which makes OpenGL step 'pitch' bytes per row
+        PixelBufferPtr pixels;
+    };
+
+
+    // an image which is uploaded as more than one texture.
+    // plane 0 goes to the main texture of TextureProtocol, plane i to its sub texture i - 1
+    struct ImagePlanes
+    {
+        enum { MaxPlanes = 1 + TextureProtocol::MaxSubTextures };
+
+        ImagePlanes() : format(TextureProtocol::RGBA_8888), width(0), height(0), count(0) {}
+
+        TextureProtocol::InnerFormat format;    // format of the whole image, e.g. YUV while each plane is Gray_8
+        int width;
+        int height;
+        int count;
+        Image planes[MaxPlanes];
+        vector<Image> mips[MaxPlanes];          // levels 1, 2, ... of each plane, empty if the plane has no mip levels
+    };
+
+
+    // the size an image is needed at. bigger images are shrunk while they are decoded, so the full size image never exists:
+    // JPEG by the DCT scaling of libjpeg (n/8), WebP by its rescaler, PNG by averaging blocks of 2^n x 2^n pixels.
+    // the decoded image is not smaller than asked, but may be a little bigger (JPEG and PNG). other formats are decoded at full size
+    struct ImageDecodeHint
+    {
+        ImageDecodeHint() : maxSize(0), scale(1.0f) {}
+
+        int maxSize;        // of width and height, 0 if not limited
+        float scale;        // of the source size, 1 if not scaled
+    };
+
+
+    // bytes per pixel, GL format and GL type of an uncompressed InnerFormat. returns false for formats which are not a single plane
+    bool Image_GetFormatInfo(TextureProtocol::InnerFormat format, int* bytesPerPixel, GLenum* glFormat, GLenum* glType);
+
+    // rows are 4 bytes aligned, which is the default GL_UNPACK_ALIGNMENT
+    int Image_GetAlignedPitch(int width, int bytesPerPixel);
+
+    // returns 0 if no GL_UNPACK_ALIGNMENT can describe the pitch (the rows must be repacked)
+    GLint Image_GetUnpackAlignment(int rowBytes, int pitch);
+
+    // allocate the pixels of an image from PixelBufferPool.
+    // 'minPitch' is for codecs which write whole blocks, the pitch must still be described by GL_UNPACK_ALIGNMENT
+    bool Image_Allocate(Image* image, TextureProtocol::InnerFormat format, int width, int height, int minPitch = 0);
+
+    ImageCodec Image_DetectCodec(const uint8_t* header, size_t size);
+
+    // Decode WebP / PNG / JPEG straight into a pooled buffer by the codec's own "decode into buffer" API,
+    // no SDL_Surface is involved. other formats go through SDL_image and are copied once.
+    // the result is RGBA_8888 or RGB_888, or Gray_8 / Alpha_8 for gray images and white masks (see Image_ReduceChannels).
+    // 'name' is only used for logging
+    bool Image_Decode(SDL_RWops* rw, const string& name, Image* image, const ImageDecodeHint& hint = ImageDecodeHint());
+
+    // JPEG and lossy WebP without alpha are decoded to their native Y, U, V planes (Gray_8, U and V are usually
+    // half width and half height), skipping the codec's upsampling and color conversion.
+    // other images are decoded as Image_Decode does, to a single plane
+    bool Image_DecodeYUV(SDL_RWops* rw, const string& name, ImagePlanes* planes, const ImageDecodeHint& hint = ImageDecodeHint());
+
+    // an RGB_888 / RGBA_8888 image becomes Gray_8 when it is opaque gray, or Alpha_8 when every visible pixel is white.
+    // otherwise it is not changed
+    void Image_ReduceChannels(Image* image);
+
+    // RGB_565 for opaque images, RGBA_5551 when alpha is only 0 or 255, otherwise RGBA_4444
+    TextureProtocol::InnerFormat Image_Choose16BitFormat(const Image& image);
+
+    // convert an RGBA_8888 or RGB_888 image to RGB_565 / RGBA_4444 / RGBA_5551 by SSE2 or NEON when available.
+    // done in worker thread, 'dst' is allocated from PixelBufferPool
+    bool Image_ConvertTo16Bit(const Image& src, TextureProtocol::InnerFormat format, TextureOptions::Dither dither, Image* dst);
+
+    // the mip levels 1, 2, ... down to 1x1 of an RGBA_8888 / RGB_888 / Gray_8 / Alpha_8 image, each half the size (rounded down)
+    // of the previous one as OpenGL expects. done in worker thread, the rows of each level are spread over all CPUs by ParallelFor.
+    // with 'gammaCorrect' the color channels are treated as sRGB and filtered in linear light
+    bool Image_GenerateMipmaps(const Image& src, TextureOptions::MipFilter filter, bool gammaCorrect, vector<Image>* mips);
+
+    // only the next level of 'src', as Image_GenerateMipmaps makes it. for a caller which needs one level at a time
+    bool Image_GenerateMipmap(const Image& src, TextureOptions::MipFilter filter, bool gammaCorrect, Image* mip);
+
+    // average blocks of 'factor' x 'factor' pixels of 'rows' (at most 'factor') rows into one row of 'dst',
+    // which is (srcWidth + factor - 1) / factor pixels wide. blocks cut by the right edge or by 'rows' average what they have
+    void Image_BoxDownsampleRows(const uint8_t* src, int srcPitch, int srcWidth, int rows, int channels, int factor, uint8_t* dst);
+
+    // RGBA_8888_Palette_256: plane 0 is the Gray_8 indices, plane 1 is a 256x1 RGBA_8888 palette.
+    // exact when the image has no more than 256 colors, otherwise median cut. 'psnr' is in dB, HUGE_VAL when exact
+    bool Image_QuantizeToPalette(const Image& src, ImagePlanes* planes, double* psnr);
+}
+
+#endif
@@ -0,0 +1,801 @@
+#include "DiImage.h"
+#include <cstring>
+#include <cmath>
+#include <climits>
+#include <algorithm>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#   include <arm_neon.h>
+#   define DI_IMAGE_CONVERT_NEON 1
+#elif defined(__SSE2__) || defined(_M_IX86) || defined(_M_X64)
+#   include <emmintrin.h>
+#   define DI_IMAGE_CONVERT_SSE2 1
+#endif
+
+namespace di
+{
+    //
+    // RGBA_8888 / RGB_888 => RGB_565 / RGBA_4444 / RGBA_5551
+    //
+    // A channel of n bits (max value m = 2^n - 1) is quantized as q = (v * m + t) / 255,
+    // where t is 127 for plain rounding, or a threshold from the 4x4 Bayer matrix for ordered dithering.
+    // v * m + t is never bigger than 255 * 63 + 255, so every step fits in 16 bit lanes,
+    // and the division is done by (x + 1 + (x >> 8)) >> 8 which is exact for x < 65535.
+    //
+
+    static const uint8_t s_bayer4x4[4][4] =
+    {
+        {  0,  8,  2, 10 },
+        { 12,  4, 14,  6 },
+        {  3, 11,  1,  9 },
+        { 15,  7, 13,  5 },
+    };
+
+
+    enum { RoundingThreshold = 127 };
+
+
+    struct PackLayout
+    {
+        int bits[4];        // bits of r, g, b, a. 0 means the channel is dropped
+        int shift[4];
+    };
+
+
+    static bool GetPackLayout(TextureProtocol::InnerFormat format, PackLayout* layout)
+    {
+        static const PackLayout layout565  = { { 5, 6, 5, 0 }, { 11, 5, 0, 0 } };
+        static const PackLayout layout4444 = { { 4, 4, 4, 4 }, { 12, 8, 4, 0 } };
+        static const PackLayout layout5551 = { { 5, 5, 5, 1 }, { 11, 6, 1, 0 } };
+
+        switch (format)
+        {
+        case TextureProtocol::RGB_565:      *layout = layout565;  return true;
+        case TextureProtocol::RGBA_4444:    *layout = layout4444; return true;
+        case TextureProtocol::RGBA_5551:    *layout = layout5551; return true;
+        default:                            return false;
+        }
+    }
+
+
+    static inline uint16_t QuantizeScalar(unsigned v, unsigned m, unsigned t)
+    {
+        unsigned x = v * m + t;
+        return uint16_t((x + 1 + (x >> 8)) >> 8);
+    }
+
+
+    // thresholds of row 'y' for each channel. a 1 bit alpha is never dithered, it looks like a screen door
+    static void GetRowThresholds(const PackLayout& layout, TextureOptions::Dither dither, int y, uint8_t thresholds[4][4])
+    {
+        for (int c = 0; c < 4; ++c)
+        {
+            for (int i = 0; i < 4; ++i)
+            {
+                if (dither == TextureOptions::Dither_Ordered && layout.bits[c] > 1)
+                {
+                    thresholds[c][i] = uint8_t(s_bayer4x4[y & 3][i] * 16 + 8);
+                }
+                else
+                {
+                    thresholds[c][i] = RoundingThreshold;
+                }
+            }
+        }
+    }
+
+
+    static inline void LoadPixelScalar(const uint8_t* src, int srcBpp, int x, unsigned rgba[4])
+    {
+        const uint8_t* p = src + x * srcBpp;
+        rgba[0] = p[0];
+        rgba[1] = p[1];
+        rgba[2] = p[2];
+        rgba[3] = srcBpp == 4 ? p[3] : 255;
+    }
+
+
+    static void ConvertRowScalar(const uint8_t* src, int srcBpp, uint16_t* dst, int begin, int end, const PackLayout& layout, const uint8_t thresholds[4][4])
+    {
+        for (int x = begin; x < end; ++x)
+        {
+            unsigned rgba[4];
+            LoadPixelScalar(src, srcBpp, x, rgba);
+
+            unsigned packed = 0;
+            for (int c = 0; c < 4; ++c)
+            {
+                if (layout.bits[c])
+                {
+                    packed |= unsigned(QuantizeScalar(rgba[c], (1u << layout.bits[c]) - 1, thresholds[c][x & 3])) << layout.shift[c];
+                }
+            }
+
+            dst[x] = uint16_t(packed);
+        }
+    }
+
+
+#if DI_IMAGE_CONVERT_SSE2
+
+    static inline __m128i Quantize8(__m128i v, __m128i m, __m128i t)
+    {
+        __m128i x = _mm_add_epi16(_mm_mullo_epi16(v, m), t);
+        x = _mm_add_epi16(x, _mm_add_epi16(_mm_set1_epi16(1), _mm_srli_epi16(x, 8)));
+        return _mm_srli_epi16(x, 8);
+    }
+
+
+    // 8 pixels per step. returns the number of pixels converted
+    static int ConvertRowSIMD(const uint8_t* src, int srcBpp, uint16_t* dst, int width, const PackLayout& layout, const uint8_t thresholds[4][4])
+    {
+        __m128i m[4], t[4], packedShift[4];
+        for (int c = 0; c < 4; ++c)
+        {
+            m[c] = _mm_set1_epi16(short((1 << layout.bits[c]) - 1));
+            t[c] = _mm_setr_epi16(thresholds[c][0], thresholds[c][1], thresholds[c][2], thresholds[c][3],
+                                  thresholds[c][0], thresholds[c][1], thresholds[c][2], thresholds[c][3]);
+            packedShift[c] = _mm_cvtsi32_si128(layout.shift[c]);
+        }
+
+        const __m128i byteMask = _mm_set1_epi32(0xFF);
+
+        // RGB_888 is read 4 bytes per pixel, so the last pixel of a row is left to the scalar loop
+        int limit = srcBpp == 4 ? width : width - 1;
+        int x = 0;
+        for (; x + 8 <= limit; x += 8)
+        {
+            __m128i lo, hi;
+            if (srcBpp == 4)
+            {
+                lo = _mm_loadu_si128((const __m128i*)(src + x * 4));
+                hi = _mm_loadu_si128((const __m128i*)(src + x * 4 + 16));
+            }
+            else
+            {
+                // SSE2 has no byte shuffle, gather RGBx words instead
+                uint32_t w[8];
+                for (int i = 0; i < 8; ++i)
+                {
+                    memcpy(&w[i], src + (x + i) * 3, 4);
+                }
+                const __m128i opaque = _mm_set1_epi32(int(0xFF000000));
+                lo = _mm_or_si128(_mm_loadu_si128((const __m128i*)&w[0]), opaque);
+                hi = _mm_or_si128(_mm_loadu_si128((const __m128i*)&w[4]), opaque);
+            }
+
+            __m128i channel[4];
+            for (int c = 0; c < 4; ++c)
+            {
+                // byte c of each 32 bit pixel, packed into 16 bit lanes
+                __m128i byteShift = _mm_cvtsi32_si128(c * 8);
+                __m128i l = _mm_and_si128(_mm_srl_epi32(lo, byteShift), byteMask);
+                __m128i h = _mm_and_si128(_mm_srl_epi32(hi, byteShift), byteMask);
+                channel[c] = _mm_packs_epi32(l, h);
+            }
+
+            __m128i packed = _mm_setzero_si128();
+            for (int c = 0; c < 4; ++c)
+            {
+                if (layout.bits[c])
+                {
+                    __m128i q = Quantize8(channel[c], m[c], t[c]);
+                    packed = _mm_or_si128(packed, _mm_sll_epi16(q, packedShift[c]));
+                }
+            }
+
+            _mm_storeu_si128((__m128i*)(dst + x), packed);
+        }
+
+        return x;
+    }
+
+#elif DI_IMAGE_CONVERT_NEON
+
+    static inline uint16x8_t Quantize8(uint16x8_t v, uint16x8_t m, uint16x8_t t)
+    {
+        uint16x8_t x = vmlaq_u16(t, v, m);
+        x = vaddq_u16(x, vaddq_u16(vdupq_n_u16(1), vshrq_n_u16(x, 8)));
+        return vshrq_n_u16(x, 8);
+    }
+
+
+    // 8 pixels per step. returns the number of pixels converted
+    static int ConvertRowSIMD(const uint8_t* src, int srcBpp, uint16_t* dst, int width, const PackLayout& layout, const uint8_t thresholds[4][4])
+    {
+        uint16x8_t m[4], t[4];
+        int16x8_t packedShift[4];
+        for (int c = 0; c < 4; ++c)
+        {
+            const uint16_t row[8] = { thresholds[c][0], thresholds[c][1], thresholds[c][2], thresholds[c][3],
+                                      thresholds[c][0], thresholds[c][1], thresholds[c][2], thresholds[c][3] };
+            m[c] = vdupq_n_u16(uint16_t((1 << layout.bits[c]) - 1));
+            t[c] = vld1q_u16(row);
+            packedShift[c] = vdupq_n_s16(int16_t(layout.shift[c]));
+        }
+
+        int x = 0;
+        for (; x + 8 <= width; x += 8)
+        {
+            uint16x8_t channel[4];
+            if (srcBpp == 4)
+            {
+                uint8x8x4_t v = vld4_u8(src + x * 4);
+                for (int c = 0; c < 4; ++c)
+                {
+                    channel[c] = vmovl_u8(v.val[c]);
+                }
+            }
+            else
+            {
+                uint8x8x3_t v = vld3_u8(src + x * 3);
+                for (int c = 0; c < 3; ++c)
+                {
+                    channel[c] = vmovl_u8(v.val[c]);
+                }
+                channel[3] = vdupq_n_u16(255);
+            }
+
+            uint16x8_t packed = vdupq_n_u16(0);
+            for (int c = 0; c < 4; ++c)
+            {
+                if (layout.bits[c])
+                {
+                    uint16x8_t q = Quantize8(channel[c], m[c], t[c]);
+                    packed = vorrq_u16(packed, vshlq_u16(q, packedShift[c]));
+                }
+            }
+
+            vst1q_u16(dst + x, packed);
+        }
+
+        return x;
+    }
+
+#else
+
+    static int ConvertRowSIMD(const uint8_t*, int, uint16_t*, int, const PackLayout&, const uint8_t[4][4])
+    {
+        return 0;
+    }
+
+#endif
+
+
+    static void ConvertThreshold(const Image& src, int srcBpp, Image* dst, const PackLayout& layout, TextureOptions::Dither dither)
+    {
+        for (int y = 0; y < src.height; ++y)
+        {
+            const uint8_t* srcRow = src.pixels->GetData() + size_t(src.pitch) * y;
+            uint16_t* dstRow = (uint16_t*)(dst->pixels->GetData() + size_t(dst->pitch) * y);
+
+            uint8_t thresholds[4][4];
+            GetRowThresholds(layout, dither, y, thresholds);
+
+            int done = ConvertRowSIMD(srcRow, srcBpp, dstRow, src.width, layout, thresholds);
+            ConvertRowScalar(srcRow, srcBpp, dstRow, done, src.width, layout, thresholds);
+        }
+    }
+
+
+    // Floyd-Steinberg. each pixel depends on the one before it, so this one stays scalar
+    static void ConvertErrorDiffusion(const Image& src, int srcBpp, Image* dst, const PackLayout& layout)
+    {
+        // errors of the current row and the next row, one pixel of padding on both sides
+        const size_t errorsPerRow = size_t(src.width + 2) * 4;
+        vector<int16_t> errors(errorsPerRow * 2, 0);
+        int16_t* curErrors = &errors[0];
+        int16_t* nextErrors = &errors[errorsPerRow];
+
+        for (int y = 0; y < src.height; ++y)
+        {
+            const uint8_t* srcRow = src.pixels->GetData() + size_t(src.pitch) * y;
+            uint16_t* dstRow = (uint16_t*)(dst->pixels->GetData() + size_t(dst->pitch) * y);
+
+            for (int x = 0; x < src.width; ++x)
+            {
+                unsigned rgba[4];
+                LoadPixelScalar(srcRow, srcBpp, x, rgba);
+
+                unsigned packed = 0;
+                for (int c = 0; c < 4; ++c)
+                {
+                    if (!layout.bits[c])
+                    {
+                        continue;
+                    }
+
+                    unsigned m = (1u << layout.bits[c]) - 1;
+                    if (layout.bits[c] == 1)
+                    {
+                        packed |= unsigned(QuantizeScalar(rgba[c], m, RoundingThreshold)) << layout.shift[c];
+                        continue;
+                    }
+
+                    int16_t* e = curErrors + (x + 1) * 4 + c;
+                    int v = int(rgba[c]) + ((*e + 8) >> 4);
+                    v = v < 0 ? 0 : (v > 255 ? 255 : v);
+
+                    unsigned q = QuantizeScalar(unsigned(v), m, RoundingThreshold);
+                    int err = v - int((q * 255 + m / 2) / m);
+
+                    e[4] = int16_t(e[4] + err * 7);
+                    int16_t* n = nextErrors + (x + 1) * 4 + c;
+                    n[-4] = int16_t(n[-4] + err * 3);
+                    n[0] = int16_t(n[0] + err * 5);
+                    n[4] = int16_t(n[4] + err);
+
+                    packed |= q << layout.shift[c];
+                }
+
+                dstRow[x] = uint16_t(packed);
+            }
+
+            swap(curErrors, nextErrors);
+            memset(nextErrors, 0, errorsPerRow * sizeof(int16_t));
+        }
+    }
+
+
+    TextureProtocol::InnerFormat Image_Choose16BitFormat(const Image& image)
+    {
+        if (image.format != TextureProtocol::RGBA_8888)
+        {
+            return TextureProtocol::RGB_565;
+        }
+
+        bool opaque = true;
+        for (int y = 0; y < image.height; ++y)
+        {
+            const uint8_t* alpha = image.pixels->GetData() + size_t(image.pitch) * y + 3;
+            for (int x = 0; x < image.width; ++x, alpha += 4)
+            {
+                if (*alpha != 255)
+                {
+                    if (*alpha != 0)
+                    {
+                        return TextureProtocol::RGBA_4444;
+                    }
+                    opaque = false;
+                }
+            }
+        }
+
+        return opaque ? TextureProtocol::RGB_565 : TextureProtocol::RGBA_5551;
+    }
+
+
+    bool Image_ConvertTo16Bit(const Image& src, TextureProtocol::InnerFormat format, TextureOptions::Dither dither, Image* dst)
+    {
+        PackLayout layout;
+        if (!GetPackLayout(format, &layout))
+        {
+            LogError("Image_ConvertTo16Bit: format %d is not a 16 bit format", int(format));
+            return false;
+        }
+
+        int srcBpp;
+        if (src.format == TextureProtocol::RGBA_8888)
+        {
+            srcBpp = 4;
+        }
+        else if (src.format == TextureProtocol::RGB_888)
+        {
+            srcBpp = 3;
+        }
+        else
+        {
+            LogError("Image_ConvertTo16Bit: source format %d is not supported", int(src.format));
+            return false;
+        }
+
+        Image result;
+        if (!Image_Allocate(&result, format, src.width, src.height))
+        {
+            return false;
+        }
+
+        if (dither == TextureOptions::Dither_ErrorDiffusion)
+        {
+            ConvertErrorDiffusion(src, srcBpp, &result, layout);
+        }
+        else
+        {
+            ConvertThreshold(src, srcBpp, &result, layout, dither);
+        }
+
+        *dst = result;
+        return true;
+    }
+
+
+    //
+    // RGBA_8888 / RGB_888 => Gray_8 / Alpha_8
+    //
+    // gray images and white masks (every visible pixel is white) need only one channel.
+    // RGB under alpha 0 is not visible, many tools leave it black
+    //
+
+    void Image_ReduceChannels(Image* image)
+    {
+        int srcBpp;
+        if (image->format == TextureProtocol::RGBA_8888)
+        {
+            srcBpp = 4;
+        }
+        else if (image->format == TextureProtocol::RGB_888)
+        {
+            srcBpp = 3;
+        }
+        else
+        {
+            return;
+        }
+
+        bool gray = true;
+        bool whiteMask = srcBpp == 4;
+        for (int y = 0; y < image->height && (gray || whiteMask); ++y)
+        {
+            const uint8_t* p = image->pixels->GetData() + size_t(image->pitch) * y;
+            for (int x = 0; x < image->width; ++x, p += srcBpp)
+            {
+                unsigned a = srcBpp == 4 ? p[3] : 255;
+                gray = gray && a == 255 && p[0] == p[1] && p[1] == p[2];
+                whiteMask = whiteMask && (a == 0 || (p[0] & p[1] & p[2]) == 255);
+            }
+        }
+
+        if (!gray && !whiteMask)
+        {
+            return;
+        }
+
+        // the gray value, or the alpha
+        int channel = gray ? 0 : 3;
+
+        Image reduced;
+        if (!Image_Allocate(&reduced, gray ? TextureProtocol::Gray_8 : TextureProtocol::Alpha_8, image->width, image->height))
+        {
+            return;
+        }
+
+        for (int y = 0; y < image->height; ++y)
+        {
+            const uint8_t* p = image->pixels->GetData() + size_t(image->pitch) * y + channel;
+            uint8_t* out = reduced.pixels->GetData() + size_t(reduced.pitch) * y;
+            for (int x = 0; x < image->width; ++x, p += srcBpp)
+            {
+                out[x] = *p;
+            }
+        }
+
+        *image = reduced;
+    }
+
+
+    //
+    // RGBA_8888 / RGB_888 => RGBA_8888_Palette_256
+    //
+    // Images with no more than 256 colors (most flat shaded UI art) get their exact colors.
+    // Others go through median cut on a 5-5-5-4 bits histogram, then each histogram cell takes its nearest palette color.
+    //
+
+    enum { PaletteSize = 256 };
+
+
+    static inline uint32_t PackRGBA(unsigned r, unsigned g, unsigned b, unsigned a)
+    {
+        return r | (g << 8) | (b << 16) | (a << 24);
+    }
+
+
+    static inline unsigned HistogramKey(const unsigned rgba[4])
+    {
+        return (rgba[0] >> 3) | ((rgba[1] >> 3) << 5) | ((rgba[2] >> 3) << 10) | ((rgba[3] >> 4) << 15);
+    }
+
+
+    struct HistogramCell
+    {
+        uint32_t key;
+        uint32_t count;
+        uint32_t sum[4];
+        uint8_t coord[4];       // reduced channels, alpha is doubled so that all 4 axes have the same range
+    };
+
+
+    struct MedianCutBox
+    {
+        size_t begin;
+        size_t end;
+        uint64_t count;
+        int axis;               // the longest axis
+        int range;
+    };
+
+
+    static void MedianCutBox_Shrink(MedianCutBox* box, const vector<HistogramCell>& cells)
+    {
+        int lo[4] = { 255, 255, 255, 255 };
+        int hi[4] = { 0, 0, 0, 0 };
+        box->count = 0;
+        for (size_t i = box->begin; i < box->end; ++i)
+        {
+            for (int c = 0; c < 4; ++c)
+            {
+                lo[c] = min(lo[c], int(cells[i].coord[c]));
+                hi[c] = max(hi[c], int(cells[i].coord[c]));
+            }
+            box->count += cells[i].count;
+        }
+
+        box->axis = 0;
+        box->range = -1;
+        for (int c = 0; c < 4; ++c)
+        {
+            if (hi[c] - lo[c] > box->range)
+            {
+                box->axis = c;
+                box->range = hi[c] - lo[c];
+            }
+        }
+    }
+
+
+    static void MedianCut(vector<HistogramCell>& cells, uint32_t palette[PaletteSize], int* colorCount)
+    {
+        vector<MedianCutBox> boxes(1);
+        boxes[0].begin = 0;
+        boxes[0].end = cells.size();
+        MedianCutBox_Shrink(&boxes[0], cells);
+
+        while (boxes.size() < PaletteSize)
+        {
+            // split the box which covers most pixels along the longest distance
+            int best = -1;
+            double bestScore = 0;
+            for (int i = 0; i < int(boxes.size()); ++i)
+            {
+                double score = double(boxes[i].count) * boxes[i].range;
+                if (boxes[i].end - boxes[i].begin >= 2 && score > bestScore)
+                {
+                    best = i;
+                    bestScore = score;
+                }
+            }
+
+            if (best < 0)
+            {
+                break;
+            }
+
+            MedianCutBox& box = boxes[best];
+            int axis = box.axis;
+            sort(cells.begin() + box.begin, cells.begin() + box.end, [axis](const HistogramCell& a, const HistogramCell& b) { return a.coord[axis] < b.coord[axis]; });
+
+            uint64_t half = box.count / 2;
+            uint64_t accumulated = 0;
+            size_t split = box.begin + 1;
+            for (size_t i = box.begin; i < box.end - 1; ++i)
+            {
+                accumulated += cells[i].count;
+                split = i + 1;
+                if (accumulated >= half)
+                {
+                    break;
+                }
+            }
+
+            MedianCutBox upper;
+            upper.begin = split;
+            upper.end = box.end;
+            box.end = split;
+            MedianCutBox_Shrink(&box, cells);
+            MedianCutBox_Shrink(&upper, cells);
+            boxes.push_back(upper);
+        }
+
+        for (size_t i = 0; i < boxes.size(); ++i)
+        {
+            uint64_t sum[4] = { 0, 0, 0, 0 };
+            for (size_t j = boxes[i].begin; j < boxes[i].end; ++j)
+            {
+                for (int c = 0; c < 4; ++c)
+                {
+                    sum[c] += cells[j].sum[c];
+                }
+            }
+
+            uint64_t n = max<uint64_t>(boxes[i].count, 1);
+            palette[i] = PackRGBA(unsigned((sum[0] + n / 2) / n), unsigned((sum[1] + n / 2) / n), unsigned((sum[2] + n / 2) / n), unsigned((sum[3] + n / 2) / n));
+        }
+
+        *colorCount = int(boxes.size());
+    }
+
+
+    static int NearestPaletteIndex(const uint32_t palette[PaletteSize], int colorCount, const int rgba[4])
+    {
+        int best = 0;
+        int bestDistance = INT_MAX;
+        for (int i = 0; i < colorCount; ++i)
+        {
+            int distance = 0;
+            for (int c = 0; c < 4; ++c)
+            {
+                int d = int((palette[i] >> (c * 8)) & 0xFF) - rgba[c];
+                distance += d * d;
+            }
+
+            if (distance < bestDistance)
+            {
+                best = i;
+                bestDistance = distance;
+            }
+        }
+
+        return best;
+    }
+
+
+    // returns false if the image has more than 256 colors
+    static bool CollectExactPalette(const Image& src, int srcBpp, uint32_t palette[PaletteSize], int* colorCount, unordered_map<uint32_t, uint8_t>* colorToIndex)
+    {
+        *colorCount = 0;
+        for (int y = 0; y < src.height; ++y)
+        {
+            const uint8_t* row = src.pixels->GetData() + size_t(src.pitch) * y;
+            for (int x = 0; x < src.width; ++x)
+            {
+                unsigned rgba[4];
+                LoadPixelScalar(row, srcBpp, x, rgba);
+
+                uint32_t color = PackRGBA(rgba[0], rgba[1], rgba[2], rgba[3]);
+                if (colorToIndex->find(color) == colorToIndex->end())
+                {
+                    if (*colorCount == PaletteSize)
+                    {
+                        return false;
+                    }
+
+                    palette[*colorCount] = color;
+                    (*colorToIndex)[color] = uint8_t(*colorCount);
+                    ++*colorCount;
+                }
+            }
+        }
+
+        return true;
+    }
+
+
+    bool Image_QuantizeToPalette(const Image& src, ImagePlanes* planes, double* psnr)
+    {
+        int srcBpp;
+        if (src.format == TextureProtocol::RGBA_8888)
+        {
+            srcBpp = 4;
+        }
+        else if (src.format == TextureProtocol::RGB_888)
+        {
+            srcBpp = 3;
+        }
+        else
+        {
+            LogError("Image_QuantizeToPalette: source format %d is not supported", int(src.format));
+            return false;
+        }
+
+        ImagePlanes result;
+        Image& indices = result.planes[0];
+        Image& paletteImage = result.planes[1];
+        if (!Image_Allocate(&indices, TextureProtocol::Gray_8, src.width, src.height) ||
+            !Image_Allocate(&paletteImage, TextureProtocol::RGBA_8888, PaletteSize, 1))
+        {
+            return false;
+        }
+
+        uint32_t palette[PaletteSize];
+        int colorCount;
+        unordered_map<uint32_t, uint8_t> colorToIndex;
+
+        vector<int> cellOfKey;
+        vector<HistogramCell> cells;
+        vector<uint8_t> indexOfCell;
+
+        bool exact = CollectExactPalette(src, srcBpp, palette, &colorCount, &colorToIndex);
+        if (!exact)
+        {
+            cellOfKey.assign(1 << 19, -1);
+            for (int y = 0; y < src.height; ++y)
+            {
+                const uint8_t* row = src.pixels->GetData() + size_t(src.pitch) * y;
+                for (int x = 0; x < src.width; ++x)
+                {
+                    unsigned rgba[4];
+                    LoadPixelScalar(row, srcBpp, x, rgba);
+
+                    int& cellIndex = cellOfKey[HistogramKey(rgba)];
+                    if (cellIndex < 0)
+                    {
+                        HistogramCell cell;
+                        memset(&cell, 0, sizeof(cell));
+                        cell.key = HistogramKey(rgba);
+                        cell.coord[0] = uint8_t(rgba[0] >> 3);
+                        cell.coord[1] = uint8_t(rgba[1] >> 3);
+                        cell.coord[2] = uint8_t(rgba[2] >> 3);
+                        cell.coord[3] = uint8_t((rgba[3] >> 4) * 2);
+                        cellIndex = int(cells.size());
+                        cells.push_back(cell);
+                    }
+
+                    HistogramCell& cell = cells[cellIndex];
+                    cell.count++;
+                    for (int c = 0; c < 4; ++c)
+                    {
+                        cell.sum[c] += rgba[c];
+                    }
+                }
+            }
+
+            // MedianCut sorts the cells, cellOfKey must point to the new places
+            MedianCut(cells, palette, &colorCount);
+
+            indexOfCell.resize(cells.size());
+            for (size_t i = 0; i < cells.size(); ++i)
+            {
+                const HistogramCell& cell = cells[i];
+                int mean[4];
+                for (int c = 0; c < 4; ++c)
+                {
+                    mean[c] = int((cell.sum[c] + cell.count / 2) / cell.count);
+                }
+
+                cellOfKey[cell.key] = int(i);
+                indexOfCell[i] = uint8_t(NearestPaletteIndex(palette, colorCount, mean));
+            }
+        }
+
+        // indices, and the error for PSNR
+        uint64_t squaredError = 0;
+        for (int y = 0; y < src.height; ++y)
+        {
+            const uint8_t* row = src.pixels->GetData() + size_t(src.pitch) * y;
+            uint8_t* indexRow = indices.pixels->GetData() + size_t(indices.pitch) * y;
+            for (int x = 0; x < src.width; ++x)
+            {
+                unsigned rgba[4];
+                LoadPixelScalar(row, srcBpp, x, rgba);
+
+                uint8_t index = exact ? colorToIndex[PackRGBA(rgba[0], rgba[1], rgba[2], rgba[3])] : indexOfCell[cellOfKey[HistogramKey(rgba)]];
+                indexRow[x] = index;
+
+                for (int c = 0; c < srcBpp; ++c)
+                {
+                    int d = int((palette[index] >> (c * 8)) & 0xFF) - int(rgba[c]);
+                    squaredError += uint64_t(d * d);
+                }
+            }
+        }
+
+        memset(palette + colorCount, 0, (PaletteSize - colorCount) * sizeof(uint32_t));
+        for (int i = 0; i < PaletteSize; ++i)
+        {
+            uint8_t* p = paletteImage.pixels->GetData() + i * 4;
+            for (int c = 0; c < 4; ++c)
+            {
+                p[c] = uint8_t(palette[i] >> (c * 8));
+            }
+        }
+
+        double meanSquaredError = double(squaredError) / (double(src.width) * src.height * srcBpp);
+        *psnr = meanSquaredError > 0 ? 10.0 * log10(255.0 * 255.0 / meanSquaredError) : HUGE_VAL;
+
+        result.format = TextureProtocol::RGBA_8888_Palette_256;
+        result.width = src.width;
+        result.height = src.height;
+        result.count = 2;
+        *planes = result;
+        return true;
+    }
+}
@@ -0,0 +1,433 @@
+#include "DiImage.h"
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#   include <arm_neon.h>
+#   define DI_IMAGE_MIPMAP_NEON 1
+#elif defined(__SSE2__) || defined(_M_IX86) || defined(_M_X64)
+#   include <emmintrin.h>
+#   define DI_IMAGE_MIPMAP_SSE2 1
+#endif
+
+namespace di
+{
+    //
+    // Each level is filtered from the previous one by a separable 2:1 filter,
+    // dst[x] = sum of weights[k] * src[2x + offset + k], taps outside the image are clamped to the edge.
+    // The vertical pass sums whole rows of floats by SSE2 / NEON, then the horizontal pass picks every other pixel.
+    // With gamma correction the color channels are converted from sRGB to linear light by a table before filtering,
+    // and back by a 4096 entries table. alpha is always filtered as it is, the colors of RGBA are weighted by it
+    // (premultiplied, filtered, divided by the filtered alpha), so the color of transparent pixels does not bleed in
+    //
+
+    enum { MaxTaps = 6, RowsPerBand = 16 };
+
+
+    struct MipKernel
+    {
+        int offset;
+        int taps;
+        float weights[MaxTaps];
+    };
+
+
+    static double BesselI0(double x)
+    {
+        double sum = 1.0;
+        double term = 1.0;
+        for (int k = 1; k < 32; ++k)
+        {
+            term *= (x / (2.0 * k)) * (x / (2.0 * k));
+            sum += term;
+        }
+        return sum;
+    }
+
+
+    // sinc with the cutoff of half the source frequency, windowed by Kaiser (alpha 4) over 3 source pixels each side
+    static MipKernel MakeKaiserKernel()
+    {
+        const double pi = 3.14159265358979323846;
+        const double alpha = 4.0;
+        const double radius = 3.0;
+
+        MipKernel kernel;
+        kernel.offset = -2;
+        kernel.taps = MaxTaps;
+
+        double weights[MaxTaps];
+        double sum = 0;
+        for (int k = 0; k < MaxTaps; ++k)
+        {
+            // distance from the center of the 2 source pixels under the destination pixel
+            double d = (k + kernel.offset) - 0.5;
+            double x = pi * d * 0.5;
+            double sinc = x == 0 ? 1.0 : sin(x) / x;
+            double t = d / radius;
+            double window = BesselI0(alpha * sqrt(max(0.0, 1.0 - t * t))) / BesselI0(alpha);
+
+            weights[k] = sinc * window;
+            sum += weights[k];
+        }
+
+        for (int k = 0; k < MaxTaps; ++k)
+        {
+            kernel.weights[k] = float(weights[k] / sum);
+        }
+
+        return kernel;
+    }
+
+
+    static const MipKernel& GetKernel(TextureOptions::MipFilter filter)
+    {
+        static const MipKernel box = { 0, 2, { 0.5f, 0.5f } };
+        static const MipKernel kaiser = MakeKaiserKernel();
+        return filter == TextureOptions::Mip_Kaiser ? kaiser : box;
+    }
+
+
+    struct GammaTables
+    {
+        float toLinear[256];
+        float toFloat[256];
+        uint8_t fromLinear[4096];
+
+        GammaTables()
+        {
+            for (int i = 0; i < 256; ++i)
+            {
+                double c = i / 255.0;
+                toLinear[i] = float(c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4));
+                toFloat[i] = float(c);
+            }
+
+            for (int i = 0; i < 4096; ++i)
+            {
+                double l = i / 4095.0;
+                double c = l <= 0.0031308 ? l * 12.92 : 1.055 * pow(l, 1.0 / 2.4) - 0.055;
+                fromLinear[i] = uint8_t(min(255.0, max(0.0, c * 255.0 + 0.5)));
+            }
+        }
+    };
+
+
+    static const GammaTables& GetGammaTables()
+    {
+        static const GammaTables tables;    // constructed thread safely in C++11
+        return tables;
+    }
+
+
+#if DI_IMAGE_MIPMAP_SSE2
+
+    static void AccumulateRow(float* acc, const float* row, float weight, int count)
+    {
+        __m128 w = _mm_set1_ps(weight);
+
+        int i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            _mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i), _mm_mul_ps(w, _mm_loadu_ps(row + i))));
+        }
+
+        for (; i < count; ++i)
+        {
+            acc[i] += weight * row[i];
+        }
+    }
+
+#elif DI_IMAGE_MIPMAP_NEON
+
+    static void AccumulateRow(float* acc, const float* row, float weight, int count)
+    {
+        int i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            vst1q_f32(acc + i, vmlaq_n_f32(vld1q_f32(acc + i), vld1q_f32(row + i), weight));
+        }
+
+        for (; i < count; ++i)
+        {
+            acc[i] += weight * row[i];
+        }
+    }
+
+#else
+
+    static void AccumulateRow(float* acc, const float* row, float weight, int count)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            acc[i] += weight * row[i];
+        }
+    }
+
+#endif
+
+
+    struct MipChannels
+    {
+        int count;
+        const float* toFloat[4];
+        bool linear[4];         // converted back by GammaTables::fromLinear
+        bool premultiply;       // the colors are weighted by channel 3 while they are filtered
+    };
+
+
+    static void DownsampleRows(const Image& src, Image* dst, const MipChannels& channels, const MipKernel& kernel, int beginRow, int endRow)
+    {
+        const GammaTables& tables = GetGammaTables();
+        int n = channels.count;
+        int rowFloats = src.width * n;
+
+        vector<float> row(rowFloats);
+        vector<float> acc(rowFloats);
+
+        for (int dy = beginRow; dy < endRow; ++dy)
+        {
+            fill(acc.begin(), acc.end(), 0.0f);
+
+            for (int k = 0; k < kernel.taps; ++k)
+            {
+                int sy = min(max(dy * 2 + kernel.offset + k, 0), src.height - 1);
+                const uint8_t* s = src.pixels->GetData() + size_t(src.pitch) * sy;
+                for (int i = 0; i < rowFloats; i += n)
+                {
+                    for (int c = 0; c < n; ++c)
+                    {
+                        row[i + c] = channels.toFloat[c][s[i + c]];
+                    }
+
+                    if (channels.premultiply)
+                    {
+                        row[i] *= row[i + 3];
+                        row[i + 1] *= row[i + 3];
+                        row[i + 2] *= row[i + 3];
+                    }
+                }
+
+                AccumulateRow(&acc[0], &row[0], kernel.weights[k], rowFloats);
+            }
+
+            uint8_t* d = dst->pixels->GetData() + size_t(dst->pitch) * dy;
+            for (int dx = 0; dx < dst->width; ++dx)
+            {
+                float v[4];
+                for (int c = 0; c < n; ++c)
+                {
+                    v[c] = 0;
+                    for (int k = 0; k < kernel.taps; ++k)
+                    {
+                        int sx = min(max(dx * 2 + kernel.offset + k, 0), src.width - 1);
+                        v[c] += kernel.weights[k] * acc[sx * n + c];
+                    }
+                }
+
+                // a fully transparent result keeps no color
+                if (channels.premultiply)
+                {
+                    float scale = v[3] > 0.0f ? 1.0f / v[3] : 0.0f;
+                    v[0] *= scale;
+                    v[1] *= scale;
+                    v[2] *= scale;
+                }
+
+                for (int c = 0; c < n; ++c)
+                {
+                    float value = min(max(v[c], 0.0f), 1.0f);
+                    d[dx * n + c] = channels.linear[c] ? tables.fromLinear[int(value * 4095.0f + 0.5f)] : uint8_t(value * 255.0f + 0.5f);
+                }
+            }
+        }
+    }
+
+
+    static bool GetMipChannels(TextureProtocol::InnerFormat format, bool gammaCorrect, MipChannels* channels)
+    {
+        switch (format)
+        {
+        case TextureProtocol::RGBA_8888:    channels->count = 4; break;
+        case TextureProtocol::RGB_888:      channels->count = 3; break;
+        case TextureProtocol::Gray_8:       channels->count = 1; break;
+        case TextureProtocol::Alpha_8:      channels->count = 1; break;
+        default:
+            LogError("Image_GenerateMipmaps: format %d is not supported", int(format));
+            return false;
+        }
+
+        channels->premultiply = format == TextureProtocol::RGBA_8888;
+
+        const GammaTables& tables = GetGammaTables();
+        for (int c = 0; c < channels->count; ++c)
+        {
+            bool alpha = format == TextureProtocol::Alpha_8 || c == 3;
+            channels->linear[c] = gammaCorrect && !alpha;
+            channels->toFloat[c] = channels->linear[c] ? tables.toLinear : tables.toFloat;
+        }
+
+        return true;
+    }
+
+
+    static bool DownsampleLevel(const Image& level, const MipChannels& channels, const MipKernel& kernel, Image* mip)
+    {
+        if (!Image_Allocate(mip, level.format, max(level.width / 2, 1), max(level.height / 2, 1)))
+        {
+            return false;
+        }
+
+        int bands = (mip->height + RowsPerBand - 1) / RowsPerBand;
+        ParallelFor("Mipmap", bands, 0, [&level, mip, &channels, &kernel](int band)
+        {
+            DownsampleRows(level, mip, channels, kernel, band * RowsPerBand, min((band + 1) * RowsPerBand, mip->height));
+        });
+
+        return true;
+    }
+
+
+    bool Image_GenerateMipmaps(const Image& src, TextureOptions::MipFilter filter, bool gammaCorrect, vector<Image>* mips)
+    {
+        DI_SAVE_CALLSTACK();
+
+        mips->clear();
+
+        MipChannels channels;
+        if (!GetMipChannels(src.format, gammaCorrect, &channels))
+        {
+            return false;
+        }
+
+        const MipKernel& kernel = GetKernel(filter);
+
+        const Image* level = &src;
+        while (level->width > 1 || level->height > 1)
+        {
+            Image mip;
+            if (!DownsampleLevel(*level, channels, kernel, &mip))
+            {
+                mips->clear();
+                return false;
+            }
+
+            mips->push_back(mip);
+            level = &mips->back();
+        }
+
+        return true;
+    }
+
+
+    bool Image_GenerateMipmap(const Image& src, TextureOptions::MipFilter filter, bool gammaCorrect, Image* mip)
+    {
+        DI_SAVE_CALLSTACK();
+
+        MipChannels channels;
+        return GetMipChannels(src.format, gammaCorrect, &channels) && DownsampleLevel(src, channels, GetKernel(filter), mip);
+    }
+
+
+    //
+    // box downsampling while decoding, see DiImage.cpp.
+    // the rows of a block are summed into 16 bit counters by SSE2 / NEON (256 rows of 255 fit),
+    // then each block of columns is summed and divided once, so the result is the exact rounded average
+    //
+
+#if DI_IMAGE_MIPMAP_SSE2
+
+    static void SumRow(uint16_t* sums, const uint8_t* row, int count)
+    {
+        __m128i zero = _mm_setzero_si128();
+
+        int i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            __m128i bytes = _mm_loadu_si128((const __m128i*)(row + i));
+            __m128i lo = _mm_loadu_si128((const __m128i*)(sums + i));
+            __m128i hi = _mm_loadu_si128((const __m128i*)(sums + i + 8));
+            _mm_storeu_si128((__m128i*)(sums + i), _mm_add_epi16(lo, _mm_unpacklo_epi8(bytes, zero)));
+            _mm_storeu_si128((__m128i*)(sums + i + 8), _mm_add_epi16(hi, _mm_unpackhi_epi8(bytes, zero)));
+        }
+
+        for (; i < count; ++i)
+        {
+            sums[i] = uint16_t(sums[i] + row[i]);
+        }
+    }
+
+#elif DI_IMAGE_MIPMAP_NEON
+
+    static void SumRow(uint16_t* sums, const uint8_t* row, int count)
+    {
+        int i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            uint8x16_t bytes = vld1q_u8(row + i);
+            vst1q_u16(sums + i, vaddw_u8(vld1q_u16(sums + i), vget_low_u8(bytes)));
+            vst1q_u16(sums + i + 8, vaddw_u8(vld1q_u16(sums + i + 8), vget_high_u8(bytes)));
+        }
+
+        for (; i < count; ++i)
+        {
+            sums[i] = uint16_t(sums[i] + row[i]);
+        }
+    }
+
+#else
+
+    static void SumRow(uint16_t* sums, const uint8_t* row, int count)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            sums[i] = uint16_t(sums[i] + row[i]);
+        }
+    }
+
+#endif
+
+
+    void Image_BoxDownsampleRows(const uint8_t* src, int srcPitch, int srcWidth, int rows, int channels, int factor, uint8_t* dst)
+    {
+        DI_ASSERT(rows > 0 && rows <= factor && factor <= 256);
+
+        int rowBytes = srcWidth * channels;
+
+        // the stack is enough for the rows of textures up to 4096 RGBA pixels
+        uint16_t stackSums[4096 * 4];
+        vector<uint16_t> heapSums;
+        uint16_t* sums = stackSums;
+        if (rowBytes > int(sizeof(stackSums) / sizeof(stackSums[0])))
+        {
+            heapSums.resize(rowBytes);
+            sums = &heapSums[0];
+        }
+
+        memset(sums, 0, rowBytes * sizeof(uint16_t));
+        for (int y = 0; y < rows; ++y)
+        {
+            SumRow(sums, src + size_t(srcPitch) * y, rowBytes);
+        }
+
+        int dstWidth = (srcWidth + factor - 1) / factor;
+        for (int dx = 0; dx < dstWidth; ++dx)
+        {
+            int x0 = dx * factor;
+            int x1 = min(x0 + factor, srcWidth);
+            uint32_t count = uint32_t((x1 - x0) * rows);
+
+            for (int c = 0; c < channels; ++c)
+            {
+                uint32_t sum = 0;
+                for (int x = x0; x < x1; ++x)
+                {
+                    sum += sums[x * channels + c];
+                }
+
+                dst[dx * channels + c] = uint8_t((sum + count / 2) / count);
+            }
+        }
+    }
+}
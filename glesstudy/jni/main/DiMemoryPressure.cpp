@@ -0,0 +1,115 @@
+#include "DiMemoryPressure.h"
+#include "DiImage.h"
+
+namespace di
+{
+    unique_ptr<MemoryPressure> MemoryPressure::s_singleton;
+
+
+    static const char* GetTierName(MemoryTier tier)
+    {
+        switch (tier)
+        {
+        case MemoryTier_CpuCaches:              return "CPU caches";
+        case MemoryTier_UnusedPages:            return "unused pages";
+        case MemoryTier_LowPriorityTextures:    return "low priority textures";
+        case MemoryTier_TopMips:                return "top mips";
+        default:                                return "?";
+        }
+    }
+
+
+    MemoryPressure::MemoryPressure()
+        : m_nextId(1), m_lowPriority(0), m_idleTicks(1000)
+    {
+        AddPurger(MemoryTier_CpuCaches, "PixelBufferPool", []()
+        {
+            return PixelBufferPool::Singleton().Trim();
+        });
+
+        AddPurger(MemoryTier_CpuCaches, "FileByteCache", []()
+        {
+            return FileByteCache::Singleton().Trim();
+        });
+
+        AddPurger(MemoryTier_CpuCaches, "retained textures", []()
+        {
+            return ResourceManager::Singleton().DropRetainedBytes();
+        });
+
+        AddPurger(MemoryTier_LowPriorityTextures, "ResourceManager", [this]()
+        {
+            return ResourceManager::Singleton().ReleaseIdleTextures(m_lowPriority, m_idleTicks);
+        });
+
+        AddPurger(MemoryTier_TopMips, "ResourceManager", []()
+        {
+            return ResourceManager::Singleton().DropTopMipLevels();
+        });
+    }
+
+
+    int MemoryPressure::AddPurger(MemoryTier tier, const string& name, const Purger& purger)
+    {
+        Entry entry;
+        entry.id = m_nextId++;
+        entry.tier = tier;
+        entry.name = name;
+        entry.purger = purger;
+        m_purgers.push_back(entry);
+        return entry.id;
+    }
+
+
+    void MemoryPressure::RemovePurger(int id)
+    {
+        for (auto iter = m_purgers.begin(); iter != m_purgers.end(); ++iter)
+        {
+            if (iter->id == id)
+            {
+                m_purgers.erase(iter);
+                return;
+            }
+        }
+    }
+
+
+    MemoryPressure::Report MemoryPressure::Purge(MemoryTier lastTier /* = MemoryTier_TopMips */)
+    {
+        DI_SAVE_CALLSTACK();
+
+        uint64_t startClock = HighClock_Get();
+
+        Report report;
+        for (int tier = 0; tier < MemoryTier_Count; ++tier)
+        {
+            report.bytes[tier] = 0;
+            if (tier > lastTier)
+            {
+                continue;
+            }
+
+            for (size_t i = 0; i < m_purgers.size(); ++i)
+            {
+                if (m_purgers[i].tier == tier)
+                {
+                    report.bytes[tier] += m_purgers[i].purger();
+                }
+            }
+
+            LogInfo("memory pressure: %s reclaimed %.1f KB", GetTierName(MemoryTier(tier)), report.bytes[tier] / 1024.0);
+        }
+
+        LogInfo("memory pressure: purge cost %.3f ms", HighClock_ToSeconds(HighClock_Get() - startClock) * 1000.0);
+        return report;
+    }
+
+
+    void MemoryPressure::SimulateLowMemory()
+    {
+        SDL_Event ev;
+        SDL_zero(ev);
+        ev.type = SDL_APP_LOWMEMORY;
+        SDL_PushEvent(&ev);
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef DI_MEMORY_PRESSURE_H_INCLUDED
+#define DI_MEMORY_PRESSURE_H_INCLUDED
+
+#include "DiResource.h"
+
+#include <functional>
+
+namespace di
+{
+    // What is given back when the system runs short of memory (SDL_APP_LOWMEMORY), cheapest to rebuild first
+    enum MemoryTier
+    {
+        MemoryTier_CpuCaches,           // idle buffers of PixelBufferPool, files of FileByteCache, bytes retained for a context loss
+        MemoryTier_UnusedPages,         // cached parts of big images which are not on screen, e.g. tiles of TiledImage
+        MemoryTier_LowPriorityTextures, // textures below MemoryPressure::SetLowPriority() which are not drawn lately
+        MemoryTier_TopMips,             // the top mip level of every texture which has more, see ResourceManager::SetTextureMemoryBudget
+        MemoryTier_Count,
+    };
+
+
+    // Frees memory tier by tier, and reports the bytes each tier gave back.
+    // the tiers are filled by purgers, each returns the bytes it has freed. the built-in ones are added by the constructor,
+    // others (e.g. TiledImage) add their own. ONLY in GL thread
+    class MemoryPressure
+    {
+    public:
+        typedef function<size_t()> Purger;
+
+        struct Report
+        {
+            size_t bytes[MemoryTier_Count];
+        };
+
+        // returns an id for RemovePurger()
+        int AddPurger(MemoryTier tier, const string& name, const Purger& purger);
+        void RemovePurger(int id);
+
+        // run the purgers of the tiers from MemoryTier_CpuCaches to 'lastTier', and log the bytes of each tier
+        Report Purge(MemoryTier lastTier = MemoryTier_TopMips);
+
+        // textures of a lower priority may be released by MemoryTier_LowPriorityTextures, 0 by default
+        void SetLowPriority(float priority) { m_lowPriority = priority; }
+
+        // textures drawn (Resource::UpdateTimeoutTick) in the last 'ticks' milliseconds are kept by MemoryTier_LowPriorityTextures,
+        // so that a texture on screen is not released and loaded again in the next frame. 1000 by default
+        void SetIdleTicks(uint32_t ticks) { m_idleTicks = ticks; }
+
+        // the same as SDL_APP_LOWMEMORY, for platforms which never send it (desktop Linux tests)
+        static void SimulateLowMemory();
+
+        static MemoryPressure& Singleton() { if (!s_singleton) { s_singleton.reset(new MemoryPressure()); } return *s_singleton; }
+        static void DestroySingleton() { s_singleton.reset(); }
+
+    private:
+        MemoryPressure();
+
+        struct Entry
+        {
+            int id;
+            MemoryTier tier;
+            string name;
+            Purger purger;
+        };
+
+        vector<Entry> m_purgers;
+        int m_nextId;
+        float m_lowPriority;
+        uint32_t m_idleTicks;
+
+        static unique_ptr<MemoryPressure> s_singleton;
+
+        DI_DISABLE_COPY(MemoryPressure);
+    };
+}
+
+#endif
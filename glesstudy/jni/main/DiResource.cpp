@@ -1,10 +1,102 @@
 #include "DiResource.h"
-#include "SDL_image.h"
+#include "DiImage.h"
+#include "DiEtc1.h"
+#include "DiTextureCache.h"
+#include "DiAssetPack.h"
+#include "DiAsyncIO.h"
+#include "DiTextureVariant.h"
+#include "di_ktx_format.h"
 
 #include <ctime>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+#ifndef GL_ETC1_RGB8_OES
+#   define GL_ETC1_RGB8_OES         0x8D64
+#endif
 
 namespace di
 {
+    void GlDeletionQueue::DeleteTextures(GLsizei count, const GLuint* textures)
+    {
+        ThreadLockGuard lock(m_lock);
+        for (GLsizei i = 0; i < count; ++i)
+        {
+            if (textures[i] != 0)
+            {
+                Pending pending = { textures[i], false, m_frame };
+                m_pending.push_back(pending);
+            }
+        }
+    }
+
+
+    void GlDeletionQueue::DeleteProgram(GLuint program)
+    {
+        if (program != 0)
+        {
+            ThreadLockGuard lock(m_lock);
+            Pending pending = { program, true, m_frame };
+            m_pending.push_back(pending);
+        }
+    }
+
+
+    void GlDeletionQueue::SetDelayFrames(int frames)
+    {
+        ThreadLockGuard lock(m_lock);
+        m_delayFrames = max(frames, 0);
+    }
+
+
+    void GlDeletionQueue::Drain()
+    {
+        DI_SAVE_CALLSTACK();
+
+        ThreadLockGuard lock(m_lock);
+        ++m_frame;
+
+        size_t count = 0;
+        for (; count < m_pending.size() && m_frame - m_pending[count].frame > uint32_t(m_delayFrames); ++count)
+        {
+            (m_pending[count].program ? m_programs : m_textures).push_back(m_pending[count].name);
+        }
+
+        m_pending.erase(m_pending.begin(), m_pending.begin() + count);
+        lock.Unlock();
+
+        if (!m_textures.empty())
+        {
+            glDeleteTextures(GLsizei(m_textures.size()), &m_textures[0]);
+            m_textures.clear();
+        }
+
+        for (auto iter = m_programs.begin(); iter != m_programs.end(); ++iter)
+        {
+            glDeleteProgram(*iter);
+        }
+        m_programs.clear();
+
+        DI_DBG_CHECK_GL_ERRORS();
+    }
+
+
+    void GlDeletionQueue::Forget()
+    {
+        ThreadLockGuard lock(m_lock);
+        m_pending.clear();
+    }
+
+
+    // never freed, resources may be destroyed by the worker thread while static objects are destroyed at exit
+    GlDeletionQueue& GlDeletionQueue::Singleton()
+    {
+        static GlDeletionQueue* s_queue = new GlDeletionQueue();
+        return *s_queue;
+    }
+
+
     unique_ptr<ResourceManager> ResourceManager::s_singleton;
 
 
@@ -12,6 +104,25 @@ namespace di
         : m_fields(new Fields)
     {
         m_fields->threadWillEnd = false;
+        m_fields->uploadBudget = 0;
+        m_fields->uploadedBytes = 0;
+        m_fields->textureMemoryBudget = 0;
+        m_fields->pressureCap = 0;
+        m_fields->pressureTick = 0;
+        m_fields->pressureFreedBytes = 0;
+        m_fields->retainBudget = 0;
+        m_fields->retainedBytes = 0;
+        m_fields->contextProbe = 0;
+        m_fields->gpuHits = 0;
+        m_fields->releaseGraceTicks = 5000;
+        m_fields->droppedHandles.reset(new DroppedHandles());
+        m_fields->prefetchStartTick = 0;
+        m_fields->prefetchRecordedTicks = 0;
+        m_fields->prefetchNext = 0;
+        m_fields->prefetchHitsReady = 0;
+        m_fields->prefetchHitsLoading = 0;
+        m_fields->prefetchMisses = 0;
+        m_fields->prefetchLate = 0;
 
         shared_ptr<Fields> fields = m_fields;
 
@@ -28,16 +139,20 @@ namespace di
         {
             // onLoop lambda begin
 
+            // resources at the top of the queue whose files are read ahead, see AsyncFileReader
+            const size_t ReadAhead = 8;
+
             Fields* f = fields.get();
 
             *willWaitMillis = 0;
 
-            vector<ResourcePtr> vec;
+            ResourcePtr r;
+            vector<ResourcePtr> ahead;
 
             f->cvToWorker.WaitUntil(
                 f->lockToWorker,
                 [f]() { return f->threadWillEnd || !f->queueToWorker.empty(); },
-                [willEndThread, f, &vec]()
+                [willEndThread, f, &r, &ahead]()
                 {
                     *willEndThread = f->threadWillEnd;
                     if (*willEndThread)
@@ -46,28 +161,60 @@ namespace di
                         return;
                     }
 
-                    // while (!f->queueToWorker.empty())
-                    if (!f->queueToWorker.empty())
+                    if (f->queueToWorker.empty())
+                    {
+                        return;
+                    }
+
+                    // only the top is loaded now, the next ones are looked at and put back
+                    r = f->queueToWorker.top();
+                    f->queueToWorker.pop();
+
+                    while (!f->queueToWorker.empty() && ahead.size() + 1 < ReadAhead)
                     {
-                        vec.push_back(f->queueToWorker.top());
+                        ahead.push_back(f->queueToWorker.top());
                         f->queueToWorker.pop();
                     }
+
+                    for (auto iter = ahead.begin(); iter != ahead.end(); ++iter)
+                    {
+                        f->queueToWorker.push(*iter);
+                    }
                 });
 
-            for (auto iter = vec.begin(); iter != vec.end(); ++iter)
+            if (*willEndThread || !r)
             {
-                if (*willEndThread)
-                {
-                    return;
-                }
+                return;
+            }
+
+            // the files of the next resources are read while this one waits for its files and decodes
+            AsyncFileReader& reader = AsyncFileReader::Singleton();
+            vector<string> files;
+            r->ListFiles(&files);
+
+            vector<string> allFiles = files;
+            for (auto iter = ahead.begin(); iter != ahead.end(); ++iter)
+            {
+                (*iter)->ListFiles(&allFiles);
+            }
+            reader.Submit(allFiles);
+
+            while (!all_of(files.begin(), files.end(), [&reader](const string& name) { return reader.IsDone(name); }))
+            {
+                reader.WaitForAny();
+            }
 
-                ResourcePtrCR r = *iter;
-                r->Load();
+            r->Load();
 
-                ThreadLockGuard lock(f->lockToGL);
-                f->queueToGL.push_back(r);
+            // e.g. an optional file the load did not need
+            for (auto name = files.begin(); name != files.end(); ++name)
+            {
+                reader.Drop(*name);
             }
 
+            ThreadLockGuard lock(f->lockToGL);
+            f->queueToGL.push_back(r);
+
             // onLoop lambda end
         };
 
@@ -92,6 +239,10 @@ namespace di
             if (state == Resource::State::Finished)
             {
                 resource->UpdateTimeoutTick();
+                if (resource->GetGpuBytes() > 0)
+                {
+                    ++m_fields->gpuHits;
+                }
             }
             else
             {
@@ -131,11 +282,17 @@ namespace di
     {
         DI_SAVE_CALLSTACK();
 
+        m_fields->uploadedBytes = 0;
+        GlDeletionQueue::Singleton().Drain();
+
         ThreadLockGuard lock(m_fields->lockToGL);
         deque<ResourcePtr> queueToGL;
         queueToGL.swap(m_fields->queueToGL);
         lock.Unlock();
 
+        // resources which ran out of upload budget, they go first in the next frame
+        deque<ResourcePtr> pending;
+
         for (auto iter = queueToGL.begin(); iter != queueToGL.end(); ++iter)
         {
             ResourcePtrCR resource = *iter;
@@ -146,315 +303,2014 @@ namespace di
                 {
                     resource->UpdateTimeoutTick();
                 }
+                else if (resource->GetState() == Resource::State::Loaded)
+                {
+                    pending.push_back(resource);
+                }
+                else if (resource->GetState() == Resource::State::Prepared)
+                {
+                    // a preview is shown, the rest goes to worker thread again
+                    ThreadLockGuard workerLock(m_fields->lockToWorker);
+                    m_fields->queueToWorker.push(resource);
+                    m_fields->cvToWorker.Notify();
+                }
             }
         }
-    }
 
+        if (!pending.empty())
+        {
+            ThreadLockGuard requeueLock(m_fields->lockToGL);
+            m_fields->queueToGL.insert(m_fields->queueToGL.begin(), pending.begin(), pending.end());
+        }
 
-    void ResourceManager::CheckTimeoutResources()
-    {
-        DI_SAVE_CALLSTACK();
+        if (m_fields->prefetchNext < m_fields->prefetchReplay.size())
+        {
+            IssuePrefetches();
+        }
 
-        auto& resourceHash = m_fields->resourceHash;
-        for (auto iter = resourceHash.begin(); iter != resourceHash.end(); ++iter)
+        ReleaseUnreferencedResources();
+
+        if (!m_fields->pressureDrops.empty())
         {
-            ResourcePtrCR resource = (*iter).second;
-//             if (resource.unique())
-//             {
-                resource->CheckTimeout();
-//             }
+            CheckPressureDrops();
+        }
+
+        if (m_fields->textureMemoryBudget != 0 || m_fields->pressureCap != 0)
+        {
+            CheckTextureMemory();
         }
     }
 
 
-    const ResourcePtr* ResourceManager::HashFindResource(const string& name)
+    // the hash keeps a strong reference, the users hold handles (see MakeHandle()). a resource whose last handle is dropped
+    // is released here in GL thread, never by the thread which drops the handle. only those resources are looked at
+    void ResourceManager::ReleaseUnreferencedResources()
     {
         DI_SAVE_CALLSTACK();
 
-        auto& hash = m_fields->resourceHash;
+        Fields* f = m_fields.get();
+        uint32_t now = SDL_GetTicks();
 
-        auto iter = hash.find(name);
-        if (iter == hash.end())
         {
-            return nullptr;
+            ThreadLockGuard lock(f->droppedHandles->lock);
+            auto& dropped = f->droppedHandles->resources;
+            for (auto iter = dropped.begin(); iter != dropped.end(); ++iter)
+            {
+                f->unreferenced[iter->first] = iter->second;
+            }
+            dropped.clear();
         }
 
-        ResourcePtrCR resource = (*iter).second;
-
-        Resource::State state = resource->GetState();
-        DI_ASSERT(state != Resource::State::Init);
-
-        AsyncLoadResource(resource);
-        return &resource;
-    }
+        for (auto iter = f->unreferenced.begin(); iter != f->unreferenced.end(); )
+        {
+            // a handle dropped by another thread may come after its resource is released, it is not looked at then
+            Resource* resource = iter->first;
+            auto handle = f->handles.find(resource);
+            if (handle == f->handles.end() || !handle->second.expired())
+            {
+                // or got again by GetResource()
+                iter = f->unreferenced.erase(iter);
+                continue;
+            }
 
+            Resource::State state = resource->GetState();
+            if (now - iter->second < f->releaseGraceTicks ||
+                (state != Resource::State::Finished && state != Resource::State::Timeout && state != Resource::State::Failed))
+            {
+                ++iter;
+                continue;
+            }
 
-    void ResourceManager::AddResource(ResourcePtrCR resource)
-    {
-        DI_SAVE_CALLSTACK();
-        DI_ASSERT(resource->GetState() == Resource::State::Init);
+            LogInfo("release unreferenced resource '%s'", resource->GetName().c_str());
 
-        m_fields->resourceHash[resource->GetName()] = resource;
+            f->handles.erase(handle);
 
-        AsyncLoadResource(resource);
+            // the hash holds the last reference
+            resource->ForceTimeout();
+            iter = f->unreferenced.erase(iter);
+            f->resourceHash.erase(resource->GetName());
+        }
     }
 
 
-    class SDLTextureLoader : public BaseTextureLoader
+    // the memory governor, see SetTextureMemoryBudget()
+    void ResourceManager::CheckTextureMemory()
     {
-    public:
-        SDLTextureLoader(const string& name) : BaseTextureLoader(name), m_imageSurface(nullptr) {}
+        DI_SAVE_CALLSTACK();
 
-        ~SDLTextureLoader()
-        {
-            glDeleteTextures(1, &m_glTexture);
+        const uint32_t PressureRelaxTicks = 5000;
 
-            SDL_FreeSurface(m_imageSurface);
-            m_imageSurface = nullptr;
+        Fields* f = m_fields.get();
+        if (!f->pressureDrops.empty())
+        {
+            return;
         }
 
-    private:
-        virtual bool Prepare_InGlThread()
+        if (f->pressureCap != 0 && SDL_GetTicks() - f->pressureTick >= PressureRelaxTicks)
         {
-            DI_SAVE_CALLSTACK();
-
-            if (m_glTexture == 0)
+            f->pressureCap += f->pressureCap / 4 + 1;
+            f->pressureTick = SDL_GetTicks();
+            if (f->textureMemoryBudget != 0 && f->pressureCap >= f->textureMemoryBudget)
             {
-                glGenTextures(1, &m_glTexture);
-                glBindTexture(GL_TEXTURE_2D, m_glTexture);
-                glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-                glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-                glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-                glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-                DI_DBG_CHECK_GL_ERRORS();
+                f->pressureCap = 0;
             }
-
-            return true;
         }
 
+        size_t budget = f->textureMemoryBudget;
+        if (f->pressureCap != 0 && (budget == 0 || f->pressureCap < budget))
+        {
+            budget = f->pressureCap;
+        }
 
-        virtual bool Load_InWorkThread()
+        if (budget == 0)
         {
-            DI_SAVE_CALLSTACK();
+            return;
+        }
 
-            if (m_imageSurface)
-            {
-                LogWarn("load new SDL surface while the old surface is still exist. resource: '%s'", GetName().c_str());
-                m_imageSurface = nullptr;
-            }
+        size_t total = 0;
+        bool anyDropped = false;
+        vector<ResourcePtr> candidates;
 
-            m_imageSurface = IMG_Load(GetName().c_str());
+        auto& resourceHash = m_fields->resourceHash;
+        for (auto iter = resourceHash.begin(); iter != resourceHash.end(); ++iter)
+        {
+            ResourcePtrCR resource = (*iter).second;
+            total += resource->GetGpuBytes();
 
-            if (m_imageSurface)
+            if (resource->GetState() == Resource::State::Finished)
             {
-                m_width = m_imageSurface->w;
-                m_height = m_imageSurface->h;
-
-                if (m_imageSurface->format->Amask != 0 || SDL_GetColorKey(m_imageSurface, NULL))
+                if (resource->GetMaxDroppedLevels() > 0)
                 {
-                    m_innerFormat = TextureProtocol::RGBA_8888;
+                    candidates.push_back(resource);
+                    anyDropped = anyDropped || resource->GetDroppedLevels() > 0;
                 }
-                else
-                {
-                    m_innerFormat = TextureProtocol::RGB_888;
-                }
-
-                return true;
             }
-            else
+            else if (resource->IsResourceOK())
             {
-                LogError("IMG_Load('%s') failed", GetName().c_str());
-                return false;
+                // the memory of a resource being loaded again is about to change, wait for it
+                return;
             }
         }
 
-
-        virtual bool Finish_InGlThread()
+        // without a budget the cap is only there to give the dropped levels back
+        if (f->textureMemoryBudget == 0 && !anyDropped)
         {
-            DI_SAVE_CALLSTACK();
-
-            DI_ASSERT(m_imageSurface);
-            DI_ASSERT(m_glTexture);
+            f->pressureCap = 0;
+            return;
+        }
 
-            Uint32 sdlFormat;
-            GLenum glFormat;
-            if (m_imageSurface->format->Amask != 0 || SDL_GetColorKey(m_imageSurface, NULL) == 0)
+        if (total > budget)
+        {
+            // the lowest priority first, as many as needed. a dropped level is about 3/4 of the bytes
+            stable_sort(candidates.begin(), candidates.end(), [](ResourcePtrCR a, ResourcePtrCR b) { return a->GetPriority() < b->GetPriority(); });
+            for (auto iter = candidates.begin(); iter != candidates.end() && total > budget; ++iter)
             {
-                sdlFormat = SDL_PIXELFORMAT_ABGR8888;   // surface has alpha, so use GL_RGBA
-                glFormat = GL_RGBA;
+                ResourcePtrCR resource = *iter;
+                if (resource->GetDroppedLevels() < resource->GetMaxDroppedLevels())
+                {
+                    total -= resource->GetGpuBytes() / 4 * 3;
+                    ReloadResource(resource, resource->GetDroppedLevels() + 1);
+                }
             }
-            else
+        }
+        else
+        {
+            // the highest priority first, one level at a time, and only when it fits.
+            // a restored level is about 3 times the bytes
+            stable_sort(candidates.begin(), candidates.end(), [](ResourcePtrCR a, ResourcePtrCR b) { return a->GetPriority() > b->GetPriority(); });
+            for (auto iter = candidates.begin(); iter != candidates.end(); ++iter)
             {
-                sdlFormat = SDL_PIXELFORMAT_RGB24;      // surface has no alpha, so use GL_RGB
-                glFormat = GL_RGB;
+                ResourcePtrCR resource = *iter;
+                if (resource->GetDroppedLevels() > 0)
+                {
+                    if (total + resource->GetGpuBytes() * 3 <= budget)
+                    {
+                        ReloadResource(resource, resource->GetDroppedLevels() - 1);
+                    }
+                    break;
+                }
             }
+        }
+    }
 
-            SDL_Surface* readingSurface;
-            SDL_Surface* tmpSurface = nullptr;
-            if (sdlFormat == m_imageSurface->format->format)    // no need to change format
-            {
-                readingSurface = m_imageSurface;
-            }
-            else                                                // need to change format
-                                                                // Normally we don't go here because blit operation has some performance cost
-                                                                // maybe move SDL_BlitSurface to ResourceManager's work thread is an optimization
-            {
-                LogWarn("SDL surface type need change. origin: %s, destination: %s",
-                    SDL_GetPixelFormatName(m_imageSurface->format->format), SDL_GetPixelFormatName(sdlFormat));
 
-                int pixelDepth;
-                Uint32 Rmask, Gmask, Bmask, Amask;
-                SDL_PixelFormatEnumToMasks(sdlFormat, &pixelDepth, &Rmask, &Gmask, &Bmask, &Amask);
+    size_t ResourceManager::GetTextureMemory()
+    {
+        size_t total = 0;
+        auto& resourceHash = m_fields->resourceHash;
+        for (auto iter = resourceHash.begin(); iter != resourceHash.end(); ++iter)
+        {
+            total += (*iter).second->GetGpuBytes();
+        }
 
-                tmpSurface = SDL_CreateRGBSurface(SDL_SWSURFACE, m_width, m_height, pixelDepth, Rmask, Gmask, Bmask, Amask);
-                if (!tmpSurface)
-                {
-                    LogError("SDL_CreateRGBSurface failed, resource: '%s'", GetName().c_str());
-                    SDL_FreeSurface(m_imageSurface);
-                    m_imageSurface = nullptr;
-                    return false;
-                }
+        return total;
+    }
 
-                SDL_BlitSurface(m_imageSurface, nullptr, tmpSurface, nullptr);
 
-                readingSurface = tmpSurface;
-            }
+    size_t ResourceManager::ReleaseIdleTextures(float lowPriority, uint32_t idleTicks)
+    {
+        DI_SAVE_CALLSTACK();
 
-            if (readingSurface->pitch % 4 != 0)
+        uint32_t now = SDL_GetTicks();
+        size_t released = 0;
+
+        auto& resourceHash = m_fields->resourceHash;
+        for (auto iter = resourceHash.begin(); iter != resourceHash.end(); ++iter)
+        {
+            ResourcePtrCR resource = (*iter).second;
+            size_t bytes = resource->GetGpuBytes();
+            if (bytes > 0 && resource->GetState() == Resource::State::Finished && resource->GetPriority() < lowPriority &&
+                now - resource->GetLastUsedTick() >= idleTicks)
             {
-                glPixelStorei(GL_PACK_ALIGNMENT, 1);
+                resource->ForceTimeout();
+                released += bytes;
             }
+        }
+
+        return released;
+    }
+
+
+    size_t ResourceManager::DropTopMipLevels()
+    {
+        DI_SAVE_CALLSTACK();
 
-            if (SDL_MUSTLOCK(readingSurface))
+        size_t estimated = 0;
+        auto& resourceHash = m_fields->resourceHash;
+        for (auto iter = resourceHash.begin(); iter != resourceHash.end(); ++iter)
+        {
+            ResourcePtrCR resource = (*iter).second;
+            if (resource->GetState() == Resource::State::Finished && resource->GetDroppedLevels() < resource->GetMaxDroppedLevels())
             {
-                SDL_UnlockSurface(readingSurface);
+                // the top level of a mip chain is about 3/4 of it
+                size_t bytes = resource->GetGpuBytes();
+                estimated += bytes / 4 * 3;
+                m_fields->pressureDrops.push_back(make_pair(resource, bytes));
+                ReloadResource(resource, resource->GetDroppedLevels() + 1);
             }
+        }
+
+        // the real bytes are logged by CheckPressureDrops()
+        return estimated;
+    }
+
 
-            glTexImage2D(GL_TEXTURE_2D, 0, glFormat, m_width, m_height, 0, glFormat, GL_UNSIGNED_BYTE, readingSurface->pixels);
+    // counts the bytes freed by DropTopMipLevels() as the smaller textures are uploaded. when the last one is, the memory
+    // governor keeps to what is left
+    void ResourceManager::CheckPressureDrops()
+    {
+        DI_SAVE_CALLSTACK();
 
-            if (SDL_MUSTLOCK(readingSurface))
+        Fields* f = m_fields.get();
+        auto& drops = f->pressureDrops;
+        for (auto iter = drops.begin(); iter != drops.end(); )
+        {
+            Resource::State state = iter->first->GetState();
+            if (state == Resource::State::Prepared || state == Resource::State::Loaded)
             {
-                SDL_UnlockSurface(readingSurface);
+                ++iter;
+                continue;
             }
 
-            if (readingSurface->pitch % 4 != 0)
+            size_t bytes = iter->first->GetGpuBytes();
+            if (bytes < iter->second)
             {
-                glPixelStorei(GL_PACK_ALIGNMENT, 4);
+                f->pressureFreedBytes += iter->second - bytes;
             }
 
-            SDL_FreeSurface(tmpSurface);
-            SDL_FreeSurface(m_imageSurface);
-            m_imageSurface = nullptr;
-            return true;
+            iter = drops.erase(iter);
         }
 
+        if (drops.empty())
+        {
+            size_t total = GetTextureMemory();
+            LogInfo("memory pressure: dropping top mip levels freed %u KB, %u KB of textures left",
+                unsigned(f->pressureFreedBytes / 1024), unsigned(total / 1024));
 
-        virtual void Timeout_InGlThread()
+            f->pressureFreedBytes = 0;
+            f->pressureCap = max(total, size_t(1));
+            f->pressureTick = SDL_GetTicks();
+        }
+    }
+
+
+    bool ResourceManager::RetainBytes(size_t bytes)
+    {
+        Fields* f = m_fields.get();
+        if (f->retainedBytes + bytes > f->retainBudget)
         {
-            glDeleteTextures(1, &m_glTexture);
-            m_glTexture = 0;
-            m_width = 0;
-            m_height = 0;
+            return false;
+        }
+
+        f->retainedBytes += bytes;
+        return true;
+    }
+
+
+    size_t ResourceManager::DropRetainedBytes()
+    {
+        DI_SAVE_CALLSTACK();
 
-            SDL_FreeSurface(m_imageSurface);
-            m_imageSurface = nullptr;
+        size_t dropped = 0;
+        auto& resourceHash = m_fields->resourceHash;
+        for (auto iter = resourceHash.begin(); iter != resourceHash.end(); ++iter)
+        {
+            dropped += (*iter).second->DropRetainedBytes();
         }
 
-        SDL_Surface* m_imageSurface;
-    };
+        return dropped;
+    }
 
 
-    class KTXTextureLoader : public BaseTextureLoader
+    bool ResourceManager::CheckContextLost()
     {
-    public:
-        KTXTextureLoader(const string& name) : BaseTextureLoader(name) {}
+        DI_SAVE_CALLSTACK();
 
-    private:
-        virtual bool Prepare_InGlThread()
+        Fields* f = m_fields.get();
+        if (f->contextProbe != 0 && glIsTexture(f->contextProbe))
         {
-            return true;
+            return false;
         }
 
+        // glIsTexture() is only true for names which have been bound
+        bool lost = f->contextProbe != 0;
+        glGenTextures(1, &f->contextProbe);
+        glBindTexture(GL_TEXTURE_2D, f->contextProbe);
 
-        virtual bool Load_InWorkThread()
+        if (!lost)
         {
-            DI_SAVE_CALLSTACK();
+            return false;
+        }
 
-            if (!m_bytes.empty())
-            {
-                LogWarn("load new KTX bytes while the old bytes is still exist. resource: '%s'", GetName().c_str());
-                m_bytes.clear();
-            }
+        GlDeletionQueue::Singleton().Forget();
 
-            SDL_RWops* rw = SDL_RWFromFile(GetName().c_str(), "rb");
-            if (!rw)
-            {
-                LogError("SDL_RWFromFile('%s') failed", GetName().c_str());
-                return false;
-            }
+        uint64_t startClock = HighClock_Get();
 
-            auto rwDeleter = MakeCallAtScopeExit([rw](){ SDL_RWclose(rw); });
+        vector<ResourcePtr> resources;
+        auto& resourceHash = f->resourceHash;
+        for (auto iter = resourceHash.begin(); iter != resourceHash.end(); ++iter)
+        {
+            resources.push_back((*iter).second);
+        }
+
+        stable_sort(resources.begin(), resources.end(), [](ResourcePtrCR a, ResourcePtrCR b) { return a->GetPriority() > b->GetPriority(); });
+
+        // the restorable ones go to GL thread first, in priority order
+        deque<ResourcePtr> restored;
+        int reloaded = 0;
+        for (auto iter = resources.begin(); iter != resources.end(); ++iter)
+        {
+            ResourcePtrCR resource = *iter;
+            bool finished = resource->GetState() == Resource::State::Finished;
+            resource->LoseContext();
 
-            m_bytes.resize(size_t(SDL_RWsize(rw)));
-            if (!m_bytes.empty())
+            if (finished && resource->GetState() == Resource::State::Loaded)
             {
-                if (SDL_RWread(rw, &m_bytes[0], m_bytes.size(), 1) != 1)
-                {
-                    vector<uint8_t>().swap(m_bytes);
-                    LogError("SDL_RWread('%s') failed", GetName().c_str());
-                    return false;
-                }
+                restored.push_back(resource);
             }
-            else
+            else if (finished && resource->GetState() == Resource::State::Timeout)
             {
-                LogError("KTX file '%s' is empty", GetName().c_str());
-                return false;
+                AsyncLoadResource(resource);
+                ++reloaded;
             }
+        }
 
+        ThreadLockGuard lock(f->lockToGL);
+        f->queueToGL.insert(f->queueToGL.begin(), restored.begin(), restored.end());
+        lock.Unlock();
+
+        LogInfo("GL context lost: %d resources restored from retained bytes, %d loaded again, cost %.3f ms",
+            int(restored.size()), reloaded, HighClock_ToSeconds(HighClock_Get() - startClock) * 1000.0);
+        return true;
+    }
+
+
+    void ResourceManager::LogTextureCacheStats()
+    {
+        uint32_t ramHits;
+        uint32_t diskReads;
+        FileByteCache::Singleton().GetStats(&ramHits, &diskReads);
+
+        uint32_t gpuHits = m_fields->gpuHits;
+        double total = max(double(gpuHits) + ramHits + diskReads, 1.0);
+        LogInfo("texture tiers: GPU %u hits (%.1f%%), RAM %u hits (%.1f%%), disk %u reads (%.1f%%), RAM tier holds %.1f KB (%.1f KB pinned by textures)",
+            gpuHits, gpuHits * 100.0 / total, ramHits, ramHits * 100.0 / total, diskReads, diskReads * 100.0 / total,
+            FileByteCache::Singleton().GetBytes() / 1024.0, FileByteCache::Singleton().GetPinnedBytes() / 1024.0);
+
+        uint32_t ringReads;
+        uint32_t threadReads;
+        uint32_t packRanges;
+        AsyncFileReader::Singleton().GetStats(&ringReads, &threadReads, &packRanges);
+        LogInfo("files read ahead: %u by io_uring, %u by threads, %u asset pack ranges", ringReads, threadReads, packRanges);
+    }
+
+
+    void ResourceManager::StartPrefetchManifest(const string& name)
+    {
+        DI_SAVE_CALLSTACK();
+
+        Fields* f = m_fields.get();
+        const string& directory = PrefPath_Get();
+        if (directory.empty() || !f->prefetchPath.empty())
+        {
+            return;
+        }
+
+        f->prefetchPath = directory + name;
+        f->prefetchStartTick = SDL_GetTicks();
+        LoadPrefetchManifest();
+        IssuePrefetches();
+    }
+
+
+    void ResourceManager::FinishPrefetchManifest()
+    {
+        DI_SAVE_CALLSTACK();
+
+        Fields* f = m_fields.get();
+        if (f->prefetchPath.empty())
+        {
+            return;
+        }
+
+        uint32_t ticks = SDL_GetTicks() - f->prefetchStartTick;
+        SavePrefetchManifest();
+
+        uint32_t hits = f->prefetchHitsReady + f->prefetchHitsLoading;
+        double total = max(double(hits) + f->prefetchMisses, 1.0);
+        LogInfo("prefetch '%s': %u hits (%.1f%%, %u ready, %u still loading), %u misses (%u the manifest has, not loaded ahead yet), "
+            "%u loaded ahead for nothing, %u not loaded ahead. interactive after %u ms, the recorded run after %u ms",
+            f->prefetchPath.c_str(), hits, hits * 100.0 / total, f->prefetchHitsReady, f->prefetchHitsLoading, f->prefetchMisses, f->prefetchLate,
+            unsigned(f->prefetched.size()), unsigned(f->prefetchReplay.size() - f->prefetchNext), ticks, f->prefetchRecordedTicks);
+
+        // they have never had a handle, they are released as if it were dropped now
+        uint32_t now = SDL_GetTicks();
+        for (auto iter = f->prefetched.begin(); iter != f->prefetched.end(); ++iter)
+        {
+            f->handles[iter->second.get()];
+            f->unreferenced[iter->second.get()] = now;
+        }
+        f->prefetched.clear();
+        f->prefetchReplay.clear();
+        f->prefetchRecord.clear();
+        f->prefetchRecordIndex.clear();
+        f->prefetchPath.clear();
+        f->prefetchNext = 0;
+        f->prefetchHitsReady = 0;
+        f->prefetchHitsLoading = 0;
+        f->prefetchMisses = 0;
+        f->prefetchLate = 0;
+    }
+
+
+    // a request of the app by GetResource(), 'created' if the resource did not exist
+    void ResourceManager::RecordPrefetchRequest(ResourcePtrCR resource, bool created)
+    {
+        Fields* f = m_fields.get();
+        string args;
+        if (!resource->GetPrefetchArgs(&args))
+        {
+            return;
+        }
+
+        const string& name = resource->GetName();
+        auto prefetched = f->prefetched.find(name);
+        if (prefetched != f->prefetched.end())
+        {
+            ++(resource->GetState() == Resource::State::Finished ? f->prefetchHitsReady : f->prefetchHitsLoading);
+            f->prefetched.erase(prefetched);
+        }
+        else if (created)
+        {
+            ++f->prefetchMisses;
+            for (size_t i = f->prefetchNext; i < f->prefetchReplay.size(); ++i)
+            {
+                if (f->prefetchReplay[i].name == name)
+                {
+                    ++f->prefetchLate;
+                    break;
+                }
+            }
+        }
+
+        if (f->prefetchRecordIndex.count(name) != 0)
+        {
+            return;
+        }
+
+        PrefetchEntry entry;
+        entry.name = name;
+        entry.priority = resource->GetPriority();
+        entry.args = args;
+        entry.ticks = SDL_GetTicks() - f->prefetchStartTick;
+        entry.bytes = 0;
+        f->prefetchRecordIndex[name] = f->prefetchRecord.size();
+        f->prefetchRecord.push_back(entry);
+    }
+
+
+    // the next resources of the manifest, a few at a time, so they load in the recorded order and what the app asks for
+    // meanwhile does not wait behind all of them. with a texture memory budget, the resources loaded ahead take at most
+    // half of it, by their recorded sizes
+    void ResourceManager::IssuePrefetches()
+    {
+        DI_SAVE_CALLSTACK();
+
+        const int MaxLoading = 8;
+
+        Fields* f = m_fields.get();
+        int loading = 0;
+        size_t aheadBytes = 0;
+        for (auto iter = f->prefetched.begin(); iter != f->prefetched.end(); ++iter)
+        {
+            Resource::State state = iter->second->GetState();
+            if (state == Resource::State::Prepared || state == Resource::State::Loaded)
+            {
+                ++loading;
+            }
+            aheadBytes += iter->second->GetGpuBytes();
+        }
+
+        while (loading < MaxLoading && f->prefetchNext < f->prefetchReplay.size())
+        {
+            const PrefetchEntry& entry = f->prefetchReplay[f->prefetchNext];
+            if (f->textureMemoryBudget != 0 && aheadBytes + entry.bytes > f->textureMemoryBudget / 2)
+            {
+                break;
+            }
+
+            ++f->prefetchNext;
+            if (f->resourceHash.count(entry.name) != 0)
+            {
+                continue;
+            }
+
+            // the resource GetResource<ImageAsTexture>() has made under the name, with the options it was made with (the policy
+            // may not be set yet at startup). its loader is chosen by the extension as for the app
+            TextureOptions options;
+            if (!TextureOptions::FromText(entry.args, &options))
+            {
+                LogWarn("prefetch '%s': bad texture options '%s'", entry.name.c_str(), entry.args.c_str());
+                continue;
+            }
+
+            ResourcePtr resource(new ImageAsTexture(entry.name, entry.priority, options));
+            f->resourceHash[entry.name] = resource;
+            f->prefetched[entry.name] = resource;
+            AsyncLoadResource(resource);
+            aheadBytes += entry.bytes;
+            ++loading;
+        }
+    }
+
+
+    // the manifest is "DiPrefetch <Version> <ticks of the run>", then a line of "<ticks> <priority> <GPU bytes> <args> <name>"
+    // for each resource in the order the app asked for them
+    void ResourceManager::LoadPrefetchManifest()
+    {
+        DI_SAVE_CALLSTACK();
+
+        const int Version = 2;
+
+        Fields* f = m_fields.get();
+        SDL_RWops* rw = SDL_RWFromFile(f->prefetchPath.c_str(), "rb");
+        if (!rw)
+        {
+            LogInfo("no prefetch manifest '%s' yet, this run records it", f->prefetchPath.c_str());
+            return;
+        }
+
+        string text(size_t(max(SDL_RWsize(rw), Sint64(0))), '\0');
+        bool read = text.empty() || SDL_RWread(rw, &text[0], text.size(), 1) == 1;
+        SDL_RWclose(rw);
+        if (!read)
+        {
+            LogWarn("read prefetch manifest '%s' failed", f->prefetchPath.c_str());
+            return;
+        }
+
+        int version = 0;
+        size_t lineStart = 0;
+        for (int line = 0; lineStart < text.size(); ++line)
+        {
+            size_t lineEnd = text.find('\n', lineStart);
+            if (lineEnd == string::npos)
+            {
+                lineEnd = text.size();
+            }
+
+            string lineText = text.substr(lineStart, lineEnd - lineStart);
+            lineStart = lineEnd + 1;
+
+            if (line == 0)
+            {
+                unsigned ticks = 0;
+                SDL_sscanf(lineText.c_str(), "DiPrefetch %d %u", &version, &ticks);
+                if (version != Version)
+                {
+                    LogInfo("prefetch manifest version %d is not %d, this run records it again", version, Version);
+                    return;
+                }
+
+                f->prefetchRecordedTicks = ticks;
+                continue;
+            }
+
+            // the name is the rest of the line after 4 fields, it may have spaces
+            size_t nameStart = 0;
+            for (int field = 0; field < 4 && nameStart != string::npos; ++field)
+            {
+                nameStart = lineText.find(' ', nameStart);
+                if (nameStart != string::npos)
+                {
+                    ++nameStart;
+                }
+            }
+
+            unsigned ticks;
+            float priority;
+            unsigned long long bytes;
+            if (SDL_sscanf(lineText.c_str(), "%u %f %llu", &ticks, &priority, &bytes) != 3 || nameStart == string::npos || nameStart >= lineText.size())
+            {
+                continue;
+            }
+
+            size_t argsStart = lineText.rfind(' ', nameStart - 2) + 1;
+
+            PrefetchEntry entry;
+            entry.name = lineText.substr(nameStart);
+            entry.priority = priority;
+            entry.args = lineText.substr(argsStart, nameStart - 1 - argsStart);
+            entry.ticks = ticks;
+            entry.bytes = size_t(bytes);
+            f->prefetchReplay.push_back(entry);
+        }
+
+        LogInfo("prefetch manifest '%s': %d resources", f->prefetchPath.c_str(), int(f->prefetchReplay.size()));
+    }
+
+
+    void ResourceManager::SavePrefetchManifest()
+    {
+        DI_SAVE_CALLSTACK();
+
+        const int Version = 2;
+
+        Fields* f = m_fields.get();
+        string text = String_Format("DiPrefetch %d %u\n", Version, unsigned(SDL_GetTicks() - f->prefetchStartTick));
+        for (auto iter = f->prefetchRecord.begin(); iter != f->prefetchRecord.end(); ++iter)
+        {
+            auto found = f->resourceHash.find(iter->name);
+            size_t bytes = found != f->resourceHash.end() ? found->second->GetGpuBytes() : iter->bytes;
+            text += String_Format("%u %g %llu %s %s\n", iter->ticks, iter->priority, (unsigned long long)bytes, iter->args.c_str(), iter->name.c_str());
+        }
+
+        File_WriteAtomically(f->prefetchPath, "prefetch manifest", [&text](SDL_RWops* rw) { return SDL_RWwrite(rw, text.data(), text.size(), 1) == 1; });
+    }
+
+
+    void ResourceManager::ReloadResource(ResourcePtrCR resource, int droppedLevels)
+    {
+        DI_SAVE_CALLSTACK();
+
+        LogInfo("memory governor: '%s' %s to %d dropped levels", resource->GetName().c_str(),
+            droppedLevels > resource->GetDroppedLevels() ? "drops" : "restores", droppedLevels);
+
+        resource->Reload(droppedLevels);
+
+        ThreadLockGuard lock(m_fields->lockToWorker);
+        m_fields->queueToWorker.push(resource);
+        m_fields->cvToWorker.Notify();
+    }
+
+
+    bool ResourceManager::ConsumeUploadBudget(size_t bytes)
+    {
+        Fields* f = m_fields.get();
+        if (f->uploadBudget != 0 && f->uploadedBytes != 0 && f->uploadedBytes + bytes > f->uploadBudget)
+        {
+            return false;
+        }
+
+        f->uploadedBytes += bytes;
+        return true;
+    }
+
+
+    void ResourceManager::CheckTimeoutResources()
+    {
+        DI_SAVE_CALLSTACK();
+
+        auto& resourceHash = m_fields->resourceHash;
+        for (auto iter = resourceHash.begin(); iter != resourceHash.end(); ++iter)
+        {
+            // unreferenced resources are released by ReleaseUnreferencedResources(), this is for the ones which are held but idle
+            ResourcePtrCR resource = (*iter).second;
+            resource->CheckTimeout();
+        }
+    }
+
+
+    ResourcePtr ResourceManager::HashFindResource(const string& name)
+    {
+        DI_SAVE_CALLSTACK();
+
+        auto& hash = m_fields->resourceHash;
+
+        auto iter = hash.find(name);
+        if (iter == hash.end())
+        {
+            return ResourcePtr();
+        }
+
+        ResourcePtrCR resource = (*iter).second;
+
+        Resource::State state = resource->GetState();
+        DI_ASSERT(state != Resource::State::Init);
+
+        if (!m_fields->prefetchPath.empty())
+        {
+            RecordPrefetchRequest(resource, false);
+        }
+
+        AsyncLoadResource(resource);
+        return MakeHandle(resource);
+    }
+
+
+    ResourcePtr ResourceManager::AddResource(ResourcePtrCR resource)
+    {
+        DI_SAVE_CALLSTACK();
+        DI_ASSERT(resource->GetState() == Resource::State::Init);
+
+        m_fields->resourceHash[resource->GetName()] = resource;
+
+        if (!m_fields->prefetchPath.empty())
+        {
+            RecordPrefetchRequest(resource, true);
+        }
+
+        AsyncLoadResource(resource);
+        return MakeHandle(resource);
+    }
+
+
+    // a handle shares the resource with the hash, its own count tells when the users have dropped it. all handles given out
+    // while one of them lives share that count
+    ResourcePtr ResourceManager::MakeHandle(ResourcePtrCR resource)
+    {
+        weak_ptr<Resource>& weak = m_fields->handles[resource.get()];
+        ResourcePtr handle = weak.lock();
+        if (!handle)
+        {
+            // aliases a count of its own, the resource is owned by the hash (and its shared_from_this() stays untouched)
+            shared_ptr<DroppedHandles> dropped = m_fields->droppedHandles;
+            Resource* r = resource.get();
+            shared_ptr<void> count(nullptr, [dropped, r](void*)
+            {
+                ThreadLockGuard lock(dropped->lock);
+                dropped->resources.push_back(make_pair(r, SDL_GetTicks()));
+            });
+            handle = ResourcePtr(count, r);
+            weak = handle;
+        }
+
+        return handle;
+    }
+
+
+    static void CreateGlTexture(GLuint* texture)
+    {
+        glGenTextures(1, texture);
+        glBindTexture(GL_TEXTURE_2D, *texture);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        DI_DBG_CHECK_GL_ERRORS();
+    }
+
+
+    // bytes passed to GL
+    static size_t GetImageBytes(const Image& image)
+    {
+        return size_t(image.pitch) * (image.glType == 0 ? (image.height + 3) / 4 : image.height);
+    }
+
+
+    // a source file of a texture: where it is in a mounted asset pack, otherwise read by FileByteCache into 'bytes'
+    // (unless they are already there), which the loader keeps to demote them. a compressed file in a pack is left
+    // compressed, unless 'inflate' asks for it in 'bytes' for the decoders. false if the file can not be read
+    static bool GetTextureFile(const string& name, bool optional, bool inflate, PixelBufferPtr* bytes, AssetView* file)
+    {
+        if (!*bytes && AssetPack_Find(name, file))
+        {
+            if (!inflate || file->codec == PackCodec_None)
+            {
+                return true;
+            }
+
+            // inflated by an earlier load, if it was demoted to the RAM tier
+            *bytes = FileByteCache::Singleton().Take(name);
+            if (!*bytes)
+            {
+                return AssetPack_Inflate(file, bytes);
+            }
+        }
+        else if (!*bytes)
+        {
+            *bytes = FileByteCache::Singleton().Read(name, optional);
+            if (!*bytes)
+            {
+                return false;
+            }
+        }
+
+        file->data = (*bytes)->GetData();
+        file->size = (*bytes)->GetSize();
+        file->rawSize = file->size;
+        file->codec = PackCodec_None;
+        return true;
+    }
+
+
+    static void DropFileBytes(PixelBufferPtr* bytes)
+    {
+        if (*bytes)
+        {
+            FileByteCache::Singleton().Unpin(*bytes);
+            bytes->reset();
+        }
+    }
+
+
+    // after the upload a texture keeps the file it was read from, to demote it to FileByteCache later, only if the file fits
+    // the budget of the cache. otherwise it is read again when the texture is loaded again
+    static void KeepFileBytes(PixelBufferPtr* bytes)
+    {
+        if (*bytes && !FileByteCache::Singleton().Pin(*bytes))
+        {
+            bytes->reset();
+        }
+    }
+
+
+    static void UploadImage(GLuint texture, const Image& image, GLint level)
+    {
+        glBindTexture(GL_TEXTURE_2D, texture);
+
+        if (image.glType == 0)
+        {
+            glCompressedTexImage2D(GL_TEXTURE_2D, level, image.glFormat, image.width, image.height, 0, GLsizei(GetImageBytes(image)), image.pixels->GetData());
+            DI_DBG_CHECK_GL_ERRORS();
+            return;
+        }
+
+        if (image.unpackAlignment != 4)
+        {
+            glPixelStorei(GL_UNPACK_ALIGNMENT, image.unpackAlignment);
+        }
+
+        glTexImage2D(GL_TEXTURE_2D, level, image.glFormat, image.width, image.height, 0, image.glFormat, image.glType, image.pixels->GetData());
+
+        if (image.unpackAlignment != 4)
+        {
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        }
+
+        DI_DBG_CHECK_GL_ERRORS();
+    }
+
+
+    class SDLTextureLoader : public BaseTextureLoader
+    {
+    public:
+        SDLTextureLoader(const string& name, const TextureOptions& options)
+            : BaseTextureLoader(name, options), m_etc1GlFormat(0), m_diskCache(false), m_preview(false), m_nextUpload(0), m_uploadSeconds(0), m_uploadTextures(), m_retainedBytes(0) {}
+
+        ~SDLTextureLoader()
+        {
+            DeleteGlTextures();
+            GlDeletionQueue::Singleton().DeleteTextures(MaxPlanes, m_uploadTextures);
+
+            // the budget goes with ResourceManager when it is destroyed
+            if (ResourceManager::HasSingleton())
+            {
+                DropRetainedBytes();
+            }
+
+            DropFileBytes(&m_fileBytes);
+        }
+
+
+        virtual size_t DropRetainedBytes()
+        {
+            size_t dropped = m_retainedBytes;
+            if (dropped > 0)
+            {
+                ResourceManager::Singleton().ReleaseRetainedBytes(dropped);
+                m_retained = ImagePlanes();
+                m_retainedBytes = 0;
+            }
+
+            return dropped;
+        }
+
+    private:
+        virtual bool Prepare_InGlThread()
+        {
+            DI_SAVE_CALLSTACK();
+
+            // GL queries are not allowed in worker thread
+            m_npotMipmaps = GpuTextureCaps_Get().npotMipmaps;
+            m_preview = GetOptions().previewSize > 0;
+
+            if (GetOptions().format == TextureOptions::Format_ETC1)
+            {
+                m_etc1GlFormat = Etc1_GetGlFormat();
+            }
+
+            m_diskCache = GetOptions().diskCache && TextureDiskCache::Singleton().Open();
+            return true;
+        }
+
+
+        // after the preview the file is already here, and it is not needed when its planes are in the disk cache
+        virtual void ListFiles_InWorkThread(vector<string>* names)
+        {
+            uint64_t sourceHash;
+            if (!m_fileBytes && !(m_diskCache && GetSourceStamp(&sourceHash) && TextureDiskCache::Singleton().Has(sourceHash, GetCacheKey())))
+            {
+                names->push_back(GetName());
+            }
+        }
+
+
+        // everything except glTexImage2D is done here, so that the GL thread only uploads pixels.
+        // the image is decoded straight into pooled buffers in their final GL format and row alignment.
+        // TextureProtocol's fields are not touched, the GL thread may be drawing the preview
+        virtual bool Load_InWorkThread()
+        {
+            DI_SAVE_CALLSTACK();
+
+            if (m_planes.count > 0)
+            {
+                LogWarn("load new image while the old image is still exist. resource: '%s'", GetName().c_str());
+                m_planes = ImagePlanes();
+            }
+
+            // planes made by an earlier run are read as they were uploaded, no preview is needed for them.
+            // a source with a stamp is looked up without reading it
+            uint64_t sourceHash = 0;
+            bool stamped = m_diskCache && GetSourceStamp(&sourceHash);
+            if (stamped && ReadDiskCache(sourceHash))
+            {
+                return true;
+            }
+
+            // from an asset pack, or from the RAM tier if the texture was demoted there. after the preview the file is already here
+            AssetView file;
+            if (!GetTextureFile(GetName(), false, true, &m_fileBytes, &file))
+            {
+                return false;
+            }
+
+            SDL_RWops* rw = SDL_RWFromConstMem(file.data, int(file.size));
+            if (!rw)
+            {
+                LogError("SDL_RWFromConstMem('%s') failed", GetName().c_str());
+                return false;
+            }
+
+            auto rwDeleter = MakeCallAtScopeExit([rw](){ SDL_RWclose(rw); });
+
+            // otherwise by the hash of its bytes
+            if (m_diskCache && !stamped)
+            {
+                sourceHash = TextureDiskCache::HashBytes(file.data, file.size);
+                if (ReadDiskCache(sourceHash))
+                {
+                    return true;
+                }
+            }
+
+            // the preview is decoded as it is, no mip levels, no conversion and no cache
+            if (m_preview)
+            {
+                ImageDecodeHint hint;
+                hint.maxSize = GetOptions().previewSize;
+                if (!Image_Decode(rw, GetName(), &m_planes.planes[0], hint))
+                {
+                    return false;
+                }
+
+                SetSinglePlane();
+                return true;
+            }
+
+            if (GetOptions().format == TextureOptions::Format_YUV)
+            {
+                if (!Image_DecodeYUV(rw, GetName(), &m_planes, GetDecodeHint()))
+                {
+                    return false;
+                }
+
+                // Y, U, V are not colors, each plane is filtered as it is
+                bool yuv = m_planes.format == YUV || m_planes.format == YUV_VideoRange;
+                for (int i = 0; i < m_planes.count; ++i)
+                {
+                    if (WantMipmaps(m_planes.planes[i]) && !GenerateMipmaps(m_planes.planes[i], !yuv && GetOptions().gammaCorrect, &m_planes.mips[i]))
+                    {
+                        m_planes = ImagePlanes();
+                        return false;
+                    }
+                }
+            }
+            else if (GetOptions().format == TextureOptions::Format_Palette256)
+            {
+                Image decoded;
+                if (!Image_Decode(rw, GetName(), &decoded, GetDecodeHint()))
+                {
+                    return false;
+                }
+
+                if (!QuantizeToPalette(decoded))
+                {
+                    return false;
+                }
+            }
+            else if (GetOptions().format == TextureOptions::Format_ETC1 && m_etc1GlFormat != 0)
+            {
+                if (!LoadETC1(rw))
+                {
+                    m_planes = ImagePlanes();
+                    return false;
+                }
+            }
+            else
+            {
+                if (!Image_Decode(rw, GetName(), &m_planes.planes[0], GetDecodeHint()))
+                {
+                    return false;
+                }
+
+                // filtered before the 16 bit conversion, which then dithers each level
+                if (WantMipmaps(m_planes.planes[0]) && !GenerateMipmaps(m_planes.planes[0], GetOptions().gammaCorrect, &m_planes.mips[0]))
+                {
+                    m_planes = ImagePlanes();
+                    return false;
+                }
+
+                if (!ConvertToOptionsFormat(&m_planes.planes[0], &m_planes.mips[0]))
+                {
+                    m_planes = ImagePlanes();
+                    return false;
+                }
+
+                SetSinglePlane();
+            }
+
+            if (m_diskCache)
+            {
+                TextureDiskCache::Singleton().Write(sourceHash, GetCacheKey(), m_planes);
+            }
+
+            return true;
+        }
+
+
+        // tells the source file apart for TextureDiskCache without reading it: by the CRC of its asset pack entry,
+        // or by the size and modification time of a loose file. false if it has neither (e.g. a file in the APK)
+        bool GetSourceStamp(uint64_t* sourceHash)
+        {
+            AssetView view;
+            uint64_t size;
+            uint64_t modified;
+            string stamp;
+            if (AssetPack_Find(GetName(), &view))
+            {
+                stamp = String_Format("pack %s %08x %llu", GetName().c_str(), unsigned(view.crc), (unsigned long long)view.rawSize);
+            }
+            else if (File_GetStamp(GetName(), &size, &modified))
+            {
+                stamp = String_Format("file %s %llu %llu", GetName().c_str(), (unsigned long long)size, (unsigned long long)modified);
+            }
+            else
+            {
+                return false;
+            }
+
+            *sourceHash = TextureDiskCache::HashBytes((const uint8_t*)stamp.data(), stamp.size());
+            return true;
+        }
+
+
+        bool ReadDiskCache(uint64_t sourceHash)
+        {
+            uint64_t startClock = HighClock_Get();
+            if (!TextureDiskCache::Singleton().Read(sourceHash, GetCacheKey(), &m_planes))
+            {
+                return false;
+            }
+
+            LogInfo("texture '%s' read from texture cache, cost %.3f ms", GetName().c_str(), HighClock_ToSeconds(HighClock_Get() - startClock) * 1000.0);
+            m_preview = false;
+            return true;
+        }
+
+
+        // everything except the source file which changes the planes, see TextureDiskCache
+        string GetCacheKey()
+        {
+            const TextureOptions& options = GetOptions();
+            char key[128];
+            SDL_snprintf(key, sizeof(key), "f%d d%d q%d m%d g%d s%d_%d etc1_%x npot%d", int(options.format), int(options.dither), int(options.quality),
+                int(options.mipmaps), int(options.gammaCorrect), options.maxSize, int(options.scale * 1000 + 0.5f), m_etc1GlFormat, int(m_npotMipmaps));
+            return key;
+        }
+
+
+        ImageDecodeHint GetDecodeHint()
+        {
+            ImageDecodeHint hint;
+            hint.maxSize = GetOptions().maxSize;
+            hint.scale = GetOptions().scale;
+            return hint;
+        }
+
+
+        bool WantMipmaps(const Image& image)
+        {
+            if (GetOptions().mipmaps == TextureOptions::Mip_None)
+            {
+                return false;
+            }
+
+            bool pot = (image.width & (image.width - 1)) == 0 && (image.height & (image.height - 1)) == 0;
+            if (!pot && !m_npotMipmaps)
+            {
+                LogWarn("texture '%s' is %dx%d, the GPU has no mip levels for sizes which are not a power of 2", GetName().c_str(), image.width, image.height);
+                return false;
+            }
+
+            return true;
+        }
+
+
+        bool GenerateMipmaps(const Image& image, bool gammaCorrect, vector<Image>* mips)
+        {
+            uint64_t startClock = HighClock_Get();
+
+            if (!Image_GenerateMipmaps(image, GetOptions().mipmaps, gammaCorrect, mips))
+            {
+                LogError("generate mip levels of texture '%s' failed", GetName().c_str());
+                return false;
+            }
+
+            LogInfo("texture '%s' %dx%d: %d mip levels generated, cost %.3f ms", GetName().c_str(), image.width, image.height, int(mips->size()), HighClock_ToSeconds(HighClock_Get() - startClock) * 1000.0);
+            return true;
+        }
+
+
+        void SetSinglePlane()
+        {
+            m_planes.format = m_planes.planes[0].format;
+            m_planes.width = m_planes.planes[0].width;
+            m_planes.height = m_planes.planes[0].height;
+            m_planes.count = 1;
+        }
+
+
+        bool QuantizeToPalette(const Image& decoded)
+        {
+            // Gray_8 / Alpha_8 are already 1 byte per pixel, and exact
+            if (decoded.format != RGBA_8888 && decoded.format != RGB_888)
+            {
+                m_planes.planes[0] = decoded;
+                SetSinglePlane();
+                return true;
+            }
+
+            uint64_t startClock = HighClock_Get();
+
+            double psnr;
+            if (!Image_QuantizeToPalette(decoded, &m_planes, &psnr))
+            {
+                LogError("quantize texture '%s' to palette failed", GetName().c_str());
+                return false;
+            }
+
+            LogInfo("texture '%s' quantized to palette, PSNR %.2f dB, cost %.3f ms", GetName().c_str(), psnr, HighClock_ToSeconds(HighClock_Get() - startClock) * 1000.0);
+            return true;
+        }
+
+
+        // decode and encode. translucent images get a second ETC1 plane of their alpha,
+        // Gray_8 / Alpha_8 images stay as decoded
+        bool LoadETC1(SDL_RWops* rw)
+        {
+            Image decoded;
+            if (!Image_Decode(rw, GetName(), &decoded, GetDecodeHint()))
+            {
+                return false;
+            }
+
+            vector<Image> decodedMips;
+            if (WantMipmaps(decoded) && !GenerateMipmaps(decoded, GetOptions().gammaCorrect, &decodedMips))
+            {
+                return false;
+            }
+
+            if (decoded.format != RGBA_8888 && decoded.format != RGB_888)
+            {
+                m_planes.planes[0] = decoded;
+                m_planes.mips[0].swap(decodedMips);
+                SetSinglePlane();
+                return true;
+            }
+
+            bool hasAlpha = !Etc1_CanEncode(decoded);
+
+            uint64_t startClock = HighClock_Get();
+
+            m_planes.mips[0].resize(decodedMips.size());
+            m_planes.mips[1].resize(hasAlpha ? decodedMips.size() : 0);
+            for (size_t level = 0; level <= decodedMips.size(); ++level)
+            {
+                const Image& src = level == 0 ? decoded : decodedMips[level - 1];
+                Image* color = level == 0 ? &m_planes.planes[0] : &m_planes.mips[0][level - 1];
+                Image* alpha = level == 0 ? &m_planes.planes[1] : hasAlpha ? &m_planes.mips[1][level - 1] : nullptr;
+
+                if (!Etc1_Encode(src, GetOptions().quality, m_etc1GlFormat, color) ||
+                    (hasAlpha && !Etc1_EncodeAlpha(src, GetOptions().quality, m_etc1GlFormat, alpha)))
+                {
+                    LogError("encode texture '%s' to ETC1 failed", GetName().c_str());
+                    return false;
+                }
+            }
+
+            LogInfo("texture '%s' encoded to ETC1%s, quality %d, %d mip levels, cost %.3f ms", GetName().c_str(), hasAlpha ? " with alpha" : "", int(GetOptions().quality),
+                int(decodedMips.size()), HighClock_ToSeconds(HighClock_Get() - startClock) * 1000.0);
+#ifdef _DEBUG
+            LogInfo("texture '%s' ETC1 PSNR %.2f dB", GetName().c_str(), Etc1_ComputePSNR(decoded, m_planes.planes[0]));
+#endif
+
+            SetETC1Planes(hasAlpha);
+            return true;
+        }
+
+
+        void SetETC1Planes(bool hasAlpha)
+        {
+            SetSinglePlane();
+            if (hasAlpha)
+            {
+                m_planes.format = ETC1_RGB_Alpha;
+                m_planes.count = 2;
+            }
+        }
+
+
+        // RGB_565 / RGBA_4444 / RGBA_5551 asked by the options, converted here in worker thread.
+        // the mip levels get the format chosen for the image
+        bool ConvertToOptionsFormat(Image* image, vector<Image>* mips)
+        {
+            // Gray_8 / Alpha_8 are already smaller than any 16 bit format
+            if (image->format != RGBA_8888 && image->format != RGB_888)
+            {
+                return true;
+            }
+
+            InnerFormat format;
+            switch (GetOptions().format)
+            {
+            case TextureOptions::Format_16Bit:      format = Image_Choose16BitFormat(*image); break;
+            case TextureOptions::Format_RGB_565:    format = RGB_565; break;
+            case TextureOptions::Format_RGBA_4444:  format = RGBA_4444; break;
+            case TextureOptions::Format_RGBA_5551:  format = RGBA_5551; break;
+            default:                                return true;
+            }
+
+            uint64_t startClock = HighClock_Get();
+
+            for (size_t level = 0; level <= mips->size(); ++level)
+            {
+                Image* src = level == 0 ? image : &(*mips)[level - 1];
+
+                Image converted;
+                if (!Image_ConvertTo16Bit(*src, format, GetOptions().dither, &converted))
+                {
+                    LogError("convert texture '%s' to format %d failed", GetName().c_str(), int(format));
+                    return false;
+                }
+
+                *src = converted;
+            }
+
+            LogInfo("texture '%s' converted to format %d, cost %.3f ms", GetName().c_str(), int(format), HighClock_ToSeconds(HighClock_Get() - startClock) * 1000.0);
+            return true;
+        }
+
+
+        // every plane and every mip level is a separate upload, as many as the upload budget of this frame allows.
+        // the rest is uploaded by the next calls. the planes go to new GL textures which replace the old ones (the preview)
+        // when everything is uploaded, so a texture being drawn is never half uploaded
+        virtual bool Finish_InGlThread()
+        {
+            DI_SAVE_CALLSTACK();
+
+            DI_ASSERT(m_planes.count > 0);
+
+            uint64_t startClock = HighClock_Get();
+
+            m_finishPending = false;
+            m_loadAgain = false;
+
+            int item = 0;
+            for (int i = 0; i < m_planes.count && !m_finishPending; ++i)
+            {
+                GLuint& texture = m_uploadTextures[i];
+                for (int level = 0; level <= int(m_planes.mips[i].size()); ++level, ++item)
+                {
+                    if (item < m_nextUpload)
+                    {
+                        continue;
+                    }
+
+                    const Image& image = level == 0 ? m_planes.planes[i] : m_planes.mips[i][level - 1];
+                    if (!ResourceManager::Singleton().ConsumeUploadBudget(GetImageBytes(image)))
+                    {
+                        m_finishPending = true;
+                        break;
+                    }
+
+                    if (texture == 0)
+                    {
+                        CreateGlTexture(&texture);
+                    }
+
+                    UploadImage(texture, image, level);
+                    m_nextUpload = item + 1;
+                }
+            }
+
+            m_uploadSeconds += HighClock_ToSeconds(HighClock_Get() - startClock);
+            if (m_finishPending)
+            {
+                return true;
+            }
+
+            // indices can not be interpolated, and the palette is looked up by texel centers
+            for (int i = 0; i < m_planes.count; ++i)
+            {
+                GLenum minFilter = m_planes.format == RGBA_8888_Palette_256 ? GL_NEAREST : m_planes.mips[i].empty() ? GL_LINEAR : GL_LINEAR_MIPMAP_LINEAR;
+                GLenum magFilter = m_planes.format == RGBA_8888_Palette_256 ? GL_NEAREST : GL_LINEAR;
+
+                glBindTexture(GL_TEXTURE_2D, m_uploadTextures[i]);
+                glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GLfloat(minFilter));
+                glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GLfloat(magFilter));
+            }
+
+            DeleteGlTextures();
+            m_glTexture = m_uploadTextures[0];
+            memcpy(m_glSubTextures, m_uploadTextures + 1, sizeof(m_glSubTextures));
+            memset(m_uploadTextures, 0, sizeof(m_uploadTextures));
+
+            m_width = m_planes.width;
+            m_height = m_planes.height;
+            m_innerFormat = m_planes.format;
+
+            m_gpuBytes = 0;
+            for (int i = 0; i < m_planes.count; ++i)
+            {
+                m_gpuBytes += GetImageBytes(m_planes.planes[i]);
+                for (size_t level = 0; level < m_planes.mips[i].size(); ++level)
+                {
+                    m_gpuBytes += GetImageBytes(m_planes.mips[i][level]);
+                }
+            }
+
+            PerformanceProfileData::Singleton().Add("SDLTextureLoader_Upload", m_uploadSeconds);
+            LogInfo("texture '%s'%s (%dx%d, %d planes, %d uploads) uploaded, GL thread cost %.3f ms", GetName().c_str(), m_preview ? " preview" : "",
+                m_width, m_height, m_planes.count, m_nextUpload, m_uploadSeconds * 1000.0);
+
+            // the pixel buffers are kept for a context loss if they fit, otherwise they go back to PixelBufferPool
+            DropRetainedBytes();
+            if (!m_preview && ResourceManager::Singleton().RetainBytes(m_gpuBytes))
+            {
+                m_retained = m_planes;
+                m_retainedBytes = m_gpuBytes;
+            }
+
+            m_planes = ImagePlanes();
+            m_nextUpload = 0;
+            m_uploadSeconds = 0;
+
+            if (m_preview)
+            {
+                m_preview = false;
+                m_loadAgain = true;
+            }
+            else
+            {
+                KeepFileBytes(&m_fileBytes);
+            }
+
+            return true;
+        }
+
+
+        virtual void Timeout_InGlThread()
+        {
+            DeleteGlTextures();
+            m_width = 0;
+            m_height = 0;
+            m_gpuBytes = 0;
+
+            GlDeletionQueue::Singleton().DeleteTextures(MaxPlanes, m_uploadTextures);
+            memset(m_uploadTextures, 0, sizeof(m_uploadTextures));
+
+            m_planes = ImagePlanes();
+            m_nextUpload = 0;
+            m_uploadSeconds = 0;
+            DropRetainedBytes();
+            DemoteFileBytes();
+        }
+
+
+        void DemoteFileBytes()
+        {
+            if (m_fileBytes)
+            {
+                FileByteCache::Singleton().Demote(GetName(), m_fileBytes);
+                m_fileBytes.reset();
+            }
+        }
+
+
+        virtual bool LoseContext_InGlThread(bool finished)
+        {
+            m_glTexture = 0;
+            memset(m_glSubTextures, 0, sizeof(m_glSubTextures));
+            memset(m_uploadTextures, 0, sizeof(m_uploadTextures));
+            m_nextUpload = 0;
+            m_uploadSeconds = 0;
+            m_gpuBytes = 0;
+
+            if (!finished || m_retainedBytes == 0)
+            {
+                return false;
+            }
+
+            // Finish_InGlThread() keeps them again
+            m_planes = m_retained;
+            DropRetainedBytes();
+            return true;
+        }
+
+
+        void DeleteGlTextures()
+        {
+            GlDeletionQueue::Singleton().DeleteTextures(1, &m_glTexture);
+            GlDeletionQueue::Singleton().DeleteTextures(MaxSubTextures, m_glSubTextures);
+            m_glTexture = 0;
+            memset(m_glSubTextures, 0, sizeof(m_glSubTextures));
+        }
+
+        ImagePlanes m_planes;
+        GLenum m_etc1GlFormat;      // 0 if ETC1 is not asked or not supported
+        bool m_diskCache;           // the planes are kept in TextureDiskCache
+        bool m_preview;             // the next Load_InWorkThread() / Finish_InGlThread() is the preview
+        int m_nextUpload;           // planes and their levels already uploaded by Finish_InGlThread()
+        double m_uploadSeconds;
+
+        enum { MaxPlanes = ImagePlanes::MaxPlanes };
+        GLuint m_uploadTextures[MaxPlanes];     // become m_glTexture and m_glSubTextures when all uploads are done
+
+        ImagePlanes m_retained;     // the uploaded planes, kept for a context loss, see ResourceManager::SetRetainBudget
+        size_t m_retainedBytes;
+        PixelBufferPtr m_fileBytes; // the file, demoted to FileByteCache when the texture leaves the GPU. null for files in asset packs
+    };
+
+
+    // A KTX file. ETC1 has no alpha, so an ETC1 file may bring its alpha along:
+    // - "name_alpha.ktx" next to "name.ktx" is loaded as sub texture 0, the format is ETC1_RGB_Alpha
+    // - a file with the key "DiAlphaLayout" = "stacked" has the alpha in its bottom half, the format is ETC1_RGB_AlphaStacked
+    class KTXTextureLoader : public BaseTextureLoader
+    {
+    public:
+        KTXTextureLoader(const string& name, const TextureOptions& options) : BaseTextureLoader(name, options), m_preview(false), m_levels(0), m_retainedCount(0) {}
+
+        ~KTXTextureLoader()
+        {
+            if (ResourceManager::HasSingleton())
+            {
+                DropRetainedBytes();
+            }
+
+            DropFileBytes(&m_fileBytes);
+            DropFileBytes(&m_alphaFileBytes);
+        }
+
+        // the smallest level is always kept
+        virtual int GetMaxDroppedLevels() const { return max(m_levels - 1, 0); }
+
+
+        virtual size_t DropRetainedBytes()
+        {
+            size_t dropped = m_retainedCount;
+            if (dropped > 0)
+            {
+                ResourceManager::Singleton().ReleaseRetainedBytes(dropped);
+                vector<uint8_t>().swap(m_retainedBytes);
+                vector<uint8_t>().swap(m_retainedAlphaBytes);
+                m_retainedCount = 0;
+            }
+
+            return dropped;
+        }
+
+    private:
+        virtual bool Prepare_InGlThread()
+        {
+            // GL queries are not allowed in worker thread
+            m_npotMipmaps = GpuTextureCaps_Get().npotMipmaps;
+            m_preview = GetOptions().previewSize > 0;
+            return true;
+        }
+
+
+        virtual void PrepareLike_InWorkThread(const BaseTextureLoader& prepared)
+        {
+            BaseTextureLoader::PrepareLike_InWorkThread(prepared);
+            m_preview = GetOptions().previewSize > 0;
+        }
+
+
+        // the alpha file is only looked for beside an ETC1 file. a file stored in an asset pack tells it here,
+        // others when they are read by Load_InWorkThread()
+        virtual void ListFiles_InWorkThread(vector<string>* names)
+        {
+            if (m_bytes.empty())
+            {
+                names->push_back(GetName());
+
+                AssetView file;
+                if (AssetPack_Find(GetName(), &file) && file.codec == PackCodec_None && IsEtc1(file.data, file.size))
+                {
+                    names->push_back(GetAlphaName());
+                }
+            }
+        }
+
+
+        virtual bool Load_InWorkThread()
+        {
+            DI_SAVE_CALLSTACK();
+
+            // after the preview, the files are already here. the files come from an asset pack,
+            // or from the RAM tier if the texture was demoted there
+            if (m_bytes.empty())
+            {
+                AssetView file;
+                if (!GetTextureFile(GetName(), false, false, &m_fileBytes, &file))
+                {
+                    return false;
+                }
+
+                if (file.rawSize == 0)
+                {
+                    LogError("KTX file '%s' is empty", GetName().c_str());
+                    return false;
+                }
+
+                // a compressed file is decompressed straight into the bytes which are uploaded
+                m_bytes.resize(file.rawSize);
+                if (!AssetPack_Read(file, &m_bytes[0]))
+                {
+                    vector<uint8_t>().swap(m_bytes);
+                    return false;
+                }
+                GenerateMipmaps(GetName(), &m_bytes);
+
+                // the alpha file is optional, ETC1 has no alpha of its own
+                AssetView alphaFile;
+                if (IsEtc1(&m_bytes[0], m_bytes.size()) && GetTextureFile(GetAlphaName(), true, false, &m_alphaFileBytes, &alphaFile) && alphaFile.rawSize > 0)
+                {
+                    m_alphaBytes.resize(alphaFile.rawSize);
+                    if (!AssetPack_Read(alphaFile, &m_alphaBytes[0]))
+                    {
+                        vector<uint8_t>().swap(m_alphaBytes);
+                        vector<uint8_t>().swap(m_bytes);
+                        return false;
+                    }
+                    GenerateMipmaps(GetAlphaName(), &m_alphaBytes);
+                }
+
+                m_levels = GetLevelCount(m_bytes);
+                if (!m_alphaBytes.empty())
+                {
+                    m_levels = min(m_levels, GetLevelCount(m_alphaBytes));
+                }
+
+                if (m_preview)
+                {
+                    m_preview = MakePreview(m_bytes, GetOptions().previewSize, &m_previewBytes) &&
+                                (m_alphaBytes.empty() || MakePreview(m_alphaBytes, GetOptions().previewSize, &m_previewAlphaBytes));
+                    if (!m_preview)
+                    {
+                        vector<uint8_t>().swap(m_previewBytes);
+                        vector<uint8_t>().swap(m_previewAlphaBytes);
+                    }
+                }
+            }
+
+            // the memory governor asks for the smaller levels only
+            int first = min(m_droppedLevels, m_levels - 1);
+            if (!m_preview && first > 0)
+            {
+                vector<uint8_t> dropped;
+                vector<uint8_t> droppedAlpha;
+                if (DropTopLevels(m_bytes, first, &dropped) && (m_alphaBytes.empty() || DropTopLevels(m_alphaBytes, first, &droppedAlpha)))
+                {
+                    m_bytes.swap(dropped);
+                    m_alphaBytes.swap(droppedAlpha);
+                }
+            }
+
+            return true;
+        }
+
+
+        static bool IsEtc1(const uint8_t* bytes, size_t size)
+        {
+            uint32_t header[KtxHeaderFields];
+            if (size < KtxIdentifierSize + sizeof(header))
+            {
+                return false;
+            }
+
+            memcpy(header, bytes + KtxIdentifierSize, sizeof(header));
+            return header[KtxEndianness] == KtxEndiannessValue && header[KtxGlInternalFormat] == GL_ETC1_RGB8_OES;
+        }
+
+
+        // number of mip levels of a 2D KTX file, 0 if it is not one
+        static int GetLevelCount(const vector<uint8_t>& bytes)
+        {
+            size_t headerSize = KtxIdentifierSize + KtxHeaderFields * sizeof(uint32_t);
+            if (bytes.size() < headerSize)
+            {
+                return 0;
+            }
+
+            uint32_t header[KtxHeaderFields];
+            memcpy(header, &bytes[KtxIdentifierSize], sizeof(header));
+
+            if (header[KtxEndianness] != KtxEndiannessValue || header[KtxPixelDepth] != 0 || header[KtxNumberOfArrayElements] != 0 || header[KtxNumberOfFaces] != 1)
+            {
+                return 0;
+            }
+
+            return int(header[KtxNumberOfMipmapLevels]);
+        }
+
+
+        // the preview is a KTX file of the smaller levels only, from the first level which is at most 'maxSize'.
+        // false if there is no such level below level 0
+        static bool MakePreview(const vector<uint8_t>& bytes, int maxSize, vector<uint8_t>* preview)
+        {
+            int levels = GetLevelCount(bytes);
+            if (levels < 2)
+            {
+                return false;
+            }
+
+            uint32_t header[KtxHeaderFields];
+            memcpy(header, &bytes[KtxIdentifierSize], sizeof(header));
+
+            int width = int(header[KtxPixelWidth]);
+            int height = int(max(header[KtxPixelHeight], 1u));
+
+            int first = 1;
+            while (first < levels && max(width >> first, height >> first) > maxSize)
+            {
+                ++first;
+            }
+
+            return first < levels && DropTopLevels(bytes, first, preview);
+        }
+
+
+        // a KTX file of the levels from 'first' of a 2D KTX file (see GetLevelCount), 'first' is its level 0
+        static bool DropTopLevels(const vector<uint8_t>& bytes, int first, vector<uint8_t>* dropped)
+        {
+            int levels = GetLevelCount(bytes);
+            if (first < 1 || first >= levels)
+            {
+                return false;
+            }
+
+            size_t headerSize = KtxIdentifierSize + KtxHeaderFields * sizeof(uint32_t);
+            uint32_t header[KtxHeaderFields];
+            memcpy(header, &bytes[KtxIdentifierSize], sizeof(header));
+
+            int width = int(header[KtxPixelWidth]);
+            int height = int(max(header[KtxPixelHeight], 1u));
+
+            // each level is its size, its data, and padding to 4 bytes
+            size_t offset = headerSize + header[KtxBytesOfKeyValueData];
+            for (int level = 0; level < first; ++level)
+            {
+                uint32_t imageSize;
+                if (offset + sizeof(imageSize) > bytes.size())
+                {
+                    return false;
+                }
+
+                memcpy(&imageSize, &bytes[offset], sizeof(imageSize));
+                offset += sizeof(imageSize) + ((imageSize + 3) & ~3u);
+            }
+
+            if (offset >= bytes.size())
+            {
+                return false;
+            }
+
+            size_t keyValueEnd = headerSize + header[KtxBytesOfKeyValueData];
+            dropped->resize(keyValueEnd + (bytes.size() - offset));
+            memcpy(&(*dropped)[0], &bytes[0], keyValueEnd);
+            memcpy(&(*dropped)[keyValueEnd], &bytes[offset], bytes.size() - offset);
+
+            header[KtxPixelWidth] = uint32_t(max(width >> first, 1));
+            if (header[KtxPixelHeight] != 0)
+            {
+                header[KtxPixelHeight] = uint32_t(max(height >> first, 1));
+            }
+            header[KtxNumberOfMipmapLevels] = uint32_t(levels - first);
+            memcpy(&(*dropped)[KtxIdentifierSize], header, sizeof(header));
             return true;
         }
 
 
+        // A KTX file whose numberOfMipmapLevels is 0 asks the loader to generate the levels, which libktx does by glGenerateMipmap
+        // in GL thread. for uncompressed 8 bit 2D files the levels are generated here by Image_GenerateMipmaps instead,
+        // and 'bytes' becomes a KTX file with all levels. other files are left to libktx
+        void GenerateMipmaps(const string& name, vector<uint8_t>* bytes)
+        {
+            DI_SAVE_CALLSTACK();
+
+            size_t headerSize = KtxIdentifierSize + KtxHeaderFields * sizeof(uint32_t);
+            if (bytes->size() < headerSize)
+            {
+                return;     // libktx reports the error
+            }
+
+            uint32_t header[KtxHeaderFields];
+            memcpy(header, &(*bytes)[KtxIdentifierSize], sizeof(header));
+
+            if (header[KtxEndianness] != KtxEndiannessValue || header[KtxNumberOfMipmapLevels] != 0 || header[KtxGlType] != GL_UNSIGNED_BYTE ||
+                header[KtxPixelDepth] != 0 || header[KtxNumberOfArrayElements] != 0 || header[KtxNumberOfFaces] != 1 || header[KtxPixelHeight] == 0)
+            {
+                return;
+            }
+
+            InnerFormat format;
+            switch (header[KtxGlFormat])
+            {
+            case GL_RGBA:       format = RGBA_8888; break;
+            case GL_RGB:        format = RGB_888; break;
+            case GL_LUMINANCE:  format = Gray_8; break;
+            case GL_ALPHA:      format = Alpha_8; break;
+            default:            return;
+            }
+
+            // the levels of a texture whose size is not a power of 2 are of no use then, the file is left as it is
+            uint32_t width = header[KtxPixelWidth];
+            uint32_t height = header[KtxPixelHeight];
+            if (((width & (width - 1)) != 0 || (height & (height - 1)) != 0) && !m_npotMipmaps)
+            {
+                LogWarn("texture '%s' is %ux%u, the GPU has no mip levels for sizes which are not a power of 2", name.c_str(), unsigned(width), unsigned(height));
+                return;
+            }
+
+            // the rows of KTX levels are 4 bytes aligned, as Image_Allocate does
+            Image image;
+            size_t dataOffset = headerSize + header[KtxBytesOfKeyValueData];
+            if (!Image_Allocate(&image, format, int(header[KtxPixelWidth]), int(header[KtxPixelHeight])) ||
+                dataOffset + sizeof(uint32_t) + GetImageBytes(image) > bytes->size())
+            {
+                return;
+            }
+
+            memcpy(image.pixels->GetData(), &(*bytes)[dataOffset + sizeof(uint32_t)], GetImageBytes(image));
+
+            uint64_t startClock = HighClock_Get();
+
+            TextureOptions::MipFilter filter = GetOptions().mipmaps != TextureOptions::Mip_None ? GetOptions().mipmaps : TextureOptions::Mip_Box;
+            vector<Image> mips;
+            if (!Image_GenerateMipmaps(image, filter, GetOptions().gammaCorrect, &mips))
+            {
+                return;
+            }
+
+            size_t size = dataOffset;
+            for (size_t level = 0; level <= mips.size(); ++level)
+            {
+                size += sizeof(uint32_t) + GetImageBytes(level == 0 ? image : mips[level - 1]);
+            }
+
+            vector<uint8_t> rebuilt(size);
+            memcpy(&rebuilt[0], &(*bytes)[0], dataOffset);
+
+            header[KtxNumberOfMipmapLevels] = uint32_t(1 + mips.size());
+            memcpy(&rebuilt[KtxIdentifierSize], header, sizeof(header));
+
+            uint8_t* p = &rebuilt[dataOffset];
+            for (size_t level = 0; level <= mips.size(); ++level)
+            {
+                const Image& levelImage = level == 0 ? image : mips[level - 1];
+                uint32_t imageSize = uint32_t(GetImageBytes(levelImage));
+                memcpy(p, &imageSize, sizeof(imageSize));
+                memcpy(p + sizeof(imageSize), levelImage.pixels->GetData(), imageSize);
+                p += sizeof(imageSize) + imageSize;
+            }
+
+            bytes->swap(rebuilt);
+            LogInfo("KTX '%s' %dx%d: %d mip levels generated, cost %.3f ms", name.c_str(), image.width, image.height, int(mips.size()), HighClock_ToSeconds(HighClock_Get() - startClock) * 1000.0);
+        }
+
+
+        // "name.ktx" => "name_alpha.ktx"
+        string GetAlphaName()
+        {
+            const string& name = GetName();
+            size_t pos = name.find_last_of('.');
+            return pos != string::npos ? name.substr(0, pos) + "_alpha" + name.substr(pos) : name + "_alpha";
+        }
+
+
         virtual bool Finish_InGlThread()
         {
             DI_SAVE_CALLSTACK();
 
             DI_ASSERT(!m_bytes.empty());
 
+            // the preview stage uploads the preview files, the full files are kept for the next stage
+            vector<uint8_t>& bytes = m_preview ? m_previewBytes : m_bytes;
+            vector<uint8_t>& alphaBytes = m_preview ? m_previewAlphaBytes : m_alphaBytes;
+
+            // a KTX file is uploaded at once by libktx, so it waits for a frame with enough budget
+            m_loadAgain = false;
+            m_finishPending = !ResourceManager::Singleton().ConsumeUploadBudget(bytes.size() + alphaBytes.size());
+            if (m_finishPending)
+            {
+                return true;
+            }
+
+            size_t gpuBytes = bytes.size() + alphaBytes.size();
+
+            KTX_dimensions dimensions;
+            bool stacked = false;
+            GLuint tex = LoadTexture(GetName(), bytes, &dimensions, &stacked);
+
+            GLuint alphaTex = 0;
+            if (tex && !alphaBytes.empty())
+            {
+                KTX_dimensions alphaDimensions;
+                bool alphaStacked;
+                alphaTex = LoadTexture(GetAlphaName(), alphaBytes, &alphaDimensions, &alphaStacked);
+
+                if (alphaTex && (alphaDimensions.width != dimensions.width || alphaDimensions.height != dimensions.height))
+                {
+                    LogError("alpha '%s' is %dx%d, but the color is %dx%d", GetAlphaName().c_str(), alphaDimensions.width, alphaDimensions.height, dimensions.width, dimensions.height);
+                    GlDeletionQueue::Singleton().DeleteTextures(1, &alphaTex);
+                    alphaTex = 0;
+                }
+            }
+
+            // the files are kept for a context loss if they fit
+            DropRetainedBytes();
+            if (tex && !m_preview && ResourceManager::Singleton().RetainBytes(gpuBytes))
+            {
+                m_retainedBytes.swap(bytes);
+                m_retainedAlphaBytes.swap(alphaBytes);
+                m_retainedCount = gpuBytes;
+            }
+
+            vector<uint8_t>().swap(bytes);
+            vector<uint8_t>().swap(alphaBytes);
+
+            if (!tex)
+            {
+                return false;
+            }
+
+            // the new textures replace the preview
+            GlDeletionQueue::Singleton().DeleteTextures(1, &m_glTexture);
+            GlDeletionQueue::Singleton().DeleteTextures(MaxSubTextures, m_glSubTextures);
+
+            m_width = dimensions.width;
+            m_height = dimensions.height;
+            m_glTexture = tex;
+            m_glSubTextures[0] = alphaTex;
+            m_gpuBytes = gpuBytes;
+
+            if (alphaTex)
+            {
+                m_innerFormat = InnerFormat::ETC1_RGB_Alpha;
+            }
+            else if (stacked)
+            {
+                m_innerFormat = InnerFormat::ETC1_RGB_AlphaStacked;
+                m_height = dimensions.height / 2;
+            }
+            else
+            {
+                m_innerFormat = InnerFormat::RGB_888;
+            }
+
+            if (m_preview)
+            {
+                LogInfo("KTX '%s' preview (%dx%d) uploaded", GetName().c_str(), m_width, m_height);
+                m_preview = false;
+                m_loadAgain = true;
+                return true;
+            }
+
+            if (m_droppedLevels > 0)
+            {
+                LogInfo("KTX '%s' uploaded without %d top levels (%dx%d)", GetName().c_str(), min(m_droppedLevels, m_levels - 1), m_width, m_height);
+            }
+
+            // the retained files stand in for the read ones, the same bytes are not kept twice
+            if (m_retainedCount > 0)
+            {
+                DropFileBytes(&m_fileBytes);
+                DropFileBytes(&m_alphaFileBytes);
+            }
+            else
+            {
+                KeepFileBytes(&m_fileBytes);
+                KeepFileBytes(&m_alphaFileBytes);
+            }
+
+            return true;
+        }
+
+
+        // returns 0 if failed
+        static GLuint LoadTexture(const string& name, const vector<uint8_t>& bytes, KTX_dimensions* dimensions, bool* stacked)
+        {
             GLuint tex;
             GLenum target;
             GLenum glerr;
             GLboolean isMipmap;
-            KTX_dimensions dimensions;
-            KTX_error_code ktxErr = ktxLoadTextureM(&m_bytes[0], m_bytes.size(), &tex, &target, &dimensions, &isMipmap, &glerr, 0, NULL);
+            unsigned int kvdLen = 0;
+            unsigned char* kvd = nullptr;
+            KTX_error_code ktxErr = ktxLoadTextureM(&bytes[0], bytes.size(), &tex, &target, dimensions, &isMipmap, &glerr, &kvdLen, &kvd);
 
-            vector<uint8_t>().swap(m_bytes);
+            auto kvdDeleter = MakeCallAtScopeExit([kvd](){ free(kvd); });
 
             if (ktxErr != KTX_SUCCESS || glerr != GL_NO_ERROR)
             {
-                LogError("ktxLoadTextureM('%s') failed. ktxErr = 0x%X, glerr = 0x%X", GetName().c_str(), ktxErr, glerr);
-                return false;
+                LogError("ktxLoadTextureM('%s') failed. ktxErr = 0x%X, glerr = 0x%X", name.c_str(), ktxErr, glerr);
+                return 0;
             }
 
             if (target != GL_TEXTURE_2D)
             {
                 glBindTexture(target, 0);
-                glDeleteTextures(1, &target);
-                LogError("ktxLoadTextureM('%s') not a 2D texture", GetName().c_str());
-                return false;
+                GlDeletionQueue::Singleton().DeleteTextures(1, &tex);
+                LogError("ktxLoadTextureM('%s') not a 2D texture", name.c_str());
+                return 0;
             }
 
-	        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, isMipmap ? GL_LINEAR_MIPMAP_NEAREST : GL_LINEAR);
-	        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, isMipmap ? GL_LINEAR_MIPMAP_NEAREST : GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
-		    m_width = dimensions.width;
-		    m_height = dimensions.height;
-            m_glTexture = tex;
-            m_innerFormat = InnerFormat::RGB_888;
+            *stacked = IsAlphaStacked(kvdLen, kvd);
+            return tex;
+        }
 
-            return true;
+
+        static bool IsAlphaStacked(unsigned int kvdLen, unsigned char* kvd)
+        {
+            KTX_hash_table table;
+            if (!kvd || ktxHashTable_Deserialize(kvdLen, kvd, &table) != KTX_SUCCESS)
+            {
+                return false;
+            }
+
+            unsigned int valueLen;
+            void* value;
+            bool stacked = ktxHashTable_FindValue(table, "DiAlphaLayout", &valueLen, &value) == KTX_SUCCESS
+                        && valueLen >= 7 && memcmp(value, "stacked", 7) == 0;
+
+            ktxHashTable_Destroy(table);
+            return stacked;
         }
 
 
@@ -462,31 +2318,186 @@ namespace di
         {
             DI_SAVE_CALLSTACK();
 
-            glDeleteTextures(1, &m_glTexture);
+            GlDeletionQueue::Singleton().DeleteTextures(1, &m_glTexture);
+            GlDeletionQueue::Singleton().DeleteTextures(MaxSubTextures, m_glSubTextures);
             m_glTexture = 0;
+            memset(m_glSubTextures, 0, sizeof(m_glSubTextures));
             m_width = 0;
             m_height = 0;
+            m_gpuBytes = 0;
 
             vector<uint8_t>().swap(m_bytes);
+            vector<uint8_t>().swap(m_alphaBytes);
+            vector<uint8_t>().swap(m_previewBytes);
+            vector<uint8_t>().swap(m_previewAlphaBytes);
+            DropRetainedBytes();
+
+            if (m_fileBytes)
+            {
+                FileByteCache::Singleton().Demote(GetName(), m_fileBytes);
+                m_fileBytes.reset();
+            }
+
+            if (m_alphaFileBytes)
+            {
+                FileByteCache::Singleton().Demote(GetAlphaName(), m_alphaFileBytes);
+                m_alphaFileBytes.reset();
+            }
+        }
+
+
+        virtual bool LoseContext_InGlThread(bool finished)
+        {
+            m_glTexture = 0;
+            memset(m_glSubTextures, 0, sizeof(m_glSubTextures));
+            m_gpuBytes = 0;
+
+            if (!finished || m_retainedCount == 0)
+            {
+                return false;
+            }
+
+            // Finish_InGlThread() keeps them again
+            m_bytes.swap(m_retainedBytes);
+            m_alphaBytes.swap(m_retainedAlphaBytes);
+            DropRetainedBytes();
+            return true;
         }
 
 
         vector<uint8_t> m_bytes;
+        vector<uint8_t> m_alphaBytes;
+        bool m_preview;             // the next Finish_InGlThread() uploads the preview files
+        vector<uint8_t> m_previewBytes;
+        vector<uint8_t> m_previewAlphaBytes;
+        int m_levels;               // of the files, as read before any level is dropped
+
+        vector<uint8_t> m_retainedBytes;        // the uploaded files, kept for a context loss, see ResourceManager::SetRetainBudget
+        vector<uint8_t> m_retainedAlphaBytes;
+        size_t m_retainedCount;
+
+        PixelBufferPtr m_fileBytes;         // the files as read, demoted to FileByteCache when the texture leaves the GPU. null for files in asset packs
+        PixelBufferPtr m_alphaFileBytes;
     };
 
 
+    static TextureOptions s_defaultTextureOptions;
+    static unordered_map<string, TextureOptions> s_textureOptionsPolicy;
+
+
+    string TextureOptions::ToText() const
+    {
+        return String_Format("%d,%d,%d,%d,%d,%d,%d,%d,%g,%d", int(format), int(dither), int(quality), int(diskCache), int(variants),
+            int(mipmaps), int(gammaCorrect), maxSize, scale, previewSize);
+    }
+
+
+    bool TextureOptions::FromText(const string& text, TextureOptions* options)
+    {
+        int values[7];
+        int maxSize;
+        float scale;
+        int previewSize;
+        if (SDL_sscanf(text.c_str(), "%d,%d,%d,%d,%d,%d,%d,%d,%f,%d", &values[0], &values[1], &values[2], &values[3], &values[4],
+            &values[5], &values[6], &maxSize, &scale, &previewSize) != 10)
+        {
+            return false;
+        }
+
+        if (values[0] < Format_AsDecoded || values[0] > Format_ETC1 || values[1] < Dither_None || values[1] > Dither_ErrorDiffusion ||
+            values[2] < Quality_Fast || values[2] > Quality_Best || values[5] < Mip_None || values[5] > Mip_Kaiser)
+        {
+            return false;
+        }
+
+        options->format = FormatPolicy(values[0]);
+        options->dither = Dither(values[1]);
+        options->quality = Quality(values[2]);
+        options->diskCache = values[3] != 0;
+        options->variants = values[4] != 0;
+        options->mipmaps = MipFilter(values[5]);
+        options->gammaCorrect = values[6] != 0;
+        options->maxSize = maxSize;
+        options->scale = scale;
+        options->previewSize = previewSize;
+        return true;
+    }
+
+
+    const TextureOptions& TextureOptions::GetPolicy(const string& name)
+    {
+        auto iter = s_textureOptionsPolicy.find(name);
+        return iter != s_textureOptionsPolicy.end() ? (*iter).second : s_defaultTextureOptions;
+    }
+
+
+    void TextureOptions::SetPolicy(const string& name, const TextureOptions& options)
+    {
+        s_textureOptionsPolicy[name] = options;
+    }
+
+
+    void TextureOptions::SetDefault(const TextureOptions& options)
+    {
+        s_defaultTextureOptions = options;
+    }
+
+
     ImageAsTexture::ImageAsTexture(const string& name, float priority /* = 0 */ )
         : Resource(name, priority), m_loader(nullptr)
     {
-        size_t pos = name.find_last_of('.');
-        if (pos != string::npos && SDL_strncasecmp(name.c_str() + pos + 1, "ktx", 3) == 0)
+        CreateLoader(TextureOptions::GetPolicy(name));
+    }
+
+
+    ImageAsTexture::ImageAsTexture(const string& name, float priority, const TextureOptions& options)
+        : Resource(name, priority), m_loader(nullptr)
+    {
+        CreateLoader(options);
+    }
+
+
+    void ImageAsTexture::CreateLoader(const TextureOptions& options)
+    {
+        // the variants are looked for by the first load, the files are not opened in GL thread
+        if (options.variants)
         {
-            m_loader.reset(new KTXTextureLoader(name));
+            m_variants = TextureVariant_List(GetName());
+        }
+
+        const string& name = GetName();
+        if (TextureVariant_IsKtx(name))
+        {
+            m_loader.reset(new KTXTextureLoader(name, options));
         }
         else
         {
-            m_loader.reset(new SDLTextureLoader(name));
+            m_loader.reset(new SDLTextureLoader(name, options));
+        }
+    }
+
+
+    // the resource keeps the asked name, the variant chosen for this GPU gets a loader of its own. m_loader is not touched,
+    // the GL thread may read it meanwhile
+    void ImageAsTexture::ChooseVariant_InWorkThread()
+    {
+        if (m_variants.empty())
+        {
+            return;
+        }
+
+        string name = TextureVariant_Find(m_variants);
+        m_variants.clear();
+        if (name.empty())
+        {
+            return;
         }
+
+        LogInfo("texture '%s' loads variant '%s'", GetName().c_str(), name.c_str());
+
+        // with the GPU caps m_loader has queried in GL thread
+        m_variantLoader.reset(new KTXTextureLoader(name, m_loader->GetOptions()));
+        m_variantLoader->PrepareLike_InWorkThread(*m_loader);
     }
 
 
@@ -498,13 +2509,37 @@ namespace di
 
     bool ImageAsTexture::Load_InWorkThread()
     {
-        return m_loader->Load_InWorkThread();
+        ChooseVariant_InWorkThread();
+
+        BaseTextureLoader* loader = m_variantLoader ? m_variantLoader.get() : m_loader.get();
+        loader->SetDroppedLevels(GetDroppedLevels());
+        return loader->Load_InWorkThread();
     }
 
 
     bool ImageAsTexture::Finish_InGlThread()
     {
-        return m_loader->Finish_InGlThread();
+        if (m_variantLoader)
+        {
+            // the image loader has loaded nothing
+            m_loader = move(m_variantLoader);
+        }
+
+        if (!m_loader->Finish_InGlThread())
+        {
+            return false;
+        }
+
+        if (m_loader->IsFinishPending())
+        {
+            ContinueFinishLater();
+        }
+        else if (m_loader->IsLoadAgain())
+        {
+            LoadAgainLater();
+        }
+
+        return true;
     }
 
 
@@ -512,4 +2547,17 @@ namespace di
     {
         m_loader->Timeout_InGlThread();
     }
+
+
+    bool ImageAsTexture::LoseContext_InGlThread(bool finished)
+    {
+        return m_loader->LoseContext_InGlThread(finished);
+    }
+
+
+    void ImageAsTexture::ListFiles_InWorkThread(vector<string>* names)
+    {
+        ChooseVariant_InWorkThread();
+        (m_variantLoader ? m_variantLoader.get() : m_loader.get())->ListFiles_InWorkThread(names);
+    }
 }
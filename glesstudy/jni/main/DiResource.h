@@ -44,24 +44,95 @@ namespace di
             Timeout,
         };
 
-        Resource(const string& name, float priority = 0) : m_state(State::Init), m_name(name), m_priority(priority), m_lastUsedTick(SDL_GetTicks()), m_timeoutTicks(uint32_t(1000 * 300)) {}
+        Resource(const string& name, float priority = 0) : m_state(State::Init), m_name(name), m_priority(priority), m_lastUsedTick(SDL_GetTicks()), m_timeoutTicks(uint32_t(1000 * 300)), m_finishPending(false), m_loadAgain(false), m_previewShown(false), m_droppedLevels(0) {}
         virtual ~Resource() { DI_ASSERT_IN_DESTRUCTOR(m_state == State::Failed || m_state == State::Timeout); }
 
-        bool IsResourceOK() const { return m_state == State::Finished; }
+        // also true while a preview is shown and the rest is still loading (see LoadAgainLater()),
+        // or while the resource is loaded again with other mip levels (see ResourceManager::SetTextureMemoryBudget)
+        bool IsResourceOK() const { return m_state == State::Finished || (m_previewShown && (m_state == State::Prepared || m_state == State::Loaded)); }
         State GetState() const { return m_state; }
         float GetPriority() const { return m_priority; }
         const string& GetName() const { return m_name; }
 
         void ForceTimeout() { if (m_state == State::Finished) { DI_SAVE_CALLSTACK(); m_state = State::Timeout; Timeout_InGlThread(); } }
         void UpdateTimeoutTick() { m_lastUsedTick = SDL_GetTicks(); }
+        uint32_t GetLastUsedTick() const { return m_lastUsedTick; }
         void CheckTimeout() { if (m_state != State::Finished) return; if (SDL_GetTicks() - m_lastUsedTick >= m_timeoutTicks) { DI_SAVE_CALLSTACK(); m_state = State::Timeout; Timeout_InGlThread(); } }
 
         void SetTimeoutTicks(uint32_t ticks) { m_timeoutTicks = ticks; }
 
+        // GPU memory of the resource, 0 if it is not a texture
+        virtual size_t GetGpuBytes() const { return 0; }
+
+        // a texture with mip levels may be loaded without its top levels to save GPU memory, each level saves about 75%.
+        // the levels are dropped and restored by the memory governor of ResourceManager
+        virtual int GetMaxDroppedLevels() const { return 0; }
+        int GetDroppedLevels() const { return m_droppedLevels; }
+
+        // free the bytes kept to restore the resource after a GL context loss (see ResourceManager::SetRetainBudget),
+        // returns the bytes freed
+        virtual size_t DropRetainedBytes() { return 0; }
+
+        // true if the resource is made again from its name, priority and 'args' (ImageAsTexture: its TextureOptions::ToText()),
+        // so a prefetch manifest may record it and load it ahead (see ResourceManager::StartPrefetchManifest)
+        virtual bool GetPrefetchArgs(string* /*args*/) const { return false; }
+
         // Internal calls, called in differenet threads. Only called by class ResourceManager
-        void Prepare() { DI_SAVE_CALLSTACK(); ThreadLockGuard guard(m_lock); DI_ASSERT(m_state == State::Init || m_state == State::Timeout); m_state = Prepare_InGlThread() ? State::Prepared : State::Failed; }
+        void Prepare() { DI_SAVE_CALLSTACK(); ThreadLockGuard guard(m_lock); DI_ASSERT(m_state == State::Init || m_state == State::Timeout); m_previewShown = false; m_state = Prepare_InGlThread() ? State::Prepared : State::Failed; }
+        void Reload(int droppedLevels) { DI_SAVE_CALLSTACK(); ThreadLockGuard guard(m_lock); DI_ASSERT(m_state == State::Finished); m_droppedLevels = droppedLevels; m_previewShown = true; m_state = State::Prepared; }
+        void LoseContext()
+        {
+            DI_SAVE_CALLSTACK();
+            ThreadLockGuard guard(m_lock);
+
+            // a preview shown is gone with the context too
+            bool finished = m_state == State::Finished;
+            bool restorable = LoseContext_InGlThread(finished);
+            m_previewShown = false;
+            if (finished)
+            {
+                m_state = restorable ? State::Loaded : State::Timeout;
+            }
+        }
+        void ListFiles(vector<string>* names) { ThreadLockGuard guard(m_lock); ListFiles_InWorkThread(names); }
         void Load() { DI_SAVE_CALLSTACK(); ThreadLockGuard guard(m_lock); DI_ASSERT(m_state == State::Prepared); m_state = Load_InWorkThread() ? State::Loaded : State::Failed; }
-        void Finish() { DI_SAVE_CALLSTACK(); ThreadLockGuard guard(m_lock); DI_ASSERT(m_state == State::Loaded); m_state = Finish_InGlThread() ? State::Finished : State::Failed; }
+        void Finish()
+        {
+            DI_SAVE_CALLSTACK();
+            ThreadLockGuard guard(m_lock);
+            DI_ASSERT(m_state == State::Loaded);
+
+            m_finishPending = false;
+            m_loadAgain = false;
+            if (!Finish_InGlThread())
+            {
+                m_state = State::Failed;
+            }
+            else if (m_finishPending)
+            {
+                m_state = State::Loaded;
+            }
+            else if (m_loadAgain)
+            {
+                m_state = State::Prepared;
+                m_previewShown = true;
+            }
+            else
+            {
+                m_state = State::Finished;
+                m_previewShown = false;
+            }
+        }
+
+    protected:
+        // called in Finish_InGlThread() which has done only a part of its work (e.g. the upload budget of this frame is used up),
+        // the resource stays Loaded and Finish_InGlThread() is called again in the next CheckAsyncFinishedResources()
+        void ContinueFinishLater() { m_finishPending = true; }
+
+        // called in Finish_InGlThread() which has made the resource usable in a lower quality (e.g. a small preview of a texture),
+        // IsResourceOK() becomes true and the resource goes back to worker thread for another Load_InWorkThread() and Finish_InGlThread().
+        // the GL thread may use the resource meanwhile, so Load_InWorkThread() must not change what it uses
+        void LoadAgainLater() { m_loadAgain = true; }
 
     private:
         virtual bool Prepare_InGlThread() = 0;
@@ -69,12 +140,67 @@ namespace di
         virtual bool Finish_InGlThread() = 0;
         virtual void Timeout_InGlThread() = 0;
 
+        // the GL context is lost, every GL object of the resource is gone. their names are forgotten, not deleted
+        // (the new context may give the same names to other objects). when 'finished', returns true if Finish_InGlThread()
+        // can upload it again from bytes it has kept, otherwise the resource is loaded again from the start
+        virtual bool LoseContext_InGlThread(bool finished) = 0;
+
+        // the files the next Load_InWorkThread() reads, so the worker thread reads them ahead (see AsyncFileReader)
+        virtual void ListFiles_InWorkThread(vector<string>* /*names*/) {}
+
         ThreadLock m_lock;
         State m_state;
         float m_priority;
         uint32_t m_lastUsedTick;
         uint32_t m_timeoutTicks;
         const string m_name;
+        bool m_finishPending;
+        bool m_loadAgain;
+        bool m_previewShown;
+        int m_droppedLevels;
+    };
+
+
+    // GL objects are deleted only here, in GL thread, once per frame with one glDeleteTextures for all the textures.
+    // so any thread may release them, e.g. the worker thread which drops the last handle of a resource where no GL
+    // context is current, and a frame never stalls in many small deletions
+    class GlDeletionQueue
+    {
+    public:
+        GlDeletionQueue() : m_frame(0), m_delayFrames(0) {}
+
+        // names 0 are skipped. thread safe
+        void DeleteTextures(GLsizei count, const GLuint* textures);
+        void DeleteProgram(GLuint program);
+
+        // objects are deleted 'frames' drains later than the one after their release, for drivers which stall when
+        // an object the GPU is still drawing with is deleted. 0 (default) deletes them in the next drain
+        void SetDelayFrames(int frames);
+
+        // ONLY in GL thread, once per frame by ResourceManager::CheckAsyncFinishedResources()
+        void Drain();
+
+        // the GL context is lost, the queued names are forgotten, not deleted (the new context may give them to other objects)
+        void Forget();
+
+        static GlDeletionQueue& Singleton();
+
+    private:
+        struct Pending
+        {
+            GLuint name;
+            bool program;
+            uint32_t frame;             // m_frame when it was queued
+        };
+
+        ThreadLock m_lock;
+        vector<Pending> m_pending;      // in the order queued
+        vector<GLuint> m_textures;      // of one drain, GL thread only
+        vector<GLuint> m_programs;
+        uint32_t m_frame;               // drains so far
+        int m_delayFrames;
+
+        DI_DISABLE_COPY(GlDeletionQueue);
     };
 
 
@@ -89,29 +215,131 @@ namespace di
         void CheckAsyncFinishedResources();
         void CheckTimeoutResources();
 
+        // resources which nobody but ResourceManager holds are released (Timeout_InGlThread()) and forgotten by
+        // CheckAsyncFinishedResources(), once the last handle GetResource() gave out has been dropped for 'ticks' milliseconds,
+        // so GPU memory follows what the scene uses. a handle got again within the grace period keeps the resource, so a
+        // resource got by GetResource() every frame into a local handle stays. 5000 by default
+        void SetReleaseGraceTicks(uint32_t ticks) { m_fields->releaseGraceTicks = ticks; }
+
+        // bytes which may be uploaded to GL in one CheckAsyncFinishedResources(), so that big textures and mip chains
+        // are spread over several frames instead of stalling one. 0 (default) means no limit
+        void SetUploadBudget(size_t bytesPerFrame) { m_fields->uploadBudget = bytesPerFrame; }
+
+        // called by Finish_InGlThread() before uploading 'bytes'. returns false if this frame's budget is used up,
+        // the first upload of a frame is always allowed so that an item bigger than the budget still goes through
+        bool ConsumeUploadBudget(size_t bytes);
+
+        // GPU memory of all textures which the memory governor keeps to. while the textures need more, the ones of the lowest
+        // priority are loaded again without their top mip level, and when there is room again the ones of the highest priority
+        // get their levels back. they are drawn at their old levels meanwhile, so no texture disappears.
+        // checked by CheckAsyncFinishedResources(). 0 (default) means no limit
+        void SetTextureMemoryBudget(size_t bytes) { m_fields->textureMemoryBudget = bytes; }
+        size_t GetTextureMemory();
+
+        // tiers of MemoryPressure, each returns the bytes given back.
+        // textures of a priority below 'lowPriority' which are not used in the last 'idleTicks' milliseconds are released
+        size_t ReleaseIdleTextures(float lowPriority, uint32_t idleTicks);
+
+        // every texture which has more mip levels drops its top one. the old textures are drawn until the smaller ones are
+        // uploaded, so nothing is freed yet: the estimate (3/4 of each texture) is returned, the bytes really freed are logged
+        // when the last one is uploaded.
+        // then the memory governor keeps to what is left (besides the budget, even if it is 0) and relaxes that cap by 1/4
+        // every few seconds without another drop, giving the levels back, until it reaches the budget or nothing is dropped
+        size_t DropTopMipLevels();
+
+        // CPU memory kept for the textures to be uploaded again after a GL context loss, instead of loading and decoding them again.
+        // upload-ready pixels of SDL images, compressed bytes of KTX files, as long as the budget allows. 0 (default) keeps nothing
+        void SetRetainBudget(size_t bytes) { m_fields->retainBudget = bytes; }
+
+        // called by Finish_InGlThread() which keeps 'bytes' (false if they do not fit), and when they are freed
+        bool RetainBytes(size_t bytes);
+        void ReleaseRetainedBytes(size_t bytes) { DI_ASSERT(m_fields->retainedBytes >= bytes); m_fields->retainedBytes -= bytes; }
+
+        // free all retained bytes, a tier of MemoryPressure. returns the bytes freed
+        size_t DropRetainedBytes();
+
+        // called when the app comes back to the foreground (SDL_APP_DIDENTERFOREGROUND). if the GL context has been lost
+        // meanwhile, the resources upload their retained bytes in priority order (within the upload budget), the others are
+        // loaded again from the start. returns true if the context was lost, other GL objects of the app must be made again
+        bool CheckContextLost();
+
+        // log the hits of each texture tier since the start, with their rates: requests (AsyncLoadResource) of textures
+        // which are on the GPU, files read from the RAM tier (FileByteCache), and files read from the disk
+        void LogTextureCacheStats();
+
+        // a prefetch manifest 'name' in SDL_GetPrefPath() (see PrefPath_Get). the resources the app asks for by
+        // GetResource() until FinishPrefetchManifest() (startup, entering a scene) are recorded in order, with their time,
+        // priority, GPU bytes and texture options. if an earlier run has written the manifest, its resources are loaded ahead
+        // in the recorded order, priority and options, a few at a time, before the app asks for them. ONLY in GL thread
+        void StartPrefetchManifest(const string& name);
+
+        // the app is interactive: the manifest of this run is written, resources loaded ahead which the app has not asked for
+        // are left to ReleaseUnreferencedResources(), and the hits and misses are logged with the time since the start
+        void FinishPrefetchManifest();
+
         // consider use this Singleton ONLY in GL thread
         // (other threads may create some other instance of ResourceManager, if necessary)
         static ResourceManager& Singleton() { if (!s_singleton) { s_singleton.reset(new ResourceManager()); } return *s_singleton; }
         static void DestroySingleton() { s_singleton.reset(); }
+        static bool HasSingleton() { return bool(s_singleton); }     // false while the singleton is being destroyed
 
         template <typename T>
         shared_ptr<T> GetResource(const string& name, float priority = 0) {
-            const ResourcePtr* r = HashFindResource(name);
+            ResourcePtr r = HashFindResource(name);
             if (r) {
 #ifdef _WIN32
-                DI_ASSERT(dynamic_pointer_cast<T>(*r)); // on Android we compile with -fno-rtti, so dynamic_cast is not available
+                DI_ASSERT(dynamic_pointer_cast<T>(r)); // on Android we compile with -fno-rtti, so dynamic_cast is not available
 #endif
-                return static_pointer_cast<T>(*r);
+                return static_pointer_cast<T>(r);
             }
 
-            shared_ptr<T> ret(new T(name, priority));
-            AddResource(ret);
-            return ret;
+            return static_pointer_cast<T>(AddResource(ResourcePtr(new T(name, priority))));
+        }
+
+        // same as above, but 'arg' is passed to the constructor of T when the resource is created.
+        // if the resource already exists, 'arg' is ignored
+        template <typename T, typename A>
+        shared_ptr<T> GetResource(const string& name, float priority, const A& arg) {
+            ResourcePtr r = HashFindResource(name);
+            if (r) {
+#ifdef _WIN32
+                DI_ASSERT(dynamic_pointer_cast<T>(r));
+#endif
+                return static_pointer_cast<T>(r);
+            }
+
+            return static_pointer_cast<T>(AddResource(ResourcePtr(new T(name, priority, arg))));
         }
 
     private:
-        const ResourcePtr* HashFindResource(const string& name);
-        void AddResource(ResourcePtrCR resource);
+        // the handles given out by GetResource() return their resource to ResourceManager by this list when the last of them
+        // is dropped, from whichever thread drops it
+        struct DroppedHandles
+        {
+            ThreadLock lock;
+            vector<pair<Resource*, uint32_t>> resources;    // with the tick they were dropped
+        };
+
+        ResourcePtr HashFindResource(const string& name);
+        ResourcePtr AddResource(ResourcePtrCR resource);
+        ResourcePtr MakeHandle(ResourcePtrCR resource);
+        void CheckTextureMemory();
+        void CheckPressureDrops();
+        void ReleaseUnreferencedResources();
+        void ReloadResource(ResourcePtrCR resource, int droppedLevels);
+        void RecordPrefetchRequest(ResourcePtrCR resource, bool created);
+        void IssuePrefetches();
+        void LoadPrefetchManifest();
+        void SavePrefetchManifest();
+
+        struct PrefetchEntry
+        {
+            string name;
+            float priority;
+            string args;                // see Resource::GetPrefetchArgs()
+            uint32_t ticks;             // since the start of the session
+            size_t bytes;               // on the GPU
+        };
 
         struct ResourcePriorityComp
         {
@@ -132,6 +360,37 @@ namespace di
 
             bool threadWillEnd;
             unordered_map<string, ResourcePtr> resourceHash;
+
+            size_t uploadBudget;
+            size_t uploadedBytes;       // in the current CheckAsyncFinishedResources()
+            size_t textureMemoryBudget;
+            size_t pressureCap;         // set by DropTopMipLevels(), 0 if none
+            uint32_t pressureTick;      // when pressureCap was set or last relaxed
+            vector<pair<ResourcePtr, size_t>> pressureDrops;    // being loaded without their top level, with their old bytes
+            size_t pressureFreedBytes;
+            size_t retainBudget;
+            size_t retainedBytes;
+            GLuint contextProbe;        // a texture which exists as long as the GL context does
+            uint32_t gpuHits;
+
+            uint32_t releaseGraceTicks;
+            unordered_map<Resource*, weak_ptr<Resource>> handles;  // the handles given out, see MakeHandle()
+            shared_ptr<DroppedHandles> droppedHandles;
+            unordered_map<Resource*, uint32_t> unreferenced;    // the tick each resource lost its last handle
+
+            // see StartPrefetchManifest(), the path is empty while no session runs
+            string prefetchPath;
+            uint32_t prefetchStartTick;
+            uint32_t prefetchRecordedTicks;                 // of the run which wrote the manifest
+            vector<PrefetchEntry> prefetchReplay;           // read from the manifest
+            size_t prefetchNext;                            // in prefetchReplay
+            unordered_map<string, ResourcePtr> prefetched;  // loaded ahead, not asked for yet
+            vector<PrefetchEntry> prefetchRecord;           // of this run
+            unordered_map<string, size_t> prefetchRecordIndex;
+            uint32_t prefetchHitsReady;
+            uint32_t prefetchHitsLoading;
+            uint32_t prefetchMisses;
+            uint32_t prefetchLate;                          // misses which the manifest has, not loaded ahead yet
         };
 
         shared_ptr<Fields> m_fields;
@@ -153,21 +412,105 @@ namespace di
             Red_8,
             Gray_8,
             RGBA_8888_Palette_256,
-            YUV, // !?  could we try to use an OpenGL shader to convert YUV to RGB, so save CPU operations?
+            YUV,                // Y, U, V planes in full range (JPEG). converted to RGB by the shader, see DiTextureShader.h
+            YUV_VideoRange,     // same as YUV, but Y in [16, 235] and U, V in [16, 240] (lossy WebP)
+            Alpha_8,            // masks and glyphs, drawn white (or the tint of TextureShader) with this alpha
+            ETC1_RGB,           // 4x4 blocks of 8 bytes, from KTX files or encoded at load time (see DiEtc1.h)
+            ETC1_RGB_Alpha,     // ETC1 color, and the alpha as another gray ETC1 texture
+            ETC1_RGB_AlphaStacked,  // one ETC1 texture of double height, color in the top half and alpha as gray in the bottom half.
+                                    // GetHeight() is the height of a half
         };
 
+        enum { MaxSubTextures = 2 };
+
         InnerFormat GetInnerFormat() const { return m_innerFormat; }
         int GetWidth() const { return m_width; }
         int GetHeight() const { return m_height; }
         GLuint GetGlTexture() const { return m_glTexture; }
 
+        // extra textures of the formats which have more than one plane, 0 if not used.
+        // YUV: 0 is U plane, 1 is V plane. m_glTexture is the Y plane
+        // RGBA_8888_Palette_256: 0 is the 256x1 palette. m_glTexture is the indices
+        // ETC1_RGB_Alpha: 0 is the alpha. m_glTexture is the color
+        GLuint GetGlSubTexture(int index) const { return m_glSubTextures[index]; }
+
     protected:
-        TextureProtocol() : m_innerFormat(RGBA_8888), m_width(0), m_height(0), m_glTexture(0) {}
+        TextureProtocol() : m_innerFormat(RGBA_8888), m_width(0), m_height(0), m_glTexture(0), m_glSubTextures() {}
 
         InnerFormat m_innerFormat;
         int m_width;
         int m_height;
         GLuint m_glTexture;     // OpenGL texture is not created/destroyed in class TextureProtocol
+        GLuint m_glSubTextures[MaxSubTextures];
+    };
+
+
+    // How an image is stored in GPU memory.
+    // Given when an ImageAsTexture is created, or looked up from the policy (SetPolicy / SetDefault) by name.
+    struct TextureOptions
+    {
+        enum FormatPolicy
+        {
+            Format_AsDecoded,       // RGBA_8888, or RGB_888 when the image has no alpha
+            Format_16Bit,           // RGB_565 when opaque, RGBA_5551 when alpha is only 0 or 255, otherwise RGBA_4444
+            Format_RGB_565,
+            Format_RGBA_4444,
+            Format_RGBA_5551,
+            Format_YUV,             // Y, U, V planes for JPEG and lossy WebP without alpha, otherwise as Format_AsDecoded
+            Format_Palette256,      // RGBA_8888_Palette_256, for flat shaded UI art
+            Format_ETC1,            // ETC1_RGB, or ETC1_RGB_Alpha for translucent images, when the GPU supports it. otherwise as Format_AsDecoded
+        };
+
+        enum Dither
+        {
+            Dither_None,
+            Dither_Ordered,         // 4x4 Bayer matrix, cheap and SIMD friendly
+            Dither_ErrorDiffusion,  // Floyd-Steinberg, better for smooth gradients but slower
+        };
+
+        // speed of the encoders running in worker thread (only ETC1 so far), slower is better looking
+        enum Quality
+        {
+            Quality_Fast,
+            Quality_Normal,
+            Quality_Best,
+        };
+
+        // mip levels generated by the CPU in worker thread, see Image_GenerateMipmaps
+        enum MipFilter
+        {
+            Mip_None,               // no mip levels, GL_LINEAR minification
+            Mip_Box,                // average of 2x2 pixels
+            Mip_Kaiser,             // Kaiser windowed sinc over 6x6 pixels, sharper than box and less aliased
+        };
+
+        TextureOptions() : format(Format_AsDecoded), dither(Dither_Ordered), quality(Quality_Normal), diskCache(false), variants(true), mipmaps(Mip_None), gammaCorrect(true), maxSize(0), scale(1.0f), previewSize(0) {}
+
+        FormatPolicy format;
+        Dither dither;
+        Quality quality;
+        bool diskCache;             // keep the planes ready for upload on disk (TextureDiskCache), so the next run does not decode, convert or encode again
+        bool variants;              // load a compressed variant of the image file if there is one, see DiTextureVariant.h
+        MipFilter mipmaps;          // also used for KTX files which ask the loader to generate their mip levels (Mip_Box if Mip_None)
+        bool gammaCorrect;          // filter the color of mip levels in linear light instead of sRGB values. alpha is always linear
+
+        // the size the texture is drawn at, so a big image is decoded at about this size instead of its full size
+        // (see ImageDecodeHint in DiImage.h). the texture's GetWidth() / GetHeight() are the decoded size. not used by KTX files
+        int maxSize;                // of width and height, 0 if not limited
+        float scale;                // of the source size, 1 if not scaled
+
+        // a preview at most this big (of width and height) is loaded and drawn first, then replaced by the full image.
+        // decoded at the small size for images (JPEG decodes 1/8 by DC only), or a small mip level of KTX files. 0 for no preview
+        int previewSize;
+
+        // the options as text without spaces, as a prefetch manifest records them. FromText() returns false if 'text' is not one
+        string ToText() const;
+        static bool FromText(const string& text, TextureOptions* options);
+
+        // the policy, only used in GL thread
+        static const TextureOptions& GetPolicy(const string& name);
+        static void SetPolicy(const string& name, const TextureOptions& options);
+        static void SetDefault(const TextureOptions& options);
     };
 
 
@@ -176,16 +519,44 @@ namespace di
     class BaseTextureLoader : public TextureProtocol
     {
     public:
-        BaseTextureLoader(const string& name) : m_name(name) {}
+        BaseTextureLoader(const string& name, const TextureOptions& options) : m_finishPending(false), m_loadAgain(false), m_gpuBytes(0), m_droppedLevels(0), m_npotMipmaps(false), m_name(name), m_options(options) {}
 
         const string& GetName() { return m_name; }
+        const TextureOptions& GetOptions() { return m_options; }
         virtual bool Prepare_InGlThread() = 0;
         virtual bool Load_InWorkThread() = 0;
         virtual bool Finish_InGlThread() = 0;
         virtual void Timeout_InGlThread() = 0;
+        virtual bool LoseContext_InGlThread(bool finished) = 0;
+        virtual void ListFiles_InWorkThread(vector<string>* /*names*/) {}
+
+        // for a variant loader made in worker thread: what Prepare_InGlThread() does, with the GPU caps 'prepared' has queried
+        virtual void PrepareLike_InWorkThread(const BaseTextureLoader& prepared) { m_npotMipmaps = prepared.m_npotMipmaps; }
+
+        // true after a Finish_InGlThread() which has uploaded only a part of the texture, see ResourceManager::ConsumeUploadBudget
+        bool IsFinishPending() const { return m_finishPending; }
+
+        // true after a Finish_InGlThread() which has uploaded a preview, see TextureOptions::previewSize
+        bool IsLoadAgain() const { return m_loadAgain; }
+
+        // see Resource::GetMaxDroppedLevels(). the levels to drop are set before each Load_InWorkThread()
+        virtual int GetMaxDroppedLevels() const { return 0; }
+        void SetDroppedLevels(int levels) { m_droppedLevels = levels; }
+        size_t GetGpuBytes() const { return m_gpuBytes; }
+
+        // see Resource::DropRetainedBytes()
+        virtual size_t DropRetainedBytes() { return 0; }
+
+    protected:
+        bool m_finishPending;
+        bool m_loadAgain;
+        size_t m_gpuBytes;
+        int m_droppedLevels;
+        bool m_npotMipmaps;         // GpuTextureCaps::npotMipmaps, set by Prepare_InGlThread()
 
     private:
         const string m_name;
+        const TextureOptions m_options;
     };
 
 
@@ -193,19 +564,33 @@ namespace di
     {
     public:
         ImageAsTexture(const string& name, float priority = 0);
+        ImageAsTexture(const string& name, float priority, const TextureOptions& options);
 
         TextureProtocol::InnerFormat GetInnerFormat() const { return m_loader->GetInnerFormat(); }
         int GetWidth() const { return m_loader->GetWidth(); }
         int GetHeight() const { return m_loader->GetHeight(); }
         GLuint GetGlTexture() const { return m_loader->GetGlTexture(); }
+        GLuint GetGlSubTexture(int index) const { return m_loader->GetGlSubTexture(index); }
+
+        virtual size_t GetGpuBytes() const { return m_loader->GetGpuBytes(); }
+        virtual int GetMaxDroppedLevels() const { return m_loader->GetMaxDroppedLevels(); }
+        virtual size_t DropRetainedBytes() { return m_loader->DropRetainedBytes(); }
+        virtual bool GetPrefetchArgs(string* args) const { *args = m_loader->GetOptions().ToText(); return true; }
 
     private:
         virtual bool Prepare_InGlThread();
         virtual bool Load_InWorkThread();
         virtual bool Finish_InGlThread();
         virtual void Timeout_InGlThread();
+        virtual bool LoseContext_InGlThread(bool finished);
+        virtual void ListFiles_InWorkThread(vector<string>* names);
+
+        void CreateLoader(const TextureOptions& options);
+        void ChooseVariant_InWorkThread();
 
         unique_ptr<BaseTextureLoader> m_loader;
+        vector<string> m_variants;                  // to look for by the first load, see TextureVariant_List
+        unique_ptr<BaseTextureLoader> m_variantLoader;  // loaded by the worker thread, replaces m_loader in Finish_InGlThread()
     };
 
 
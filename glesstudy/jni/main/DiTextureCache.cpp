@@ -0,0 +1,588 @@
+#include "DiTextureCache.h"
+#include "di_ktx_format.h"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+namespace di
+{
+    //
+    // A plane is a KTX 1.1 file of the plane and its mip levels, which KTXTextureLoader can also load when its rows are
+    // 4 bytes aligned. written here instead of by ktxWriteKTXN, which refuses compressed formats (it checks glTypeSize
+    // against glType 0). the only key / value pair is "DiPlane", the PlaneFields below as uint32_t
+    //
+
+    enum
+    {
+        PlanesFormat,               // of ImagePlanes
+        PlanesWidth,
+        PlanesHeight,
+        PlanesCount,
+        PlaneFormat,                // of the Image of this plane
+        PlaneFields,
+    };
+
+
+    static const char s_planeKey[8] = "DiPlane";
+
+
+    struct PlaneKeyValue
+    {
+        uint32_t keyAndValueByteSize;
+        char key[sizeof(s_planeKey)];
+        uint32_t fields[PlaneFields];
+    };
+
+
+    static size_t GetLevelBytes(const Image& image)
+    {
+        return size_t(image.pitch) * (image.glType == 0 ? (image.height + 3) / 4 : image.height);
+    }
+
+
+    TextureDiskCache& TextureDiskCache::Singleton()
+    {
+        static TextureDiskCache s_cache;
+        return s_cache;
+    }
+
+
+    bool TextureDiskCache::Open()
+    {
+        ThreadLockGuard lock(m_lock);
+        if (!m_opened)
+        {
+            m_opened = true;
+            m_directory = PrefPath_Get();
+        }
+
+        return !m_directory.empty();
+    }
+
+
+    void TextureDiskCache::SetMaxBytes(size_t bytes)
+    {
+        ThreadLockGuard lock(m_lock);
+        m_maxBytes = bytes;
+        if (m_loaded)
+        {
+            Trim(m_maxBytes);
+            if (m_dirty)
+            {
+                SaveIndex();
+            }
+        }
+    }
+
+
+    size_t TextureDiskCache::GetBytes()
+    {
+        ThreadLockGuard lock(m_lock);
+        return m_bytes;
+    }
+
+
+    uint64_t TextureDiskCache::HashBytes(const uint8_t* bytes, size_t size)
+    {
+        // MurmurHash64A, 8 bytes a step, so hashing a file costs less than reading it
+        const uint64_t m = 0xC6A4A7935BD1E995ull;
+        uint64_t h = 0x9E3779B97F4A7C15ull ^ (uint64_t(size) * m);
+
+        size_t words = size / 8;
+        for (size_t i = 0; i < words; ++i)
+        {
+            uint64_t k;
+            memcpy(&k, bytes + i * 8, sizeof(k));
+            k *= m;
+            k ^= k >> 47;
+            k *= m;
+            h ^= k;
+            h *= m;
+        }
+
+        if (size % 8 != 0)
+        {
+            for (size_t i = words * 8; i < size; ++i)
+            {
+                h ^= uint64_t(bytes[i]) << ((i % 8) * 8);
+            }
+            h *= m;
+        }
+
+        h ^= h >> 47;
+        h *= m;
+        h ^= h >> 47;
+        return h;
+    }
+
+
+    static string GetEntryName(uint64_t sourceHash, const string& key)
+    {
+        char name[64];
+        SDL_snprintf(name, sizeof(name), "texcache_%016llx_%016llx", (unsigned long long)sourceHash,
+            (unsigned long long)TextureDiskCache::HashBytes((const uint8_t*)key.data(), key.size()));
+        return name;
+    }
+
+
+    string TextureDiskCache::GetPlanePath(const string& name, int plane) const
+    {
+        char suffix[16];
+        SDL_snprintf(suffix, sizeof(suffix), "_%d.ktx", plane);
+        return m_directory + name + suffix;
+    }
+
+
+    static bool ReadPlane(const string& path, ImagePlanes* planes, int plane, size_t* bytes)
+    {
+        SDL_RWops* rw = SDL_RWFromFile(path.c_str(), "rb");
+        if (!rw)
+        {
+            LogWarn("texture cache '%s' is missing", path.c_str());
+            return false;
+        }
+
+        auto rwDeleter = MakeCallAtScopeExit([rw](){ SDL_RWclose(rw); });
+
+        uint8_t identifier[KtxIdentifierSize];
+        uint32_t header[KtxHeaderFields];
+        PlaneKeyValue keyValue;
+        if (SDL_RWread(rw, identifier, sizeof(identifier), 1) != 1 || SDL_RWread(rw, header, sizeof(header), 1) != 1 ||
+            header[KtxBytesOfKeyValueData] != sizeof(keyValue) || SDL_RWread(rw, &keyValue, sizeof(keyValue), 1) != 1)
+        {
+            LogWarn("texture cache '%s' is truncated", path.c_str());
+            return false;
+        }
+
+        int width = int(header[KtxPixelWidth]);
+        int height = int(header[KtxPixelHeight]);
+        int levels = int(header[KtxNumberOfMipmapLevels]);
+        if (memcmp(identifier, KtxIdentifier, sizeof(identifier)) != 0 || header[KtxEndianness] != KtxEndiannessValue ||
+            header[KtxPixelDepth] != 0 || header[KtxNumberOfArrayElements] != 0 || header[KtxNumberOfFaces] != 1 ||
+            levels < 1 || levels > 32 || width <= 0 || height <= 0 || memcmp(keyValue.key, s_planeKey, sizeof(s_planeKey)) != 0)
+        {
+            LogWarn("texture cache '%s' is not a plane KTX file", path.c_str());
+            return false;
+        }
+
+        if (plane == 0)
+        {
+            planes->format = TextureProtocol::InnerFormat(keyValue.fields[PlanesFormat]);
+            planes->width = int(keyValue.fields[PlanesWidth]);
+            planes->height = int(keyValue.fields[PlanesHeight]);
+            planes->count = int(keyValue.fields[PlanesCount]);
+        }
+
+        TextureProtocol::InnerFormat format = TextureProtocol::InnerFormat(keyValue.fields[PlaneFormat]);
+        GLenum glType = header[KtxGlType];
+        int bytesPerPixel = 0;
+        GLenum glFormat;
+        GLenum formatType;
+        if (glType != 0 && !Image_GetFormatInfo(format, &bytesPerPixel, &glFormat, &formatType))
+        {
+            LogWarn("texture cache '%s' has a wrong format %d", path.c_str(), int(format));
+            return false;
+        }
+
+        planes->mips[plane].resize(size_t(levels - 1));
+        for (int level = 0; level < levels; ++level)
+        {
+            Image* image = level == 0 ? &planes->planes[plane] : &planes->mips[plane][level - 1];
+            image->format = format;
+            image->glFormat = glType == 0 ? header[KtxGlInternalFormat] : header[KtxGlFormat];
+            image->glType = glType;
+            image->width = max(width >> level, 1);
+            image->height = max(height >> level, 1);
+
+            uint32_t imageSize = 0;
+            int rows = glType == 0 ? (image->height + 3) / 4 : image->height;
+            if (SDL_RWread(rw, &imageSize, sizeof(imageSize), 1) != 1 || imageSize == 0 || imageSize % uint32_t(rows) != 0)
+            {
+                LogWarn("texture cache '%s' has a wrong image size", path.c_str());
+                return false;
+            }
+
+            image->pitch = int(imageSize / uint32_t(rows));
+            image->unpackAlignment = glType == 0 ? 4 : Image_GetUnpackAlignment(image->width * bytesPerPixel, image->pitch);
+            if (image->unpackAlignment == 0)
+            {
+                LogWarn("texture cache '%s' has a wrong pitch", path.c_str());
+                return false;
+            }
+
+            image->pixels = PixelBufferPool::Singleton().Acquire(imageSize);
+            uint32_t padding = 3 - (imageSize + 3) % 4;
+            if (SDL_RWread(rw, image->pixels->GetData(), imageSize, 1) != 1 || (padding > 0 && SDL_RWseek(rw, padding, RW_SEEK_CUR) < 0))
+            {
+                LogWarn("texture cache '%s' is truncated", path.c_str());
+                return false;
+            }
+
+            *bytes += imageSize;
+        }
+
+        return true;
+    }
+
+
+    static bool WritePlane(const string& path, const ImagePlanes& planes, int plane, size_t* bytes)
+    {
+        const Image& image = planes.planes[plane];
+        const vector<Image>& mips = planes.mips[plane];
+
+        uint32_t header[KtxHeaderFields] = {};
+        header[KtxEndianness] = KtxEndiannessValue;
+        header[KtxGlType] = image.glType;
+        header[KtxGlTypeSize] = image.glType == 0 || image.glType == GL_UNSIGNED_BYTE ? 1 : 2;
+        header[KtxGlFormat] = image.glType == 0 ? 0 : image.glFormat;
+        header[KtxGlInternalFormat] = image.glFormat;
+        header[KtxGlBaseInternalFormat] = image.glType == 0 ? GL_RGB : image.glFormat;
+        header[KtxPixelWidth] = uint32_t(image.width);
+        header[KtxPixelHeight] = uint32_t(image.height);
+        header[KtxNumberOfFaces] = 1;
+        header[KtxNumberOfMipmapLevels] = uint32_t(1 + mips.size());
+        header[KtxBytesOfKeyValueData] = sizeof(PlaneKeyValue);
+
+        PlaneKeyValue keyValue;
+        keyValue.keyAndValueByteSize = sizeof(keyValue) - sizeof(keyValue.keyAndValueByteSize);
+        memcpy(keyValue.key, s_planeKey, sizeof(s_planeKey));
+        keyValue.fields[PlanesFormat] = uint32_t(planes.format);
+        keyValue.fields[PlanesWidth] = uint32_t(planes.width);
+        keyValue.fields[PlanesHeight] = uint32_t(planes.height);
+        keyValue.fields[PlanesCount] = uint32_t(planes.count);
+        keyValue.fields[PlaneFormat] = uint32_t(image.format);
+
+        return File_WriteAtomically(path, "texture cache", [&](SDL_RWops* rw)
+        {
+            bool written = SDL_RWwrite(rw, KtxIdentifier, sizeof(KtxIdentifier), 1) == 1
+                        && SDL_RWwrite(rw, header, sizeof(header), 1) == 1
+                        && SDL_RWwrite(rw, &keyValue, sizeof(keyValue), 1) == 1;
+
+            for (size_t level = 0; written && level <= mips.size(); ++level)
+            {
+                const Image& levelImage = level == 0 ? image : mips[level - 1];
+                static const uint8_t s_padding[3] = {};
+                uint32_t imageSize = uint32_t(GetLevelBytes(levelImage));
+                uint32_t padding = 3 - (imageSize + 3) % 4;
+
+                written = SDL_RWwrite(rw, &imageSize, sizeof(imageSize), 1) == 1
+                       && SDL_RWwrite(rw, levelImage.pixels->GetData(), imageSize, 1) == 1
+                       && (padding == 0 || SDL_RWwrite(rw, s_padding, padding, 1) == 1);
+
+                *bytes += imageSize;
+            }
+
+            return written;
+        });
+    }
+
+
+    bool TextureDiskCache::Has(uint64_t sourceHash, const string& key)
+    {
+        string name = GetEntryName(sourceHash, key);
+
+        ThreadLockGuard lock(m_lock);
+        if (m_directory.empty())
+        {
+            return false;
+        }
+
+        if (!m_loaded)
+        {
+            LoadIndex();
+        }
+
+        return m_entries.find(name) != m_entries.end();
+    }
+
+
+    bool TextureDiskCache::Read(uint64_t sourceHash, const string& key, ImagePlanes* planes)
+    {
+        DI_SAVE_CALLSTACK();
+
+        string name = GetEntryName(sourceHash, key);
+
+        ThreadLockGuard lock(m_lock);
+        if (m_directory.empty())
+        {
+            return false;
+        }
+
+        if (!m_loaded)
+        {
+            LoadIndex();
+        }
+
+        auto found = m_entries.find(name);
+        if (found == m_entries.end())
+        {
+            return false;
+        }
+
+        found->second.lastUse = ++m_lastUse;
+        m_dirty = true;
+        int count = found->second.planes;
+        lock.Unlock();
+
+        size_t bytes = 0;
+        *planes = ImagePlanes();
+        for (int plane = 0; plane < count; ++plane)
+        {
+            if (!ReadPlane(GetPlanePath(name, plane), planes, plane, &bytes) || planes->count != count)
+            {
+                *planes = ImagePlanes();
+
+                ThreadLockGuard lockAgain(m_lock);
+                DeleteEntry(name);
+                SaveIndex();
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+
+    bool TextureDiskCache::Write(uint64_t sourceHash, const string& key, const ImagePlanes& planes)
+    {
+        DI_SAVE_CALLSTACK();
+
+        string name = GetEntryName(sourceHash, key);
+
+        {
+            ThreadLockGuard lock(m_lock);
+            if (m_directory.empty())
+            {
+                return false;
+            }
+
+            if (!m_loaded)
+            {
+                LoadIndex();
+            }
+        }
+
+        size_t bytes = 0;
+        for (int plane = 0; plane < planes.count; ++plane)
+        {
+            if (!WritePlane(GetPlanePath(name, plane), planes, plane, &bytes))
+            {
+                for (int written = 0; written < plane; ++written)
+                {
+                    remove(GetPlanePath(name, written).c_str());
+                }
+                return false;
+            }
+        }
+
+        ThreadLockGuard lock(m_lock);
+
+        auto found = m_entries.find(name);
+        if (found != m_entries.end())
+        {
+            m_bytes -= found->second.bytes;
+        }
+
+        Entry& entry = m_entries[name];
+        entry.planes = planes.count;
+        entry.bytes = bytes;
+        entry.lastUse = ++m_lastUse;
+        m_bytes += bytes;
+
+        // the new entry is the last one to go, and goes too if it alone is over the limit
+        Trim(m_maxBytes);
+        SaveIndex();
+        return true;
+    }
+
+
+    void TextureDiskCache::Flush()
+    {
+        ThreadLockGuard lock(m_lock);
+        if (m_loaded && m_dirty)
+        {
+            SaveIndex();
+        }
+    }
+
+
+    // the index is "DiTextureCache <Version>", then a line of "<name> <planes> <bytes> <last use>" for each entry
+    void TextureDiskCache::LoadIndex()
+    {
+        DI_SAVE_CALLSTACK();
+
+        m_loaded = true;
+
+        string path = m_directory + "texcache_index.txt";
+        SDL_RWops* rw = SDL_RWFromFile(path.c_str(), "rb");
+        if (!rw)
+        {
+            DeleteOrphans();
+            return;
+        }
+
+        string text(size_t(max(SDL_RWsize(rw), Sint64(0))), '\0');
+        bool read = text.empty() || SDL_RWread(rw, &text[0], text.size(), 1) == 1;
+        SDL_RWclose(rw);
+        if (!read)
+        {
+            LogWarn("read texture cache index '%s' failed", path.c_str());
+            return;
+        }
+
+        int version = 0;
+        size_t lineStart = 0;
+        for (int line = 0; lineStart < text.size(); ++line)
+        {
+            size_t lineEnd = text.find('\n', lineStart);
+            if (lineEnd == string::npos)
+            {
+                lineEnd = text.size();
+            }
+
+            string lineText = text.substr(lineStart, lineEnd - lineStart);
+            lineStart = lineEnd + 1;
+
+            if (line == 0)
+            {
+                SDL_sscanf(lineText.c_str(), "DiTextureCache %d", &version);
+                continue;
+            }
+
+            char name[64];
+            int planes;
+            unsigned long long bytes;
+            unsigned long long lastUse;
+            if (SDL_sscanf(lineText.c_str(), "%63s %d %llu %llu", name, &planes, &bytes, &lastUse) != 4 || planes < 1 || planes > ImagePlanes::MaxPlanes)
+            {
+                continue;
+            }
+
+            Entry& entry = m_entries[name];
+            entry.planes = planes;
+            entry.bytes = size_t(bytes);
+            entry.lastUse = lastUse;
+            m_bytes += entry.bytes;
+            m_lastUse = max(m_lastUse, uint64_t(lastUse));
+        }
+
+        if (version != Version)
+        {
+            LogInfo("texture cache version %d is not %d, %d entries deleted", version, int(Version), int(m_entries.size()));
+            Trim(0);
+            SaveIndex();
+            DeleteOrphans();
+            return;
+        }
+
+        // the limit may have been lowered since the last run
+        size_t count = m_entries.size();
+        Trim(m_maxBytes);
+        if (m_entries.size() != count)
+        {
+            SaveIndex();
+        }
+
+        LogInfo("texture cache: %d entries, %.1f KB", int(m_entries.size()), m_bytes / 1024.0);
+    }
+
+
+    void TextureDiskCache::SaveIndex()
+    {
+        DI_SAVE_CALLSTACK();
+
+        string text;
+        char line[128];
+        SDL_snprintf(line, sizeof(line), "DiTextureCache %d\n", int(Version));
+        text += line;
+
+        for (auto iter = m_entries.begin(); iter != m_entries.end(); ++iter)
+        {
+            SDL_snprintf(line, sizeof(line), "%s %d %llu %llu\n", iter->first.c_str(), iter->second.planes,
+                (unsigned long long)iter->second.bytes, (unsigned long long)iter->second.lastUse);
+            text += line;
+        }
+
+        string path = m_directory + "texcache_index.txt";
+        if (File_WriteAtomically(path, "texture cache index", [&text](SDL_RWops* rw) { return SDL_RWwrite(rw, text.data(), text.size(), 1) == 1; }))
+        {
+            m_dirty = false;
+        }
+    }
+
+
+    // files no index knows: the entries of the ETC1 cache this one replaced ("etc1_<name>_<source size>_<options>.ktx"),
+    // and planes of an older version whose index was lost
+    void TextureDiskCache::DeleteOrphans()
+    {
+        DI_SAVE_CALLSTACK();
+
+        vector<string> names;
+        if (!File_ListDirectory(m_directory, &names))
+        {
+            return;
+        }
+
+        int deleted = 0;
+        for (auto iter = names.begin(); iter != names.end(); ++iter)
+        {
+            const string& name = *iter;
+            if (name.size() <= 4 || name.compare(name.size() - 4, 4, ".ktx") != 0)
+            {
+                continue;
+            }
+
+            bool etc1 = name.compare(0, 5, "etc1_") == 0;
+            bool plane = name.compare(0, 9, "texcache_") == 0 && m_entries.find(name.substr(0, name.rfind('_'))) == m_entries.end();
+            if (etc1 || plane)
+            {
+                remove((m_directory + name).c_str());
+                ++deleted;
+            }
+        }
+
+        if (deleted > 0)
+        {
+            LogInfo("texture cache: %d orphaned files deleted", deleted);
+        }
+    }
+
+
+    void TextureDiskCache::DeleteEntry(const string& name)
+    {
+        auto found = m_entries.find(name);
+        if (found == m_entries.end())
+        {
+            return;
+        }
+
+        for (int plane = 0; plane < found->second.planes; ++plane)
+        {
+            remove(GetPlanePath(name, plane).c_str());
+        }
+
+        m_bytes -= found->second.bytes;
+        m_entries.erase(found);
+        m_dirty = true;
+    }
+
+
+    void TextureDiskCache::Trim(size_t maxBytes)
+    {
+        while (m_bytes > maxBytes && !m_entries.empty())
+        {
+            auto oldest = m_entries.begin();
+            for (auto iter = m_entries.begin(); iter != m_entries.end(); ++iter)
+            {
+                if (iter->second.lastUse < oldest->second.lastUse)
+                {
+                    oldest = iter;
+                }
+            }
+
+            string name = oldest->first;
+            DeleteEntry(name);
+        }
+    }
+}
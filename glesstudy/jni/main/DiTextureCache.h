@@ -0,0 +1,74 @@
+#ifndef DI_TEXTURE_CACHE_H_INCLUDED
+#define DI_TEXTURE_CACHE_H_INCLUDED
+
+#include "DiImage.h"
+
+namespace di
+{
+    // Upload-ready textures kept in SDL_GetPrefPath() (TextureOptions::diskCache), so a later run reads them
+    // instead of decoding, converting or encoding the image again.
+    // an entry is the ImagePlanes made by SDLTextureLoader, one KTX file per plane, named by a hash which tells the source
+    // file apart (see SDLTextureLoader) and the hash of a key of everything else which changes the planes (the options,
+    // the GL formats of the device).
+    // the index of the entries is a text file next to them, which also keeps their use order: beyond the size limit
+    // the least recently used entries are deleted, and a cache of another Version is deleted as a whole, together with
+    // the files no index knows (e.g. of the ETC1 cache this one replaced).
+    // thread safe, Read() and Write() are called by worker thread
+    class TextureDiskCache
+    {
+    public:
+        enum { Version = 2 };       // raise it when the planes written by the loaders or their source hashes change. 2: source stamps
+
+        // false if there is no writable directory. ONLY in GL thread (see PrefPath_Get)
+        bool Open();
+
+        // the files of all entries, 64 MB by default
+        void SetMaxBytes(size_t bytes);
+        size_t GetBytes();
+
+        // whether Read() would find the entry, without reading it
+        bool Has(uint64_t sourceHash, const string& key);
+
+        // false if there is no such entry or its files are broken (the entry is deleted then)
+        bool Read(uint64_t sourceHash, const string& key, ImagePlanes* planes);
+        bool Write(uint64_t sourceHash, const string& key, const ImagePlanes& planes);
+
+        // save the use order of the entries read since the last save. Write() saves by itself
+        void Flush();
+
+        static uint64_t HashBytes(const uint8_t* bytes, size_t size);
+
+        static TextureDiskCache& Singleton();
+
+    private:
+        TextureDiskCache() : m_opened(false), m_loaded(false), m_dirty(false), m_bytes(0), m_maxBytes(64 * 1024 * 1024), m_lastUse(0) {}
+
+        struct Entry
+        {
+            int planes;
+            size_t bytes;
+            uint64_t lastUse;
+        };
+
+        string GetPlanePath(const string& name, int plane) const;
+        void LoadIndex();
+        void SaveIndex();
+        void DeleteEntry(const string& name);
+        void Trim(size_t maxBytes);
+        void DeleteOrphans();
+
+        ThreadLock m_lock;
+        bool m_opened;
+        bool m_loaded;              // the index is read lazily, by the first Read() or Write() in worker thread
+        bool m_dirty;
+        string m_directory;
+        unordered_map<string, Entry> m_entries;
+        size_t m_bytes;
+        size_t m_maxBytes;
+        uint64_t m_lastUse;
+
+        DI_DISABLE_COPY(TextureDiskCache);
+    };
+}
+
+#endif
@@ -0,0 +1,298 @@
+#include "DiTextureShader.h"
+
+#ifdef WIN32
+#   define DI_SHADER_PRECISION  "#define highp\n#define mediump\n#define lowp\n"
+#else
+#   define DI_SHADER_PRECISION  "precision mediump float;\n"
+#endif
+
+namespace di
+{
+    unique_ptr<TextureShader> TextureShader::s_singleton;
+
+
+    static const char s_vertexSource[] =
+        DI_SHADER_PRECISION
+        "attribute vec4 vPosition;\n"
+        "varying highp vec2 vTexcoord;\n"
+        "void main() {\n"
+        "  vTexcoord = vec2(vPosition.x * 0.5 + 0.5, 0.5 - vPosition.y * 0.5);\n"
+        "  gl_Position = vPosition;\n"
+        "}\n";
+
+
+    // RGBA / RGB / 16 bit formats / Gray_8, the GPU expands them
+    static const char s_plainSource[] =
+        DI_SHADER_PRECISION
+        "varying highp vec2 vTexcoord;\n"
+        "uniform lowp sampler2D tex;\n"
+        "void main() {\n"
+        "  gl_FragColor = texture2D(tex, vTexcoord);\n"
+        "}\n";
+
+
+    // JFIF: Y, U, V all in [0, 255], BT.601 coefficients
+    static const char s_yuvSource[] =
+        DI_SHADER_PRECISION
+        "varying highp vec2 vTexcoord;\n"
+        "uniform lowp sampler2D tex;\n"
+        "uniform lowp sampler2D subTex0;\n"
+        "uniform lowp sampler2D subTex1;\n"
+        "void main() {\n"
+        "  mediump float y = texture2D(tex, vTexcoord).r;\n"
+        "  mediump float u = texture2D(subTex0, vTexcoord).r - 0.501961;\n"
+        "  mediump float v = texture2D(subTex1, vTexcoord).r - 0.501961;\n"
+        "  gl_FragColor = vec4(y + 1.402 * v, y - 0.344136 * u - 0.714136 * v, y + 1.772 * u, 1.0);\n"
+        "}\n";
+
+
+    // VP8: Y in [16, 235], U and V in [16, 240], BT.601 coefficients
+    static const char s_yuvVideoRangeSource[] =
+        DI_SHADER_PRECISION
+        "varying highp vec2 vTexcoord;\n"
+        "uniform lowp sampler2D tex;\n"
+        "uniform lowp sampler2D subTex0;\n"
+        "uniform lowp sampler2D subTex1;\n"
+        "void main() {\n"
+        "  mediump float y = 1.164383 * (texture2D(tex, vTexcoord).r - 0.062745);\n"
+        "  mediump float u = texture2D(subTex0, vTexcoord).r - 0.501961;\n"
+        "  mediump float v = texture2D(subTex1, vTexcoord).r - 0.501961;\n"
+        "  gl_FragColor = vec4(y + 1.596027 * v, y - 0.391762 * u - 0.812968 * v, y + 2.017232 * u, 1.0);\n"
+        "}\n";
+
+
+    // the index is a texel of GL_LUMINANCE in [0, 1], the palette has 256 texels in a row
+    static const char s_paletteSource[] =
+        DI_SHADER_PRECISION
+        "varying highp vec2 vTexcoord;\n"
+        "uniform lowp sampler2D tex;\n"
+        "uniform lowp sampler2D subTex0;\n"
+        "void main() {\n"
+        "  mediump float index = texture2D(tex, vTexcoord).r;\n"
+        "  gl_FragColor = texture2D(subTex0, vec2(index * (255.0 / 256.0) + (0.5 / 256.0), 0.5));\n"
+        "}\n";
+
+
+    // GL_ALPHA samples as (0, 0, 0, a), the color comes from the tint
+    static const char s_alphaMaskSource[] =
+        DI_SHADER_PRECISION
+        "varying highp vec2 vTexcoord;\n"
+        "uniform lowp sampler2D tex;\n"
+        "uniform lowp vec4 tint;\n"
+        "void main() {\n"
+        "  gl_FragColor = vec4(tint.rgb, tint.a * texture2D(tex, vTexcoord).a);\n"
+        "}\n";
+
+
+    // ETC1 color, and the alpha as a gray ETC1 texture
+    static const char s_etc1AlphaSource[] =
+        DI_SHADER_PRECISION
+        "varying highp vec2 vTexcoord;\n"
+        "uniform lowp sampler2D tex;\n"
+        "uniform lowp sampler2D subTex0;\n"
+        "void main() {\n"
+        "  gl_FragColor = vec4(texture2D(tex, vTexcoord).rgb, texture2D(subTex0, vTexcoord).g);\n"
+        "}\n";
+
+
+    // color in the top half, alpha in the bottom half
+    static const char s_etc1AlphaStackedSource[] =
+        DI_SHADER_PRECISION
+        "varying highp vec2 vTexcoord;\n"
+        "uniform lowp sampler2D tex;\n"
+        "void main() {\n"
+        "  highp vec2 colorCoord = vec2(vTexcoord.x, vTexcoord.y * 0.5);\n"
+        "  gl_FragColor = vec4(texture2D(tex, colorCoord).rgb, texture2D(tex, colorCoord + vec2(0.0, 0.5)).g);\n"
+        "}\n";
+
+
+    static GLuint CompileShader(GLenum type, const char* source)
+    {
+        GLuint shader = glCreateShader(type);
+        if (!shader)
+        {
+            LogError("glCreateShader(%d) failed", int(type));
+            return 0;
+        }
+
+        glShaderSource(shader, 1, &source, NULL);
+        glCompileShader(shader);
+
+        GLint compiled = 0;
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+        if (!compiled)
+        {
+            GLint logLength = 0;
+            glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &logLength);
+
+            string log(size_t(max(logLength, 1)), '\0');
+            glGetShaderInfoLog(shader, GLsizei(log.size()), NULL, &log[0]);
+            LogError("compile shader %d failed:\n%s", int(type), log.c_str());
+
+            glDeleteShader(shader);
+            return 0;
+        }
+
+        return shader;
+    }
+
+
+    static GLuint LinkProgram(const char* vertexSource, const char* fragmentSource)
+    {
+        GLuint vertexShader = CompileShader(GL_VERTEX_SHADER, vertexSource);
+        GLuint fragmentShader = CompileShader(GL_FRAGMENT_SHADER, fragmentSource);
+
+        // the program keeps the shaders alive as long as they are attached
+        auto shaderDeleter = MakeCallAtScopeExit([vertexShader, fragmentShader]() { glDeleteShader(vertexShader); glDeleteShader(fragmentShader); });
+
+        if (!vertexShader || !fragmentShader)
+        {
+            return 0;
+        }
+
+        GLuint program = glCreateProgram();
+        glAttachShader(program, vertexShader);
+        glAttachShader(program, fragmentShader);
+        glLinkProgram(program);
+
+        GLint linked = GL_FALSE;
+        glGetProgramiv(program, GL_LINK_STATUS, &linked);
+        if (linked != GL_TRUE)
+        {
+            GLint logLength = 0;
+            glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLength);
+
+            string log(size_t(max(logLength, 1)), '\0');
+            glGetProgramInfoLog(program, GLsizei(log.size()), NULL, &log[0]);
+            LogError("link program failed:\n%s", log.c_str());
+
+            glDeleteProgram(program);
+            return 0;
+        }
+
+        return program;
+    }
+
+
+    TextureShader::~TextureShader()
+    {
+        for (auto& p : m_programs)
+        {
+            GlDeletionQueue::Singleton().DeleteProgram(p.second.program);
+        }
+    }
+
+
+    const char* TextureShader::GetVertexSource()
+    {
+        return s_vertexSource;
+    }
+
+
+    const char* TextureShader::GetFragmentSource(TextureProtocol::InnerFormat format)
+    {
+        switch (format)
+        {
+        case TextureProtocol::YUV:                      return s_yuvSource;
+        case TextureProtocol::YUV_VideoRange:           return s_yuvVideoRangeSource;
+        case TextureProtocol::RGBA_8888_Palette_256:    return s_paletteSource;
+        case TextureProtocol::Alpha_8:                  return s_alphaMaskSource;
+        case TextureProtocol::ETC1_RGB_Alpha:           return s_etc1AlphaSource;
+        case TextureProtocol::ETC1_RGB_AlphaStacked:    return s_etc1AlphaStackedSource;
+        default:                                        return s_plainSource;
+        }
+    }
+
+
+    const TextureShader::Program* TextureShader::GetProgram(TextureProtocol::InnerFormat format)
+    {
+        const char* fragmentSource = GetFragmentSource(format);
+
+        auto iter = m_programs.find(fragmentSource);
+        if (iter == m_programs.end())
+        {
+            DI_SAVE_CALLSTACK();
+
+            // a failed program is also kept, so it is not compiled again every frame
+            Program p;
+            p.program = LinkProgram(s_vertexSource, fragmentSource);
+            p.positionLocation = -1;
+            p.tintLocation = -1;
+
+            if (p.program)
+            {
+                p.positionLocation = glGetAttribLocation(p.program, "vPosition");
+                p.tintLocation = glGetUniformLocation(p.program, "tint");
+
+                glUseProgram(p.program);
+                glUniform1i(glGetUniformLocation(p.program, "tex"), 0);
+                glUniform1i(glGetUniformLocation(p.program, "subTex0"), 1);
+                glUniform1i(glGetUniformLocation(p.program, "subTex1"), 2);
+                DI_DBG_CHECK_GL_ERRORS();
+            }
+            else
+            {
+                LogError("no program for texture format %d", int(format));
+            }
+
+            iter = m_programs.insert(make_pair(fragmentSource, p)).first;
+        }
+
+        return (*iter).second.program ? &(*iter).second : nullptr;
+    }
+
+
+    GLint TextureShader::Use(const ImageAsTexture& texture)
+    {
+        GLuint subTextures[TextureProtocol::MaxSubTextures];
+        for (int i = 0; i < TextureProtocol::MaxSubTextures; ++i)
+        {
+            subTextures[i] = texture.GetGlSubTexture(i);
+        }
+
+        return Use(texture.GetInnerFormat(), texture.GetGlTexture(), subTextures);
+    }
+
+
+    GLint TextureShader::Use(const TextureProtocol& texture)
+    {
+        GLuint subTextures[TextureProtocol::MaxSubTextures];
+        for (int i = 0; i < TextureProtocol::MaxSubTextures; ++i)
+        {
+            subTextures[i] = texture.GetGlSubTexture(i);
+        }
+
+        return Use(texture.GetInnerFormat(), texture.GetGlTexture(), subTextures);
+    }
+
+
+    GLint TextureShader::Use(TextureProtocol::InnerFormat format, GLuint texture, const GLuint* subTextures)
+    {
+        const Program* p = GetProgram(format);
+        if (!p)
+        {
+            return -1;
+        }
+
+        glUseProgram(p->program);
+
+        if (p->tintLocation >= 0)
+        {
+            glUniform4fv(p->tintLocation, 1, m_maskTint);
+        }
+
+        for (int i = 0; i < TextureProtocol::MaxSubTextures; ++i)
+        {
+            if (subTextures[i])
+            {
+                glActiveTexture(GL_TEXTURE1 + i);
+                glBindTexture(GL_TEXTURE_2D, subTextures[i]);
+            }
+        }
+
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, texture);
+
+        return p->positionLocation;
+    }
+}
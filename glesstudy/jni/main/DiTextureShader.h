@@ -0,0 +1,64 @@
+#ifndef DI_TEXTURE_SHADER_H_INCLUDED
+#define DI_TEXTURE_SHADER_H_INCLUDED
+
+#include "DiResource.h"
+
+#include <unordered_map>
+
+namespace di
+{
+    // Programs which draw an ImageAsTexture whatever its InnerFormat is.
+    // The vertex shader maps attribute 'vPosition' in [-1, 1] to texture coordinates,
+    // the fragment shader of each format samples the texture (and its sub textures) and outputs RGBA,
+    // e.g. YUV planes are converted to RGB here instead of by the CPU.
+    class TextureShader
+    {
+    public:
+        ~TextureShader();
+
+        // glUseProgram the program of the texture's format, bind the texture and its sub textures to units 0, 1, ...
+        // returns the location of attribute 'vPosition', or -1 if the program is not available
+        GLint Use(const ImageAsTexture& texture);
+
+        // same as above, for resources which are a TextureProtocol themselves (e.g. ImageTile)
+        GLint Use(const TextureProtocol& texture);
+
+        // color of Alpha_8 textures, white by default. applied by the next Use()
+        void SetMaskTint(float r, float g, float b, float a) { m_maskTint[0] = r; m_maskTint[1] = g; m_maskTint[2] = b; m_maskTint[3] = a; }
+
+        // the programs went with a lost GL context (see ResourceManager::CheckContextLost), forget them without deleting.
+        // they are made again by the next Use()
+        void LoseContext() { m_programs.clear(); }
+
+        // fragment shader source of an InnerFormat. samplers are 'tex', 'subTex0', 'subTex1'
+        static const char* GetFragmentSource(TextureProtocol::InnerFormat format);
+        static const char* GetVertexSource();
+
+        // ONLY in GL thread
+        static TextureShader& Singleton() { if (!s_singleton) { s_singleton.reset(new TextureShader()); } return *s_singleton; }
+        static void DestroySingleton() { s_singleton.reset(); }
+
+    private:
+        TextureShader() { SetMaskTint(1.0f, 1.0f, 1.0f, 1.0f); }
+
+        struct Program
+        {
+            GLuint program;
+            GLint positionLocation;
+            GLint tintLocation;
+        };
+
+        const Program* GetProgram(TextureProtocol::InnerFormat format);
+        GLint Use(TextureProtocol::InnerFormat format, GLuint texture, const GLuint* subTextures);
+
+        // formats sharing a fragment shader share the program, so the key is the source
+        unordered_map<const char*, Program> m_programs;
+        GLfloat m_maskTint[4];
+
+        static unique_ptr<TextureShader> s_singleton;
+
+        DI_DISABLE_COPY(TextureShader);
+    };
+}
+
+#endif
@@ -0,0 +1,195 @@
+#include "DiTextureVariant.h"
+#include "DiAssetPack.h"
+
+#include <unordered_map>
+
+namespace di
+{
+    const GpuTextureCaps& GpuTextureCaps_Get()
+    {
+        static bool s_probed = false;
+        static GpuTextureCaps s_caps;
+
+        if (!s_probed)
+        {
+            s_probed = true;
+
+            // the same probe the KTX loader uses to choose upload formats
+            KTX_context_capabilities ktxCaps;
+            ktxGetContextCapabilities(&ktxCaps);
+
+            s_caps.isES = ktxCaps.isES != GL_FALSE;
+            s_caps.majorVersion = ktxCaps.majorVersion;
+            s_caps.minorVersion = ktxCaps.minorVersion;
+
+            // ETC2 is core in GLES 3.0 and OpenGL 4.3
+            bool es3 = s_caps.isES && s_caps.majorVersion >= 3;
+            bool gl43 = !s_caps.isES && (s_caps.majorVersion > 4 || (s_caps.majorVersion == 4 && s_caps.minorVersion >= 3));
+
+            s_caps.etc1 = SDL_GL_ExtensionSupported("GL_OES_compressed_ETC1_RGB8_texture") == SDL_TRUE;
+            s_caps.etc2 = es3 || gl43 || SDL_GL_ExtensionSupported("GL_ARB_ES3_compatibility") == SDL_TRUE;
+            s_caps.astc = SDL_GL_ExtensionSupported("GL_KHR_texture_compression_astc_ldr") == SDL_TRUE ||
+                          SDL_GL_ExtensionSupported("GL_OES_texture_compression_astc") == SDL_TRUE;
+            s_caps.s3tc = SDL_GL_ExtensionSupported("GL_EXT_texture_compression_s3tc") == SDL_TRUE;
+            s_caps.npotMipmaps = !s_caps.isES || s_caps.majorVersion >= 3 || SDL_GL_ExtensionSupported("GL_OES_texture_npot") == SDL_TRUE;
+
+            LogInfo("GPU texture caps: %s %d.%d, ETC1 %d, ETC2 %d, ASTC %d, S3TC %d, NPOT mipmaps %d", s_caps.isES ? "OpenGL ES" : "OpenGL",
+                s_caps.majorVersion, s_caps.minorVersion, int(s_caps.etc1), int(s_caps.etc2), int(s_caps.astc), int(s_caps.s3tc), int(s_caps.npotMipmaps));
+        }
+
+        return s_caps;
+    }
+
+
+    const char* TextureVariant_GetSuffix(TextureVariant variant)
+    {
+        switch (variant)
+        {
+        case TextureVariant_ASTC:   return "astc";
+        case TextureVariant_ETC2:   return "etc2";
+        case TextureVariant_S3TC:   return "s3tc";
+        case TextureVariant_ETC1:   return "etc1";
+        default:                    return "";
+        }
+    }
+
+
+    bool TextureVariant_IsSupported(TextureVariant variant, const GpuTextureCaps& caps)
+    {
+        switch (variant)
+        {
+        case TextureVariant_ASTC:   return caps.astc;
+        case TextureVariant_ETC2:   return caps.etc2;
+        case TextureVariant_S3TC:   return caps.s3tc;
+        case TextureVariant_ETC1:   return caps.etc1;   // GL_ETC1_RGB8_OES itself is not accepted by ETC2 only contexts
+        default:                    return false;
+        }
+    }
+
+
+    string TextureVariant_GetFileName(const string& name, TextureVariant variant)
+    {
+        size_t slash = name.find_last_of("/\\");
+        size_t dot = name.find_last_of('.');
+        string base = (dot != string::npos && (slash == string::npos || dot > slash)) ? name.substr(0, dot) : name;
+        return base + "." + TextureVariant_GetSuffix(variant) + ".ktx";
+    }
+
+
+    bool TextureVariant_IsKtx(const string& name)
+    {
+        size_t slash = name.find_last_of("/\\");
+        size_t dot = name.find_last_of('.');
+        return dot != string::npos && (slash == string::npos || dot > slash) && SDL_strcasecmp(name.c_str() + dot + 1, "ktx") == 0;
+    }
+
+
+    vector<string> TextureVariant_List(const string& name)
+    {
+        vector<string> variants;
+
+        if (TextureVariant_IsKtx(name))
+        {
+            return variants;
+        }
+
+        const GpuTextureCaps& caps = GpuTextureCaps_Get();
+        for (int i = 0; i < TextureVariant_Count; ++i)
+        {
+            TextureVariant variant = TextureVariant(i);
+            if (TextureVariant_IsSupported(variant, caps))
+            {
+                variants.push_back(TextureVariant_GetFileName(name, variant));
+            }
+        }
+
+        return variants;
+    }
+
+
+    // the KTX files of a directory, listed once. a directory which can not be listed (the assets in the APK)
+    // is probed file by file and each answer is kept, so no file is opened twice
+    struct VariantDirectory
+    {
+        bool listed;
+        unordered_map<string, bool> exists;     // by file name
+    };
+
+
+    static bool VariantFile_Exists(const string& path)
+    {
+        static ThreadLock* s_lock = new ThreadLock();
+        static unordered_map<string, VariantDirectory>* s_directories = new unordered_map<string, VariantDirectory>();
+
+        size_t slash = path.find_last_of("/\\");
+        string directory = slash != string::npos ? path.substr(0, slash + 1) : string();
+        string file = slash != string::npos ? path.substr(slash + 1) : path;
+
+        ThreadLockGuard lock(*s_lock);
+
+        auto found = s_directories->find(directory);
+        if (found == s_directories->end())
+        {
+            VariantDirectory entry;
+            entry.listed = false;
+
+#ifdef __ANDROID__
+            // SDL_RWFromFile() reads relative paths from the APK, which opendir() can not see
+            bool listable = !directory.empty() && directory[0] == '/';
+#else
+            bool listable = true;
+#endif
+            vector<string> names;
+            if (listable && File_ListDirectory(directory.empty() ? string("./") : directory, &names))
+            {
+                entry.listed = true;
+                for (auto iter = names.begin(); iter != names.end(); ++iter)
+                {
+                    if (TextureVariant_IsKtx(*iter))
+                    {
+                        entry.exists[*iter] = true;
+                    }
+                }
+            }
+
+            found = s_directories->insert(make_pair(directory, entry)).first;
+        }
+
+        VariantDirectory& entry = found->second;
+        auto known = entry.exists.find(file);
+        if (known != entry.exists.end())
+        {
+            return known->second;
+        }
+        if (entry.listed)
+        {
+            return false;
+        }
+
+        SDL_RWops* rw = SDL_RWFromFile(path.c_str(), "rb");
+        if (rw)
+        {
+            SDL_RWclose(rw);
+        }
+
+        entry.exists[file] = rw != nullptr;
+        return rw != nullptr;
+    }
+
+
+    string TextureVariant_Find(const vector<string>& variants)
+    {
+        DI_SAVE_CALLSTACK();
+
+        for (auto iter = variants.begin(); iter != variants.end(); ++iter)
+        {
+            AssetView view;
+            if (AssetPack_Find(*iter, &view) || VariantFile_Exists(*iter))
+            {
+                return *iter;
+            }
+        }
+
+        return string();
+    }
+}
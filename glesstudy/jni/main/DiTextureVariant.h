@@ -0,0 +1,57 @@
+#ifndef DI_TEXTURE_VARIANT_H_INCLUDED
+#define DI_TEXTURE_VARIANT_H_INCLUDED
+
+#include "DiResource.h"
+
+namespace di
+{
+    // compressed formats the current GL context samples natively, and other texture limits
+    struct GpuTextureCaps
+    {
+        bool isES;
+        int majorVersion;
+        int minorVersion;
+        bool etc1;
+        bool etc2;          // ETC2 decoders also read ETC1 blocks
+        bool astc;          // LDR profile
+        bool s3tc;
+        bool npotMipmaps;   // mip levels of textures whose size is not a power of 2, GLES 2.0 needs GL_OES_texture_npot
+    };
+
+    // probed once by libktx's ktxGetContextCapabilities and the extension string. ONLY in GL thread
+    const GpuTextureCaps& GpuTextureCaps_Get();
+
+
+    // An image "dir/name.png" may be shipped with compressed variants beside it:
+    // "dir/name.astc.ktx", "dir/name.etc2.ktx", "dir/name.s3tc.ktx", "dir/name.etc1.ktx".
+    // The first variant in this order which the GPU samples natively and which exists is loaded instead of the image,
+    // so each device gets the smallest format it can upload without conversion. otherwise the image itself is loaded
+    enum TextureVariant
+    {
+        TextureVariant_ASTC,
+        TextureVariant_ETC2,
+        TextureVariant_S3TC,
+        TextureVariant_ETC1,
+        TextureVariant_Count,
+    };
+
+    // "astc", "etc2", "s3tc", "etc1"
+    const char* TextureVariant_GetSuffix(TextureVariant variant);
+    bool TextureVariant_IsSupported(TextureVariant variant, const GpuTextureCaps& caps);
+
+    // "dir/name.png" => "dir/name.etc2.ktx"
+    string TextureVariant_GetFileName(const string& name, TextureVariant variant);
+
+    // true if 'name' has the extension ".ktx" in any case, such a file has no variants
+    bool TextureVariant_IsKtx(const string& name);
+
+    // the variants of the image 'name' the GPU samples natively, in the order above. empty for a KTX file. ONLY in GL thread
+    vector<string> TextureVariant_List(const string& name);
+
+    // the first of 'variants' which is in an asset pack or exists as a file, "" if none. the directory of the files is
+    // listed once and kept (files added after are not seen). it may read the disk, so it is called by the worker thread
+    // (see ImageAsTexture)
+    string TextureVariant_Find(const vector<string>& variants);
+}
+
+#endif
@@ -0,0 +1,887 @@
+#include "DiTiledImage.h"
+#include "DiMemoryPressure.h"
+#include "DiAssetPack.h"
+#include "DiTextureCache.h"
+#include <cstring>
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+
+namespace di
+{
+    //
+    // pyramid file: "DITILES3", then the header fields below as uint32_t, then the tiles
+    //
+
+    enum PyramidHeaderField
+    {
+        PyramidSourceHashLow,
+        PyramidSourceHashHigh,
+        PyramidWidth,
+        PyramidHeight,
+        PyramidTileSize,
+        PyramidFormat,
+        PyramidHeaderFields,
+    };
+
+    static const char s_pyramidIdentifier[8] = { 'D', 'I', 'T', 'I', 'L', 'E', 'S', '3' };
+    static const uint64_t s_pyramidHeaderBytes = sizeof(s_pyramidIdentifier) + PyramidHeaderFields * sizeof(uint32_t);
+
+
+    void TilePyramid::Layout(int width, int height, TextureProtocol::InnerFormat format)
+    {
+        GLenum glFormat;
+        GLenum glType;
+        Image_GetFormatInfo(format, &bytesPerPixel, &glFormat, &glType);
+        this->format = format;
+
+        levels.clear();
+        offsets.clear();
+
+        uint64_t offset = s_pyramidHeaderBytes;
+        for (;;)
+        {
+            Level level;
+            level.width = width;
+            level.height = height;
+            level.tilesX = (width + TileSize - 1) / TileSize;
+            level.tilesY = (height + TileSize - 1) / TileSize;
+            level.firstTile = int(offsets.size());
+            levels.push_back(level);
+
+            int l = int(levels.size()) - 1;
+            for (int y = 0; y < level.tilesY; ++y)
+            {
+                for (int x = 0; x < level.tilesX; ++x)
+                {
+                    offsets.push_back(offset);
+                    offset += uint64_t(Image_GetAlignedPitch(GetStoredWidth(l, x), bytesPerPixel)) * GetStoredHeight(l, y);
+                }
+            }
+
+            if (width <= TileSize && height <= TileSize)
+            {
+                break;
+            }
+
+            // the same sizes as Image_GenerateMipmaps
+            width = max(width / 2, 1);
+            height = max(height / 2, 1);
+        }
+
+        offsets.push_back(offset);
+    }
+
+
+    // the pyramids of every version of a source share it, it has no spaces
+    static string GetPyramidBaseName(const string& name)
+    {
+        string baseName = "tiles_";
+        for (char c : name)
+        {
+            bool keep = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '.' || c == '-';
+            baseName += keep ? c : '_';
+        }
+
+        return baseName;
+    }
+
+
+    static string GetPyramidPath(const string& directory, const string& baseName, uint64_t sourceHash)
+    {
+        char suffix[32];
+        SDL_snprintf(suffix, sizeof(suffix), "_%016llx.dit", (unsigned long long)sourceHash);
+        return directory + baseName + suffix;
+    }
+
+
+    //
+    // The index of the pyramid files is a text file next to them, as the one of TextureDiskCache:
+    // "DiTilePyramids <IndexVersion>", then a line of "<source hash> <bytes> <last use> <base name>" for each source.
+    // thread safe, used by the worker thread when a TiledImage is loaded
+    //
+
+    class PyramidIndex
+    {
+    public:
+        enum { IndexVersion = 1 };
+
+        void SetMaxBytes(size_t bytes);
+
+        // the pyramid of 'baseName' is now the one of 'sourceHash', the file of any other version is deleted
+        void Use(const string& directory, const string& baseName, uint64_t sourceHash, uint64_t bytes);
+
+        static PyramidIndex& Singleton();
+
+    private:
+        PyramidIndex() : m_loaded(false), m_bytes(0), m_maxBytes(256 * 1024 * 1024), m_lastUse(0), m_firstUseOfRun(1) {}
+
+        struct Entry
+        {
+            uint64_t sourceHash;
+            uint64_t bytes;
+            uint64_t lastUse;
+        };
+
+        void Load();
+        void Save();
+        void Trim();
+
+        ThreadLock m_lock;
+        bool m_loaded;              // read by the first Use()
+        string m_directory;
+        unordered_map<string, Entry> m_entries;
+        uint64_t m_bytes;
+        size_t m_maxBytes;
+        uint64_t m_lastUse;
+        uint64_t m_firstUseOfRun;   // entries used since are kept beyond the limit, their tiles may be loading
+
+        DI_DISABLE_COPY(PyramidIndex);
+    };
+
+
+    PyramidIndex& PyramidIndex::Singleton()
+    {
+        static PyramidIndex s_index;
+        return s_index;
+    }
+
+
+    void PyramidIndex::SetMaxBytes(size_t bytes)
+    {
+        ThreadLockGuard lock(m_lock);
+        m_maxBytes = bytes;
+        if (m_loaded)
+        {
+            size_t count = m_entries.size();
+            Trim();
+            if (m_entries.size() != count)
+            {
+                Save();
+            }
+        }
+    }
+
+
+    void PyramidIndex::Use(const string& directory, const string& baseName, uint64_t sourceHash, uint64_t bytes)
+    {
+        DI_SAVE_CALLSTACK();
+
+        ThreadLockGuard lock(m_lock);
+        if (!m_loaded)
+        {
+            m_directory = directory;
+            Load();
+        }
+
+        auto found = m_entries.find(baseName);
+        if (found != m_entries.end())
+        {
+            m_bytes -= found->second.bytes;
+            if (found->second.sourceHash != sourceHash)
+            {
+                string stalePath = GetPyramidPath(m_directory, baseName, found->second.sourceHash);
+                remove(stalePath.c_str());
+                LogInfo("stale tile pyramid '%s' deleted", stalePath.c_str());
+            }
+        }
+
+        Entry& entry = m_entries[baseName];
+        entry.sourceHash = sourceHash;
+        entry.bytes = bytes;
+        entry.lastUse = ++m_lastUse;
+        m_bytes += bytes;
+
+        Trim();
+        Save();
+    }
+
+
+    void PyramidIndex::Load()
+    {
+        DI_SAVE_CALLSTACK();
+
+        m_loaded = true;
+
+        string path = m_directory + "tiles_index.txt";
+        SDL_RWops* rw = SDL_RWFromFile(path.c_str(), "rb");
+        if (!rw)
+        {
+            return;
+        }
+
+        string text(size_t(max(SDL_RWsize(rw), Sint64(0))), '\0');
+        bool read = text.empty() || SDL_RWread(rw, &text[0], text.size(), 1) == 1;
+        SDL_RWclose(rw);
+        if (!read)
+        {
+            LogWarn("read tile pyramid index '%s' failed", path.c_str());
+            return;
+        }
+
+        // an index of another version is ignored, its files are left as they are
+        int version = 0;
+        size_t lineStart = 0;
+        for (int line = 0; lineStart < text.size(); ++line)
+        {
+            size_t lineEnd = text.find('\n', lineStart);
+            if (lineEnd == string::npos)
+            {
+                lineEnd = text.size();
+            }
+
+            string lineText = text.substr(lineStart, lineEnd - lineStart);
+            lineStart = lineEnd + 1;
+
+            if (line == 0)
+            {
+                SDL_sscanf(lineText.c_str(), "DiTilePyramids %d", &version);
+                if (version != IndexVersion)
+                {
+                    break;
+                }
+                continue;
+            }
+
+            unsigned long long sourceHash;
+            unsigned long long bytes;
+            unsigned long long lastUse;
+            int nameStart = 0;
+            if (SDL_sscanf(lineText.c_str(), "%llx %llu %llu %n", &sourceHash, &bytes, &lastUse, &nameStart) != 3 ||
+                nameStart == 0 || size_t(nameStart) >= lineText.size())
+            {
+                continue;
+            }
+
+            Entry& entry = m_entries[lineText.substr(size_t(nameStart))];
+            entry.sourceHash = sourceHash;
+            entry.bytes = bytes;
+            entry.lastUse = lastUse;
+            m_bytes += entry.bytes;
+            m_lastUse = max(m_lastUse, uint64_t(lastUse));
+        }
+
+        m_firstUseOfRun = m_lastUse + 1;
+        LogInfo("tile pyramids: %d files, %.1f KB", int(m_entries.size()), m_bytes / 1024.0);
+    }
+
+
+    void PyramidIndex::Save()
+    {
+        DI_SAVE_CALLSTACK();
+
+        string text;
+        char line[96];
+        SDL_snprintf(line, sizeof(line), "DiTilePyramids %d\n", int(IndexVersion));
+        text += line;
+
+        for (auto iter = m_entries.begin(); iter != m_entries.end(); ++iter)
+        {
+            SDL_snprintf(line, sizeof(line), "%016llx %llu %llu ", (unsigned long long)iter->second.sourceHash,
+                (unsigned long long)iter->second.bytes, (unsigned long long)iter->second.lastUse);
+            text += line;
+            text += iter->first;
+            text += '\n';
+        }
+
+        string path = m_directory + "tiles_index.txt";
+        File_WriteAtomically(path, "tile pyramid index", [&text](SDL_RWops* rw) { return SDL_RWwrite(rw, text.data(), text.size(), 1) == 1; });
+    }
+
+
+    void PyramidIndex::Trim()
+    {
+        while (m_bytes > m_maxBytes)
+        {
+            auto oldest = m_entries.end();
+            for (auto iter = m_entries.begin(); iter != m_entries.end(); ++iter)
+            {
+                if (iter->second.lastUse < m_firstUseOfRun && (oldest == m_entries.end() || iter->second.lastUse < oldest->second.lastUse))
+                {
+                    oldest = iter;
+                }
+            }
+
+            if (oldest == m_entries.end())
+            {
+                return;
+            }
+
+            string path = GetPyramidPath(m_directory, oldest->first, oldest->second.sourceHash);
+            remove(path.c_str());
+            LogInfo("tile pyramid '%s' deleted, %.1f KB over the limit", path.c_str(), (m_bytes - m_maxBytes) / 1024.0);
+
+            m_bytes -= oldest->second.bytes;
+            m_entries.erase(oldest);
+        }
+    }
+
+
+    // false if the file does not exist or was written for another source
+    static bool ReadPyramid(TilePyramid* pyramid)
+    {
+        SDL_RWops* rw = SDL_RWFromFile(pyramid->path.c_str(), "rb");
+        if (!rw)
+        {
+            return false;
+        }
+
+        auto rwDeleter = MakeCallAtScopeExit([rw](){ SDL_RWclose(rw); });
+
+        char identifier[sizeof(s_pyramidIdentifier)];
+        uint32_t header[PyramidHeaderFields];
+        if (SDL_RWread(rw, identifier, sizeof(identifier), 1) != 1 ||
+            SDL_RWread(rw, header, sizeof(header), 1) != 1 ||
+            memcmp(identifier, s_pyramidIdentifier, sizeof(identifier)) != 0)
+        {
+            LogWarn("tile pyramid '%s' is broken", pyramid->path.c_str());
+            return false;
+        }
+
+        uint64_t sourceHash = uint64_t(header[PyramidSourceHashLow]) | (uint64_t(header[PyramidSourceHashHigh]) << 32);
+        if (sourceHash != pyramid->sourceHash || header[PyramidTileSize] != TilePyramid::TileSize ||
+            header[PyramidWidth] == 0 || header[PyramidHeight] == 0)
+        {
+            return false;
+        }
+
+        int bytesPerPixel;
+        GLenum glFormat;
+        GLenum glType;
+        TextureProtocol::InnerFormat format = TextureProtocol::InnerFormat(header[PyramidFormat]);
+        if (!Image_GetFormatInfo(format, &bytesPerPixel, &glFormat, &glType))
+        {
+            LogWarn("tile pyramid '%s' is broken", pyramid->path.c_str());
+            return false;
+        }
+
+        pyramid->Layout(int(header[PyramidWidth]), int(header[PyramidHeight]), format);
+        if (uint64_t(SDL_RWsize(rw)) != pyramid->offsets.back())
+        {
+            LogWarn("tile pyramid '%s' is truncated", pyramid->path.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+
+    // the tile at 'x', 'y' of 'width' x 'height' pixels, and its gutter. the gutter out of the image repeats the edge pixels
+    static bool WriteTile(SDL_RWops* rw, const Image& level, int bytesPerPixel, int x, int y, int width, int height, Image* tile)
+    {
+        const int gutter = TilePyramid::Gutter;
+        if (!Image_Allocate(tile, level.format, width + 2 * gutter, height + 2 * gutter))
+        {
+            return false;
+        }
+
+        for (int row = 0; row < tile->height; ++row)
+        {
+            int sy = min(max(y - gutter + row, 0), level.height - 1);
+            const uint8_t* src = level.pixels->GetData() + size_t(level.pitch) * sy;
+            uint8_t* dst = tile->pixels->GetData() + size_t(tile->pitch) * row;
+
+            for (int column = 0; column < tile->width; )
+            {
+                int sx = x - gutter + column;
+                if (sx >= 0 && sx < level.width)
+                {
+                    int pixels = min(tile->width - column, level.width - sx);
+                    memcpy(dst + size_t(column) * bytesPerPixel, src + size_t(sx) * bytesPerPixel, size_t(pixels) * bytesPerPixel);
+                    column += pixels;
+                }
+                else
+                {
+                    sx = min(max(sx, 0), level.width - 1);
+                    memcpy(dst + size_t(column) * bytesPerPixel, src + size_t(sx) * bytesPerPixel, bytesPerPixel);
+                    ++column;
+                }
+            }
+        }
+
+        return SDL_RWwrite(rw, tile->pixels->GetData(), size_t(tile->pitch) * tile->height, 1) == 1;
+    }
+
+
+    // decode the source and write its levels as tiles. each level is made from the previous one, which is dropped then,
+    // so only two levels are in memory at a time
+    static bool BuildPyramid(SDL_RWops* source, const string& name, TilePyramid* pyramid)
+    {
+        DI_SAVE_CALLSTACK();
+
+        uint64_t startClock = HighClock_Get();
+
+        Image image;
+        if (!Image_Decode(source, name, &image))
+        {
+            return false;
+        }
+
+        pyramid->Layout(image.width, image.height, image.format);
+
+        uint32_t header[PyramidHeaderFields];
+        header[PyramidSourceHashLow] = uint32_t(pyramid->sourceHash);
+        header[PyramidSourceHashHigh] = uint32_t(pyramid->sourceHash >> 32);
+        header[PyramidWidth] = uint32_t(image.width);
+        header[PyramidHeight] = uint32_t(image.height);
+        header[PyramidTileSize] = TilePyramid::TileSize;
+        header[PyramidFormat] = uint32_t(image.format);
+
+        Image levelImage = image;
+        image = Image();
+
+        // a killed process never leaves a truncated pyramid
+        bool built = File_WriteAtomically(pyramid->path, "tile pyramid", [&](SDL_RWops* rw)
+        {
+            bool written = SDL_RWwrite(rw, s_pyramidIdentifier, sizeof(s_pyramidIdentifier), 1) == 1
+                        && SDL_RWwrite(rw, header, sizeof(header), 1) == 1;
+
+            Image tile;
+            for (int l = 0; written && l < int(pyramid->levels.size()); ++l)
+            {
+                const TilePyramid::Level& level = pyramid->levels[l];
+                if (l > 0)
+                {
+                    Image mip;
+                    if (!Image_GenerateMipmap(levelImage, TextureOptions::Mip_Box, true, &mip))
+                    {
+                        return false;
+                    }
+
+                    levelImage = mip;
+                }
+
+                DI_ASSERT(levelImage.width == level.width && levelImage.height == level.height);
+
+                for (int y = 0; written && y < level.tilesY; ++y)
+                {
+                    for (int x = 0; written && x < level.tilesX; ++x)
+                    {
+                        written = WriteTile(rw, levelImage, pyramid->bytesPerPixel, x * TilePyramid::TileSize, y * TilePyramid::TileSize,
+                            pyramid->GetTileWidth(l, x), pyramid->GetTileHeight(l, y), &tile);
+                    }
+                }
+            }
+
+            return written;
+        });
+
+        if (!built)
+        {
+            return false;
+        }
+
+        LogInfo("tile pyramid of '%s' (%dx%d, %d levels, %d tiles) built, cost %.3f ms", name.c_str(), pyramid->levels[0].width, pyramid->levels[0].height,
+            int(pyramid->levels.size()), int(pyramid->offsets.size() - 1), HighClock_ToSeconds(HighClock_Get() - startClock) * 1000.0);
+        return true;
+    }
+
+
+    ImageTile::~ImageTile()
+    {
+        GlDeletionQueue::Singleton().DeleteTextures(1, &m_glTexture);
+    }
+
+
+    bool ImageTile::Prepare_InGlThread()
+    {
+        return true;
+    }
+
+
+    bool ImageTile::Load_InWorkThread()
+    {
+        DI_SAVE_CALLSTACK();
+
+        const TilePyramid& pyramid = *m_source.pyramid;
+        int width = pyramid.GetStoredWidth(m_source.level, m_source.x);
+        int height = pyramid.GetStoredHeight(m_source.level, m_source.y);
+
+        SDL_RWops* rw = SDL_RWFromFile(pyramid.path.c_str(), "rb");
+        if (!rw)
+        {
+            LogError("SDL_RWFromFile('%s') failed", pyramid.path.c_str());
+            return false;
+        }
+
+        auto rwDeleter = MakeCallAtScopeExit([rw](){ SDL_RWclose(rw); });
+
+        if (!Image_Allocate(&m_image, pyramid.format, width, height))
+        {
+            return false;
+        }
+
+        DI_ASSERT(m_image.pitch == Image_GetAlignedPitch(width, pyramid.bytesPerPixel));
+        if (SDL_RWseek(rw, int64_t(pyramid.GetTileOffset(m_source.level, m_source.x, m_source.y)), RW_SEEK_SET) < 0 ||
+            SDL_RWread(rw, m_image.pixels->GetData(), size_t(m_image.pitch) * height, 1) != 1)
+        {
+            LogError("read tile '%s' failed", GetName().c_str());
+            m_image = Image();
+            return false;
+        }
+
+        return true;
+    }
+
+
+    bool ImageTile::Finish_InGlThread()
+    {
+        DI_SAVE_CALLSTACK();
+
+        size_t bytes = size_t(m_image.pitch) * m_image.height;
+        if (!ResourceManager::Singleton().ConsumeUploadBudget(bytes))
+        {
+            ContinueFinishLater();
+            return true;
+        }
+
+        // the gutter is under the filter at the seams, the texture is clamped so it never repeats
+        glGenTextures(1, &m_glTexture);
+        glBindTexture(GL_TEXTURE_2D, m_glTexture);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+        if (m_image.unpackAlignment != 4)
+        {
+            glPixelStorei(GL_UNPACK_ALIGNMENT, m_image.unpackAlignment);
+        }
+
+        glTexImage2D(GL_TEXTURE_2D, 0, m_image.glFormat, m_image.width, m_image.height, 0, m_image.glFormat, m_image.glType, m_image.pixels->GetData());
+
+        if (m_image.unpackAlignment != 4)
+        {
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        }
+
+        DI_DBG_CHECK_GL_ERRORS();
+
+        m_innerFormat = m_image.format;
+        m_width = m_image.width;
+        m_height = m_image.height;
+        m_bytes = bytes;
+        m_image = Image();
+        return true;
+    }
+
+
+    void ImageTile::Timeout_InGlThread()
+    {
+        GlDeletionQueue::Singleton().DeleteTextures(1, &m_glTexture);
+        m_glTexture = 0;
+        m_bytes = 0;
+    }
+
+
+    // read again from the pyramid file, which is cheap
+    bool ImageTile::LoseContext_InGlThread(bool /*finished*/)
+    {
+        m_glTexture = 0;
+        m_bytes = 0;
+        return false;
+    }
+
+
+    void TiledImage::SetPyramidCacheBytes(size_t bytes)
+    {
+        PyramidIndex::Singleton().SetMaxBytes(bytes);
+    }
+
+
+    TiledImage::~TiledImage()
+    {
+        if (m_purger)
+        {
+            MemoryPressure::Singleton().RemovePurger(m_purger);
+        }
+    }
+
+
+    bool TiledImage::Prepare_InGlThread()
+    {
+        // shared with TextureDiskCache, both are SDL_GetPrefPath()
+        m_directory = PrefPath_Get();
+        if (m_directory.empty())
+        {
+            LogError("no writable directory for the tile pyramid of '%s'", GetName().c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+
+    bool TiledImage::Load_InWorkThread()
+    {
+        DI_SAVE_CALLSTACK();
+
+        // a compressed file in an asset pack is inflated for the decoder, and kept until the pyramid is built
+        AssetView view;
+        PixelBufferPtr inflated;
+        bool inPack = AssetPack_Find(GetName(), &view);
+        if (inPack && !AssetPack_Inflate(&view, &inflated))
+        {
+            return false;
+        }
+
+        // a big source image is decoded straight from the mapping of its file
+        SDL_RWops* rw = inPack ? SDL_RWFromConstMem(view.data, int(view.size)) : SDL_RWFromMappedFile(GetName().c_str());
+        if (!rw)
+        {
+            LogError("SDL_RWFromMappedFile('%s') failed", GetName().c_str());
+            return false;
+        }
+
+        // the bytes are hashed in place. a file which can not be mapped is read into a pooled buffer and decoded from there
+        size_t size = 0;
+        const uint8_t* bytes = (const uint8_t*)SDL_RWGetMemoryView(rw, &size);
+        PixelBufferPtr read;
+        if (!bytes)
+        {
+            Sint64 fileSize = SDL_RWsize(rw);
+            if (fileSize > 0)
+            {
+                read = PixelBufferPool::Singleton().Acquire(size_t(fileSize));
+                if (SDL_RWread(rw, read->GetData(), size_t(fileSize), 1) == 1)
+                {
+                    bytes = read->GetData();
+                    size = size_t(fileSize);
+                }
+            }
+
+            SDL_RWclose(rw);
+            rw = bytes ? SDL_RWFromConstMem(bytes, int(size)) : nullptr;
+            if (!rw)
+            {
+                LogError("read '%s' failed", GetName().c_str());
+                return false;
+            }
+        }
+
+        auto rwDeleter = MakeCallAtScopeExit([rw](){ SDL_RWclose(rw); });
+
+        shared_ptr<TilePyramid> pyramid(new TilePyramid());
+        pyramid->sourceHash = TextureDiskCache::HashBytes(bytes, size);
+        string baseName = GetPyramidBaseName(GetName());
+        pyramid->path = GetPyramidPath(m_directory, baseName, pyramid->sourceHash);
+
+        if (!ReadPyramid(pyramid.get()) && !BuildPyramid(rw, GetName(), pyramid.get()))
+        {
+            return false;
+        }
+
+        PyramidIndex::Singleton().Use(m_directory, baseName, pyramid->sourceHash, pyramid->offsets.back());
+
+        m_pyramid = pyramid;
+        return true;
+    }
+
+
+    bool TiledImage::Finish_InGlThread()
+    {
+        LogInfo("tiled image '%s' %dx%d, %d levels", GetName().c_str(), GetWidth(), GetHeight(), int(m_pyramid->levels.size()));
+
+        if (!m_purger)
+        {
+            m_purger = MemoryPressure::Singleton().AddPurger(MemoryTier_UnusedPages, GetName(), [this]() { return ReleaseUnusedTiles(); });
+        }
+
+        return true;
+    }
+
+
+    void TiledImage::Timeout_InGlThread()
+    {
+        for (auto iter = m_tiles.begin(); iter != m_tiles.end(); ++iter)
+        {
+            iter->second.tile->ForceTimeout();
+        }
+
+        m_tiles.clear();
+
+        if (m_purger)
+        {
+            MemoryPressure::Singleton().RemovePurger(m_purger);
+            m_purger = 0;
+        }
+    }
+
+
+    // the pyramid has no GL objects, the tiles are resources of their own
+    bool TiledImage::LoseContext_InGlThread(bool /*finished*/)
+    {
+        return true;
+    }
+
+
+    size_t TiledImage::ReleaseUnusedTiles()
+    {
+        size_t released = 0;
+        for (auto iter = m_tiles.begin(); iter != m_tiles.end(); ++iter)
+        {
+            CachedTile& cached = iter->second;
+            if (cached.lastUsedFrame != m_frame && cached.tile->GetState() == Resource::State::Finished)
+            {
+                released += cached.tile->GetGpuBytes();
+                cached.tile->ForceTimeout();
+            }
+        }
+
+        return released;
+    }
+
+
+    void TiledImage::RequestTile(int level, int x, int y, float priority)
+    {
+        CachedTile& cached = m_tiles[GetTileKey(level, x, y)];
+        if (!cached.tile)
+        {
+            // the source hash tells the tiles of a changed source apart
+            char suffix[64];
+            SDL_snprintf(suffix, sizeof(suffix), "#%016llx_%d_%d_%d", (unsigned long long)m_pyramid->sourceHash, level, x, y);
+
+            ImageTileSource source;
+            source.pyramid = m_pyramid;
+            source.level = level;
+            source.x = x;
+            source.y = y;
+            cached.tile = ResourceManager::Singleton().GetResource<ImageTile>(GetName() + suffix, priority, source);
+        }
+        else
+        {
+            // loads the tile again if it was released by TrimCache()
+            ResourceManager::Singleton().AsyncLoadResource(cached.tile);
+        }
+
+        cached.lastUsedFrame = m_frame;
+    }
+
+
+    // the tile, or the nearest coarser level covering it while it is loading
+    void TiledImage::AddDraw(int level, int x, int y, vector<TiledImageDraw>* draws)
+    {
+        const TilePyramid& pyramid = *m_pyramid;
+
+        for (; level < int(pyramid.levels.size()); ++level, x /= 2, y /= 2)
+        {
+            auto iter = m_tiles.find(GetTileKey(level, x, y));
+            if (iter == m_tiles.end() || !iter->second.tile->IsResourceOK())
+            {
+                continue;
+            }
+
+            ImageTilePtrCR tile = iter->second.tile;
+            for (size_t i = 0; i < draws->size(); ++i)
+            {
+                if ((*draws)[i].tile == tile)
+                {
+                    return;
+                }
+            }
+
+            const TilePyramid::Level& l = pyramid.levels[level];
+            float sx = float(pyramid.levels[0].width) / l.width;
+            float sy = float(pyramid.levels[0].height) / l.height;
+
+            TiledImageDraw draw;
+            draw.tile = tile;
+            draw.x = float(x * TilePyramid::TileSize) * sx;
+            draw.y = float(y * TilePyramid::TileSize) * sy;
+            draw.width = float(pyramid.GetTileWidth(level, x)) * sx;
+            draw.height = float(pyramid.GetTileHeight(level, y)) * sy;
+            draw.u0 = float(TilePyramid::Gutter) / pyramid.GetStoredWidth(level, x);
+            draw.v0 = float(TilePyramid::Gutter) / pyramid.GetStoredHeight(level, y);
+            draw.u1 = float(TilePyramid::Gutter + pyramid.GetTileWidth(level, x)) / pyramid.GetStoredWidth(level, x);
+            draw.v1 = float(TilePyramid::Gutter + pyramid.GetTileHeight(level, y)) / pyramid.GetStoredHeight(level, y);
+            draws->push_back(draw);
+            return;
+        }
+    }
+
+
+    void TiledImage::TrimCache()
+    {
+        size_t bytes = 0;
+        vector<CachedTile*> released;
+        for (auto iter = m_tiles.begin(); iter != m_tiles.end(); ++iter)
+        {
+            CachedTile& cached = iter->second;
+            bytes += cached.tile->GetGpuBytes();
+            if (cached.lastUsedFrame != m_frame && cached.tile->GetState() == Resource::State::Finished)
+            {
+                released.push_back(&cached);
+            }
+        }
+
+        if (bytes <= m_cacheBytes)
+        {
+            return;
+        }
+
+        sort(released.begin(), released.end(), [](const CachedTile* a, const CachedTile* b) { return a->lastUsedFrame < b->lastUsedFrame; });
+        for (size_t i = 0; i < released.size() && bytes > m_cacheBytes; ++i)
+        {
+            bytes -= released[i]->tile->GetGpuBytes();
+            released[i]->tile->ForceTimeout();
+        }
+    }
+
+
+    void TiledImage::Update(float x, float y, float width, float height, float scale, vector<TiledImageDraw>* draws)
+    {
+        DI_SAVE_CALLSTACK();
+
+        draws->clear();
+        if (!IsResourceOK())
+        {
+            return;
+        }
+
+        UpdateTimeoutTick();
+        ++m_frame;
+
+        const TilePyramid& pyramid = *m_pyramid;
+        int levels = int(pyramid.levels.size());
+
+        // the finest level whose pixels are still not smaller than the screen's
+        int level = 0;
+        while (level + 1 < levels && scale * float(1 << (level + 1)) <= 1.0f)
+        {
+            ++level;
+        }
+
+        const TilePyramid::Level& l = pyramid.levels[level];
+        float sx = float(l.width) / pyramid.levels[0].width / TilePyramid::TileSize;
+        float sy = float(l.height) / pyramid.levels[0].height / TilePyramid::TileSize;
+        int x0 = max(int(floor(x * sx)), 0);
+        int y0 = max(int(floor(y * sy)), 0);
+        int x1 = min(int(ceil((x + width) * sx)), l.tilesX);
+        int y1 = min(int(ceil((y + height) * sy)), l.tilesY);
+
+        // the coarsest level first, it is under everything else
+        RequestTile(levels - 1, 0, 0, GetPriority() + 2);
+
+        int m = m_prefetchMargin;
+        for (int ty = max(y0 - m, 0); ty < min(y1 + m, l.tilesY); ++ty)
+        {
+            for (int tx = max(x0 - m, 0); tx < min(x1 + m, l.tilesX); ++tx)
+            {
+                bool visible = tx >= x0 && tx < x1 && ty >= y0 && ty < y1;
+                RequestTile(level, tx, ty, GetPriority() + (visible ? 1 : 0));
+            }
+        }
+
+        for (int ty = y0; ty < y1; ++ty)
+        {
+            for (int tx = x0; tx < x1; ++tx)
+            {
+                AddDraw(level, tx, ty, draws);
+            }
+        }
+
+        stable_sort(draws->begin(), draws->end(), [](const TiledImageDraw& a, const TiledImageDraw& b) { return a.tile->GetSource().level > b.tile->GetSource().level; });
+
+        TrimCache();
+    }
+}
@@ -0,0 +1,169 @@
+#ifndef DI_TILED_IMAGE_H_INCLUDED
+#define DI_TILED_IMAGE_H_INCLUDED
+
+#include "DiImage.h"
+
+#include <unordered_map>
+
+namespace di
+{
+    DI_TYPEDEF_PTR(TiledImage);
+    DI_TYPEDEF_PTR(ImageTile);
+
+    // The tile pyramid of a TiledImage, kept as one file in SDL_GetPrefPath().
+    // level 0 is the source image, each next level is half the size of the previous one (rounded down, as mip levels),
+    // up to the first level which fits in one tile. tiles are TileSize x TileSize pixels except at the right and bottom edges.
+    // each tile is stored with a gutter of Gutter pixels around it, copied from its neighbours (the edge pixels at the border
+    // of the image), so linear filtering across the seam of two tiles blends what it would inside one texture.
+    // the file is a header followed by the raw pixels of every tile (rows 4 bytes aligned), level by level and row by row,
+    // so a tile is read by one seek and one read
+    struct TilePyramid
+    {
+        enum { TileSize = 256, Gutter = 1 };
+
+        struct Level
+        {
+            int width;
+            int height;
+            int tilesX;
+            int tilesY;
+            int firstTile;          // index of tile (0, 0) of this level in 'offsets'
+        };
+
+        TilePyramid() : sourceHash(0), format(TextureProtocol::RGBA_8888), bytesPerPixel(4) {}
+
+        // fill 'levels' and 'offsets' for an image of this size and format
+        void Layout(int width, int height, TextureProtocol::InnerFormat format);
+
+        int GetTileWidth(int level, int x) const { return min(int(TileSize), levels[level].width - x * TileSize); }
+        int GetTileHeight(int level, int y) const { return min(int(TileSize), levels[level].height - y * TileSize); }
+
+        // of the texture of a tile, with its gutter
+        int GetStoredWidth(int level, int x) const { return GetTileWidth(level, x) + 2 * Gutter; }
+        int GetStoredHeight(int level, int y) const { return GetTileHeight(level, y) + 2 * Gutter; }
+        uint64_t GetTileOffset(int level, int x, int y) const { return offsets[levels[level].firstTile + y * levels[level].tilesX + x]; }
+
+        string path;
+        uint64_t sourceHash;        // of the bytes of the source file, a changed source gets a new pyramid
+        TextureProtocol::InnerFormat format;
+        int bytesPerPixel;
+        vector<Level> levels;
+        vector<uint64_t> offsets;   // of each tile in the file, and the end of the file at the back
+    };
+
+
+    struct ImageTileSource
+    {
+        shared_ptr<const TilePyramid> pyramid;
+        int level;
+        int x;
+        int y;
+    };
+
+
+    // One tile of a TiledImage, loaded from the pyramid file by the worker thread as any other Resource.
+    // it is its own TextureProtocol, so TextureShader draws it as an ImageAsTexture
+    class ImageTile : public Resource, public TextureProtocol
+    {
+    public:
+        ImageTile(const string& name, float priority, const ImageTileSource& source) : Resource(name, priority), m_source(source), m_bytes(0) {}
+        ~ImageTile();
+
+        const ImageTileSource& GetSource() const { return m_source; }
+
+        virtual size_t GetGpuBytes() const { return m_bytes; }
+
+    private:
+        virtual bool Prepare_InGlThread();
+        virtual bool Load_InWorkThread();
+        virtual bool Finish_InGlThread();
+        virtual void Timeout_InGlThread();
+        virtual bool LoseContext_InGlThread(bool finished);
+
+        const ImageTileSource m_source;
+        Image m_image;
+        size_t m_bytes;
+    };
+
+
+    // where a tile is drawn, in pixels of the source image, and the part of its texture drawn there (inside the gutter)
+    struct TiledImageDraw
+    {
+        ImageTilePtr tile;
+        float x;
+        float y;
+        float width;
+        float height;
+        float u0;
+        float v0;
+        float u1;
+        float v1;
+    };
+
+
+    // An image bigger than GL_MAX_TEXTURE_SIZE (a map, a panorama), drawn as tiles.
+    // The first load decodes the source once in worker thread, and splits it into a TilePyramid file level by level,
+    // each mip level is made from the previous one which is then dropped.
+    // the pyramid files are kept within a size limit, see SetPyramidCacheBytes().
+    // Update() then loads only the tiles of the level matching the zoom which intersect the viewport,
+    // plus a margin of tiles around it which are likely to be scrolled in next. Tiles which are still loading
+    // are covered by their coarser levels, the coarsest level (one tile) is always kept.
+    // the tiles are textures of their own, the least recently used ones beyond the cache budget are released
+    class TiledImage : public Resource
+    {
+    public:
+        TiledImage(const string& name, float priority = 0) : Resource(name, priority), m_cacheBytes(32 * 1024 * 1024), m_prefetchMargin(1), m_frame(0), m_purger(0) {}
+        ~TiledImage();
+
+        // size of the source image, after IsResourceOK()
+        int GetWidth() const { return m_pyramid->levels[0].width; }
+        int GetHeight() const { return m_pyramid->levels[0].height; }
+
+        // GPU memory of the tiles, 32 MB by default. tiles used by the current frame are kept even beyond it
+        void SetCacheBytes(size_t bytes) { m_cacheBytes = bytes; }
+
+        // tiles loaded around the viewport, 1 by default
+        void SetPrefetchMargin(int tiles) { m_prefetchMargin = tiles; }
+
+        // the pyramid files of all tiled images, 256 MB by default. beyond it the least recently used ones are deleted,
+        // except those used by this run. the pyramid of an older version of a source is deleted when the new one is made
+        static void SetPyramidCacheBytes(size_t bytes);
+
+        // called once a frame in GL thread. 'x', 'y', 'width', 'height' is the visible part of the image in pixels of the source,
+        // 'scale' is screen pixels per source pixel. 'draws' gets the tiles to draw, coarser levels first
+        void Update(float x, float y, float width, float height, float scale, vector<TiledImageDraw>* draws);
+
+        // release the tiles which are not used by the current frame, returns the bytes given back.
+        // called by MemoryPressure as MemoryTier_UnusedPages
+        size_t ReleaseUnusedTiles();
+
+    private:
+        virtual bool Prepare_InGlThread();
+        virtual bool Load_InWorkThread();
+        virtual bool Finish_InGlThread();
+        virtual void Timeout_InGlThread();
+        virtual bool LoseContext_InGlThread(bool finished);
+
+        struct CachedTile
+        {
+            ImageTilePtr tile;
+            uint32_t lastUsedFrame;
+        };
+
+        static uint64_t GetTileKey(int level, int x, int y) { return (uint64_t(level) << 48) | (uint64_t(y) << 24) | uint64_t(x); }
+
+        void RequestTile(int level, int x, int y, float priority);
+        void AddDraw(int level, int x, int y, vector<TiledImageDraw>* draws);
+        void TrimCache();
+
+        string m_directory;
+        shared_ptr<const TilePyramid> m_pyramid;
+        unordered_map<uint64_t, CachedTile> m_tiles;
+        size_t m_cacheBytes;
+        int m_prefetchMargin;
+        uint32_t m_frame;
+        int m_purger;               // id of ReleaseUnusedTiles() in MemoryPressure, 0 if not added
+    };
+}
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef DI_KTX_FORMAT_H_INCLUDED
+#define DI_KTX_FORMAT_H_INCLUDED
+
+#include <cstdint>
+
+// The KTX 1.1 header, shared by KTXTextureLoader (DiResource.cpp) which reads and rewrites it, and TextureDiskCache
+// (DiTextureCache.cpp) which writes its planes as KTX files.
+// a file is the identifier, then KtxHeaderFields uint32_t in the order below, then the key / value data and the levels,
+// each level as its uint32_t imageSize and its bytes padded to 4
+namespace di
+{
+    static const uint8_t KtxIdentifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+    enum
+    {
+        KtxIdentifierSize = sizeof(KtxIdentifier),
+        KtxEndiannessValue = 0x04030201,   // of KtxEndianness, when the file is in the byte order of the reader
+    };
+
+    enum KtxHeaderField
+    {
+        KtxEndianness,
+        KtxGlType,
+        KtxGlTypeSize,
+        KtxGlFormat,
+        KtxGlInternalFormat,
+        KtxGlBaseInternalFormat,
+        KtxPixelWidth,
+        KtxPixelHeight,
+        KtxPixelDepth,
+        KtxNumberOfArrayElements,
+        KtxNumberOfFaces,
+        KtxNumberOfMipmapLevels,
+        KtxBytesOfKeyValueData,
+        KtxHeaderFields,
+    };
+}
+
+#endif
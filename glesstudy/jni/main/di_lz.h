@@ -0,0 +1,266 @@
+#ifndef DI_LZ_H_INCLUDED
+#define DI_LZ_H_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+// DiLz, a byte oriented LZ77 codec of the LZ4 family for asset packs: it saves less than zlib, but decodes several
+// times faster, since it is only copies of literals and matches, without entropy coding.
+// the encoder is used by the pack builder (glesstudy/tools/dipack), the decoder by DiAssetPack.cpp.
+//
+// a stream is the file cut in blocks of LzBlockSize bytes (the last one may be shorter), each block is, little endian:
+//   uint32_t header               size of the block data, LzStoredBlock is set if the data is the raw bytes
+//   sequences                     until the end of the block data:
+//     token                         literal count in the high 4 bits, match length - LzMinMatch in the low 4 bits,
+//                                   15 means more bytes of the count follow, each added, until one which is not 255
+//     literals
+//     uint16_t offset               back from the current position, not in the last sequence of a block
+//
+// a match may reach into the blocks before, so blocks are decoded in order into one buffer, one block at a time
+namespace di
+{
+    enum
+    {
+        LzBlockSize = 64 * 1024,
+        LzMinMatch = 4,
+        LzMaxOffset = 65535,
+        LzStoredBlock = 0x80000000,
+    };
+
+    inline uint32_t Lz_ReadU32(const uint8_t* p)
+    {
+        return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+    }
+
+
+    // the lengths of a token and the bytes after it, false if they run out of [*src, end)
+    inline bool Lz_ReadLength(const uint8_t** src, const uint8_t* end, size_t* length)
+    {
+        if (*length != 15)
+        {
+            return true;
+        }
+
+        for (;;)
+        {
+            if (*src == end)
+            {
+                return false;
+            }
+
+            uint8_t more = *(*src)++;
+            *length += more;
+            if (more != 255)
+            {
+                return true;
+            }
+        }
+    }
+
+
+    // decodes the block data [src, src + srcSize) to [dst, dst + dstSize), where dst - dstStart bytes before it are
+    // decoded already. every length and offset is checked, false if the block is broken
+    inline bool Lz_DecodeBlock(const uint8_t* src, size_t srcSize, uint8_t* dstStart, uint8_t* dst, size_t dstSize)
+    {
+        const uint8_t* srcEnd = src + srcSize;
+        uint8_t* dstEnd = dst + dstSize;
+
+        while (src < srcEnd)
+        {
+            uint8_t token = *src++;
+
+            size_t literals = token >> 4;
+            if (!Lz_ReadLength(&src, srcEnd, &literals) || literals > size_t(srcEnd - src) || literals > size_t(dstEnd - dst))
+            {
+                return false;
+            }
+
+            memcpy(dst, src, literals);
+            src += literals;
+            dst += literals;
+
+            if (src == srcEnd)
+            {
+                break;
+            }
+
+            if (srcEnd - src < 2)
+            {
+                return false;
+            }
+
+            size_t offset = size_t(src[0]) | (size_t(src[1]) << 8);
+            src += 2;
+
+            size_t length = token & 15;
+            if (!Lz_ReadLength(&src, srcEnd, &length))
+            {
+                return false;
+            }
+
+            length += LzMinMatch;
+            if (offset == 0 || offset > size_t(dst - dstStart) || length > size_t(dstEnd - dst))
+            {
+                return false;
+            }
+
+            const uint8_t* match = dst - offset;
+            if (offset >= length)
+            {
+                memcpy(dst, match, length);
+                dst += length;
+            }
+            else
+            {
+                // the match overlaps what it writes, a run
+                for (size_t i = 0; i < length; ++i)
+                {
+                    *dst++ = *match++;
+                }
+            }
+        }
+
+        return dst == dstEnd;
+    }
+
+
+    // decodes a whole stream block by block to [dst, dst + dstSize), false if it is broken or not of dstSize bytes
+    inline bool Lz_Decode(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize)
+    {
+        const uint8_t* srcEnd = src + srcSize;
+        for (size_t done = 0; done < dstSize; done += LzBlockSize)
+        {
+            if (srcEnd - src < 4)
+            {
+                return false;
+            }
+
+            uint32_t header = Lz_ReadU32(src);
+            src += 4;
+
+            size_t blockSize = header & ~uint32_t(LzStoredBlock);
+            size_t rawSize = std::min(dstSize - done, size_t(LzBlockSize));
+            if (blockSize > size_t(srcEnd - src))
+            {
+                return false;
+            }
+
+            if (header & LzStoredBlock)
+            {
+                if (blockSize != rawSize)
+                {
+                    return false;
+                }
+                memcpy(dst + done, src, rawSize);
+            }
+            else if (!Lz_DecodeBlock(src, blockSize, dst, dst + done, rawSize))
+            {
+                return false;
+            }
+
+            src += blockSize;
+        }
+
+        return src == srcEnd;
+    }
+
+
+    inline void Lz_WriteLength(std::vector<uint8_t>* out, size_t length)
+    {
+        for (length -= 15; length >= 255; length -= 255)
+        {
+            out->push_back(255);
+        }
+        out->push_back(uint8_t(length));
+    }
+
+
+    inline void Lz_WriteSequence(std::vector<uint8_t>* out, const uint8_t* literals, size_t literalCount, size_t offset, size_t matchLength)
+    {
+        size_t matchCode = matchLength > 0 ? matchLength - LzMinMatch : 0;
+        out->push_back(uint8_t(((literalCount < 15 ? literalCount : 15) << 4) | (matchCode < 15 ? matchCode : 15)));
+        if (literalCount >= 15)
+        {
+            Lz_WriteLength(out, literalCount);
+        }
+
+        out->insert(out->end(), literals, literals + literalCount);
+
+        if (matchLength > 0)
+        {
+            out->push_back(uint8_t(offset));
+            out->push_back(uint8_t(offset >> 8));
+            if (matchCode >= 15)
+            {
+                Lz_WriteLength(out, matchCode);
+            }
+        }
+    }
+
+
+    // appends the stream of [data, data + size) to 'out'. greedy matching with a hash table of the last position of
+    // every 4 bytes, the builder only encodes once, it is the decoder which must be fast
+    inline void Lz_Encode(const uint8_t* data, size_t size, std::vector<uint8_t>* out)
+    {
+        const int HashBits = 16;
+        std::vector<uint32_t> table(size_t(1) << HashBits, 0);      // position + 1, 0 if none
+
+        for (size_t blockStart = 0; blockStart < size; blockStart += LzBlockSize)
+        {
+            size_t blockEnd = std::min(blockStart + LzBlockSize, size);
+            size_t headerPos = out->size();
+            out->resize(headerPos + 4);
+
+            size_t pos = blockStart;
+            size_t literalStart = blockStart;
+            while (pos + LzMinMatch <= blockEnd)
+            {
+                uint32_t bytes;
+                memcpy(&bytes, data + pos, 4);
+                uint32_t hash = (bytes * 2654435761u) >> (32 - HashBits);
+                size_t candidate = table[hash];
+                table[hash] = uint32_t(pos + 1);
+
+                if (candidate == 0 || pos - (candidate - 1) > LzMaxOffset || memcmp(data + candidate - 1, data + pos, 4) != 0)
+                {
+                    ++pos;
+                    continue;
+                }
+
+                size_t match = candidate - 1;
+                size_t length = LzMinMatch;
+                while (pos + length < blockEnd && data[match + length] == data[pos + length])
+                {
+                    ++length;
+                }
+
+                Lz_WriteSequence(out, data + literalStart, pos - literalStart, pos - match, length);
+                pos += length;
+                literalStart = pos;
+            }
+
+            Lz_WriteSequence(out, data + literalStart, blockEnd - literalStart, 0, 0);
+
+            // a block which does not get smaller is stored
+            size_t encoded = out->size() - headerPos - 4;
+            uint32_t header = uint32_t(encoded);
+            if (encoded >= blockEnd - blockStart)
+            {
+                out->resize(headerPos + 4);
+                out->insert(out->end(), data + blockStart, data + blockEnd);
+                header = uint32_t(blockEnd - blockStart) | LzStoredBlock;
+            }
+
+            uint8_t* p = &(*out)[headerPos];
+            p[0] = uint8_t(header);
+            p[1] = uint8_t(header >> 8);
+            p[2] = uint8_t(header >> 16);
+            p[3] = uint8_t(header >> 24);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef DI_PACK_FORMAT_H_INCLUDED
+#define DI_PACK_FORMAT_H_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+
+// The asset pack format, shared by the runtime (DiAssetPack.cpp) and the host builder (glesstudy/tools/dipack).
+// no other header of the app is included, so the builder is built without SDL.
+//
+// a pack is, little endian:
+//   PackHeader
+//   PackEntry[entryCount]         the index, sorted by nameHash and then by name
+//   names                         every name followed by '\0', names are relative paths with '/'
+//   payloads                      each at a multiple of PackAlignment, compressed by the codec of its entry or not
+//
+// the runtime maps the pack once, finds a name by a binary search of its hash, and reads the payload where it is.
+// the builder compresses a file only if, by the decode speed it measured, reading fewer bytes saves more time than
+// decoding them costs
+namespace di
+{
+    enum
+    {
+        PackVersion = 3,            // 2: PackEntry::codec and rawSize, 3: PackEntry::crc
+        PackAlignment = 64,         // a cache line, also enough for SIMD loads and the 4 bytes KTX levels need
+    };
+
+    static const char PackMagic[8] = { 'D', 'I', 'P', 'A', 'C', 'K', '\r', '\n' };
+
+    // what the payload is, from the extension of the file, so a loader can be chosen without looking at the bytes
+    enum PackFormat
+    {
+        PackFormat_Raw,
+        PackFormat_KTX,
+        PackFormat_PNG,
+        PackFormat_JPEG,
+        PackFormat_WebP,
+    };
+
+    enum PackCodec
+    {
+        PackCodec_None,             // the payload is the file
+        PackCodec_Zlib,             // a zlib stream, for files which compress well and are read seldom
+        PackCodec_DiLz,             // a DiLz stream (di_lz.h), less saved, but decoded several times faster
+
+        PackCodec_Count
+    };
+
+    struct PackHeader
+    {
+        char magic[8];              // PackMagic
+        uint32_t version;           // PackVersion
+        uint32_t entryCount;
+        uint64_t indexOffset;
+        uint64_t namesOffset;
+        uint64_t namesSize;
+    };
+
+    struct PackEntry
+    {
+        uint64_t nameHash;          // Pack_HashName()
+        uint64_t offset;            // of the payload from the start of the pack
+        uint64_t size;              // of the payload
+        uint64_t rawSize;           // of the file, equal to size if codec is PackCodec_None
+        uint32_t nameOffset;        // from namesOffset
+        uint32_t format;            // PackFormat
+        uint32_t codec;             // PackCodec
+        uint32_t crc;               // CRC-32 of the file (zlib's crc32()), it tells a changed file apart without reading it
+    };
+
+    // FNV-1a, 64 bits
+    inline uint64_t Pack_HashName(const char* name, size_t length)
+    {
+        uint64_t hash = 0xCBF29CE484222325ull;
+        for (size_t i = 0; i < length; ++i)
+        {
+            hash ^= uint8_t(name[i]);
+            hash *= 0x100000001B3ull;
+        }
+        return hash;
+    }
+
+    inline uint64_t Pack_AlignOffset(uint64_t offset)
+    {
+        return (offset + PackAlignment - 1) / PackAlignment * PackAlignment;
+    }
+}
+
+#endif
@@ -4,6 +4,11 @@
 
 #include "di_gl_header.h"
 #include "DiResource.h"
+#include "DiImage.h"
+#include "DiTextureCache.h"
+#include "DiAssetPack.h"
+#include "DiTextureShader.h"
+#include "DiMemoryPressure.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -190,6 +195,30 @@ bool setupGraphics(int w, int h) {
 
     glViewport(0, 0, w, h);
     checkGlError("glViewport");
+
+    // built by glesstudy/tools/dipack from the assets directory. without it the files are opened one by one
+    AssetPack_Mount("assets.pack");
+
+    // the background is a lossy WebP photo, keep its YUV planes and let the shader convert them.
+    // 1.5 bytes per pixel, and no banding as RGB_565 has
+    TextureOptions bgOptions;
+    bgOptions.format = TextureOptions::Format_YUV;
+    bgOptions.previewSize = 64;     // a blurry background at once instead of a black screen while the photo decodes
+    bgOptions.diskCache = true;     // later runs read the planes instead of decoding the photo
+    TextureOptions::SetPolicy("main_bg.webp", bgOptions);
+
+    // about 4 ms of texture upload per frame on low end phones, bigger textures and mip chains take more frames
+    ResourceManager::Singleton().SetUploadBudget(4 * 1024 * 1024);
+
+    // back from the background in a few frames if Android has lost the context, instead of decoding every texture again
+    ResourceManager::Singleton().SetRetainBudget(16 * 1024 * 1024);
+    ResourceManager::Singleton().CheckContextLost();    // the first call makes the probe texture
+
+    // the textures of the startup, in the order the last run asked for them, are loaded before renderFrame() asks
+    ResourceManager::Singleton().StartPrefetchManifest("startup_prefetch.txt");
+
+    // a texture which has timed out or been released comes back from memory instead of the disk
+    FileByteCache::Singleton().SetMaxBytes(8 * 1024 * 1024);
     return true;
 }
 
@@ -642,20 +671,27 @@ void renderFrame() {
     shared_ptr<ImageAsTexture> texture = ResourceManager::Singleton().GetResource<ImageAsTexture>("main_bg.webp");
     // texture->SetTimeoutTicks(0);
 
-    if (texture->IsResourceOK())
+    GLint positionHandle;
+    if (texture->IsResourceOK() && (positionHandle = TextureShader::Singleton().Use(*texture)) >= 0)
     {
-        glUseProgram(gProgram);
-        checkGlError("glUseProgram");
+        checkGlError("TextureShader::Use");
 
-        glBindTexture(GL_TEXTURE_2D, texture->GetGlTexture());
-        glVertexAttribPointer(gvPositionHandle, 2, GL_FLOAT, GL_FALSE, 0, gTriangleVertices);
+        glVertexAttribPointer(positionHandle, 2, GL_FLOAT, GL_FALSE, 0, gTriangleVertices);
         checkGlError("glVertexAttribPointer");
-        glEnableVertexAttribArray(gvPositionHandle);
+        glEnableVertexAttribArray(positionHandle);
         checkGlError("glEnableVertexAttribArray");
         glDrawArrays(GL_TRIANGLES, 0, sizeof(gTriangleVertices) / sizeof(gTriangleVertices[0]) / 2);
         checkGlError("glDrawArrays");
 
         texture->UpdateTimeoutTick();
+
+        // the first frame with the background is the end of the startup
+        static bool s_startupDone = false;
+        if (!s_startupDone)
+        {
+            s_startupDone = true;
+            ResourceManager::Singleton().FinishPrefetchManifest();
+        }
     }
 #endif
 }
@@ -711,7 +747,7 @@ void TestImagePerformance(const char* filename, int times)
     for (int i = 0; i < times; ++i)
     {
         Uint64 startTick = SDL_GetPerformanceCounter();
-        SDL_Surface* surface = IMG_Load(filename);
+        SDL_Surface* surface = IMG_Load_RW(SDL_RWFromMappedFile(filename), 1);
         Uint64 ticks = SDL_GetPerformanceCounter() - startTick;
         if (!surface)
         {
@@ -744,11 +780,24 @@ void TestImagePerformance(const char* filename, int times)
 }
 
 
+#if defined(__linux__) && !defined(__ANDROID__)
+// "kill -USR1 <pid>" simulates SDL_APP_LOWMEMORY on desktop Linux, which never sends it. not on Android, where ART uses SIGUSR1
+static volatile sig_atomic_t s_lowMemorySignaled = 0;
+
+void onLowMemorySignal(int)
+{
+    s_lowMemorySignaled = 1;
+}
+#endif
+
 int main(int argc, char* argv[]) // the function 'main' is actually 'SDL_main'
 {
 #ifndef _DEBUG
     signal(SIGSEGV, onSignal);
 #endif
+#if defined(__linux__) && !defined(__ANDROID__)
+    signal(SIGUSR1, onLowMemorySignal);
+#endif
 
     DI_SAVE_CALLSTACK();
 
@@ -853,6 +902,7 @@ int main(int argc, char* argv[]) // the function 'main' is actually 'SDL_main'
             else if (ev.type == SDL_APP_WILLENTERBACKGROUND)
             {
                 LogInfo("Event SDL_APP_WILLENTERBACKGROUND");
+                TextureDiskCache::Singleton().Flush();     // the process may be killed in the background
             }
             else if (ev.type == SDL_APP_DIDENTERBACKGROUND)
             {
@@ -865,6 +915,15 @@ int main(int argc, char* argv[]) // the function 'main' is actually 'SDL_main'
             else if (ev.type == SDL_APP_DIDENTERFOREGROUND)
             {
                 LogInfo("Event SDL_APP_DIDENTERFOREGROUND");
+                if (ResourceManager::Singleton().CheckContextLost())
+                {
+                    TextureShader::Singleton().LoseContext();
+                }
+            }
+            else if (ev.type == SDL_APP_LOWMEMORY)
+            {
+                LogInfo("Event SDL_APP_LOWMEMORY");
+                MemoryPressure::Singleton().Purge();
             }
             else if (ev.type == SDL_KEYUP)
             {
@@ -887,6 +946,14 @@ int main(int argc, char* argv[]) // the function 'main' is actually 'SDL_main'
             break;
         }
 
+#if defined(__linux__) && !defined(__ANDROID__)
+        if (s_lowMemorySignaled)
+        {
+            s_lowMemorySignaled = 0;
+            MemoryPressure::SimulateLowMemory();
+        }
+#endif
+
         // glClearColor(1.0f, 0.0f, 0.0f, 1.0f);
 		// glClear(GL_COLOR_BUFFER_BIT);
 		renderFrame();
@@ -895,7 +962,11 @@ int main(int argc, char* argv[]) // the function 'main' is actually 'SDL_main'
 		SDL_WaitEventTimeout(NULL, 1000 / 30);
 	}
 
+    ResourceManager::Singleton().LogTextureCacheStats();
+    TextureDiskCache::Singleton().Flush();
     ResourceManager::DestroySingleton();
+    MemoryPressure::DestroySingleton();     // after the resources, which may remove their purgers
+    TextureShader::DestroySingleton();
     PerformanceProfileData::Singleton().OutputToLog();
     PerformanceProfileData::DestroySingleton();
 
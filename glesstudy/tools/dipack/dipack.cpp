@@ -0,0 +1,400 @@
+//
+// dipack: builds an asset pack (see jni/main/di_pack_format.h) of every file under a directory, on a Linux host.
+//
+//   g++ -O2 -std=c++11 -I../../jni/main -o dipack dipack.cpp -lz
+//   ./dipack [-r <read MB/s>] [-s <device slowdown>] ../../assets ../../assets/assets.pack
+//
+// the names in the pack are the paths relative to the directory, as the app passes them to GetResource().
+// files whose name starts with '.' and the output pack itself are skipped
+//
+// every file is compressed by each codec and decoded back, timed. a codec is chosen if the time it saves reading
+// (the bytes saved at the read speed of the device, -r) is more than the time decoding costs on the device
+// (the decode time here times -s), the one which saves the most wins. otherwise the file is stored, which also
+// lets the app use it in place
+//
+
+#include "di_pack_format.h"
+#include "di_lz.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <climits>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+using namespace std;
+using namespace di;
+
+struct InputFile
+{
+    string name;                // relative, with '/'
+    string path;
+    uint64_t nameHash;
+    uint64_t size;
+    uint32_t crc;
+    PackFormat format;
+    PackCodec codec;
+    vector<uint8_t> payload;    // compressed, empty if the file is stored
+};
+
+
+struct DeviceModel
+{
+    double readBytesPerSecond;
+    double slowdown;            // of decoding on the device, against this host
+};
+
+
+static PackFormat GetFormat(const string& name)
+{
+    size_t pos = name.find_last_of('.');
+    string ext = pos == string::npos ? "" : name.substr(pos + 1);
+    transform(ext.begin(), ext.end(), ext.begin(), [](char c) { return char(tolower(c)); });
+
+    if (ext == "ktx")                   return PackFormat_KTX;
+    if (ext == "png")                   return PackFormat_PNG;
+    if (ext == "jpg" || ext == "jpeg")  return PackFormat_JPEG;
+    if (ext == "webp")                  return PackFormat_WebP;
+    return PackFormat_Raw;
+}
+
+
+static bool ListFiles(const string& root, const string& relative, const string& skipPath, vector<InputFile>* files)
+{
+    string directory = relative.empty() ? root : root + "/" + relative;
+    DIR* dir = opendir(directory.c_str());
+    if (!dir)
+    {
+        fprintf(stderr, "can not open directory '%s'\n", directory.c_str());
+        return false;
+    }
+
+    bool ok = true;
+    while (dirent* item = readdir(dir))
+    {
+        if (item->d_name[0] == '.')
+        {
+            continue;
+        }
+
+        string name = relative.empty() ? string(item->d_name) : relative + "/" + item->d_name;
+        string path = root + "/" + name;
+
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+        {
+            fprintf(stderr, "can not stat '%s'\n", path.c_str());
+            ok = false;
+            break;
+        }
+
+        if (S_ISDIR(st.st_mode))
+        {
+            if (!ListFiles(root, name, skipPath, files))
+            {
+                ok = false;
+                break;
+            }
+        }
+        else if (S_ISREG(st.st_mode))
+        {
+            char resolved[PATH_MAX];
+            if (realpath(path.c_str(), resolved) && skipPath == resolved)
+            {
+                continue;
+            }
+
+            InputFile file;
+            file.name = name;
+            file.path = path;
+            file.nameHash = Pack_HashName(name.data(), name.size());
+            file.size = uint64_t(st.st_size);
+            file.format = GetFormat(name);
+            file.codec = PackCodec_None;
+            file.crc = 0;
+            files->push_back(file);
+        }
+    }
+
+    closedir(dir);
+    return ok;
+}
+
+
+static bool ReadFile(const InputFile& file, vector<uint8_t>* bytes)
+{
+    FILE* in = fopen(file.path.c_str(), "rb");
+    if (!in)
+    {
+        fprintf(stderr, "can not open '%s'\n", file.path.c_str());
+        return false;
+    }
+
+    bytes->resize(size_t(file.size) + 1);
+    size_t n = fread(&(*bytes)[0], 1, bytes->size(), in);     // one byte more, to see a file which grew
+    fclose(in);
+
+    if (n != file.size)
+    {
+        fprintf(stderr, "'%s' changed while it was packed\n", file.path.c_str());
+        return false;
+    }
+
+    bytes->resize(n);
+    return true;
+}
+
+
+static bool Compress(PackCodec codec, const vector<uint8_t>& raw, vector<uint8_t>* out)
+{
+    out->clear();
+    if (codec == PackCodec_DiLz)
+    {
+        Lz_Encode(raw.data(), raw.size(), out);
+        return true;
+    }
+
+    uLongf size = compressBound(uLong(raw.size()));
+    out->resize(size);
+    if (compress2(&(*out)[0], &size, raw.data(), uLong(raw.size()), Z_BEST_COMPRESSION) != Z_OK)
+    {
+        return false;
+    }
+
+    out->resize(size);
+    return true;
+}
+
+
+static bool Decompress(PackCodec codec, const vector<uint8_t>& payload, vector<uint8_t>* raw)
+{
+    if (codec == PackCodec_DiLz)
+    {
+        return Lz_Decode(payload.data(), payload.size(), &(*raw)[0], raw->size());
+    }
+
+    uLongf size = uLongf(raw->size());
+    return uncompress(&(*raw)[0], &size, payload.data(), uLong(payload.size())) == Z_OK && size == raw->size();
+}
+
+
+// the shortest of a few decodes, which is also a check that the payload decodes to the file
+static bool TimeDecode(PackCodec codec, const vector<uint8_t>& payload, const vector<uint8_t>& raw, double* seconds)
+{
+    vector<uint8_t> decoded(raw.size());
+    *seconds = 1e9;
+    for (int i = 0; i < 5; ++i)
+    {
+        auto start = chrono::steady_clock::now();
+        bool ok = Decompress(codec, payload, &decoded);
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (!ok || decoded != raw)
+        {
+            return false;
+        }
+
+        *seconds = min(*seconds, elapsed);
+    }
+
+    return true;
+}
+
+
+static bool ChooseCodec(InputFile* file, const vector<uint8_t>& raw, const DeviceModel& device)
+{
+    static const char* const CodecNames[] = { "stored", "zlib", "dilz" };
+
+    file->codec = PackCodec_None;
+    file->payload.clear();
+    double bestGain = 0;
+
+    for (int codec = PackCodec_None + 1; codec < PackCodec_Count && !raw.empty(); ++codec)
+    {
+        vector<uint8_t> payload;
+        if (!Compress(PackCodec(codec), raw, &payload))
+        {
+            fprintf(stderr, "compress '%s' failed\n", file->name.c_str());
+            return false;
+        }
+
+        if (payload.size() >= raw.size())
+        {
+            continue;
+        }
+
+        double decodeSeconds;
+        if (!TimeDecode(PackCodec(codec), payload, raw, &decodeSeconds))
+        {
+            fprintf(stderr, "'%s' does not decode back by %s\n", file->name.c_str(), CodecNames[codec]);
+            return false;
+        }
+
+        double gain = (raw.size() - payload.size()) / device.readBytesPerSecond - decodeSeconds * device.slowdown;
+        if (gain > bestGain)
+        {
+            bestGain = gain;
+            file->codec = PackCodec(codec);
+            file->payload.swap(payload);
+        }
+    }
+
+    printf("  %-40s %10llu -> %10llu  %s\n", file->name.c_str(), (unsigned long long)raw.size(),
+        (unsigned long long)(file->codec == PackCodec_None ? raw.size() : file->payload.size()), CodecNames[file->codec]);
+    return true;
+}
+
+
+static bool Pad(FILE* out, uint64_t* offset, uint64_t aligned)
+{
+    static const char zeros[PackAlignment] = {};
+    size_t padding = size_t(aligned - *offset);
+    *offset = aligned;
+    return padding == 0 || fwrite(zeros, 1, padding, out) == padding;
+}
+
+
+int main(int argc, char** argv)
+{
+    // a slow eMMC or an APK read, and a phone core a few times slower than a desktop one
+    DeviceModel device;
+    device.readBytesPerSecond = 40.0 * 1024 * 1024;
+    device.slowdown = 4.0;
+
+    int arg = 1;
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2)
+    {
+        double value = atof(argv[arg + 1]);
+        if (strcmp(argv[arg], "-r") == 0 && value > 0)
+        {
+            device.readBytesPerSecond = value * 1024 * 1024;
+        }
+        else if (strcmp(argv[arg], "-s") == 0 && value > 0)
+        {
+            device.slowdown = value;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (argc - arg != 2)
+    {
+        fprintf(stderr, "usage: %s [-r <read MB/s>] [-s <device slowdown>] <asset directory> <output pack>\n", argv[0]);
+        return 1;
+    }
+
+    string root = argv[arg];
+    string outPath = argv[arg + 1];
+
+    // the pack may be written into the directory it packs, it must not pack an older version of itself
+    char resolved[PATH_MAX];
+    string skipPath = realpath(outPath.c_str(), resolved) ? resolved : "";
+
+    vector<InputFile> files;
+    if (!ListFiles(root, "", skipPath, &files))
+    {
+        return 1;
+    }
+
+    sort(files.begin(), files.end(), [](const InputFile& a, const InputFile& b)
+    {
+        return a.nameHash != b.nameHash ? a.nameHash < b.nameHash : a.name < b.name;
+    });
+
+    // only the compressed payloads are kept, a stored file is read again when it is written
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        vector<uint8_t> raw;
+        if (!ReadFile(files[i], &raw) || !ChooseCodec(&files[i], raw, device))
+        {
+            return 1;
+        }
+
+        files[i].crc = uint32_t(crc32(crc32(0, Z_NULL, 0), raw.empty() ? Z_NULL : raw.data(), uInt(raw.size())));
+    }
+
+    PackHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PackMagic, sizeof(PackMagic));
+    header.version = PackVersion;
+    header.entryCount = uint32_t(files.size());
+    header.indexOffset = sizeof(PackHeader);
+    header.namesOffset = header.indexOffset + files.size() * sizeof(PackEntry);
+
+    vector<PackEntry> entries(files.size());
+    string names;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        entries[i].nameHash = files[i].nameHash;
+        entries[i].nameOffset = uint32_t(names.size());
+        entries[i].format = uint32_t(files[i].format);
+        names += files[i].name;
+        names += '\0';
+    }
+    if (names.empty())
+    {
+        names += '\0';
+    }
+    header.namesSize = names.size();
+
+    uint64_t offset = header.namesOffset + header.namesSize;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        offset = Pack_AlignOffset(offset);
+        entries[i].offset = offset;
+        entries[i].size = files[i].codec == PackCodec_None ? files[i].size : files[i].payload.size();
+        entries[i].rawSize = files[i].size;
+        entries[i].codec = uint32_t(files[i].codec);
+        entries[i].crc = files[i].crc;
+        offset += entries[i].size;
+    }
+
+    // written to a temporary file first, so a failed build never leaves a broken pack
+    string tempPath = outPath + ".tmp";
+    FILE* out = fopen(tempPath.c_str(), "wb");
+    if (!out)
+    {
+        fprintf(stderr, "can not create '%s'\n", tempPath.c_str());
+        return 1;
+    }
+
+    bool written = fwrite(&header, sizeof(header), 1, out) == 1
+                && (entries.empty() || fwrite(&entries[0], sizeof(PackEntry), entries.size(), out) == entries.size())
+                && fwrite(names.data(), 1, names.size(), out) == names.size();
+
+    offset = header.namesOffset + header.namesSize;
+    for (size_t i = 0; written && i < files.size(); ++i)
+    {
+        written = Pad(out, &offset, entries[i].offset);
+
+        vector<uint8_t> raw;
+        const vector<uint8_t>* payload = &files[i].payload;
+        if (written && files[i].codec == PackCodec_None)
+        {
+            written = ReadFile(files[i], &raw);
+            payload = &raw;
+        }
+
+        written = written && (payload->empty() || fwrite(payload->data(), 1, payload->size(), out) == payload->size());
+        offset += entries[i].size;
+    }
+
+    if (fclose(out) != 0 || !written || rename(tempPath.c_str(), outPath.c_str()) != 0)
+    {
+        fprintf(stderr, "write '%s' failed\n", outPath.c_str());
+        remove(tempPath.c_str());
+        return 1;
+    }
+
+    printf("%s: %d files, %llu bytes\n", outPath.c_str(), int(files.size()), (unsigned long long)offset);
+    return 0;
+}